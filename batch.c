@@ -0,0 +1,297 @@
+/*
+ * bstoolbox --batch scripts, see batch.h
+ *
+ * The whole script is parsed before the first step runs, so a typo on the
+ * last line doesn't leave the card half provisioned.
+ */
+
+#include <ctype.h>
+
+#include "bstoolbox.h"
+#include "transport.h"
+#include "batch.h"
+
+typedef struct {
+	int line;
+	int mode;
+	int cd_img;
+	int file;
+	char arg[BATCH_LINE_LEN];
+	char text[BATCH_TEXT_LEN];
+	int on_error;
+	int retries;
+
+	/* Filled in as it runs */
+	int ran;
+	int status;
+	int attempts;
+	unsigned long long us;
+} batch_step;
+
+static const char *policy_names[] = { "stop", "continue", "ignore" };
+
+static char *skip_space(char *s)
+{
+	while (isspace((unsigned char)*s))
+		s++;
+	return s;
+}
+
+/* Split off the first word of s, returning the rest */
+static char *next_word(char *s, char **word)
+{
+	s = skip_space(s);
+	*word = s;
+	while (*s != '\0' && !isspace((unsigned char)*s))
+		s++;
+	if (*s != '\0')
+		*s++ = '\0';
+	return skip_space(s);
+}
+
+static int parse_num(const char *s, int *out)
+{
+	char *end;
+	long v;
+
+	if (*s == '\0')
+		return -1;
+	v = strtol(s, &end, 10);
+	if (*skip_space(end) != '\0' || v < 0 || v > 0xFFFF)
+		return -1;
+	*out = (int)v;
+	return 0;
+}
+
+/*
+ * Turn one command line into a step.  rest is everything after the
+ * command word, already trimmed.
+ */
+static int parse_command(const char *cmd, char *rest, batch_step *s)
+{
+	char *word;
+
+	s->mode = MODE_NONE;
+	s->cd_img = NOT_ACTIVE;
+	s->file = NOT_ACTIVE;
+	s->arg[0] = '\0';
+
+	if (strcmp(cmd, "list") == 0 && *rest == '\0')
+		s->mode = MODE_SHARED;
+	else if (strcmp(cmd, "pwd") == 0 && *rest == '\0')
+		s->mode = MODE_GET_WDIR;
+	else if (strcmp(cmd, "cds") == 0 && *rest == '\0')
+		s->mode = MODE_CD;
+	else if (strcmp(cmd, "inquiry") == 0 && *rest == '\0')
+		s->mode = MODE_INQUIRY;
+	else if (strcmp(cmd, "wdir") == 0 && *rest != '\0') {
+		s->mode = MODE_SET_WDIR;
+		snprintf(s->arg, sizeof(s->arg), "%s", rest);
+	}
+	else if (strcmp(cmd, "put") == 0 && *rest != '\0') {
+		s->mode = MODE_PUT;
+		snprintf(s->arg, sizeof(s->arg), "%s", rest);
+	}
+	else if (strcmp(cmd, "log") == 0) {
+		s->mode = MODE_GET_LOG;
+		snprintf(s->arg, sizeof(s->arg), "%s", rest);
+	}
+	else if (strcmp(cmd, "get") == 0) {
+		rest = next_word(rest, &word);
+		if (parse_num(word, &s->file) != 0)
+			return -1;
+		snprintf(s->arg, sizeof(s->arg), "%s", rest);
+	}
+	else if (strcmp(cmd, "remove") == 0 && *rest != '\0') {
+		s->mode = MODE_REMOVE_FILE;
+		snprintf(s->arg, sizeof(s->arg), "%s", rest);
+	}
+	else if (strcmp(cmd, "cd") == 0 && *rest != '\0') {
+		if (parse_num(rest, &s->cd_img) != 0) {
+			s->cd_img = CD_BY_NAME;
+			snprintf(s->arg, sizeof(s->arg), "%s", rest);
+		}
+	}
+	else if (strcmp(cmd, "debug") == 0) {
+		s->mode = MODE_DEBUG;
+		if (parse_num(rest, &s->file) != 0 || s->file > 1)
+			return -1;
+	}
+	else
+		return -1;
+	return 0;
+}
+
+static int load_script(const char *script, batch_step *steps, int *nsteps)
+{
+	char line[BATCH_LINE_LEN];
+	FILE *f;
+	char *p, *cmd, *rest;
+	int on_error = BATCH_STOP;
+	int retries = 0;
+	int lineno = 0;
+	int n = 0;
+	int ok = 1;
+	int i;
+
+	if (strcmp(script, "-") == 0)
+		f = stdin;
+	else if ((f = fopen(script, "r")) == NULL) {
+		fprintf(stderr, "Error: can't open batch file %s - %s\n", script, strerror(errno));
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		lineno++;
+		if ((p = strchr(line, '#')) != NULL)
+			*p = '\0';
+		p = skip_space(line);
+		for (i = strlen(p); i > 0 && isspace((unsigned char)p[i - 1]); i--)
+			p[i - 1] = '\0';
+		if (*p == '\0')
+			continue;
+
+		rest = next_word(p, &cmd);
+		if (strcmp(cmd, "onerror") == 0) {
+			for (i = 0; i < 3; i++)
+				if (strcmp(rest, policy_names[i]) == 0)
+					break;
+			if (i == 3) {
+				fprintf(stderr, "Error: %s:%d: onerror takes stop, continue or ignore\n", script, lineno);
+				ok = 0;
+			}
+			else
+				on_error = i;
+			continue;
+		}
+		if (strcmp(cmd, "retry") == 0) {
+			if (parse_num(rest, &retries) != 0 || retries > BATCH_MAX_RETRY) {
+				fprintf(stderr, "Error: %s:%d: retry takes 0 to %d\n", script, lineno, BATCH_MAX_RETRY);
+				ok = 0;
+			}
+			continue;
+		}
+
+		if (n == BATCH_MAX_STEPS) {
+			fprintf(stderr, "Error: %s: more than %d steps\n", script, BATCH_MAX_STEPS);
+			ok = 0;
+			break;
+		}
+		memset(&steps[n], 0, sizeof(steps[n]));
+		steps[n].line = lineno;
+		steps[n].on_error = on_error;
+		steps[n].retries = retries;
+		if (*cmd == '-') {
+			steps[n].on_error = BATCH_IGNORE;
+			cmd++;
+		}
+		snprintf(steps[n].text, sizeof(steps[n].text), "%s%s%s", cmd, *rest ? " " : "", rest);
+		if (parse_command(cmd, rest, &steps[n]) != 0) {
+			fprintf(stderr, "Error: %s:%d: bad command \"%s\"\n", script, lineno, steps[n].text);
+			ok = 0;
+			continue;
+		}
+		n++;
+	}
+	if (f != stdin)
+		fclose(f);
+
+	if (!ok)
+		return -1;
+	*nsteps = n;
+	return 0;
+}
+
+static void print_summary(batch_step *steps, int n, unsigned long long total_us)
+{
+	const char *state;
+	int nok = 0, nfailed = 0, nskipped = 0;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (!steps[i].ran)
+			nskipped++;
+		else if (steps[i].status == 0)
+			nok++;
+		else
+			nfailed++;
+	}
+
+	fprintf(stdout, "\nBatch: %d steps, %d ok, %d failed, %d skipped in %.3f s\n",
+		n, nok, nfailed, nskipped, total_us / 1000000.0);
+	for (i = 0; i < n; i++) {
+		fprintf(stdout, "  line %-4d %-*s ", steps[i].line, BATCH_TEXT_LEN - 1, steps[i].text);
+		if (!steps[i].ran) {
+			fprintf(stdout, "skipped\n");
+			continue;
+		}
+		state = steps[i].status == 0 ? "ok" : "failed";
+		fprintf(stdout, "%-7s %10.1f ms", state, steps[i].us / 1000.0);
+		if (steps[i].attempts > 1)
+			fprintf(stdout, ", %d tries", steps[i].attempts);
+		if (steps[i].status != 0 && steps[i].on_error == BATCH_IGNORE)
+			fprintf(stdout, " (ignored)");
+		fprintf(stdout, "\n");
+	}
+}
+
+/*
+ * A failed put may have left part of the file behind, and a failed remove
+ * may have taken some of its files and shifted the rest, so running
+ * either again could append to the wrong file or remove the wrong ones.
+ */
+static int step_repeatable(int mode)
+{
+	return mode != MODE_PUT && mode != MODE_REMOVE_FILE;
+}
+
+/*
+ * Run a script through step().  Returns 0 if every step that counts
+ * worked, 1 otherwise.
+ */
+int batch_run(const char *script, batch_step_fn step, void *arg)
+{
+	batch_step *steps;
+	unsigned long long start, t;
+	int failed = 0;
+	int n, i;
+
+	steps = malloc(BATCH_MAX_STEPS * sizeof(*steps));
+	if (steps == NULL) {
+		fprintf(stderr, "Error: out of memory\n");
+		return 1;
+	}
+	if (load_script(script, steps, &n) != 0) {
+		free(steps);
+		return 1;
+	}
+
+	start = scsi_now_us();
+	for (i = 0; i < n; i++) {
+		batch_step *s = &steps[i];
+
+		t = scsi_now_us();
+		s->ran = 1;
+		do {
+			s->attempts++;
+			if (verbose)
+				fprintf(stderr, "batch: line %d: %s\n", s->line, s->text);
+			s->status = step(arg, s->mode, s->cd_img, s->file, s->arg);
+		} while (s->status > 0 && s->attempts <= s->retries && step_repeatable(s->mode));
+		s->us = scsi_now_us() - t;
+
+		if (s->status == BATCH_FATAL) {
+			failed = 1;
+			break;
+		}
+		if (s->status == 0 || s->on_error == BATCH_IGNORE)
+			continue;
+		failed = 1;
+		if (s->on_error == BATCH_STOP)
+			break;
+	}
+
+	print_summary(steps, n, scsi_now_us() - start);
+	free(steps);
+	return failed;
+}
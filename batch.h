@@ -0,0 +1,50 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+/*
+ * bstoolbox --batch: a script of toolbox commands run over one device
+ * session, so the open, handshake, listing and transfer buffer are shared
+ * by every step.  One command per line, '#' starts a comment:
+ *
+ *	wdir DIR        set the working directory      (-W)
+ *	pwd             print the working directory    (-w)
+ *	list            list the working directory     (-s)
+ *	get NUM [DIR]   get a file                     (-g, -o)
+ *	put FILE        put a file                     (-p)
+ *	remove SPEC     remove files                   (-D)
+ *	cds             list CD images                 (-l)
+ *	cd NUM|NAME     change CD                      (-c)
+ *	log [DIR]       show the BlueSCSI log          (-L)
+ *	inquiry         (-i)
+ *	debug 0|1       (-d)
+ *
+ * What a failed step does is set by directives, which hold until changed:
+ *
+ *	onerror stop      abandon the rest of the script (the default)
+ *	onerror continue  carry on, the batch still fails at the end
+ *	onerror ignore    carry on as if the step had worked
+ *	retry N           repeat a failed step up to N more times first
+ *	                  (not put or remove, which aren't safe to repeat)
+ *
+ * and a '-' in front of a command ignores its failure, as in make.
+ */
+
+#define BATCH_MAX_STEPS  256
+#define BATCH_LINE_LEN   1024
+#define BATCH_TEXT_LEN   40		/* Command as shown in the summary */
+#define BATCH_MAX_RETRY  10
+
+#define BATCH_FATAL      (-1)	/* From the step function: device unusable, stop */
+
+enum {
+	BATCH_STOP,
+	BATCH_CONTINUE,
+	BATCH_IGNORE
+};
+
+/* Carries out one step, returning 0, 1 for failure or BATCH_FATAL */
+typedef int (*batch_step_fn)(void *arg, int mode, int cd_img, int file, char *outdir);
+
+int batch_run(const char *script, batch_step_fn step, void *arg);
+
+#endif
@@ -0,0 +1,227 @@
+/*
+ * bstoolbox bench, see bench.h
+ *
+ * Everything goes through the bs_*_test() calls, which time the commands
+ * alone, so local disk speed doesn't show up in the numbers.
+ */
+#include "bstoolbox.h"
+#include "qos.h"
+#include "bench.h"
+
+/* Chunk sweeps, in the units each command counts in */
+static const int send_blocks[] = { 8, 16, 32, 64, SEND_BLOCKS_PER_XFER, 255 };
+static const int get_blocks[] = { 1, 2, 4, GET_BLOCKS_PER_XFER, 16, 32, 64 };
+#define SEND_STEPS_STD  5	/* Up to SEND_BLOCKS_PER_XFER */
+#define GET_STEPS_STD   4	/* Up to GET_BLOCKS_PER_XFER */
+
+static const struct {
+	int which;
+	const char *name;
+} bench_cmds[] = {
+	{ BS_CMD_COUNT_FILES, "COUNT_FILES" },
+	{ BS_CMD_GET_WDIR,    "GET_WDIR" },
+	{ BS_CMD_GET_CAP,     "GET_CAP" }
+};
+
+/* min, max and total of a series of samples */
+typedef struct {
+	double min, max, sum;
+	int n;
+} bench_acc;
+
+static void acc_add(bench_acc *a, double v)
+{
+	if (a->n == 0 || v < a->min)
+		a->min = v;
+	if (a->n == 0 || v > a->max)
+		a->max = v;
+	a->sum += v;
+	a->n++;
+}
+
+static double rate(unsigned long long bytes, unsigned long long us)
+{
+	return bytes * 1000000.0 / (us > 0 ? us : 1);
+}
+
+/* Index of the scratch file in the working directory, -1 if absent, -2 on error */
+static int find_scratch(bs_ctx *c)
+{
+	bs_file list[BS_MAX_FILES];
+	int n, i;
+
+	if ((n = bs_list(c, list, BS_MAX_FILES)) < 0)
+		return -2;
+	for (i = 0; i < n; i++)
+		if (strcmp(list[i].name, BENCH_SCRATCH) == 0)
+			return list[i].index;
+	return -1;
+}
+
+static int remove_scratch(bs_ctx *c)
+{
+	int idx = find_scratch(c);
+
+	if (idx == -2)
+		return -1;
+	return idx < 0 ? 0 : bs_remove(c, idx);
+}
+
+static void print_xfer(int tsv, const char *dir, const char *mode, int chunk, const bench_acc *a)
+{
+	if (tsv)
+		fprintf(stdout, "%s\t%s\t%d\t%.0f\t%.0f\t%.0f\n", dir, mode, chunk,
+			a->sum / a->n, a->min, a->max);
+	else
+		fprintf(stdout, "%-5s %-7s %6.1f KB %10.2f %9.2f %9.2f\n", dir, mode, chunk / 1024.0,
+			a->sum / a->n / 1000000.0, a->min / 1000000.0, a->max / 1000000.0);
+}
+
+static int bench_send(bs_ctx *c, unsigned long long size, int runs, int steps, int tsv)
+{
+	unsigned long long us;
+	bench_acc a;
+	int legacy, i, r;
+
+	for (i = 0; i < steps; i++) {
+		for (legacy = 0; legacy <= 1; legacy++) {
+			/* A legacy byte count stops at 64 KB */
+			if (legacy && send_blocks[i] * SEND_BLOCK_SIZE > 0xFFFF)
+				continue;
+			memset(&a, 0, sizeof(a));
+			for (r = 0; r < runs; r++) {
+				if (remove_scratch(c) != 0 ||
+				    bs_write_test(c, BENCH_SCRATCH, size, send_blocks[i], legacy, &us) != 0)
+					return -1;
+				acc_add(&a, rate(size, us));
+			}
+			print_xfer(tsv, "send", legacy ? "legacy" : "block", send_blocks[i] * SEND_BLOCK_SIZE, &a);
+		}
+	}
+	return 0;
+}
+
+static int bench_get(bs_ctx *c, unsigned long long size, int runs, int steps, int tsv)
+{
+	unsigned long long bytes, us;
+	bench_acc a;
+	int idx, i, r;
+
+	if ((idx = find_scratch(c)) < 0) {
+		if (idx == -1)
+			fprintf(stderr, "Error: %s went missing\n", BENCH_SCRATCH);
+		return -1;
+	}
+	for (i = 0; i < steps; i++) {
+		memset(&a, 0, sizeof(a));
+		for (r = 0; r < runs; r++) {
+			if (bs_read_test(c, idx, get_blocks[i], size, &bytes, &us) != 0)
+				return -1;
+			acc_add(&a, rate(bytes, us));
+		}
+		print_xfer(tsv, "get", "block", get_blocks[i] * GET_BLOCK_SIZE, &a);
+	}
+	return 0;
+}
+
+static int bench_commands(bs_ctx *c, int runs, int tsv)
+{
+	unsigned long long us;
+	bench_acc a;
+	int i, r;
+
+	if (!tsv)
+		fprintf(stdout, "\n%-13s %17s %9s %9s\n", "Command", "ms avg", "min", "max");
+	for (i = 0; i < (int)(sizeof(bench_cmds) / sizeof(bench_cmds[0])); i++) {
+		memset(&a, 0, sizeof(a));
+		for (r = 0; r < runs * BENCH_CMD_RUNS; r++) {
+			if (bs_time_command(c, bench_cmds[i].which, &us) != 0)
+				return -1;
+			acc_add(&a, (double)us);
+		}
+		if (tsv)
+			fprintf(stdout, "cmd\t%s\t0\t%.1f\t%.0f\t%.0f\n", bench_cmds[i].name,
+				a.sum / a.n, a.min, a.max);
+		else
+			fprintf(stdout, "%-13s %17.3f %9.3f %9.3f\n", bench_cmds[i].name,
+				a.sum / a.n / 1000.0, a.min / 1000.0, a.max / 1000.0);
+	}
+	return 0;
+}
+
+static void bench_usage(void)
+{
+	fprintf(stderr, "Usage: bstoolbox <device> bench [-s size] [-n runs] [-x] [-t]\n");
+	fprintf(stderr, "\t-s size : scratch file size, K and M suffixes (default 4M)\n");
+	fprintf(stderr, "\t-n runs : runs of each test (default %d)\n", BENCH_RUNS);
+	fprintf(stderr, "\t-x      : also try chunks above the toolbox defaults\n");
+	fprintf(stderr, "\t-t      : tab separated results instead of the table\n");
+}
+
+/*
+ * argv[0] is "bench".  Returns 0 on success, 1 on failure; the scratch
+ * file is removed either way.
+ */
+int bench_run(bs_ctx *c, const char *devpath, int argc, char **argv)
+{
+	double size = BENCH_SIZE;
+	int runs = BENCH_RUNS;
+	int large = 0, tsv = 0;
+	int ret;
+	int opt;
+
+	optind = 1;
+	while ((opt = getopt(argc, argv, "s:n:xt")) != -1) switch (opt) {
+		case 's':
+			if (qos_parse_rate(optarg, &size) != 0 || size < GET_BLOCK_SIZE) {
+				fprintf(stderr, "Error: bad size %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'n':
+			if ((runs = atoi(optarg)) < 1) {
+				fprintf(stderr, "Error: bad run count %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'x':
+			large = 1;
+			break;
+		case 't':
+			tsv = 1;
+			break;
+		default:
+			bench_usage();
+			return 1;
+	}
+	if (optind != argc) {
+		bench_usage();
+		return 1;
+	}
+
+	/* Left over from an interrupted run? */
+	if (remove_scratch(c) != 0)
+		return 1;
+
+	if (tsv)
+		fprintf(stdout, "# test\tmode\tchunk\tavg\tmin\tmax\t(bytes/s, or us for cmd)\n");
+	else {
+		fprintf(stdout, "Benchmark of %s: %.0f KB scratch file, %d run%s of each\n\n",
+			devpath, size / 1024, runs, runs == 1 ? "" : "s");
+		fprintf(stdout, "%-5s %-7s %9s %10s %9s %9s\n", "Test", "Mode", "Chunk", "MB/s avg", "min", "max");
+	}
+
+	ret = bench_send(c, (unsigned long long)size, runs,
+		large ? (int)(sizeof(send_blocks) / sizeof(send_blocks[0])) : SEND_STEPS_STD, tsv);
+	if (ret == 0)
+		ret = bench_get(c, (unsigned long long)size, runs,
+			large ? (int)(sizeof(get_blocks) / sizeof(get_blocks[0])) : GET_STEPS_STD, tsv);
+	if (ret == 0)
+		ret = bench_commands(c, runs, tsv);
+
+	if (remove_scratch(c) != 0) {
+		fprintf(stderr, "Warning: couldn't remove %s\n", BENCH_SCRATCH);
+		ret = -1;
+	}
+	return ret != 0;
+}
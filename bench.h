@@ -0,0 +1,24 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "libbstoolbox.h"
+
+/*
+ * bstoolbox <device> bench [-s size] [-n runs] [-x] [-t]: what a host,
+ * adapter and card actually deliver.  A scratch file is written with
+ * SEND_FILE_10 at a sweep of chunk sizes, in block mode and in legacy
+ * (byte count) mode, read back with GET_FILE at a sweep of chunk sizes,
+ * and removed; then COUNT_FILES, GET_WDIR and GET_CAP round trips are
+ * timed.  -x adds chunks above the toolbox defaults, for firmware with
+ * large transfer support.  -t prints tab separated results instead of
+ * the table.
+ */
+
+#define BENCH_SCRATCH    "bstoolbox-bench.tmp"
+#define BENCH_SIZE       (4 * 1024 * 1024)
+#define BENCH_RUNS       3
+#define BENCH_CMD_RUNS   20	/* Per run, for the small commands */
+
+int bench_run(bs_ctx *c, const char *devpath, int argc, char **argv);
+
+#endif
@@ -2,1095 +2,386 @@
  * BlueSCSI v2 IRIX and Linux toolbox
  */
 #include "bstoolbox.h"
-
-int device_list[8];
-int verbose = 0;
-ToolboxFileEntry files[MAX_FILES];
-int files_count = 0;
-
-static int bluescsi_listfiles(int dev, int print);
-static int bluescsi_getfile(int dev, int idx, char *outdir);
-
-static unsigned long long size_to_long(const unsigned char size[5])
-{
-        int i;
-        unsigned long long result = 0;
-        for (i = 0; i < 5; i++)
-        {
-                result = (result << 8) | size[i];
-        }
-        return result;
-}
-
-/*
- * BLUESCSI_TOOLBOX_METADATA (0xD9) Subcommands
- */
-
-/* Subcommand 0x00 - List Devices */
-static int bluescsi_metadata_list_devices(int dev, unsigned char dev_map[8])
-{
-	unsigned char cmd[10];
-	unsigned char buf[8];
-	int i;
-
-	memset(cmd, 0, sizeof(cmd));
-	cmd[0] = BLUESCSI_TOOLBOX_METADATA;
-	cmd[1] = BLUESCSI_TOOLBOX_METADATA_LIST_DEVICES;
-	cmd[8] = 0x08; /* Allocation length = 8 bytes */
-
-	memset(buf, 0xFF, sizeof(buf));
-
-	if (scsi_send_command(dev, cmd, sizeof(cmd), buf, sizeof(buf)) != 0)
-	{
-		if (verbose)
-			fprintf(stderr, "Error: metadata list_devices command failed - %s\n", strerror(errno));
-		return -1;
-	}
-
-	for (i = 0; i < 8; i++)
-	{
-		dev_map[i] = buf[i];
-	}
-
-	return 0;
-}
-
-/* Subcommand 0x01 - Get Capabilities */
-static int bluescsi_metadata_get_capabilities(int dev, unsigned char *api_ver, unsigned char *caps)
+#include "checksum.h"
+#include "replay.h"
+#include "cmdtrace.h"
+#include "cmdstats.h"
+#include "discover.h"
+#include "devlock.h"
+#include "qos.h"
+#include "ipc.h"
+#include "batch.h"
+#include "ini.h"
+#include "bench.h"
+#include "soak.h"
+#include "libbstoolbox.h"
+
+/* Per-run settings for the context, from the command line */
+static char *manifest_file = NULL;
+static qos_state xfer_qos;
+static int listing_cache = 0;
+static char *batch_file = NULL;
+static int show_stats = 0;
+static char *metrics_file = NULL;
+
+static bs_ctx *open_drive(char *path, int readonly)
 {
-	unsigned char cmd[10];
-	unsigned char buf[8];
+	bs_ctx *c;
 
-	memset(cmd, 0, sizeof(cmd));
-	cmd[0] = BLUESCSI_TOOLBOX_METADATA;
-	cmd[1] = BLUESCSI_TOOLBOX_METADATA_GET_CAP;
-	cmd[8] = 0x08; /* Allocation length = 8 bytes */
-
-	memset(buf, 0, sizeof(buf));
-
-	if (scsi_send_command(dev, cmd, sizeof(cmd), buf, sizeof(buf)) != 0)
-	{
-		/* Legacy devices return CHECK_CONDITION: default to API v0 and no capabilities */
-		if (verbose)
-			fprintf(stdout, "Metadata get_capabilities unsupported, assuming legacy device (API v0, no caps)\n");
-		*api_ver = 0;
-		*caps = 0;
-		return 0;
-	}
-
-	*api_ver = buf[0];
-	*caps = buf[1];
-
-	if (verbose)
-	{
-		fprintf(stdout, "Toolbox Metadata API Version: %u\n", *api_ver);
-		fprintf(stdout, "Capability Flags: 0x%02X\n", *caps);
-		fprintf(stdout, " - CAP_LARGE_TRANSFERS: %s\n", (*caps & 0x01) ? "Yes" : "No");
-		fprintf(stdout, " - CAP_LARGE_SEND     : %s\n", (*caps & 0x02) ? "Yes" : "No");
-		fprintf(stdout, " - CAP_SET_WORKING_DIR: %s\n", (*caps & 0x04) ? "Yes" : "No");
+	c = bs_open(path, readonly ? BS_OPEN_READONLY : 0);
+	if (c == NULL && errno != ENODEV) {
+		if (!readonly)
+		{
+			fprintf (stderr, "Error opening device for read/write, trying to open readonly\n");
+			c = bs_open(path, BS_OPEN_READONLY);
+		}
+		if (c == NULL) {
+			fprintf(stderr, "ERROR: Cannot open device: %s\nTry running again as root\n", strerror(errno));
+			return NULL;
+		}
 	}
+	if (c == NULL)
+		return NULL;
 
-	return 0;
+	bs_set_manifest(c, manifest_file);
+	bs_set_pacing(c, xfer_qos.rate, xfer_qos.duty_on_ms, xfer_qos.duty_off_ms, xfer_qos.nice);
+	bs_set_listing_cache(c, listing_cache);
+	return c;
 }
 
-static int bluescsi_metadata_set_working_dir(int dev, const char *path)
+static int do_drive(char *path, int mode, int cd_img, int file, char *outdir)
 {
-	unsigned char cmd[10];
-	size_t path_len;
+	bs_ctx *c;
 	int ret;
 
-	if (verbose)
-		fprintf(stdout, "Setting working directory to: %s\n", path);
-
-	path_len = (path != NULL) ? strlen(path) : 0;
-	if (path_len > 64)
-	{
-		fprintf(stderr, "Error: working directory path exceeds maximum length of 64 bytes\n");
-		return -1;
-	}
-	else if (path_len == 0)
-	{
-		fprintf(stdout, "Error: set working dir path_len was zero\n");
-		return -1;
-	}
-
-	memset(cmd, 0, sizeof(cmd));
-	cmd[0] = BLUESCSI_TOOLBOX_METADATA;
-	cmd[1] = BLUESCSI_TOOLBOX_METADATA_SET_WDIR;
-	cmd[8] = (unsigned char)path_len; /* Path length in bytes (DATA_OUT) */
-
-
-	ret = scsi_send_commandw(dev, cmd, sizeof(cmd), (unsigned char *)path, (int)path_len);
-	if (ret != 0)
-	{
-		fprintf(stderr, "Error: set_working_dir failed - %s\n", strerror(errno));
-		return -1;
+	c = open_drive(path, mode == MODE_CD || cd_img != NOT_ACTIVE);
+	if (c == NULL) {
+		bluescsi_metrics_write(NULL, 1);
+		exit(1);
 	}
 
-	return 0;
-}
-
-static char *bluescsi_metadata_get_working_dir(int dev)
-{
-        unsigned char cmd[10];
-        unsigned char buf[256];
-        char *wdir;
-        size_t req_len;
-        int ret;
-
-        req_len = 255; /* Cap at 255 bytes so cmd[8] fits and leaves room for '\0' */
-
-        memset(cmd, 0, sizeof(cmd));
-        cmd[0] = BLUESCSI_TOOLBOX_METADATA;
-        cmd[1] = BLUESCSI_TOOLBOX_METADATA_GET_WDIR;
-        cmd[7] = (unsigned char)((req_len >> 8) & 0xFF);
-        cmd[8] = (unsigned char)(req_len & 0xFF);
-
-        memset(buf, 0, sizeof(buf));
-
-        ret = scsi_send_command(dev, cmd, sizeof(cmd), buf, (int)req_len);
-        if (ret != 0)
-        {
-                fprintf(stderr, "Error: get_working_dir failed - %s\n", strerror(errno));
-                return NULL;
-        }
-
-        buf[255] = '\0';
-
-        wdir = (char *)malloc(strlen((char *)buf) + 1);
-        if (wdir == NULL)
-        {
-                fprintf(stderr, "Error: Memory allocation failed for working directory string\n");
-                return NULL;
-        }
-
-        strcpy(wdir, (char *)buf);
-
-        if (verbose)
-                fprintf(stdout, "Current working directory: %s\n", wdir);
-
-        return wdir;
-}
-
-static void bluescsi_print_wdir (int dev)
-{
-	fprintf (stdout, "BlueSCSI working directory: %s\n", bluescsi_metadata_get_working_dir(dev));
-}
-
-static int bluescsi_set_wdir (int dev, char *outdir)
-{
-	return bluescsi_metadata_set_working_dir (dev, outdir);
+	ret = bluescsi_run(c, mode, cd_img, file, outdir);
+	bs_close(c);
+	return ret;
 }
 
 /*
- * Subcommand 0x04 - Remove File
+ * Hand the request to a bstoolboxd serving the device, if there is one.
+ * Returns the exit status, or -1 to do the work here instead.
  */
-static int bluescsi_remove_file(int dev, int file_num)
+static int try_daemon(char *path, int wait_secs, int mode, int cd_img, int file, char *outdir)
 {
-	unsigned char cmd[10];
-
-	if (verbose)
-		fprintf(stdout, "Removing file number: %d\n", file_num);
-
-	if (file_num < 0 || file_num > 255)
-	{
-		fprintf(stderr, "Error: file number %d out of range (0-255)\n", file_num);
-		return -1;
-	}
-
-	memset(cmd, 0, sizeof(cmd));
-	cmd[0] = BLUESCSI_TOOLBOX_METADATA;
-	cmd[1] = BLUESCSI_TOOLBOX_METADATA_REMOVE_FILE;
-	cmd[8] = (unsigned char)file_num;
-
-	if (scsi_send_command(dev, cmd, sizeof(cmd), NULL, 0) != 0)
-	{
-		fprintf(stderr, "Error: metadata remove_file failed - %s\n", strerror(errno));
+	ipc_request req;
+
+	memset(&req, 0, sizeof(req));
+	req.mode = mode;
+	req.cd_img = cd_img;
+	req.file = file;
+	req.verbose = verbose;
+	req.rate = xfer_qos.rate;
+	req.duty_on_ms = xfer_qos.duty_on_ms;
+	req.duty_off_ms = xfer_qos.duty_off_ms;
+	req.nice = xfer_qos.nice;
+	req.wait_secs = wait_secs;
+	if (getcwd(req.cwd, sizeof(req.cwd)) == NULL)
 		return -1;
-	}
-
-	if (verbose)
-		fprintf(stdout, "File #%d successfully removed.\n", file_num);
+	snprintf(req.arg, sizeof(req.arg), "%s", outdir);
+	if (manifest_file != NULL)
+		snprintf(req.manifest, sizeof(req.manifest), "%s", manifest_file);
 
-	return 0;
+	return ipc_client_run(path, &req);
 }
 
-/* Helper function that stores the current working dir, 
- * switches to / and grabs the log */
-static int bluescsi_get_log(int dev, const char *outdir)
-{
-	char *orig_wdir = NULL;
-	char log_filepath[1024];
-	int log_idx = -1;
-	int i;
-	int ret = 0;
-	FILE *fd;
-	int ch;
+/* The device side of a --batch run */
+typedef struct {
+	char *path;
+	int wait_secs;
+	int direct;		/* No daemon, or -R/-T/--stats/--metrics need the commands here */
+	bs_ctx *ctx;
+} batch_dev;
 
-	/* 1. Get and store original working directory */
-	orig_wdir = bluescsi_metadata_get_working_dir(dev);
-	if (orig_wdir == NULL)
-	{
-		fprintf(stderr, "Error: get_log couldn't determine original working directory\n");
-		return -1;
-	}
-
-	/* 2. Change working directory to root ("/") */
-	if (bluescsi_metadata_set_working_dir(dev, "/") != 0)
-	{
-		fprintf(stderr, "Error: get_log couldn't change working directory to root\n");
-		free(orig_wdir);
-		return -1;
-	}
-
-	/* 3. List files in root directory to locate "log.txt" */
-	if (bluescsi_listfiles(dev, PRINT_OFF) != 0)
-	{
-		fprintf(stderr, "Error: get_log failed to list root directory files\n");
-		ret = -1;
-		goto restore_wdir;
-	}
-
-	for (i = 0; i < files_count; i++)
-	{
-		if (strcasecmp(files[i].name, "log.txt") == 0)
-		{
-			log_idx = files[i].index;
-			break;
-		}
-	}
-
-	if (log_idx == -1)
-	{
-		fprintf(stderr, "Error: log.txt not found in root directory\n");
-		ret = -1;
-		goto restore_wdir;
-	}
-
-	/* 4. Download log.txt directly into specified output directory */
-	if (bluescsi_getfile(dev, log_idx, (char *)outdir) != 0)
-	{
-		fprintf(stderr, "Error: get_log failed to fetch log file\n");
-		ret = -1;
-		goto restore_wdir;
-	}
-
-	/* Construct local path to read log.txt from outdir */
-	if (outdir != NULL && strlen(outdir) > 0 && outdir[strlen(outdir) - 1] == '/')
-		sprintf(log_filepath, "%slog.txt", outdir);
-	else
-		sprintf(log_filepath, "%s/log.txt", (outdir && strlen(outdir) > 0) ? outdir : ".");
-
-	/* 5. Print log.txt contents to stdout */
-	fd = fopen(log_filepath, "r");
-	if (fd == NULL)
-	{
-		fprintf(stderr, "Error: get_log couldn't open fetched log file %s\n", log_filepath);
-		ret = -1;
-		goto restore_wdir;
-	}
-
-	while ((ch = fgetc(fd)) != EOF)
-	{
-		fputc(ch, stdout);
-	}
-	fclose(fd);
-
-	/* Clean up downloaded log file */
-	//unlink(log_filepath);
-
-restore_wdir:
-	/* 6. Restore original working directory */
-	if (bluescsi_metadata_set_working_dir(dev, orig_wdir) != 0)
-	{
-		fprintf(stderr, "Warning: failed to restore working directory to %s\n", orig_wdir);
-		ret = -1;
-	}
-
-	free(orig_wdir);
-	return ret;
-}
 /*
- * Sending Files (Host -> BlueSCSI / shared)
+ * One batch step: through bstoolboxd while one serves the device,
+ * otherwise on a context opened (and locked) at the first step that needs
+ * it and kept for the rest of the script.
  */
-static int bluescsi_sendfile(int dev, char *path)
+static int batch_step(void *arg, int mode, int cd_img, int file, char *outdir)
 {
-	char cmd[10] = { BLUESCSI_TOOLBOX_SEND_FILE_PREP, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
-	char filename[NAME_BUF_SIZE];
-	char *base_name;
-	char *send_buf;
-	long int bytes_read = 0;
-	long int actual_read = 0;
-	long int blk_offset = 0; /* Offset in 512-byte blocks */
-	int num_blocks;
+	batch_dev *b = arg;
 	int ret;
-	FILE *fd;
-	long int filesize;
-	struct stat st;
 
-	if (verbose)
-		fprintf(stdout, "sendfile: %s\n", path);
-
-	/* Extract base filename */
-	base_name = strrchr(path, '/');
-	if (base_name == NULL) {
-		base_name = path;
-	} else {
-		base_name++;
-	}
-
-	if (strlen(base_name) >= NAME_BUF_SIZE) {
-		fprintf(stderr, "Error: sendfile Filename too long: %s\n", base_name);
-		return -1;
-	}
-
-	memset(filename, 0, NAME_BUF_SIZE);
-	strncpy(filename, base_name, NAME_BUF_SIZE - 1);
-
-	/* Open file */
-	fd = fopen(path, "rb");
-	if (fd == NULL) {
-		fprintf(stderr, "Error: sendfile couldn't open %s\n", path);
-		return 1;
-	}
-
-	if (stat(path, &st) == 0) {
-		if (verbose)
-			printf("File size of %s is %lld bytes\n", filename, (long long)st.st_size);
-	} else {
-		fprintf(stderr, "Error: sendfile couldn't stat %s\n", path);
-		fclose(fd);
-		return 1;
-	}
-	filesize = st.st_size;
-
-	/* 1. Send BLUESCSI_TOOLBOX_SEND_FILE_PREP (0xD3) */
-	if (scsi_send_commandw(dev, (unsigned char *)cmd, SCSI_CMD_LENGTH, (unsigned char *)filename, 33) != 0) {
-		fprintf(stderr, "Error: sendfileprep failed - %s\n", strerror(errno));
-		fclose(fd);
-		return 1;
-	}
-
-	send_buf = (char *)malloc(SEND_BUF_SIZE);
-	if (send_buf == NULL) {
-		fprintf(stderr, "Error: sendfile couldn't allocate send buffer\n");
-		fclose(fd);
-		return 1;
+	if (!b->direct) {
+		if ((ret = try_daemon(b->path, b->wait_secs, mode, cd_img, file, outdir)) >= 0)
+			return ret;
+		b->direct = 1;
 	}
 
-	/* 2. Send Data Blocks via BLUESCSI_TOOLBOX_SEND_FILE_10 (0xD4) */
-	while (bytes_read < filesize) {
-		long int chunk = (filesize - bytes_read) < SEND_BUF_SIZE ? (filesize - bytes_read) : SEND_BUF_SIZE;
-		memset(send_buf, 0, SEND_BUF_SIZE);
-
-		actual_read = fread(send_buf, 1, chunk, fd);
-		if (actual_read <= 0) {
-			fprintf(stderr, "Error: fread failed or returned 0 at offset %ld\n", bytes_read);
-			free(send_buf);
-			fclose(fd);
-			return 1;
-		}
-
-		memset(cmd, 0, sizeof(cmd));
-		cmd[0] = BLUESCSI_TOOLBOX_SEND_FILE_10;
-
-		/* CDB[3..5]: 24-bit big endian block offset (512-byte blocks) */
-		cmd[3] = (unsigned char)((blk_offset >> 16) & 0xFF);
-		cmd[4] = (unsigned char)((blk_offset >>  8) & 0xFF);
-		cmd[5] = (unsigned char)((blk_offset      ) & 0xFF);
-
-		if (actual_read % SEND_BLOCK_SIZE == 0) {
-			/* Block Mode: Transfer size = CDB[6] * 512 bytes */
-			num_blocks = actual_read / SEND_BLOCK_SIZE;
-			cmd[1] = 0;
-			cmd[2] = 0;
-			cmd[6] = (unsigned char)(num_blocks & 0xFF);
-		} else {
-			/* Legacy Mode: CDB[6] = 0, CDB[1..2] = raw byte count */
-			num_blocks = (actual_read + SEND_BLOCK_SIZE - 1) / SEND_BLOCK_SIZE;
-			cmd[1] = (unsigned char)((actual_read >> 8) & 0xFF);
-			cmd[2] = (unsigned char)(actual_read & 0xFF);
-			cmd[6] = 0;
+	if (b->ctx == NULL) {
+		if (strncmp(b->path, "replay:", 7) != 0)
+		{
+			if (devlock_acquire(b->path, b->wait_secs) != 0)
+				return BATCH_FATAL;
+			atexit(devlock_release);
 		}
-
-		ret = scsi_send_commandw(dev, (unsigned char *)cmd, sizeof(cmd), (unsigned char *)send_buf, actual_read);
-		if (ret != 0) {
-			fprintf(stderr, "Error: sendfile10 failed at block %ld - %s\n", blk_offset, strerror(errno));
-			free(send_buf);
-			fclose(fd);
-			return 1;
+		if ((b->ctx = open_drive(b->path, 0)) == NULL) {
+			bluescsi_metrics_write(NULL, 1);
+			return BATCH_FATAL;
 		}
-
-		bytes_read += actual_read;
-		blk_offset += num_blocks;
-	}
-
-	free(send_buf);
-
-	/* 3. Send BLUESCSI_TOOLBOX_SEND_FILE_END (0xD5) */
-	memset(cmd, 0, sizeof(cmd));
-	cmd[0] = BLUESCSI_TOOLBOX_SEND_FILE_END;
-
-	if (scsi_send_command(dev, (unsigned char *)cmd, sizeof(cmd), NULL, 0) != 0) {
-		fprintf(stderr, "Error: sendfileend failed - %s\n", strerror(errno));
-		fclose(fd);
-		return 1;
-	}
-
-	fclose(fd);
-	return 0;
-}
-
-/*
- * Debug control
- */
-static int bluescsi_getdebug (int dev)
-{
-	int ret;
-	char cmd[10] = {BLUESCSI_TOOLBOX_TOGGLE_DEBUG, 0, 0, 0, 0, 0, 0, 0, 0, 0};	
-	char buf[1];
-	cmd[1] = DEBUG_GET;
-	memset(buf, 0, sizeof(buf));
-	if (scsi_send_command(dev, (unsigned char *)cmd, sizeof(cmd), (unsigned char *)buf, sizeof(buf)) != 0)
-	{
-		fprintf (stderr, "Error: getdebug failed - %s\n", strerror(errno));
-		return -1;
-	}
-	ret = buf[0];
-	return ret;
-}
-
-static int bluescsi_setdebug (int dev, int value)
-{
-	char cmd[10] = {BLUESCSI_TOOLBOX_TOGGLE_DEBUG, 0, 0, 0, 0, 0, 0, 0, 0, 0};
-	
-	if (value > 1)
-		value = 1;
-	else if (value < 0)
-		value = 0;
-	cmd[1] = DEBUG_SET;
-	cmd[2] = value;
-	if (scsi_send_command(dev, (unsigned char *)cmd, sizeof(cmd), (unsigned char *)NULL, 0) != 0)
-	{
-		fprintf (stderr, "Error: BlueSCSI setdebug failed - %s\n", strerror(errno));
-		return -1;
-	}
-
-	if (verbose)
-		fprintf (stdout, "Debug mode set to: %i\n", bluescsi_getdebug (dev));
-	return 0;
-}
-
-static int bluescsi_countfiles(int dev)
-{
-	char cmd[10] = {BLUESCSI_TOOLBOX_COUNT_FILES, 0, 0, 0, 0, 0, 0, 0, 0, 0};	
-	char buf[1];
-	int ret;
-	memset(buf, 0, sizeof(buf));
-	if (scsi_send_command(dev, (unsigned char *)cmd, sizeof(cmd), (unsigned char *)buf, sizeof(buf)) != 0)
-	{
-		fprintf (stderr, "Error: countfiles failed - %s\n", strerror(errno));
-		return -1;
 	}
-	ret = buf[0]; 
-	return ret;
-}
 
-static int bluescsi_countcds(int dev)
-{
-	char cmd[10] = {BLUESCSI_TOOLBOX_COUNT_CDS, 0, 0, 0, 0, 0, 0, 0, 0, 0};	
-	char buf[1];
-	int ret;
-	memset(buf, 0, sizeof(buf));
-	if (scsi_send_command(dev, (unsigned char *)cmd, sizeof(cmd), (unsigned char *)buf, sizeof(buf)) != 0)
-	{
-		fprintf (stderr, "Error: countcds failed - %s\n", strerror(errno));
-		return -1;
-	}
-	ret = buf[0];
-	if (ret < 0 || ret > MAX_FILES)
-	{
-		fprintf (stderr,"Error: countcds invalid count %i\n", ret);
-		return -1;
-	}
+	if (cd_img != NOT_ACTIVE)
+		mediad_stop (b->path);
+	ret = bluescsi_run(b->ctx, mode, cd_img, file, outdir);
+	if (cd_img != NOT_ACTIVE)
+		mediad_start (b->path);
 	return ret;
 }
 
-static int bluescsi_setnextcd(int dev, int num)
+static void usage(void)
 {
-	int max_cds;
-	char cmd[10];
-	memset(cmd, 0, sizeof(cmd));	
-	max_cds = bluescsi_countcds(dev);
-	cmd[0] = BLUESCSI_TOOLBOX_SET_NEXT_CD;
-
-	if (num < 0 || num > max_cds)
-	{
-		fprintf (stderr, "setnextcd: %i is out of range of max %i\n", num, max_cds);
-		return 1;
-	}
-
-	cmd[1] = num;
-	if (verbose)
-		fprintf (stdout, "%i set as next CD\n", cmd[1]);	
-	if (scsi_send_command(dev, (unsigned char *)cmd, 10, (unsigned char *)NULL, 0) != 0)
-	{
-		fprintf (stderr, "Error: setnextcd failed - %s\n", strerror(errno));
-		return -1;
-	}
-	return 0;
+	fprintf(stderr, "\nUsage:   bstoolbox <device> [options]\n\n");
+#if defined(OS_IRIX)
+	fprintf(stderr, "example: bstoolbox /dev/scsi/sc0d1l0 -s\n\n");
+#elif defined(OS_LINUX)
+	fprintf(stderr, "example: bstoolbox /dev/sg2 -s\n\n");
+#endif
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "\t-h      : display this help message and exit\n");
+	fprintf(stderr, "\t-v      : be verbose\n");
+	fprintf(stderr, "\t-i      : interrogate BlueSCSI and return version\n");
+	fprintf(stderr, "\t-l      : list available CDs\n");
+	fprintf(stderr, "\t-s      : List /shared directory\n");
+	fprintf(stderr, "\t-c num  : change to CD number (1, 2, etc)\n");
+	fprintf(stderr, "\t-c name : change to the CD with that name, or a unique prefix or close match\n");
+	fprintf(stderr, "\t-g num  : get file from shared directory (1, 2, etc)\n");
+	fprintf(stderr, "\t-p file : put file to shared directory\n");
+	fprintf(stderr, "\t-o dir  : set output directory, defaults to current\n");
+	fprintf(stderr, "\t-R file : record every SCSI command to a trace for replay:file\n");
+	fprintf(stderr, "\t-T file[,sample=N] : trace commands (and N payload bytes) to file\n");
+	fprintf(stderr, "\t-M file : manifest for -g/-p checksums, defaults to %s next to the file\n", MANIFEST_NAME);
+	fprintf(stderr, "\t-w      : get current working directory\n");
+	fprintf(stderr, "\t-W dir  : set working directory\n");
+	fprintf(stderr, "\t-D spec : remove files from working directory by number, range (3-7)\n");
+	fprintf(stderr, "\t          or name pattern ('*.tmp'), comma separated\n");
+	fprintf(stderr, "\t-L      : Show BlueSCSI log\n");
+	fprintf(stderr, "\t-f      : with -L, keep showing new log output until interrupted\n");
+	fprintf(stderr, "\t-d num  : set debug mode (0 = off, 1 - on)\n");
+	fprintf(stderr, "\t--wait[=secs] : queue for a device in use by another bstoolbox\n");
+	fprintf(stderr, "\t--bwlimit=rate : cap -g/-p at rate bytes/s (K, M suffixes)\n");
+	fprintf(stderr, "\t--duty=on/off  : transfer for on ms, then leave the bus idle for off ms\n");
+	fprintf(stderr, "\t--nice[=1-10]  : back off while other I/O slows the bus down\n");
+	fprintf(stderr, "\t--listing-cache : keep directory listings on disk between runs\n");
+	fprintf(stderr, "\t--batch file : run the commands in file (- for stdin) in one session\n");
+	fprintf(stderr, "\t--stats : report command counts, latency and throughput by opcode at exit\n");
+	fprintf(stderr, "\t--metrics file : write Prometheus/OpenMetrics metrics to file at exit (every 15s with -L -f)\n");
+	fprintf(stderr, "\n        bstoolbox discover [-r] [device...] : find BlueSCSI devices, -r ignores the cache\n");
+	fprintf(stderr, "        bstoolbox trace <file> : decode a -T trace\n");
+	fprintf(stderr, "        bstoolbox <device> ini show|get|profiles|diff|apply|set|probe : manage bluescsi.ini\n");
+	fprintf(stderr, "        bstoolbox <device> bench [-s size] [-n runs] [-x] [-t] : measure throughput and latency\n");
+	fprintf(stderr, "        bstoolbox <device> soak [-n iter] [-t time] [-s size] [-S seed] [-l file] [-x] [-q] : stress test the bus\n");
+	fprintf(stderr, "        Use \"auto\" as the device for the first BlueSCSI found\n");
+	fprintf(stderr, "        Requests go through bstoolboxd when one is serving the device\n");
+	fprintf(stderr, "\n\nPlease make sure you run the program as root.\n");
 }
 
-static int bluescsi_listcds(int dev)
+/*
+ * There is no getopt_long on IRIX, so long options are picked out of argv
+ * by hand before getopt() sees the rest.
+ */
+static int take_long_opts(int *argc, char *argv[], int *wait_secs, qos_state *qos)
 {
-	char cmd[10] = {BLUESCSI_TOOLBOX_MODE_CDS, 0, 0, 0, 0, 0, 0, 0, 0, 0};
-	char *buf;
 	int i, j;
-	int buf_size;
-	int num_cds;
 
-	num_cds = bluescsi_countcds (dev);
-	if (num_cds < 0 || num_cds > MAX_FILES)
+	for (i = 1; i < *argc; )
 	{
-		fprintf (stderr, "Error: CD number requested invalid: %i\n", num_cds);
-		return -1;
-	}
-	fprintf (stdout, "Found %i CDs\n", num_cds);
-	buf_size = sizeof(ToolboxFileEntry) * num_cds;
-	
-	buf = (char *)malloc(buf_size);
-	if (buf == NULL)
-	{
-		fprintf (stderr, "Error: failed to malloc %i bytes: - %s\n", buf_size, strerror(errno));
-		return -1;
-	}
-
-	memset(buf, 0, buf_size);
-	if (scsi_send_command(dev, (unsigned char *)cmd, sizeof(cmd), (unsigned char *)buf, buf_size) != 0)
-	{
-		fprintf (stderr, "Error: listcds failed - %s\n", strerror(errno));
-		free(buf);
-		return -1;
-	}
-	j = 0;
-	for (i = 0; i < buf_size; i++)
-	{
-		if (j == 0)
-			fprintf (stdout, "#%i ", (buf[i]));
-		if (j >= 2 && j <= 34)
-			fprintf (stdout, "%c", buf[i]);
-		j++;
-		if (j >= sizeof(ToolboxFileEntry))
+		if (strcmp(argv[i], "--") == 0)
+			break;
+		if (strcmp(argv[i], "--wait") == 0)
+			*wait_secs = DEVLOCK_FOREVER;
+		else if (strncmp(argv[i], "--wait=", 7) == 0)
+			*wait_secs = atoi(argv[i] + 7);
+		else if (strncmp(argv[i], "--bwlimit=", 10) == 0)
 		{
-			j = 0;
-			fprintf (stdout, "\n");
+			if (qos_parse_rate(argv[i] + 10, &qos->rate) != 0)
+			{
+				fprintf(stderr, "Error: bad rate %s\n", argv[i] + 10);
+				return -1;
+			}
 		}
-	}
-	fprintf (stdout, "\n");
-	free(buf);
-	return 1;
-}
-
-static int bluescsi_listfiles(int dev, int print)
-{
-	char cmd[10] = {BLUESCSI_TOOLBOX_MODE_FILES, 0, 0, 0, 0, 0, 0, 0, 0, 0};
-	char *buf;
-	int i;
-	int buf_size;
-	int num_files;
-	
-	if (verbose)
-		fprintf (stdout, "Listing files on dev %d\n", dev);
-
-	num_files = bluescsi_countfiles (dev);
-	if (num_files < 0 || num_files > MAX_FILES)
-	{
-		fprintf (stderr, "Error: listfiles num_files invalid: %i\n", num_files);
-		return -1;
-	}
-	files_count = num_files;
-	if (verbose)
-		fprintf (stdout, "Found %i files\n", num_files);
-	buf_size = sizeof(ToolboxFileEntry) * num_files;
-	
-	buf = (char *)malloc(buf_size);
-	if (buf == NULL)
-	{
-		fprintf (stderr, "Error: failed to malloc %i bytes: - %s\n", buf_size, strerror(errno));
-		return -1;
-	}
-
-	memset(buf, 0, buf_size);
-	if (scsi_send_command(dev, (unsigned char *)cmd, sizeof(cmd), (unsigned char *)buf, buf_size) != 0)
-	{
-		fprintf (stderr, "Error: listfiles failed - %s\n", strerror(errno));
-		free(buf);
-		return -1;
-	}
-
-	for (i = 0; i < num_files; i++) {
-		memcpy(&files[i], buf + i * sizeof(ToolboxFileEntry), sizeof(ToolboxFileEntry));
-		files[i].name[sizeof(files[i].name) - 1] = '\0';
-	}
-	free(buf);
-
-	if (verbose || print)
-	{	
-		for (i = 0; i < num_files; i++)
-			fprintf (stdout, "#%i %s %llu bytes\n", files[i].index, files[i].name, size_to_long(files[i].size));
-	}
-	return 0;
-}
-
-/*
- * Receiving Files (BlueSCSI /shared -> Host)
- * BLUESCSI_TOOLBOX_GET_FILE (0xD1)
- */
-static int bluescsi_getfile(int dev, int idx, char *outdir)
-{
-	char cmd[10];
-	char *buf;
-	FILE *fd;
-	char *filename;
-	unsigned long long total_bytes;
-	unsigned long long total_blocks;
-	unsigned long long blk_offset = 0;
-	unsigned long long bytes_written = 0;
-	unsigned long long blocks_remaining;
-	size_t bytes_to_read;
-	size_t bytes_to_write;
-	int blocks_to_req;
-	int ret;
-
-	if (strlen(outdir) < 1)
-		strcpy(outdir, "./");
-
-	if (bluescsi_listfiles(dev, 0) != 0)
-	{
-		fprintf(stderr, "Error: getfile couldn't listfiles\n");
-		return -1;
-	}
-
-	if (idx < 0 || idx >= files_count)
-	{
-		fprintf(stderr, "Error: invalid file index %d\n", idx);
-		return -1;
-	}
-
-	total_bytes = size_to_long(files[idx].size);
-	if (verbose)
-		fprintf(stdout, "getfile :#%i %s %llu bytes\n", files[idx].index, files[idx].name, total_bytes);
-
-	filename = (char *)malloc(strlen(outdir) + strlen(files[idx].name) + 2);
-	if (filename == NULL)
-	{
-		fprintf(stderr, "Error: malloc failed for filename\n");
-		return -1;
-	}
-
-	if (outdir[strlen(outdir) - 1] == '/')
-		sprintf(filename, "%s%s", outdir, files[idx].name);
-	else
-		sprintf(filename, "%s/%s", outdir, files[idx].name);
-
-	fprintf(stdout, "Fetching %s (%llu bytes)\n", files[idx].name, total_bytes);
-	fd = fopen(filename, "wb");
-	if (fd == NULL)
-	{
-		fprintf(stderr, "Error: getfile couldn't open %s\n", filename);
-		free(filename);
-		return -1;
-	}
-
-	if (total_bytes == 0)
-	{
-		fclose(fd);
-		free(filename);
-		return 0;
-	}
-
-	buf = (char *)malloc(GET_BUF_SIZE);
-	if (buf == NULL)
-	{
-		fprintf(stderr, "Error: malloc failed for receive buffer\n");
-		fclose(fd);
-		free(filename);
-		return -1;
-	}
-
-	/* Total 4096-byte blocks required */
-	total_blocks = (total_bytes + GET_BLOCK_SIZE - 1) / GET_BLOCK_SIZE;
-
-	while (blk_offset < total_blocks)
-	{
-		blocks_remaining = total_blocks - blk_offset;
-		blocks_to_req = (blocks_remaining < GET_BLOCKS_PER_XFER) ? (int)blocks_remaining : GET_BLOCKS_PER_XFER;
-
-		/* ALWAYS request full block aligned size over SCSI DMA to prevent bus hangs */
-		bytes_to_read = (size_t)blocks_to_req * GET_BLOCK_SIZE;
-
-		/* Determine actual file payload bytes to extract from this chunk */
-		if (bytes_written + bytes_to_read > total_bytes)
-			bytes_to_write = (size_t)(total_bytes - bytes_written);
-		else
-			bytes_to_write = bytes_to_read;
-
-		memset(cmd, 0, sizeof(cmd));
-		cmd[0] = BLUESCSI_TOOLBOX_GET_FILE;
-		cmd[1] = (unsigned char)(idx & 0xFF);
-		cmd[2] = (unsigned char)((blk_offset >> 24) & 0xFF);
-		cmd[3] = (unsigned char)((blk_offset >> 16) & 0xFF);
-		cmd[4] = (unsigned char)((blk_offset >>  8) & 0xFF);
-		cmd[5] = (unsigned char)((blk_offset      ) & 0xFF);
-		cmd[6] = (unsigned char)(blocks_to_req & 0xFF);
-
-		memset(buf, 0, GET_BUF_SIZE);
-		ret = scsi_send_command(dev, (unsigned char *)cmd, sizeof(cmd), (unsigned char *)buf, (int)bytes_to_read);
-		if (ret != 0)
+		else if (strncmp(argv[i], "--duty=", 7) == 0)
 		{
-			fprintf(stderr, "Error: getfile failed during transfer at block %llu - %s\n", blk_offset, strerror(errno));
-			fclose(fd);
-			free(buf);
-			free(filename);
-			return -1;
+			if (qos_parse_duty(argv[i] + 7, &qos->duty_on_ms, &qos->duty_off_ms) != 0)
+			{
+				fprintf(stderr, "Error: bad duty cycle %s, expected ON/OFF milliseconds\n", argv[i] + 7);
+				return -1;
+			}
 		}
-
-		if (fwrite(buf, 1, bytes_to_write, fd) != bytes_to_write)
+		else if (strcmp(argv[i], "--nice") == 0)
+			qos->nice = QOS_NICE_DEFAULT;
+		else if (strncmp(argv[i], "--nice=", 7) == 0)
+			qos->nice = atoi(argv[i] + 7);
+		else if (strcmp(argv[i], "--listing-cache") == 0)
+			listing_cache = 1;
+		else if (strcmp(argv[i], "--stats") == 0)
+			show_stats = 1;
+		else if (strncmp(argv[i], "--metrics=", 10) == 0)
+			metrics_file = argv[i] + 10;
+		else if (strcmp(argv[i], "--metrics") == 0)
+		{
+			if (i + 1 >= *argc)
+			{
+				fprintf(stderr, "Error: --metrics needs a file\n");
+				return -1;
+			}
+			metrics_file = argv[i + 1];
+			for (j = i; j < *argc - 1; j++)
+				argv[j] = argv[j + 1];
+			argv[--*argc] = NULL;
+		}
+		else if (strncmp(argv[i], "--batch=", 8) == 0)
+			batch_file = argv[i] + 8;
+		else if (strcmp(argv[i], "--batch") == 0)
 		{
-			fprintf(stderr, "Error: fwrite failed writing to %s\n", filename);
-			fclose(fd);
-			free(buf);
-			free(filename);
+			if (i + 1 >= *argc)
+			{
+				fprintf(stderr, "Error: --batch needs a file, or - for stdin\n");
+				return -1;
+			}
+			batch_file = argv[i + 1];
+			for (j = i; j < *argc - 1; j++)
+				argv[j] = argv[j + 1];
+			argv[--*argc] = NULL;
+		}
+		else if (strncmp(argv[i], "--", 2) == 0)
+		{
+			fprintf(stderr, "Error: unknown option %s\n", argv[i]);
 			return -1;
 		}
+		else
+		{
+			i++;
+			continue;
+		}
 
-		bytes_written += bytes_to_write;
-		blk_offset += blocks_to_req;
+		for (j = i; j < *argc - 1; j++)
+			argv[j] = argv[j + 1];
+		argv[--*argc] = NULL;
 	}
-
-	fclose(fd);
-	free(buf);
-	free(filename);
 	return 0;
 }
 
-static int bluescsi_listdevices(int dev, char **outbuf)
-{
-	char cmd[10] = {BLUESCSI_TOOLBOX_MODE_DEVICES, 0, 0, 0, 0, 0, 0, 0, 0, 0};
-	char buf[8];
-	*outbuf = NULL;
-
-	memset(buf, 0, sizeof(buf));
-	if (scsi_send_command(dev, (unsigned char *)cmd, sizeof(cmd), (unsigned char *)buf, sizeof(buf)) != 0)
-	{
-		fprintf (stderr, "Error: BlueSCSI listdevices failed - %s\n", strerror(errno));
-		return -1;
-	}
-	*outbuf = (char *)calloc(sizeof(buf), sizeof(char));
-	if (*outbuf) {
-		memcpy(*outbuf, buf, sizeof(buf));
-		return 0;
-	}
-	else
-		return -1;
-}
-
-static int bluescsi_check_vendor_page(int dev)
+int main(int argc, char *argv[])
 {
-	static const unsigned char BlueSCSIVendorPage[] = {
-		0x31, /* Page code */
-		42,   /* Page length */
-		'B','l','u','e','S','C','S','I',' ','i','s',' ','t','h','e',' ','B','E','S','T',' ',
-		'S','T','O','L','E','N',' ','F','R','O','M',' ','B','L','U','E','S','C','S','I',0x00
-	};
-
-	unsigned char cmd[6];
-	unsigned char buf[64];
-	unsigned char bdl;
-	unsigned char returned_page_code;
-	int page_offset;
-
-	/* MODE SENSE (6) CDB: Opcode 0x1A, requesting Page 0x31 */
-	cmd[0] = 0x1A; /* MODE SENSE (6) */
-	cmd[1] = 0x08; /* DBD = 1 (Disable Block Descriptors) */
-	cmd[2] = 0x31; /* Page code 0x31 */
-	cmd[3] = 0x00; /* Subpage code */
-	cmd[4] = 64;   /* Allocation length */
-	cmd[5] = 0x00; /* Control */
-
-	memset(buf, 0, sizeof(buf));
-	
-	if (verbose)
-		fprintf(stdout, "Fetching BlueSCSI vendor page\n");
-	if (scsi_send_command(dev, cmd, sizeof(cmd), buf, sizeof(buf)) != 0)
-	{
-		if (verbose)
-			fprintf(stderr, "Error: MODE SENSE (6) command failed - %s\n", strerror(errno));
-		return 1;
-	}
-
-	/* MODE SENSE (6) header is 4 bytes: [0]=length, [1]=medium type, [2]=dev param, [3]=BDL */
-	bdl = buf[3];
-	page_offset = 4 + bdl;
-
-	/* Ensure response length contains the full expected page */
-	if (page_offset + (int)sizeof(BlueSCSIVendorPage) > (int)sizeof(buf))
-	{
-		if (verbose)
-			fprintf(stderr, "Error: MODE SENSE response too short for vendor page 0x31\n");
-		return 1;
-	}
-
-	/* Mask out bit 7 (PS - Parameters Savable bit) on returned page code byte */
-	returned_page_code = buf[page_offset] & 0x3F;
-
-	if (returned_page_code != BlueSCSIVendorPage[0] ||
-	    memcmp(&buf[page_offset + 1], &BlueSCSIVendorPage[1], sizeof(BlueSCSIVendorPage) - 1) != 0)
-	{
-		if (verbose)
-			fprintf(stderr, "Error: Vendor page 0x31 data mismatch\n");
-		return 1;
-	}
-	
-	if (verbose)
-		fprintf(stdout, "Vendor page: %.*s\n", 41, (char *)&buf[page_offset + 2]);
-	return 0;
-}
+	int c, cdimg = NOT_ACTIVE, mode = 0, file = NOT_ACTIVE;
+	int ret;
+	char outdir[1024];
+	char *device_path;
+	char *record_file = NULL;
+	char *trace_spec = NULL;
+	char auto_path[SCSI_PATH_LEN];
+	int wait_secs = DEVLOCK_NOWAIT;
+	int follow = 0;
 
-static int bluescsi_inquiry(int dev, int print)
-{
-	char cmd[] ={SCSI_INQUIRY, 0, 0, 0, sizeof(scsi_inquiry), 0};	
-	char buf[sizeof(scsi_inquiry)];
-	const char *BlueSCSI_vendor_id = "BLUESCSI";
-	scsi_inquiry inq;
-	int i;
-	char* dev_flags;
-	int additional_len;
-	int total_len;
-	int toolbox_api_version;
-	unsigned char dev_map[8];
-	unsigned char api_ver;
-	unsigned char caps;
+	memset(outdir, 0, sizeof(outdir));
 
-	memset(buf, 0, sizeof(buf));
-	if (verbose)
-		fprintf(stdout, "Sending SCSI Inquiry command\n");
-	if (scsi_send_command(dev, (unsigned char *)cmd, sizeof(cmd), (unsigned char *)buf, sizeof(buf)) != 0)
+	memset(&xfer_qos, 0, sizeof(xfer_qos));
+	if (take_long_opts(&argc, argv, &wait_secs, &xfer_qos) != 0)
 	{
-		fprintf (stderr, "Error: inquiry command failed - %s\n", strerror(errno));
+		usage();
 		return 1;
 	}
 
-	memset (&inq, 0, sizeof(scsi_inquiry));
-	memcpy (&inq.version, &buf[2], 1);
-	memcpy (&inq.vendor_id, &buf[8], sizeof(inq.vendor_id) - 1);
-	inq.vendor_id[8] = '\0';
-	memcpy (&inq.product_id, &buf[16], sizeof(inq.product_id) - 1);
-	inq.product_id[16] = '\0';
-	memcpy (&inq.product_rev, &buf[32], sizeof(inq.product_rev) - 1);
-	inq.product_rev[4] = '\0';
-	
-	if (verbose || print)
+	if (show_stats)
 	{
-		fprintf (stdout, "SCSI version: %i\n", inq.version);
-		fprintf (stdout, "vendor_id: %s \nproduct_id: %s\n", inq.vendor_id, inq.product_id);
-		fprintf (stdout, "product_rev: %s\n", inq.product_rev);
-	}
-	
-	/* Do not proceed if it's not a BlueSCSI device */
-	if (strstr (inq.vendor_id, BlueSCSI_vendor_id) == NULL)
-	{
-		fprintf (stderr, "Error: didn't find \"%s\" in vendor_id: %s\n", BlueSCSI_vendor_id, inq.vendor_id);
-		return 1;
+		cmdstats_start();
+		atexit(cmdstats_report_exit);
 	}
-	else if (verbose || print)
-		fprintf (stdout, "debug mode: %i\n", bluescsi_getdebug(dev)); /* Don't try to get debug mode if it isn't a BlueSCSI */
 
-	/* Check the BlueSCSIVendorPage */
-	if (bluescsi_check_vendor_page(dev) != 0)
-	{
-		fprintf (stderr, "Error: didn't find BlueSCSI vendor page\n");
+	/* Ensure at least the device path is provided */
+	if (argc < 2 || argv[1][0] == '-') {
+		fprintf(stderr, "Error: No device path specified as first argument.\n");
+		usage();
 		return 1;
 	}
 
-	additional_len = buf[4];
-	total_len = additional_len + 5;
-
-	if (total_len <= sizeof(buf)) {
-		toolbox_api_version = buf[total_len - 1];
-		if (verbose)
-			fprintf(stdout, "Toolbox API version: %u\n", toolbox_api_version);
-
-		if (toolbox_api_version < BLUESCSI_TOOLBOX_API_VER) {
-			fprintf(stdout, "WARNING! Toolbox API version %u too old, expecting: %u\n", toolbox_api_version, BLUESCSI_TOOLBOX_API_VER);
+	if (strcmp(argv[1], "trace") == 0) {
+		if (argc != 3) {
+			usage();
+			return 1;
 		}
-	} else {
-		fprintf(stdout, "Toolbox API version: not available (length mismatch)\n");
-		return 1;
-	}
-
-	/* Use Metadata subcommand 0x00 to list devices */
-	if (bluescsi_metadata_list_devices(dev, dev_map) == 0) {
-		if (verbose)
-			fprintf (stdout, "Device flags (Metadata 0xD9:00): ");
-		for (i = 0; i < 8; i++)
-		{
-			device_list[i] = dev_map[i];
-			if (verbose)
-				fprintf (stdout,"%02x ", dev_map[i]);
+		return cmdtrace_view(argv[2]);
+	}
+
+	if (strcmp(argv[1], "discover") == 0) {
+		int rescan = 0;
+
+		optind = 2;
+		while ((c = getopt(argc, argv, "rv")) != -1) switch (c) {
+			case 'r':
+				rescan = 1;
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			default:
+				usage();
+				return 1;
 		}
-		if (verbose)
-			fprintf(stdout, "\n");
+		return discover_run(&argv[optind], argc - optind, rescan);
 	}
-	else if (bluescsi_listdevices(dev, &dev_flags) == 0) {
-		/* Fallback to legacy device list command if metadata 0xD9:00 fails */
-		if (verbose)
-			fprintf (stdout, "Device flags (Legacy): ");
-		for (i = 0; i < 8; i++)
-		{
-			device_list[i] = dev_flags[i];
-			if (verbose)
-				fprintf (stdout,"%02x ", (unsigned char) dev_flags[i]);
+
+	device_path = argv[1];
+	if (strcmp(device_path, "auto") == 0) {
+		if (discover_lookup(auto_path, sizeof(auto_path)) != 0) {
+			fprintf(stderr, "Error: no BlueSCSI found, try bstoolbox discover -r\n");
+			return 1;
 		}
-		if (verbose)
-			fprintf(stdout, "\n");
-		free(dev_flags);
-	}
-	else {
-		fprintf (stderr, "Failed to fetch device flags: %s\n", strerror(errno));
-		return 1;
+		device_path = auto_path;
 	}
 
-	/* Fetch Capabilities via Metadata 0xD9:01 */
-	bluescsi_metadata_get_capabilities(dev, &api_ver, &caps);
-
-	return 0;
-}
+	if (metrics_file != NULL)
+		bluescsi_metrics_start(metrics_file, device_path);
 
-static void do_drive(char *path, int mode, int verbose, int cd_img, int file, char *outdir)
-{
-	int dev;
-	int dev_scsi_id;
-	int readonly = 0;
-	
-	if (mode == MODE_CD || cd_img != NOT_ACTIVE)
-		readonly = 1;
+	/*
+	 * ini works outside the shared directory and bench and soak need every
+	 * command timed here, so none of them goes through bstoolboxd.
+	 */
+	if (argc > 2 && (strcmp(argv[2], "ini") == 0 || strcmp(argv[2], "bench") == 0 ||
+	    strcmp(argv[2], "soak") == 0)) {
+		bs_ctx *ctx;
 
-	dev = scsi_open(path, readonly);
-	if (dev < 0) {
-		if (!readonly)
+		if (strncmp(device_path, "replay:", 7) != 0)
 		{
-			fprintf (stderr, "Error opening device for read/write, trying to open readonly\n");
-			dev = scsi_open(path, 1);
+			if (devlock_acquire(device_path, wait_secs) != 0)
+				return 1;
+			atexit(devlock_release);
 		}
-		if (dev < 0) {
-			fprintf(stderr, "ERROR: Cannot open device: %s\nTry running again as root\n", strerror(errno));
-			exit(1);
-		}
-	}
-
-	if (bluescsi_inquiry (dev, PRINT_OFF) != 0)
-	{
-		fprintf (stderr, "Didn't find a BlueSCSI device at %s\n", path);
-		scsi_close (dev);
-		exit(1);
-	}
-	
-	if ((dev_scsi_id = path_to_devnum(path)) < 0)
-	{
-		fprintf (stderr, "Failed to get dev_scsi_id from path_to_devnum\n");
-		scsi_close(dev);
-		exit(1);
-	}
-
-	if (mode == MODE_CD)
-	{
-		if (device_list[dev_scsi_id] != TYPE_CD)
-		{
-			fprintf (stderr, "Tried to list CDs, but an emulated CD drive wasn't detected\n");
-			scsi_close(dev);
-			exit(1);
+		if ((ctx = open_drive(device_path, 0)) == NULL) {
+			bluescsi_metrics_write(NULL, 1);
+			return 1;
 		}
+		if (strcmp(argv[2], "ini") == 0)
+			ret = ini_run(ctx, device_path, argc - 3, &argv[3]);
+		else if (strcmp(argv[2], "bench") == 0)
+			ret = bench_run(ctx, device_path, argc - 2, &argv[2]);
 		else
-			bluescsi_listcds(dev);
-	}
-	else if (mode == MODE_INQUIRY)
-		bluescsi_inquiry(dev, PRINT_ON);
-	else if (mode == MODE_DEBUG)
-		bluescsi_setdebug(dev, file);
-	else if (mode == MODE_SHARED)
-		bluescsi_listfiles(dev, PRINT_ON);
-	else if (mode == MODE_PUT)
-		bluescsi_sendfile (dev, outdir);
-	else if (mode == MODE_GET_WDIR)
-		bluescsi_print_wdir(dev);
-	else if (mode == MODE_SET_WDIR)
-		bluescsi_set_wdir(dev, outdir);
-	else if (mode == MODE_REMOVE_FILE)
-		bluescsi_remove_file(dev, file);
-	else if (mode == MODE_GET_LOG)
-		bluescsi_get_log(dev, outdir);
-	else if (file != NOT_ACTIVE)
-		bluescsi_getfile (dev, file, outdir);
-	else if (cd_img != NOT_ACTIVE)
-	{
-		if (device_list[dev_scsi_id] != TYPE_CD)
-			fprintf (stderr, "Device doesn't seem to be a CD drive? Detected type %i on SCSI ID %i\n", device_list[dev_scsi_id], dev_scsi_id);
-		else
-			bluescsi_setnextcd(dev, cd_img);
-	}
-	
-	scsi_close(dev);
-}
-
-static void usage(void)
-{
-	fprintf(stderr, "\nUsage:   bstoolbox <device> [options]\n\n");
-#if defined(OS_IRIX)
-	fprintf(stderr, "example: bstoolbox /dev/scsi/sc0d1l0 -s\n\n");
-#elif defined(OS_LINUX)
-	fprintf(stderr, "example: bstoolbox /dev/sg2 -s\n\n");
-#endif
-	fprintf(stderr, "Options:\n");
-	fprintf(stderr, "\t-h      : display this help message and exit\n");
-	fprintf(stderr, "\t-v      : be verbose\n");
-	fprintf(stderr, "\t-i      : interrogate BlueSCSI and return version\n");
-	fprintf(stderr, "\t-l      : list available CDs\n");
-	fprintf(stderr, "\t-s      : List /shared directory\n");
-	fprintf(stderr, "\t-c num  : change to CD number (1, 2, etc)\n");
-	fprintf(stderr, "\t-g num  : get file from shared directory (1, 2, etc)\n");
-	fprintf(stderr, "\t-p file : put file to shared directory\n");
-	fprintf(stderr, "\t-o dir  : set output directory, defaults to current\n");
-	fprintf(stderr, "\t-w      : get current working directory\n");
-	fprintf(stderr, "\t-W dir  : set working directory\n");
-	fprintf(stderr, "\t-D num  : remove file by number from working directory\n");
-	fprintf(stderr, "\t-L      : Show BlueSCSI log\n");
-	fprintf(stderr, "\t-d num  : set debug mode (0 = off, 1 - on)\n");
-	fprintf(stderr, "\n\nPlease make sure you run the program as root.\n");
-}
-
-int main(int argc, char *argv[])
-{
-	int c, cdimg = NOT_ACTIVE, mode = 0, file = NOT_ACTIVE;
-	char outdir[1024];
-	char *device_path;
-
-	memset(outdir, 0, sizeof(outdir));
-
-	/* Ensure at least the device path is provided */
-	if (argc < 2 || argv[1][0] == '-') {
-		fprintf(stderr, "Error: No device path specified as first argument.\n");
-		usage();
-		return 1;
+			ret = soak_run(ctx, device_path, argc - 2, &argv[2]);
+		bluescsi_metrics_write(ctx, ret);
+		bs_close(ctx);
+		return ret;
 	}
 
-	device_path = argv[1];
-
 	/* Start parsing options from argv[2] onwards */
 	optind = 2;
-	while ((c = getopt(argc, argv, "hvlsic:d:D:g:o:p:wW:L")) != -1) switch (c) {
+	while ((c = getopt(argc, argv, "hvlsic:d:D:g:o:p:wW:LfM:R:T:")) != -1) switch (c) {
 		case 'c':
-			cdimg = atoi(optarg);
+			if (optarg[0] != '\0' && strspn(optarg, "0123456789") == strlen(optarg))
+				cdimg = atoi(optarg);
+			else
+			{
+				cdimg = CD_BY_NAME;
+				strncpy(outdir, optarg, sizeof(outdir) - 1);
+			}
 			break;
 		case 'g':
 			file = atoi(optarg);
@@ -1117,7 +408,7 @@ int main(int argc, char *argv[])
 			break;
 		case 'D':
 			mode = MODE_REMOVE_FILE;
-			file = atoi(optarg);
+			strncpy(outdir, optarg, sizeof(outdir) - 1);
 			break;
 		case 'w':
 			mode = MODE_GET_WDIR;
@@ -1129,6 +420,18 @@ int main(int argc, char *argv[])
 		case 'L':
 			mode = MODE_GET_LOG;
 			break;
+		case 'f':
+			follow = 1;
+			break;
+		case 'M':
+			manifest_file = optarg;
+			break;
+		case 'R':
+			record_file = optarg;
+			break;
+		case 'T':
+			trace_spec = optarg;
+			break;
 		case 'v':
 			verbose = 1;
 			break;
@@ -1138,13 +441,72 @@ int main(int argc, char *argv[])
 			return 1;
 	}
 
+	if (follow)
+	{
+		if (mode != MODE_GET_LOG)
+		{
+			fprintf(stderr, "Error: -f only goes with -L\n");
+			return 1;
+		}
+		mode = MODE_FOLLOW_LOG;
+	}
+
+	if (batch_file != NULL && (mode != MODE_NONE || file != NOT_ACTIVE || cdimg != NOT_ACTIVE))
+	{
+		fprintf(stderr, "Error: with --batch the commands come from the script\n");
+		return 1;
+	}
+
+	/* -R, -T, --stats and --metrics need the commands issued by this process */
+	if (record_file == NULL && trace_spec == NULL && !show_stats && metrics_file == NULL && batch_file == NULL)
+	{
+		if ((ret = try_daemon(device_path, wait_secs, mode, cdimg, file, outdir)) >= 0)
+			return ret;
+	}
+
+	if (record_file != NULL)
+	{
+		if (replay_record_start(record_file, device_path) != 0)
+			return 1;
+		atexit(replay_record_stop);
+	}
+
+	if (trace_spec != NULL)
+	{
+		if (cmdtrace_start(trace_spec) != 0)
+			return 1;
+		atexit(cmdtrace_stop);
+	}
+
+	if (batch_file != NULL)
+	{
+		batch_dev b;
+
+		memset(&b, 0, sizeof(b));
+		b.path = device_path;
+		b.wait_secs = wait_secs;
+		b.direct = record_file != NULL || trace_spec != NULL || show_stats || metrics_file != NULL;
+		ret = batch_run(batch_file, batch_step, &b);
+		if (b.ctx != NULL)
+			bs_close(b.ctx);
+		return ret;
+	}
+
+	/* replay: sessions don't touch a real device, so nothing to share */
+	if (strncmp(device_path, "replay:", 7) != 0)
+	{
+		if (devlock_acquire(device_path, wait_secs) != 0)
+			return 1;
+		atexit(devlock_release);
+	}
+
 	if (cdimg != -1)
-		mediad_stop ();
+		mediad_stop (device_path);
 
-	do_drive(device_path, mode, verbose, cdimg, file, outdir);
+	ret = do_drive(device_path, mode, cdimg, file, outdir);
 	
 	if (cdimg != -1)
-		mediad_start ();
+		mediad_start (device_path);
 	
-	return 0;
+	return ret;
 }
@@ -12,7 +12,13 @@
 
 #include "os.h"
 
+#define SCSI_TEST_UNIT_READY            0x00
 #define SCSI_INQUIRY                    0x12
+#define SCSI_MODE_SENSE_6               0x1A
+#define SCSI_START_STOP_UNIT            0x1B
+#define SCSI_PREVENT_ALLOW              0x1E
+#define SCSI_READ_CAPACITY              0x25
+#define SCSI_MODE_SENSE_10              0x5A
 #define BLUESCSI_TOOLBOX_MODE_FILES     0xD0
 #define BLUESCSI_TOOLBOX_GET_FILE       0xD1
 #define BLUESCSI_TOOLBOX_COUNT_FILES    0xD2
@@ -38,6 +44,7 @@
 #define MAX_FILES 100
 #define NAME_BUF_SIZE 33
 #define NOT_ACTIVE -1
+#define CD_BY_NAME -2		/* -c with a name, which is in the argument */
 #define SCSI_CMD_LENGTH 10
 
 /* New File Transfer Transfer Constants */
@@ -49,6 +56,19 @@
 #define SEND_BLOCKS_PER_XFER   127   /* Request 127 x 512B = 65,024B (~63.5KB) per SEND command */
 #define SEND_BUF_SIZE          (SEND_BLOCK_SIZE * SEND_BLOCKS_PER_XFER)
 
+/* Chunk-level recovery from transient bus errors */
+#define XFER_RETRIES           5
+#define XFER_BACKOFF_US        50000
+#define XFER_BACKOFF_MAX_US    800000
+#define SEND_RESTARTS          2
+
+/* After a CD change, wait this long for the new image to become ready */
+#define MEDIA_READY_TIMEOUT_US 10000000
+#define MEDIA_POLL_US          20000
+
+/* Typos allowed when -c picks a CD by name */
+#define CD_MATCH_TYPOS         3
+
 typedef enum
 {
 	TYPE_NONE = 0xFF,
@@ -60,8 +80,6 @@ typedef enum
 	TYPE_SEQUENTIAL = 0x05
 } dev_type;
 
-extern int device_list[8];
-
 enum {
 	MODE_NONE, 
 	MODE_CD,
@@ -72,7 +90,8 @@ enum {
 	MODE_SET_WDIR,
 	MODE_GET_LOG,
 	MODE_REMOVE_FILE,
-	MODE_DEBUG
+	MODE_DEBUG,
+	MODE_FOLLOW_LOG
 };
 
 enum {
@@ -105,7 +124,17 @@ typedef struct {
     unsigned char size[5];
 } ToolboxFileEntry;
 
-extern ToolboxFileEntry files[MAX_FILES];
-extern int files_count;
+/* Handshake facts, see bluescsi_handshake() */
+#define HS_BLUESCSI  0x01	/* INQUIRY vendor, vendor page and API version checked */
+#define HS_DEVMAP    0x02	/* device_list[] filled in */
+#define HS_CAPS      0x04	/* Metadata capabilities read */
+#define HS_ALL       (HS_BLUESCSI | HS_DEVMAP | HS_CAPS)
+#define HS_FRESH     0x10	/* Ask the device even if a fingerprint is cached */
+
+/* modes.c: one bstoolbox mode, for the CLI and bstoolboxd */
+struct bs_ctx;
+int bluescsi_run(struct bs_ctx *c, int mode, int cd_img, int file, const char *outdir);
+void bluescsi_metrics_start(const char *path, const char *devpath);
+void bluescsi_metrics_write(struct bs_ctx *c, int ret);
 
 #endif
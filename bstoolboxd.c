@@ -0,0 +1,489 @@
+/*
+ * bstoolboxd - keeps a BlueSCSI open and serves bstoolbox requests for it
+ * over a Unix socket (see ipc.h), so each CLI call skips the open and
+ * INQUIRY/vendor page/device list/capabilities handshake, and reuses the
+ * shared directory listing until something changes it.
+ *
+ * The daemon takes the device lock for each request and lets it go in
+ * between, so bstoolbox runs that need the device to themselves (-R, -T,
+ * --stats, ini, bench, soak...) can still get it; clients queue on the
+ * socket.  If anyone else held the lock since our last request, what we
+ * know about the directory and the CDs is dropped (see bs_forget()).
+ */
+#include <signal.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "bstoolbox.h"
+#include "transport.h"
+#include "discover.h"
+#include "devlock.h"
+#include "ipc.h"
+#include "metrics.h"
+#include "libbstoolbox.h"
+
+#define REQUEST_TIMEOUT_MS  5000
+#define CLIENT_SEND_TIMEOUT 10		/* Seconds a client may leave output unread */
+
+static volatile sig_atomic_t stopping = 0;
+static int log_requests = 0;
+static char *metrics_file = NULL;
+static char metrics_abs[1024];
+static char sock_path[108];
+static unsigned long lock_seq;		/* devlock_seq() of our last request */
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stopping = 1;
+}
+
+/* One record of stream to the client, see ipc.h */
+static void sock_printf(int fd, int stream, const char *fmt, ...)
+{
+	char buf[1200];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (len > (int)sizeof(buf) - 1)
+		len = sizeof(buf) - 1;
+	if (len > 0)
+		ipc_send(fd, stream, buf, len);
+}
+
+/* Pipes carrying a request's stdout and stderr, and the client they go to */
+typedef struct {
+	int sock;
+	int out;
+	int err;
+} relay_fds;
+
+/* Forward both pipes to the client as records until they are closed */
+static void *relay(void *arg)
+{
+	relay_fds *r = arg;
+	struct pollfd pfd[2];
+	char buf[IPC_MAX_RECORD];
+	ssize_t n;
+	int i;
+
+	pfd[0].fd = r->out;
+	pfd[1].fd = r->err;
+	pfd[0].events = pfd[1].events = POLLIN;
+	while (pfd[0].fd >= 0 || pfd[1].fd >= 0) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		for (i = 0; i < 2; i++) {
+			if (pfd[i].fd < 0 || pfd[i].revents == 0)
+				continue;
+			n = read(pfd[i].fd, buf, sizeof(buf));
+			if (n <= 0) {
+				pfd[i].fd = -1;		/* poll() skips it from now on */
+				continue;
+			}
+			/*
+			 * A client that went away or stopped reading still gets its
+			 * pipes drained; shutting the socket down makes every later
+			 * send fail at once rather than after another timeout.
+			 */
+			if (ipc_send(r->sock, i == 0 ? IPC_STDOUT : IPC_STDERR, buf, n) != 0)
+				shutdown(r->sock, SHUT_RDWR);
+		}
+	}
+	return NULL;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "\nUsage:   bstoolboxd [-v] [-f] [-m file] <device>\n\n");
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "\t-h : display this help message and exit\n");
+	fprintf(stderr, "\t-v : log each request\n");
+	fprintf(stderr, "\t-f : stay in the foreground\n");
+	fprintf(stderr, "\t-m file : keep Prometheus/OpenMetrics metrics in file, see bstoolbox --metrics\n");
+	fprintf(stderr, "\nbstoolbox calls for <device> are then served by the daemon.\n");
+}
+
+static bs_ctx *open_device(char *path)
+{
+	bs_ctx *c;
+
+	c = bs_open(path, 0);
+	if (c == NULL && errno != ENODEV)
+		c = bs_open(path, BS_OPEN_READONLY);
+	if (c == NULL) {
+		fprintf(stderr, "Error: cannot open device %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	/* Fail now rather than on the first request */
+	if (bs_target_type(c) < 0) {
+		bs_close(c);
+		return NULL;
+	}
+	return c;
+}
+
+static int listen_socket(const char *devpath)
+{
+	struct sockaddr_un addr;
+	mode_t mask;
+	int fd;
+	int ret;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (ipc_socket_path(devpath, 1, addr.sun_path, sizeof(addr.sun_path)) != 0) {
+		fprintf(stderr, "Error: no socket directory for %s\n", devpath);
+		return -1;
+	}
+	snprintf(sock_path, sizeof(sock_path), "%s", addr.sun_path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		fprintf(stderr, "Error: socket - %s\n", strerror(errno));
+		return -1;
+	}
+	/* The lock is only held during requests, so ask the socket itself */
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+		fprintf(stderr, "Error: a bstoolboxd already serves %s\n", devpath);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	unlink(sock_path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		fprintf(stderr, "Error: socket - %s\n", strerror(errno));
+		return -1;
+	}
+	/* Same access rule as the device itself: whoever started us, from the start */
+	mask = umask(077);
+	ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(mask);
+	if (ret != 0 || listen(fd, 16) != 0) {
+		fprintf(stderr, "Error: couldn't listen on %s - %s\n", sock_path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * The request line, which clients send in one go.  Requests are served one
+ * at a time, so a client that connects and says nothing only gets
+ * REQUEST_TIMEOUT_MS before it is dropped.
+ */
+static int read_request(int fd, char *line, int len)
+{
+	unsigned long long deadline;
+	struct pollfd pfd;
+	long left;
+	int got = 0;
+	ssize_t n;
+
+	deadline = scsi_now_us() + REQUEST_TIMEOUT_MS * 1000ULL;
+	while (got < len - 1) {
+		if (scsi_now_us() >= deadline)
+			return -1;
+		left = (long)((deadline - scsi_now_us()) / 1000);
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, (int)left) <= 0)
+			return -1;
+		n = read(fd, line + got, len - 1 - got);
+		if (n <= 0)
+			return -1;
+		got += n;
+		if (memchr(line, '\n', got) != NULL)
+			break;
+	}
+	line[got] = '\0';
+	return got;
+}
+
+/* Carry out one request with stdout and stderr relayed to the client */
+static int serve_request(int fd, char *devpath, bs_ctx *c, ipc_request *req)
+{
+	int out_pipe[2], err_pipe[2];
+	int saved_out, saved_err;
+	relay_fds fds;
+	pthread_t relayer;
+	int ret;
+
+	/* It would never end, and nobody else would get a turn meanwhile */
+	if (req->mode == MODE_FOLLOW_LOG) {
+		sock_printf(fd, IPC_STDERR, "Error: bstoolboxd can't follow the log, stop it to use -L -f\n");
+		return 1;
+	}
+	if (chdir(req->cwd) != 0) {
+		sock_printf(fd, IPC_STDERR, "Error: daemon can't use directory %s - %s\n", req->cwd, strerror(errno));
+		return 1;
+	}
+	if (pipe(out_pipe) != 0) {
+		sock_printf(fd, IPC_STDERR, "Error: daemon pipe - %s\n", strerror(errno));
+		return 1;
+	}
+	if (pipe(err_pipe) != 0) {
+		sock_printf(fd, IPC_STDERR, "Error: daemon pipe - %s\n", strerror(errno));
+		close(out_pipe[0]);
+		close(out_pipe[1]);
+		return 1;
+	}
+	fds.sock = fd;
+	fds.out = out_pipe[0];
+	fds.err = err_pipe[0];
+	if (pthread_create(&relayer, NULL, relay, &fds) != 0) {
+		sock_printf(fd, IPC_STDERR, "Error: daemon thread - %s\n", strerror(errno));
+		close(out_pipe[0]);
+		close(out_pipe[1]);
+		close(err_pipe[0]);
+		close(err_pipe[1]);
+		return 1;
+	}
+
+	verbose = req->verbose;
+	bs_set_verbose(c, req->verbose);
+	bs_set_manifest(c, req->manifest[0] != '\0' ? req->manifest : NULL);
+	bs_set_pacing(c, req->rate, req->duty_on_ms, req->duty_off_ms, req->nice);
+
+	fflush(stdout);
+	fflush(stderr);
+	saved_out = dup(1);
+	saved_err = dup(2);
+	dup2(out_pipe[1], 1);
+	dup2(err_pipe[1], 2);
+	close(out_pipe[1]);
+	close(err_pipe[1]);
+
+	/* A wait for the lock is reported to the client, as if run directly */
+	if (devlock_acquire(devpath, req->wait_secs) != 0)
+		ret = 1;
+	else {
+		if (devlock_seq() != (lock_seq + 1) % DEVLOCK_SEQ_WRAP)
+			bs_forget(c);
+		if (req->cd_img != NOT_ACTIVE)
+			mediad_stop(devpath);
+		ret = bluescsi_run(c, req->mode, req->cd_img, req->file, req->arg);
+		if (req->cd_img != NOT_ACTIVE)
+			mediad_start(devpath);
+		lock_seq = devlock_seq();
+		devlock_release();
+	}
+
+	/* Closing the last write ends lets the relay finish */
+	fflush(stdout);
+	fflush(stderr);
+	dup2(saved_out, 1);
+	dup2(saved_err, 2);
+	close(saved_out);
+	close(saved_err);
+	pthread_join(relayer, NULL);
+	close(out_pipe[0]);
+	close(err_pipe[0]);
+
+	if (chdir("/") != 0)
+		fprintf(stderr, "Warning: chdir / - %s\n", strerror(errno));
+	if (log_requests)
+		fprintf(stderr, "%s: mode %d file %d cd %d -> %d\n", devpath,
+			req->mode, req->file, req->cd_img, ret);
+	return ret;
+}
+
+static void serve(int lfd, char *devpath, bs_ctx *c)
+{
+	char line[IPC_MAX_LINE];
+	ipc_request req;
+	struct pollfd pfd;
+	struct timeval tv;
+	int ret;
+	int fd;
+
+	while (!stopping) {
+		/* Idle, the metrics file still gets refreshed now and then */
+		if (metrics_file != NULL) {
+			pfd.fd = lfd;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			ret = poll(&pfd, 1, METRICS_PERIOD_US / 1000);
+			if (ret == 0)
+				bluescsi_metrics_write(c, -1);
+			if (ret <= 0)
+				continue;
+		}
+
+		fd = accept(lfd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Error: accept - %s\n", strerror(errno));
+			break;
+		}
+#if defined(SO_SNDTIMEO)
+		/* A client that stops reading can't hold up everyone behind it */
+		tv.tv_sec = CLIENT_SEND_TIMEOUT;
+		tv.tv_usec = 0;
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+#endif
+		if (!ipc_peer_ok(fd)) {
+			sock_printf(fd, IPC_STDERR, "Error: bstoolboxd only serves its own user\n");
+			sock_printf(fd, IPC_STATUS, "1");
+			close(fd);
+			continue;
+		}
+
+		if (read_request(fd, line, sizeof(line)) < 0 || ipc_decode(line, &req) != 0) {
+			sock_printf(fd, IPC_STDERR, "Error: bad request\n");
+			sock_printf(fd, IPC_STATUS, "1");
+			close(fd);
+			continue;
+		}
+
+		ret = serve_request(fd, devpath, c, &req);
+		sock_printf(fd, IPC_STATUS, "%d", ret);
+		close(fd);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct sigaction sa;
+	char auto_path[SCSI_PATH_LEN];
+	char *device_path;
+	int foreground = 0;
+	int ready[2];
+	bs_ctx *ctx;
+	int lfd;
+	int c;
+	char ok;
+
+	while ((c = getopt(argc, argv, "hvfm:")) != -1) switch (c) {
+		case 'v':
+			log_requests = 1;
+			break;
+		case 'f':
+			foreground = 1;
+			break;
+		case 'm':
+			metrics_file = optarg;
+			break;
+		case 'h':
+		default:
+			usage();
+			return 1;
+	}
+	if (optind != argc - 1) {
+		usage();
+		return 1;
+	}
+
+	device_path = argv[optind];
+
+	/* We chdir about, so pin a relative metrics file down now */
+	if (metrics_file != NULL && metrics_file[0] != '/') {
+		if (getcwd(metrics_abs, sizeof(metrics_abs) - 1) == NULL ||
+		    strlen(metrics_abs) + strlen(metrics_file) + 2 > sizeof(metrics_abs)) {
+			fprintf(stderr, "Error: can't locate %s\n", metrics_file);
+			return 1;
+		}
+		strcat(metrics_abs, "/");
+		strcat(metrics_abs, metrics_file);
+		metrics_file = metrics_abs;
+	}
+	if (strcmp(device_path, "auto") == 0) {
+		if (discover_lookup(auto_path, sizeof(auto_path)) != 0) {
+			fprintf(stderr, "Error: no BlueSCSI found, try bstoolbox discover -r\n");
+			return 1;
+		}
+		device_path = auto_path;
+	}
+
+	/* The parent stays until the socket is up, so startup errors reach the caller */
+	if (!foreground) {
+		if (pipe(ready) != 0) {
+			fprintf(stderr, "Error: pipe - %s\n", strerror(errno));
+			return 1;
+		}
+		switch (fork()) {
+		case -1:
+			fprintf(stderr, "Error: fork - %s\n", strerror(errno));
+			return 1;
+		case 0:
+			close(ready[0]);
+			setsid();
+			break;
+		default:
+			close(ready[1]);
+			if (read(ready[0], &ok, 1) != 1)
+				ok = '1';
+			return ok != '0';
+		}
+	}
+
+	if (devlock_acquire(device_path, DEVLOCK_NOWAIT) != 0)
+		return 1;
+	if ((ctx = open_device(device_path)) == NULL)
+		return 1;
+
+	if ((lfd = listen_socket(device_path)) < 0)
+		return 1;
+
+	if (metrics_file != NULL) {
+		bluescsi_metrics_start(metrics_file, device_path);
+		bluescsi_metrics_write(ctx, -1);
+	}
+
+	/* From here on the lock is only taken for each request */
+	lock_seq = devlock_seq();
+	devlock_release();
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+
+	/* Relay each line to the client as it is printed */
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	if (!foreground) {
+		int null = open("/dev/null", O_RDWR);
+
+		ok = '0';
+		if (write(ready[1], &ok, 1) != 1)
+			return 1;
+		close(ready[1]);
+		if (null >= 0) {
+			dup2(null, 0);
+			dup2(null, 1);
+			dup2(null, 2);
+			close(null);
+		}
+	}
+	else
+		fprintf(stderr, "Serving %s on %s\n", device_path, sock_path);
+
+	if (chdir("/") != 0)
+		fprintf(stderr, "Warning: chdir / - %s\n", strerror(errno));
+
+	serve(lfd, device_path, ctx);
+
+	close(lfd);
+	unlink(sock_path);
+	bs_close(ctx);
+	return 0;
+}
@@ -18,8 +18,11 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
 
 #include "os.h"
+#include "cmdstats.h"
+#include "metrics.h"
 
 #define BLUESCSI_NETWORK_WIFI_CMD             0x1C
 
@@ -83,6 +86,10 @@ extern int scsi_send_commandw(int dev,
 
 int verbose = 0;
 
+/* Current network for -m, filled in by info */
+static struct wifi_network_entry last_info;
+static int have_info = 0;
+
 /*
  * Build a 6-byte BlueSCSI Wi-Fi CDB.
  */
@@ -380,6 +387,10 @@ wifi_info(int dev)
     fprintf(stdout, "\nCurrent Wi-Fi network:\n");
     print_network_entry(buf + 2, 1);
 
+    memcpy(&last_info, buf + 2, sizeof(last_info));
+    last_info.ssid[sizeof(last_info.ssid) - 1] = '\0';
+    have_info = 1;
+
     return 0;
 }
 
@@ -484,6 +495,59 @@ check_scsi_inquiry(int dev)
     return 0;
 }
 
+/*
+ * Write the -m metrics file: how the run went, the SCSI command counters
+ * and, after info, the signal of the current network.
+ */
+static void
+write_metrics(const char *path, const char *device, int ret)
+{
+    char tmp[1100];
+    char bssid[18];
+    FILE *f;
+
+    if ((f = metrics_begin(path, tmp, sizeof(tmp))) == NULL)
+        return;
+
+    metrics_family(f, "bswifi_last_run_success", "gauge", "Whether the last bswifi command worked.");
+    fprintf(f, "bswifi_last_run_success{device=");
+    metrics_quote(f, device);
+    fprintf(f, "} %d\n", ret == 0);
+    metrics_family(f, "bswifi_last_run_timestamp_seconds", "gauge", "When the last bswifi command ended.");
+    fprintf(f, "bswifi_last_run_timestamp_seconds{device=");
+    metrics_quote(f, device);
+    fprintf(f, "} %lu\n", (unsigned long)time(NULL));
+
+    if (have_info)
+    {
+        snprintf(bssid, sizeof(bssid), "%02x:%02x:%02x:%02x:%02x:%02x",
+                 last_info.bssid[0], last_info.bssid[1], last_info.bssid[2],
+                 last_info.bssid[3], last_info.bssid[4], last_info.bssid[5]);
+        metrics_family(f, "bswifi_connected", "gauge", "Whether the adapter is on a network.");
+        fprintf(f, "bswifi_connected{device=");
+        metrics_quote(f, device);
+        fprintf(f, "} %d\n", last_info.ssid[0] != '\0');
+        if (last_info.ssid[0] != '\0')
+        {
+            metrics_family(f, "bswifi_rssi_dbm", "gauge", "Signal strength of the current network.");
+            fprintf(f, "bswifi_rssi_dbm{device=");
+            metrics_quote(f, device);
+            fprintf(f, ",ssid=");
+            metrics_quote(f, last_info.ssid);
+            fprintf(f, ",bssid=\"%s\"} %d\n", bssid, (int)last_info.rssi);
+            metrics_family(f, "bswifi_channel", "gauge", "Channel of the current network.");
+            fprintf(f, "bswifi_channel{device=");
+            metrics_quote(f, device);
+            fprintf(f, ",ssid=");
+            metrics_quote(f, last_info.ssid);
+            fprintf(f, ",bssid=\"%s\"} %u\n", bssid, (unsigned int)last_info.channel);
+        }
+    }
+
+    metrics_commands(f, "bswifi", device);
+    metrics_end(f, tmp, path);
+}
+
 /*
  * Usage.
  */
@@ -493,9 +557,9 @@ usage(void)
     fprintf(stderr,
         "\n"
         "Usage:\n"
-        "  bswifi [-v] <device> scan\n"
-        "  bswifi [-v] <device> info\n"
-        "  bswifi [-v] <device> join <ssid> <key> [channel]\n"
+        "  bswifi [-v] [-m file] <device> scan\n"
+        "  bswifi [-v] [-m file] <device> info\n"
+        "  bswifi [-v] [-m file] <device> join <ssid> <key> [channel]\n"
         "\n"
         "Commands:\n"
         "  scan                  Scan for Wi-Fi networks and display results\n"
@@ -504,6 +568,8 @@ usage(void)
         "\n"
         "Options:\n"
         "  -v                    Verbose/debug output\n"
+        "  -m FILE               Write Prometheus/OpenMetrics metrics to FILE,\n"
+        "                        with RSSI and channel after info\n"
         "  -h                    Show this help\n"
 	"\n\nExample:\n\n sudo ./bswifi dp0 join MYNETWORK MYPASSWORD\n"
 	"\nPlease make sure you run the program as root.\n"
@@ -519,33 +585,43 @@ main(int argc, char *argv[])
     int c;
     int dev;
     int ret = 1;
+    int bad_opt = 0;
 
     char device[255];
     const char *command;
+    const char *metrics_file = NULL;
 
-    while ((c = getopt(argc, argv, "vh")) != -1)
+    while ((c = getopt(argc, argv, "vhm:")) != -1)
     {
         switch (c)
         {
             case 'v':
                 verbose = 1;
                 break;
+            case 'm':
+                metrics_file = optarg;
+                cmdstats_start();
+                break;
             case 'h':
                 usage();
                 return 0;
             default:
-                usage();
-                return 1;
+                bad_opt = 1;
+                break;
         }
     }
 
     argc -= optind;
     argv += optind;
 
-    if (argc < 2)
+    /* From here on every exit updates the metrics, so a failed run shows */
+    if (bad_opt || argc < 2)
     {
-	fprintf (stderr, "Error: not enough parameters given\n");
+        if (!bad_opt)
+            fprintf (stderr, "Error: not enough parameters given\n");
         usage();
+        if (metrics_file != NULL)
+            write_metrics(metrics_file, argc > 0 ? argv[0] : "", 1);
         return 1;
     }
 
@@ -557,6 +633,8 @@ main(int argc, char *argv[])
     else 
     {
         fprintf(stderr, "Could not find SCSI device for %s\n", argv[0]);
+        if (metrics_file != NULL)
+            write_metrics(metrics_file, argv[0], 1);
         return 1;
     } 
 
@@ -567,6 +645,8 @@ main(int argc, char *argv[])
     if (dev < 0)
     {
         fprintf(stderr, "ERROR: Cannot open %s: %s\n", device, strerror(errno));
+        if (metrics_file != NULL)
+            write_metrics(metrics_file, argv[0], 1);
         return 1;
     }
 
@@ -574,6 +654,8 @@ main(int argc, char *argv[])
     {
         fprintf(stderr, "Couldn't find wifi capabilities on %s\n", device);
         scsi_close(dev);
+        if (metrics_file != NULL)
+            write_metrics(metrics_file, argv[0], 1);
         return 1;
     }
 
@@ -627,5 +709,7 @@ main(int argc, char *argv[])
     }
 
     scsi_close(dev);
+    if (metrics_file != NULL)
+        write_metrics(metrics_file, argv[0], ret);
     return ret;
 }
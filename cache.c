@@ -0,0 +1,65 @@
+/*
+ * Location of on-disk caches, see cache.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "cache.h"
+
+/* IRIX has no O_NOFOLLOW; O_EXCL alone still refuses an existing link */
+#ifndef O_NOFOLLOW
+#define O_NOFOLLOW 0
+#endif
+
+int cache_path(char *out, size_t out_len, const char *name)
+{
+	char dir[1024];
+	const char *env;
+	struct stat st;
+	int len;
+
+	if ((env = getenv("BSTOOLBOX_CACHE_DIR")) != NULL && *env != '\0') {
+		snprintf(dir, sizeof(dir), "%s", env);
+	} else if ((env = getenv("HOME")) != NULL && *env != '\0') {
+		snprintf(dir, sizeof(dir), "%s/.cache", env);
+		mkdir(dir, 0700);
+		snprintf(dir, sizeof(dir), "%s/.cache/bstoolbox", env);
+	} else {
+		/* Not the shared lock directory: these files are trusted when read */
+		snprintf(dir, sizeof(dir), "%s-%lu", CACHE_DIR, (unsigned long)geteuid());
+	}
+
+	if (mkdir(dir, 0700) != 0 && errno != EEXIST)
+		return -1;
+	/* Nobody else may be able to plant or swap files in it */
+	if (lstat(dir, &st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != geteuid() ||
+	    (st.st_mode & (S_IWGRP | S_IWOTH)) != 0)
+		return -1;
+	len = snprintf(out, out_len, "%s/%s", dir, name);
+	if (len < 0 || (size_t)len >= out_len)
+		return -1;
+	return 0;
+}
+
+FILE *cache_create(const char *tmp)
+{
+	FILE *f;
+	int fd;
+
+	/* Left over from a run that died; the directory is ours, see above */
+	unlink(tmp);
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0644)) < 0)
+		return NULL;
+	if ((f = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		unlink(tmp);
+	}
+	return f;
+}
@@ -0,0 +1,20 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+/*
+ * Files that let later runs skip bus round trips (discovery results and
+ * the like) live in $BSTOOLBOX_CACHE_DIR, else $HOME/.cache/bstoolbox,
+ * else CACHE_DIR-<euid>.  The directory is created on demand, mode 0700,
+ * and caching is skipped unless it is ours and only we can write to it.
+ */
+#define CACHE_DIR "/var/tmp/bstoolbox-cache"
+
+int cache_path(char *out, size_t out_len, const char *name);
+
+/* A new file to write a cache into before renaming it into place */
+FILE *cache_create(const char *tmp);
+
+#endif
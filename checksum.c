@@ -0,0 +1,206 @@
+/*
+ * Inline CRC32C integrity hashing for file transfers.
+ *
+ * The checksum is folded into the get/send loops over the buffers that are
+ * already moving across the bus, so no second pass over the file is needed.
+ * Hardware CRC32C is used when the CPU has it (SSE4.2 on x86, the ARMv8 CRC
+ * extension on arm64), otherwise a slicing-by-8 table is used.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "checksum.h"
+
+#define CRC32C_POLY 0x82F63B78U
+
+static unsigned int crc32c_table[8][256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CRC32C_HW_X86
+#include <nmmintrin.h>
+
+static int crc32c_hw_ok = 0;
+
+__attribute__((target("sse4.2")))
+static unsigned int crc32c_hw(unsigned int crc, const unsigned char *p, size_t len)
+{
+	while (len > 0 && ((size_t)p & 7) != 0) {
+		crc = _mm_crc32_u8(crc, *p++);
+		len--;
+	}
+#if defined(__x86_64__)
+	{
+		unsigned long long c = crc;
+		unsigned long long v;
+
+		while (len >= 8) {
+			memcpy(&v, p, 8);
+			c = _mm_crc32_u64(c, v);
+			p += 8;
+			len -= 8;
+		}
+		crc = (unsigned int)c;
+	}
+#endif
+	while (len >= 4) {
+		unsigned int v;
+
+		memcpy(&v, p, 4);
+		crc = _mm_crc32_u32(crc, v);
+		p += 4;
+		len -= 4;
+	}
+	while (len > 0) {
+		crc = _mm_crc32_u8(crc, *p++);
+		len--;
+	}
+	return crc;
+}
+#elif defined(__ARM_FEATURE_CRC32)
+#define CRC32C_HW_ARM
+#include <arm_acle.h>
+
+static unsigned int crc32c_hw(unsigned int crc, const unsigned char *p, size_t len)
+{
+	while (len > 0 && ((size_t)p & 7) != 0) {
+		crc = __crc32cb(crc, *p++);
+		len--;
+	}
+	while (len >= 8) {
+		unsigned long long v;
+
+		memcpy(&v, p, 8);
+		crc = __crc32cd(crc, v);
+		p += 8;
+		len -= 8;
+	}
+	while (len > 0) {
+		crc = __crc32cb(crc, *p++);
+		len--;
+	}
+	return crc;
+}
+#endif
+
+static void crc32c_build_table(void)
+{
+	unsigned int i, k, c;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (k = 0; k < 8; k++)
+			c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+		crc32c_table[0][i] = c;
+	}
+	for (i = 0; i < 256; i++) {
+		for (k = 1; k < 8; k++)
+			crc32c_table[k][i] = (crc32c_table[k - 1][i] >> 8) ^
+				crc32c_table[0][crc32c_table[k - 1][i] & 0xFF];
+	}
+}
+
+/* Once per process, whichever thread gets here first */
+static void crc32c_setup(void)
+{
+	crc32c_build_table();
+#if defined(CRC32C_HW_X86)
+	crc32c_hw_ok = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+#endif
+}
+
+/* Byte-wise loads keep this correct on big endian hosts (IRIX) too */
+static unsigned int crc32c_sw(unsigned int crc, const unsigned char *p, size_t len)
+{
+	while (len >= 8) {
+		crc ^= (unsigned int)p[0] | ((unsigned int)p[1] << 8) |
+			((unsigned int)p[2] << 16) | ((unsigned int)p[3] << 24);
+		crc = crc32c_table[7][crc & 0xFF] ^
+			crc32c_table[6][(crc >> 8) & 0xFF] ^
+			crc32c_table[5][(crc >> 16) & 0xFF] ^
+			crc32c_table[4][crc >> 24] ^
+			crc32c_table[3][p[4]] ^
+			crc32c_table[2][p[5]] ^
+			crc32c_table[1][p[6]] ^
+			crc32c_table[0][p[7]];
+		p += 8;
+		len -= 8;
+	}
+	while (len > 0) {
+		crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xFF];
+		len--;
+	}
+	return crc;
+}
+
+unsigned int crc32c_init(void)
+{
+	return 0xFFFFFFFFU;
+}
+
+unsigned int crc32c_final(unsigned int crc)
+{
+	return crc ^ 0xFFFFFFFFU;
+}
+
+unsigned int crc32c_update(unsigned int crc, const void *buf, size_t len)
+{
+	pthread_once(&crc32c_once, crc32c_setup);
+#if defined(CRC32C_HW_X86)
+	if (crc32c_hw_ok)
+		return crc32c_hw(crc, (const unsigned char *)buf, len);
+#elif defined(CRC32C_HW_ARM)
+	return crc32c_hw(crc, (const unsigned char *)buf, len);
+#endif
+	return crc32c_sw(crc, (const unsigned char *)buf, len);
+}
+
+const char *crc32c_impl(void)
+{
+	pthread_once(&crc32c_once, crc32c_setup);
+#if defined(CRC32C_HW_X86)
+	if (crc32c_hw_ok)
+		return "sse4.2";
+#elif defined(CRC32C_HW_ARM)
+	return "armv8-crc";
+#endif
+	return "table";
+}
+
+/*
+ * Manifest lines are: <crc32c> <size> <unix time> <get|put> <name>
+ * The file is only ever appended to, so later audits take the last
+ * entry for a given name.
+ */
+int manifest_append(const char *manifest, const char *name, unsigned long long size,
+		unsigned int crc, const char *direction)
+{
+	FILE *fd;
+
+	fd = fopen(manifest, "a");
+	if (fd == NULL) {
+		fprintf(stderr, "Warning: couldn't open manifest %s\n", manifest);
+		return -1;
+	}
+	fprintf(fd, "%08x %llu %ld %s %s\n", crc, size, (long)time(NULL), direction, name);
+	if (fclose(fd) != 0) {
+		fprintf(stderr, "Warning: couldn't write manifest %s\n", manifest);
+		return -1;
+	}
+	return 0;
+}
+
+/* Manifest lives next to the local copy of the file */
+void manifest_path_for(char *out, size_t out_len, const char *local_path)
+{
+	const char *slash;
+
+	slash = strrchr(local_path, '/');
+	if (slash == NULL)
+		snprintf(out, out_len, "%s", MANIFEST_NAME);
+	else
+		snprintf(out, out_len, "%.*s/%s", (int)(slash - local_path), local_path, MANIFEST_NAME);
+}
@@ -0,0 +1,22 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+
+#define MANIFEST_NAME "bstoolbox.manifest"
+
+/*
+ * CRC32C (Castagnoli), computed incrementally over transfer buffers.
+ * Start with crc32c_init(), feed chunks through crc32c_update() and
+ * finish with crc32c_final().
+ */
+unsigned int crc32c_init(void);
+unsigned int crc32c_update(unsigned int crc, const void *buf, size_t len);
+unsigned int crc32c_final(unsigned int crc);
+const char *crc32c_impl(void);
+
+int manifest_append(const char *manifest, const char *name, unsigned long long size,
+		unsigned int crc, const char *direction);
+void manifest_path_for(char *out, size_t out_len, const char *local_path);
+
+#endif
@@ -0,0 +1,206 @@
+/*
+ * Per-command statistics, see cmdstats.h
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "bstoolbox.h"
+#include "transport.h"
+#include "cmdstats.h"
+
+/* Opcodes counted on their own; 0xD9 is split by subcommand below */
+static const unsigned char tracked[] = {
+	SCSI_TEST_UNIT_READY, SCSI_INQUIRY, SCSI_MODE_SENSE_6, SCSI_MODE_SENSE_10,
+	SCSI_START_STOP_UNIT, SCSI_PREVENT_ALLOW, SCSI_READ_CAPACITY,
+	BLUESCSI_TOOLBOX_MODE_FILES, BLUESCSI_TOOLBOX_GET_FILE, BLUESCSI_TOOLBOX_COUNT_FILES,
+	BLUESCSI_TOOLBOX_SEND_FILE_PREP, BLUESCSI_TOOLBOX_SEND_FILE_10, BLUESCSI_TOOLBOX_SEND_FILE_END,
+	BLUESCSI_TOOLBOX_TOGGLE_DEBUG, BLUESCSI_TOOLBOX_MODE_CDS, BLUESCSI_TOOLBOX_SET_NEXT_CD,
+	BLUESCSI_TOOLBOX_COUNT_CDS
+};
+#define N_TRACKED   ((int)sizeof(tracked))
+#define N_METADATA  (BLUESCSI_TOOLBOX_METADATA_REMOVE_FILE + 2)	/* Known subcommands, then the rest */
+#define SLOT_OTHER  (N_TRACKED + N_METADATA)
+#define N_SLOTS     (SLOT_OTHER + 1)
+
+int cmdstats_enabled = 0;
+
+static cmdstats_op slots[N_SLOTS];
+static cmdstats_total totals;
+static unsigned long long start_us;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int slot_of(const unsigned char *cmd)
+{
+	int i;
+
+	if (cmd[0] == BLUESCSI_TOOLBOX_METADATA)
+		return N_TRACKED + (cmd[1] < N_METADATA - 1 ? cmd[1] : N_METADATA - 1);
+	for (i = 0; i < N_TRACKED; i++)
+		if (tracked[i] == cmd[0])
+			return i;
+	return SLOT_OTHER;
+}
+
+/* Four buckets per power of two: 0-3 us exactly, then 4, 5, 6, 7, 8-9, 10-11, ... */
+static int bucket_of(unsigned long long us)
+{
+	int e;
+
+	if (us < 4)
+		return (int)us;
+	if (us > 0xFFFFFFFFULL)
+		us = 0xFFFFFFFFULL;
+	for (e = 2; (us >> (e + 1)) != 0; e++)
+		;
+	return 4 * (e - 1) + (int)((us >> (e - 2)) & 3);
+}
+
+static unsigned long long bucket_top(int b)
+{
+	int e;
+
+	if (b < 4)
+		return (unsigned long long)b;
+	e = b / 4 + 1;
+	return ((unsigned long long)(4 + b % 4 + 1) << (e - 2)) - 1;
+}
+
+void cmdstats_start(void)
+{
+	unsigned char cdb[2];
+	int i;
+
+	memset(slots, 0, sizeof(slots));
+	memset(&totals, 0, sizeof(totals));
+	for (i = 0; i < N_TRACKED; i++) {
+		cdb[0] = tracked[i];
+		cdb[1] = 0;
+		slots[i].name = scsi_opcode_name(cdb);
+	}
+	for (i = 0; i < N_METADATA; i++) {
+		cdb[0] = BLUESCSI_TOOLBOX_METADATA;
+		cdb[1] = (unsigned char)(i < N_METADATA - 1 ? i : 0xFF);
+		slots[N_TRACKED + i].name = scsi_opcode_name(cdb);
+	}
+	slots[SLOT_OTHER].name = "OTHER";
+
+	start_us = scsi_now_us();
+	cmdstats_enabled = 1;
+}
+
+void cmdstats_add(const unsigned char *cmd, int buf_len, int dir, int failed, unsigned long long us)
+{
+	cmdstats_op *op = &slots[slot_of(cmd)];
+
+	pthread_mutex_lock(&stats_lock);
+	op->count++;
+	op->total_us += us;
+	if (us > op->max_us)
+		op->max_us = us;
+	op->hist[bucket_of(us)]++;
+	totals.count++;
+	totals.bus_us += us;
+	if (failed) {
+		op->errors++;
+		totals.errors++;
+	} else if (buf_len > 0) {
+		op->bytes += buf_len;
+		if (dir == SCSI_DIR_WRITE)
+			totals.bytes_out += buf_len;
+		else
+			totals.bytes_in += buf_len;
+	}
+	pthread_mutex_unlock(&stats_lock);
+}
+
+/* Copy out the opcodes that saw any commands; returns how many */
+int cmdstats_ops(cmdstats_op *out, int max)
+{
+	int i, n = 0;
+
+	pthread_mutex_lock(&stats_lock);
+	for (i = 0; i < N_SLOTS && n < max; i++)
+		if (slots[i].count > 0)
+			out[n++] = slots[i];
+	pthread_mutex_unlock(&stats_lock);
+	return n;
+}
+
+void cmdstats_totals(cmdstats_total *out)
+{
+	pthread_mutex_lock(&stats_lock);
+	*out = totals;
+	pthread_mutex_unlock(&stats_lock);
+	out->wall_us = scsi_now_us() - start_us;
+}
+
+/* The latency p (0 to 1) of commands fall under, to the bucket */
+unsigned long long cmdstats_percentile(const cmdstats_op *op, double p)
+{
+	unsigned long want, seen = 0;
+	unsigned long long top;
+	int b;
+
+	if (op->count == 0)
+		return 0;
+	want = (unsigned long)(p * op->count + 0.999999);
+	if (want < 1)
+		want = 1;
+	for (b = 0; b < CMDSTATS_BUCKETS; b++) {
+		seen += op->hist[b];
+		if (seen >= want)
+			break;
+	}
+	top = bucket_top(b);
+	return top < op->max_us ? top : op->max_us;
+}
+
+static double mb_per_s(unsigned long long bytes, unsigned long long us)
+{
+	return us > 0 ? bytes / (double)us : 0.0;
+}
+
+void cmdstats_report(FILE *out)
+{
+	cmdstats_op ops[N_SLOTS];
+	cmdstats_total t;
+	unsigned long long host_us;
+	int n, i;
+
+	n = cmdstats_ops(ops, N_SLOTS);
+	cmdstats_totals(&t);
+	host_us = t.wall_us > t.bus_us ? t.wall_us - t.bus_us : 0;
+
+	fprintf(out, "\n%-16s %7s %6s %11s %9s %9s %9s %8s\n",
+		"Command", "Count", "Errors", "Bytes", "p50 ms", "p99 ms", "max ms", "MB/s");
+	for (i = 0; i < n; i++)
+		fprintf(out, "%-16s %7lu %6lu %11llu %9.3f %9.3f %9.3f %8.2f\n",
+			ops[i].name, ops[i].count, ops[i].errors, ops[i].bytes,
+			cmdstats_percentile(&ops[i], 0.50) / 1000.0,
+			cmdstats_percentile(&ops[i], 0.99) / 1000.0,
+			ops[i].max_us / 1000.0, mb_per_s(ops[i].bytes, ops[i].total_us));
+
+	fprintf(out, "\n%lu commands, %lu errors, %llu bytes in, %llu bytes out\n",
+		t.count, t.errors, t.bytes_in, t.bytes_out);
+	fprintf(out, "%.3f s total: %.3f s on the bus, %.3f s in the host\n",
+		t.wall_us / 1000000.0, t.bus_us / 1000000.0, host_us / 1000000.0);
+	fprintf(out, "%.2f MB/s on the bus, %.2f MB/s overall\n",
+		mb_per_s(t.bytes_in + t.bytes_out, t.bus_us),
+		mb_per_s(t.bytes_in + t.bytes_out, t.wall_us));
+}
+
+/* For atexit(); a run that failed before any command has nothing to show */
+void cmdstats_report_exit(void)
+{
+	cmdstats_total t;
+
+	if (!cmdstats_enabled)
+		return;
+	cmdstats_totals(&t);
+	if (t.count > 0) {
+		fflush(stdout);
+		cmdstats_report(stderr);
+	}
+}
@@ -0,0 +1,52 @@
+#ifndef CMDSTATS_H
+#define CMDSTATS_H
+
+/*
+ * Per-command statistics.
+ *
+ * With --stats every command that goes through scsi_dispatch(), retries
+ * and readiness checks included, is counted against its opcode (and for
+ * 0xD9 its subcommand): commands, errors, bytes moved and a latency
+ * histogram with four buckets per power of two microseconds, so
+ * percentiles come out within 25%.  Off, the cost is the test of
+ * cmdstats_enabled.
+ */
+
+#include <stdio.h>
+
+#define CMDSTATS_BUCKETS 128
+#define CMDSTATS_MAX_OPS 32	/* At least the opcodes cmdstats_ops() can return */
+
+typedef struct {
+	const char *name;
+	unsigned long count;
+	unsigned long errors;
+	unsigned long long bytes;	/* Of commands that worked */
+	unsigned long long total_us;
+	unsigned long long max_us;
+	unsigned long hist[CMDSTATS_BUCKETS];
+} cmdstats_op;
+
+typedef struct {
+	unsigned long long wall_us;	/* Since cmdstats_start() */
+	unsigned long long bus_us;	/* Spent in commands */
+	unsigned long long bytes_in;
+	unsigned long long bytes_out;
+	unsigned long count;
+	unsigned long errors;
+} cmdstats_total;
+
+extern int cmdstats_enabled;
+
+void cmdstats_start(void);
+void cmdstats_add(const unsigned char *cmd, int buf_len, int dir, int failed, unsigned long long us);
+
+/* Snapshots, for reports and exporters */
+int cmdstats_ops(cmdstats_op *out, int max);
+void cmdstats_totals(cmdstats_total *out);
+unsigned long long cmdstats_percentile(const cmdstats_op *op, double p);
+
+void cmdstats_report(FILE *out);
+void cmdstats_report_exit(void);
+
+#endif
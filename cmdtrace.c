@@ -0,0 +1,260 @@
+/*
+ * Binary command tracing, see cmdtrace.h
+ *
+ * Enabled with -T FILE[,sample=N], where N (up to CMDTRACE_SAMPLE_MAX) is
+ * the number of payload bytes kept per command.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "bstoolbox.h"
+#include "cmdtrace.h"
+
+#define CMDTRACE_HDR_LEN 16
+#define CMDTRACE_REC_LEN (32 + CMDTRACE_MAX_CDB + CMDTRACE_SAMPLE_MAX)
+
+#if defined(__GNUC__)
+#define ATOMIC_INC(p)   __sync_fetch_and_add((p), 1)
+#define BARRIER()       __sync_synchronize()
+#define TRY_LOCK(p)     (__sync_lock_test_and_set((p), 1) == 0)
+#define UNLOCK(p)       __sync_lock_release(p)
+#else
+/* No atomics on this compiler, which is fine as long as callers are single threaded */
+#define ATOMIC_INC(p)   ((*(p))++)
+#define BARRIER()
+#define TRY_LOCK(p)     (*(p) == 0 ? (*(p) = 1) : 0)
+#define UNLOCK(p)       (*(p) = 0)
+#endif
+
+int cmdtrace_enabled = 0;
+
+static cmdtrace_rec ring[CMDTRACE_RING];
+static volatile unsigned long published[CMDTRACE_RING];	/* Index + 1 once the slot is filled */
+static volatile unsigned long head = 0;
+static unsigned long flushed = 0;
+static unsigned long dropped = 0;
+static volatile int flushing = 0;
+static int sample_len = 0;
+static unsigned long long base_us;
+static FILE *trace_fd = NULL;
+
+static void put_be32(unsigned char *p, unsigned long v)
+{
+	p[0] = (unsigned char)(v >> 24);
+	p[1] = (unsigned char)(v >> 16);
+	p[2] = (unsigned char)(v >> 8);
+	p[3] = (unsigned char)v;
+}
+
+static unsigned long get_be32(const unsigned char *p)
+{
+	return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16) |
+		((unsigned long)p[2] << 8) | p[3];
+}
+
+/*
+ * Header: magic[4], version, sample bytes per record, 2 reserved,
+ * records written, records dropped (both filled in by cmdtrace_stop())
+ */
+int cmdtrace_start(const char *spec)
+{
+	unsigned char hdr[CMDTRACE_HDR_LEN];
+	char file[1024];
+	const char *comma;
+
+	comma = strrchr(spec, ',');
+	if (comma != NULL && strncmp(comma + 1, "sample=", 7) == 0) {
+		sample_len = atoi(comma + 8);
+		if (sample_len < 0)
+			sample_len = 0;
+		if (sample_len > CMDTRACE_SAMPLE_MAX)
+			sample_len = CMDTRACE_SAMPLE_MAX;
+		snprintf(file, sizeof(file), "%.*s", (int)(comma - spec), spec);
+	} else {
+		snprintf(file, sizeof(file), "%s", spec);
+	}
+
+	trace_fd = fopen(file, "wb");
+	if (trace_fd == NULL) {
+		fprintf(stderr, "Error: couldn't create trace %s - %s\n", file, strerror(errno));
+		return -1;
+	}
+
+	memset(hdr, 0, sizeof(hdr));
+	memcpy(hdr, CMDTRACE_MAGIC, 4);
+	hdr[4] = CMDTRACE_VERSION;
+	hdr[5] = (unsigned char)sample_len;
+	fwrite(hdr, 1, sizeof(hdr), trace_fd);
+
+	base_us = scsi_now_us();
+	cmdtrace_enabled = 1;
+	return 0;
+}
+
+static void write_rec(const cmdtrace_rec *r)
+{
+	unsigned char out[CMDTRACE_REC_LEN];
+
+	memset(out, 0, sizeof(out));
+	put_be32(&out[0], (unsigned long)(r->time_us >> 32));
+	put_be32(&out[4], (unsigned long)(r->time_us & 0xFFFFFFFFUL));
+	put_be32(&out[8], r->duration_us);
+	put_be32(&out[12], r->length);
+	out[16] = r->cdb_len;
+	out[17] = r->dir;
+	out[18] = r->status;
+	out[19] = r->cls;
+	out[20] = r->sense_key;
+	out[21] = r->asc;
+	out[22] = r->ascq;
+	out[23] = r->xport;
+	out[24] = r->sample_len;
+	memcpy(&out[32], r->cdb, CMDTRACE_MAX_CDB);
+	memcpy(&out[32 + CMDTRACE_MAX_CDB], r->sample, CMDTRACE_SAMPLE_MAX);
+	fwrite(out, 1, sizeof(out), trace_fd);
+}
+
+/*
+ * Write out every published record since the last flush.  A slot that
+ * has already been reused for a later record was lost; one that isn't
+ * published yet is still being filled, so stop there and pick it up next
+ * time.  Only one caller drains at a time, the others just carry on.
+ */
+static void cmdtrace_flush(void)
+{
+	unsigned long end;
+	unsigned long seq;
+
+	if (trace_fd == NULL || !TRY_LOCK(&flushing))
+		return;
+
+	BARRIER();
+	end = head;
+	while (flushed != end) {
+		seq = published[flushed & (CMDTRACE_RING - 1)];
+		if (seq < flushed + 1)
+			break;
+		if (seq == flushed + 1)
+			write_rec(&ring[flushed & (CMDTRACE_RING - 1)]);
+		else
+			dropped++;
+		flushed++;
+	}
+	UNLOCK(&flushing);
+}
+
+void cmdtrace_add(const unsigned char *cmd, int cmd_len, const unsigned char *buf, int buf_len, int dir,
+		const scsi_result *res, int cls, unsigned long long start_us, unsigned long long duration_us)
+{
+	cmdtrace_rec *r;
+	unsigned long idx;
+	int key, asc, ascq;
+
+	idx = ATOMIC_INC(&head);
+	r = &ring[idx & (CMDTRACE_RING - 1)];
+
+	if (cmd_len > CMDTRACE_MAX_CDB)
+		cmd_len = CMDTRACE_MAX_CDB;
+	memset(r, 0, sizeof(*r));
+	r->time_us = start_us - base_us;
+	r->duration_us = duration_us > 0xFFFFFFFFULL ? 0xFFFFFFFFUL : (unsigned int)duration_us;
+	r->length = (unsigned int)buf_len;
+	memcpy(r->cdb, cmd, cmd_len);
+	r->cdb_len = (unsigned char)cmd_len;
+	r->dir = (unsigned char)dir;
+	r->status = (unsigned char)res->status;
+	r->cls = (unsigned char)cls;
+	scsi_sense_fields(res, &key, &asc, &ascq);
+	r->sense_key = (unsigned char)key;
+	r->asc = (unsigned char)asc;
+	r->ascq = (unsigned char)ascq;
+	r->xport = (unsigned char)res->transport;
+	if (sample_len > 0 && buf != NULL && buf_len > 0) {
+		r->sample_len = (unsigned char)(buf_len < sample_len ? buf_len : sample_len);
+		memcpy(r->sample, buf, r->sample_len);
+	}
+
+	BARRIER();
+	published[idx & (CMDTRACE_RING - 1)] = idx + 1;
+
+	if (((idx + 1) & (CMDTRACE_RING / 2 - 1)) == 0)
+		cmdtrace_flush();
+}
+
+void cmdtrace_stop(void)
+{
+	unsigned char counts[8];
+
+	if (trace_fd == NULL)
+		return;
+
+	cmdtrace_enabled = 0;
+	cmdtrace_flush();
+
+	put_be32(&counts[0], flushed - dropped);
+	put_be32(&counts[4], dropped);
+	if (fseek(trace_fd, 8, SEEK_SET) == 0)
+		fwrite(counts, 1, sizeof(counts), trace_fd);
+	if (fclose(trace_fd) != 0)
+		fprintf(stderr, "Warning: error writing trace - %s\n", strerror(errno));
+	trace_fd = NULL;
+}
+
+/* Decode a trace file written by -T, one line per command */
+int cmdtrace_view(const char *file)
+{
+	unsigned char hdr[CMDTRACE_HDR_LEN];
+	unsigned char rec[CMDTRACE_REC_LEN];
+	unsigned long long t;
+	unsigned long n = 0;
+	FILE *fd;
+	int i;
+
+	fd = fopen(file, "rb");
+	if (fd == NULL) {
+		fprintf(stderr, "Error: couldn't open %s - %s\n", file, strerror(errno));
+		return 1;
+	}
+	if (fread(hdr, 1, sizeof(hdr), fd) != sizeof(hdr) ||
+	    memcmp(hdr, CMDTRACE_MAGIC, 4) != 0 || hdr[4] != CMDTRACE_VERSION) {
+		fprintf(stderr, "Error: %s is not a version %d command trace\n", file, CMDTRACE_VERSION);
+		fclose(fd);
+		return 1;
+	}
+
+	fprintf(stdout, "%-12s %9s %-2s %-16s %-30s %8s %s\n",
+		"time", "us", "", "command", "cdb", "length", "result");
+	while (fread(rec, 1, sizeof(rec), fd) == sizeof(rec)) {
+		char cdb_hex[CMDTRACE_MAX_CDB * 3 + 1];
+		int cdb_len = rec[16] > CMDTRACE_MAX_CDB ? CMDTRACE_MAX_CDB : rec[16];
+
+		t = ((unsigned long long)get_be32(&rec[0]) << 32) | get_be32(&rec[4]);
+		cdb_hex[0] = '\0';
+		for (i = 0; i < cdb_len && i < 10; i++)
+			sprintf(cdb_hex + i * 3, "%02x ", rec[32 + i]);
+
+		fprintf(stdout, "%12.6f %9lu %-2s %-16s %-30s %8lu ",
+			t / 1000000.0, get_be32(&rec[8]), rec[17] == SCSI_DIR_WRITE ? "W" : "R",
+			scsi_opcode_name(&rec[32]), cdb_hex, get_be32(&rec[12]));
+		if (rec[19] == SCSI_CLASS_OK)
+			fprintf(stdout, "ok");
+		else
+			fprintf(stdout, "%s (status 0x%02x, sense %x/%02x/%02x)",
+				scsi_class_name(rec[19]), rec[18], rec[20], rec[21], rec[22]);
+		if (rec[24] > 0) {
+			fprintf(stdout, " [");
+			for (i = 0; i < rec[24] && i < CMDTRACE_SAMPLE_MAX; i++)
+				fprintf(stdout, "%s%02x", i ? " " : "", rec[32 + CMDTRACE_MAX_CDB + i]);
+			fprintf(stdout, "]");
+		}
+		fprintf(stdout, "\n");
+		n++;
+	}
+
+	fprintf(stdout, "%lu commands, %lu recorded, %lu dropped\n", n, get_be32(&hdr[8]), get_be32(&hdr[12]));
+	fclose(fd);
+	return 0;
+}
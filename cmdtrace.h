@@ -0,0 +1,49 @@
+#ifndef CMDTRACE_H
+#define CMDTRACE_H
+
+/*
+ * Binary command tracing.
+ *
+ * Every command that goes through scsi_dispatch() can be logged as a fixed
+ * size record into an in-memory ring: timestamp, CDB, direction, length,
+ * status/sense and duration, plus optionally the first few bytes of the
+ * payload.  Slots are claimed with an atomic increment, so no lock is
+ * taken, and when tracing is off the cost is the test of cmdtrace_enabled.
+ * The ring is drained to a file whenever it is half full and at exit;
+ * "bstoolbox trace FILE" decodes it.
+ */
+
+#include "transport.h"
+
+#define CMDTRACE_MAGIC      "BSCT"
+#define CMDTRACE_VERSION    1
+#define CMDTRACE_RING       4096	/* Records, must be a power of two */
+#define CMDTRACE_MAX_CDB    16
+#define CMDTRACE_SAMPLE_MAX 20
+
+typedef struct {
+	unsigned long long time_us;	/* Since tracing started */
+	unsigned int duration_us;
+	unsigned int length;
+	unsigned char cdb[CMDTRACE_MAX_CDB];
+	unsigned char cdb_len;
+	unsigned char dir;
+	unsigned char status;
+	unsigned char cls;
+	unsigned char sense_key;
+	unsigned char asc;
+	unsigned char ascq;
+	unsigned char xport;
+	unsigned char sample_len;
+	unsigned char sample[CMDTRACE_SAMPLE_MAX];
+} cmdtrace_rec;
+
+extern int cmdtrace_enabled;
+
+int cmdtrace_start(const char *spec);
+void cmdtrace_add(const unsigned char *cmd, int cmd_len, const unsigned char *buf, int buf_len, int dir,
+		const scsi_result *res, int cls, unsigned long long start_us, unsigned long long duration_us);
+void cmdtrace_stop(void);
+int cmdtrace_view(const char *file);
+
+#endif
@@ -0,0 +1,340 @@
+/*
+ * Cross-process device locking with a FIFO queue, see devlock.h
+ *
+ * The lock itself is flock() on <key>.lock (fcntl() record locks on IRIX,
+ * which has no flock in libc), released by the kernel when the process
+ * exits however it exits.  Fairness comes from <key>.queue, a list of
+ * waiting pids that is only touched while holding a lock on the queue
+ * file: only the pid at the head may try for the device lock.
+ *
+ * The directory is shared between users like /tmp, and root runs us, so
+ * nothing in it is trusted: the directory has to belong to root or us
+ * (and be sticky if others can write to it), lock files are opened
+ * without following links and must be plain files with a single name,
+ * and they are overwritten in place with blank padding, never truncated.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#if !defined(OS_IRIX)
+#include <sys/file.h>
+#endif
+
+#include "devlock.h"
+#include "transport.h"
+
+/* IRIX has no O_NOFOLLOW; the lstat() check in lock_file() still applies */
+#ifndef O_NOFOLLOW
+#define O_NOFOLLOW 0
+#endif
+
+#define HOLDER_LEN 20		/* "pid seq" in <key>.lock, blank padded */
+
+static int lock_fd = -1;
+static unsigned long lock_seq;	/* Of our last acquire */
+
+static int file_lock(int fd, int wait)
+{
+#if defined(OS_IRIX)
+	struct flock fl;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+	return fcntl(fd, wait ? F_SETLKW : F_SETLK, &fl);
+#else
+	return flock(fd, LOCK_EX | (wait ? 0 : LOCK_NB));
+#endif
+}
+
+static void file_unlock(int fd)
+{
+#if defined(OS_IRIX)
+	struct flock fl;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = F_UNLCK;
+	fl.l_whence = SEEK_SET;
+	fcntl(fd, F_SETLK, &fl);
+#else
+	flock(fd, LOCK_UN);
+#endif
+}
+
+/*
+ * Device nodes are keyed by device number, so /dev/sg2 and a symlink to it
+ * share a lock; anything else (sim: paths) by its name without options.
+ */
+static void lock_key(const char *devpath, char *out, size_t out_len)
+{
+	struct stat st;
+	char *p;
+
+	if (stat(devpath, &st) == 0 && S_ISCHR(st.st_mode)) {
+		snprintf(out, out_len, "dev-%lx", (unsigned long)st.st_rdev);
+		return;
+	}
+	snprintf(out, out_len, "path-%.*s", (int)strcspn(devpath, ","), devpath);
+	for (p = out; *p != '\0'; p++) {
+		if (*p == '/' || *p == ':' || *p == ',' || *p == ' ')
+			*p = '_';
+	}
+}
+
+/* Refuse a lock directory that someone else could swap files in */
+static int lock_dir_ok(const char *dir)
+{
+	static int refused = 0;
+	struct stat st;
+
+	/* Said once, though both the socket and the lock come here */
+	if (refused)
+		return -1;
+	if (lstat(dir, &st) != 0) {
+		fprintf(stderr, "Error: lock directory %s - %s\n", dir, strerror(errno));
+		refused = 1;
+	}
+	else if (!S_ISDIR(st.st_mode) || (st.st_uid != 0 && st.st_uid != geteuid()) ||
+	    ((st.st_mode & (S_IWGRP | S_IWOTH)) != 0 && (st.st_mode & S_ISVTX) == 0)) {
+		fprintf(stderr, "Error: lock directory %s must be owned by root or you, "
+			"and sticky if others can write to it\n", dir);
+		refused = 1;
+	}
+	return refused ? -1 : 0;
+}
+
+/* <lock dir>/<key>.<suffix>, also used for the bstoolboxd socket */
+int devlock_path(const char *devpath, const char *suffix, char *out, size_t out_len)
+{
+	char key[512];
+	const char *dir;
+	int len;
+
+	dir = getenv("BSTOOLBOX_LOCK_DIR");
+	if (dir == NULL || *dir == '\0') {
+		dir = DEVLOCK_DIR;
+		/* Shared between users, like /tmp */
+		if (mkdir(dir, 01777) == 0)
+			chmod(dir, 01777);
+	}
+	if (lock_dir_ok(dir) != 0)
+		return -1;
+
+	lock_key(devpath, key, sizeof(key));
+	len = snprintf(out, out_len, "%s/%s.%s", dir, key, suffix);
+	if (len < 0 || (size_t)len >= out_len) {
+		fprintf(stderr, "Error: lock path for %s is too long\n", devpath);
+		return -1;
+	}
+	return 0;
+}
+
+static int lock_file(const char *devpath, const char *suffix)
+{
+	struct stat st, lst;
+	char path[1024];
+	int fd;
+
+	if (devlock_path(devpath, suffix, path, sizeof(path)) != 0)
+		return -1;
+	fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW, 0666);
+	if (fd < 0) {
+		fprintf(stderr, "Error: couldn't open lock file %s - %s\n", path, strerror(errno));
+		return -1;
+	}
+	/* A link to some other file would have us writing pids into it */
+	if (fstat(fd, &st) != 0 || lstat(path, &lst) != 0 || !S_ISREG(st.st_mode) ||
+	    st.st_nlink != 1 || st.st_dev != lst.st_dev || st.st_ino != lst.st_ino) {
+		fprintf(stderr, "Error: %s is not a plain lock file, remove it\n", path);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Overwrite the start of a lock file, blanking out the rest of len */
+static void file_put(int fd, const char *text, int len)
+{
+	char buf[DEVLOCK_MAX_QUEUE * 12];
+	int n;
+
+	n = strlen(text);
+	memset(buf, ' ', len);
+	memcpy(buf, text, n < len ? n : len);
+	buf[len - 1] = '\n';
+	lseek(fd, 0, SEEK_SET);
+	if (write(fd, buf, len) != len)
+		fprintf(stderr, "Warning: couldn't update lock file - %s\n", strerror(errno));
+}
+
+/* Read the queue, dropping pids that no longer exist */
+static int queue_read(int fd, long *pids, int max)
+{
+	char buf[DEVLOCK_MAX_QUEUE * 12];
+	char *p, *end;
+	ssize_t len;
+	long pid;
+	int n = 0;
+
+	lseek(fd, 0, SEEK_SET);
+	len = read(fd, buf, sizeof(buf) - 1);
+	if (len < 0)
+		len = 0;
+	buf[len] = '\0';
+
+	for (p = buf; n < max; p = end) {
+		pid = strtol(p, &end, 10);
+		if (end == p)
+			break;
+		if (pid > 0 && (kill((pid_t)pid, 0) == 0 || errno != ESRCH))
+			pids[n++] = pid;
+	}
+	return n;
+}
+
+static void queue_write(int fd, const long *pids, int n)
+{
+	char buf[DEVLOCK_MAX_QUEUE * 12];
+	int len = 0;
+	int i;
+
+	buf[0] = '\0';
+	for (i = 0; i < n; i++)
+		len += snprintf(buf + len, sizeof(buf) - len, "%ld\n", pids[i]);
+	/* Fixed size, so a shorter queue needs no truncate */
+	file_put(fd, buf, sizeof(buf) - 1);
+}
+
+/* Add or remove ourselves; returns our place in the queue (0 = head) */
+static int queue_update(int qfd, int join, long *holder)
+{
+	long pids[DEVLOCK_MAX_QUEUE];
+	long me = (long)getpid();
+	int n, i, pos = -1;
+
+	file_lock(qfd, 1);
+	n = queue_read(qfd, pids, DEVLOCK_MAX_QUEUE);
+	for (i = 0; i < n; i++) {
+		if (pids[i] == me)
+			pos = i;
+	}
+	if (join && pos < 0 && n < DEVLOCK_MAX_QUEUE)
+		pids[pos = n++] = me;
+	if (!join && pos >= 0) {
+		memmove(&pids[pos], &pids[pos + 1], (n - pos - 1) * sizeof(long));
+		n--;
+	}
+	queue_write(qfd, pids, n);
+	*holder = n > 0 ? pids[0] : 0;
+	file_unlock(qfd);
+	return pos;
+}
+
+/* The holder record: pid (0 once released) and how many times the lock was taken */
+static long lock_holder_seq(int fd, unsigned long *seq)
+{
+	char buf[32];
+	ssize_t len;
+	long pid = 0;
+
+	*seq = 0;
+	lseek(fd, 0, SEEK_SET);
+	len = read(fd, buf, sizeof(buf) - 1);
+	if (len <= 0)
+		return 0;
+	buf[len] = '\0';
+	sscanf(buf, "%ld %lu", &pid, seq);
+	return pid;
+}
+
+static long lock_holder(int fd)
+{
+	unsigned long seq;
+
+	return lock_holder_seq(fd, &seq);
+}
+
+/*
+ * Take the lock for devpath, queueing behind earlier waiters for up to
+ * wait_secs (DEVLOCK_NOWAIT, or DEVLOCK_FOREVER).  Returns 0 with the lock
+ * held until devlock_release() or exit, -1 if busy or on error.
+ */
+int devlock_acquire(const char *devpath, int wait_secs)
+{
+	char rec[32];
+	unsigned long long deadline;
+	long head;
+	int qfd;
+	int pos;
+	int told = 0;
+
+	if ((lock_fd = lock_file(devpath, "lock")) < 0)
+		return -1;
+	if ((qfd = lock_file(devpath, "queue")) < 0) {
+		close(lock_fd);
+		lock_fd = -1;
+		return -1;
+	}
+
+	deadline = scsi_now_us() + (unsigned long long)(wait_secs > 0 ? wait_secs : 0) * 1000000ULL;
+	for (;;) {
+		pos = queue_update(qfd, 1, &head);
+		if (pos == 0 && file_lock(lock_fd, 0) == 0)
+			break;
+
+		if (wait_secs != DEVLOCK_FOREVER && scsi_now_us() >= deadline) {
+			queue_update(qfd, 0, &head);
+			close(qfd);
+			if (wait_secs == DEVLOCK_NOWAIT)
+				fprintf(stderr, "Error: %s is in use by pid %ld, use --wait to queue for it\n",
+					devpath, lock_holder(lock_fd));
+			else
+				fprintf(stderr, "Error: timed out after %d s waiting for %s (held by pid %ld)\n",
+					wait_secs, devpath, lock_holder(lock_fd));
+			close(lock_fd);
+			lock_fd = -1;
+			return -1;
+		}
+		if (!told) {
+			fprintf(stderr, "Waiting for %s, held by pid %ld (%d ahead in queue)\n",
+				devpath, lock_holder(lock_fd), pos);
+			told = 1;
+		}
+		usleep(DEVLOCK_POLL_US);
+	}
+
+	queue_update(qfd, 0, &head);
+	close(qfd);
+
+	/* Note the holder for the benefit of anyone waiting */
+	lock_holder_seq(lock_fd, &lock_seq);
+	lock_seq = (lock_seq + 1) % DEVLOCK_SEQ_WRAP;
+	snprintf(rec, sizeof(rec), "%ld %lu", (long)getpid(), lock_seq);
+	file_put(lock_fd, rec, HOLDER_LEN + 1);
+	return 0;
+}
+
+unsigned long devlock_seq(void)
+{
+	return lock_seq;
+}
+
+void devlock_release(void)
+{
+	char rec[32];
+
+	if (lock_fd < 0)
+		return;
+	snprintf(rec, sizeof(rec), "0 %lu", lock_seq);
+	file_put(lock_fd, rec, HOLDER_LEN + 1);
+	file_unlock(lock_fd);
+	close(lock_fd);
+	lock_fd = -1;
+}
@@ -0,0 +1,34 @@
+#ifndef DEVLOCK_H
+#define DEVLOCK_H
+
+/*
+ * Cross-process device locking.
+ *
+ * Every bstoolbox run holds an exclusive lock on a file keyed by the
+ * device for as long as it talks to the card, so multi-command sequences
+ * (SEND_FILE_PREP/10/END, SET_WDIR + listing) from two jobs can't
+ * interleave.  Waiters line up in a queue file next to the lock and take
+ * it strictly in arrival order; entries of processes that have died are
+ * dropped.  Each acquire counts up a sequence number kept in the lock
+ * file, so a process that takes the lock again can tell from
+ * devlock_seq() whether anyone else held it in between.  Files live in
+ * $BSTOOLBOX_LOCK_DIR or DEVLOCK_DIR, which must belong to root or the
+ * caller; devlock_path() fails otherwise.
+ */
+
+#include <stddef.h>
+
+#define DEVLOCK_DIR       "/var/tmp/bstoolbox"
+#define DEVLOCK_POLL_US   100000
+#define DEVLOCK_MAX_QUEUE 64
+#define DEVLOCK_SEQ_WRAP  1000000000UL	/* Keeps "pid seq" within the holder record */
+
+#define DEVLOCK_NOWAIT  0	/* Fail at once if the device is busy */
+#define DEVLOCK_FOREVER (-1)
+
+int devlock_path(const char *devpath, const char *suffix, char *out, size_t out_len);
+int devlock_acquire(const char *devpath, int wait_secs);
+unsigned long devlock_seq(void);
+void devlock_release(void);
+
+#endif
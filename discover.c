@@ -0,0 +1,473 @@
+/*
+ * Discovery of BlueSCSI targets
+ *
+ * Every candidate device node is probed concurrently with INQUIRY, the
+ * vendor check and MODE SENSE page 0x31, and the BlueSCSIs among them are
+ * asked for their target list and toolbox capabilities.  Results are kept
+ * in a cache keyed by the node's identity (see scsi_identity()), so as
+ * long as nothing changed on the bus a later lookup reads one small file
+ * instead of probing every device again.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "bstoolbox.h"
+#include "transport.h"
+#include "discover.h"
+#include "cache.h"
+
+#define MODE_SENSE_6 0x1A
+
+typedef struct {
+	bs_probe *probes;
+	int *todo;
+	int ntodo;
+	int next;
+	pthread_mutex_t lock;
+} probe_work;
+
+/* Library callers may look up and update the cache from several threads */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Check a MODE SENSE (6) response for the BlueSCSI vendor page.
+ * Returns 0 if it is there.
+ */
+int bluescsi_vendor_page_match(const unsigned char *buf, int len)
+{
+	static const unsigned char BlueSCSIVendorPage[] = {
+		0x31, /* Page code */
+		42,   /* Page length */
+		'B','l','u','e','S','C','S','I',' ','i','s',' ','t','h','e',' ','B','E','S','T',' ',
+		'S','T','O','L','E','N',' ','F','R','O','M',' ','B','L','U','E','S','C','S','I',0x00
+	};
+	int page_offset;
+
+	/* MODE SENSE (6) header is 4 bytes: [0]=length, [1]=medium type, [2]=dev param, [3]=BDL */
+	if (len < 4)
+		return 1;
+	page_offset = 4 + buf[3];
+	if (page_offset + (int)sizeof(BlueSCSIVendorPage) > len)
+		return 1;
+
+	/* Mask out the PS bit on the returned page code */
+	if ((buf[page_offset] & 0x3F) != BlueSCSIVendorPage[0] ||
+	    memcmp(&buf[page_offset + 1], &BlueSCSIVendorPage[1], sizeof(BlueSCSIVendorPage) - 1) != 0)
+		return 1;
+	return 0;
+}
+
+static void copy_trimmed(char *out, const unsigned char *in, int len)
+{
+	memcpy(out, in, len);
+	out[len] = '\0';
+	while (len > 0 && out[len - 1] == ' ')
+		out[--len] = '\0';
+}
+
+/* Vendor, product and revision from an INQUIRY response */
+void bluescsi_probe_strings(bs_probe *p, const unsigned char *inq)
+{
+	copy_trimmed(p->vendor, &inq[8], 8);
+	copy_trimmed(p->product, &inq[16], 16);
+	copy_trimmed(p->rev, &inq[32], 4);
+}
+
+/*
+ * Probe one device node.  Uses no globals, so several can run at once.
+ * Returns -1 if the node couldn't be opened or didn't answer INQUIRY,
+ * otherwise 0 with p->found saying whether it is a BlueSCSI.
+ */
+int bluescsi_probe(const char *path, bs_probe *p)
+{
+	unsigned char cmd[10];
+	unsigned char inq[sizeof(scsi_inquiry)];
+	unsigned char page[64];
+	unsigned char buf[8];
+	int total_len;
+	int dev;
+
+	memset(p, 0, sizeof(*p));
+	snprintf(p->path, sizeof(p->path), "%s", path);
+	p->scsi_id = -1;
+	if (scsi_identity(path, p->identity, sizeof(p->identity)) != 0)
+		p->identity[0] = '\0';
+
+	dev = scsi_open((char *)path, 0);
+	if (dev < 0 && errno != ENOENT)
+		dev = scsi_open((char *)path, 1);
+	if (dev < 0)
+		return -1;
+
+	memset(cmd, 0, sizeof(cmd));
+	cmd[0] = SCSI_INQUIRY;
+	cmd[4] = sizeof(inq);
+	memset(inq, 0, sizeof(inq));
+	if (scsi_send_command(dev, cmd, 6, inq, sizeof(inq)) != 0) {
+		scsi_close(dev);
+		return -1;
+	}
+	bluescsi_probe_strings(p, inq);
+	if (strstr(p->vendor, "BLUESCSI") == NULL)
+		goto done;
+
+	memset(cmd, 0, sizeof(cmd));
+	cmd[0] = MODE_SENSE_6;
+	cmd[1] = 0x08; /* DBD */
+	cmd[2] = 0x31;
+	cmd[4] = sizeof(page);
+	memset(page, 0, sizeof(page));
+	if (scsi_send_command(dev, cmd, 6, page, sizeof(page)) != 0 ||
+	    bluescsi_vendor_page_match(page, sizeof(page)) != 0)
+		goto done;
+
+	total_len = inq[4] + 5;
+	if (total_len <= (int)sizeof(inq))
+		p->api_ver = inq[total_len - 1];
+
+	memset(cmd, 0, sizeof(cmd));
+	cmd[0] = BLUESCSI_TOOLBOX_METADATA;
+	cmd[1] = BLUESCSI_TOOLBOX_METADATA_LIST_DEVICES;
+	cmd[8] = sizeof(buf);
+	memset(buf, 0xFF, sizeof(buf));
+	if (scsi_send_command(dev, cmd, sizeof(cmd), buf, sizeof(buf)) != 0)
+		goto done;
+	memcpy(p->dev_map, buf, sizeof(p->dev_map));
+
+	/* Legacy firmware rejects this, which just means API v0 and no capabilities */
+	cmd[1] = BLUESCSI_TOOLBOX_METADATA_GET_CAP;
+	memset(buf, 0, sizeof(buf));
+	if (scsi_send_command(dev, cmd, sizeof(cmd), buf, sizeof(buf)) == 0) {
+		p->meta_api = buf[0];
+		p->caps = buf[1];
+	}
+
+	p->scsi_id = path_to_devnum(path);
+	p->found = 1;
+done:
+	scsi_close(dev);
+	return 0;
+}
+
+static void *probe_thread(void *arg)
+{
+	probe_work *w = (probe_work *)arg;
+	bs_probe *p;
+	char path[SCSI_PATH_LEN];
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&w->lock);
+		i = w->next < w->ntodo ? w->todo[w->next++] : -1;
+		pthread_mutex_unlock(&w->lock);
+		if (i < 0)
+			break;
+
+		p = &w->probes[i];
+		snprintf(path, sizeof(path), "%s", p->path);
+		if (bluescsi_probe(path, p) != 0 && verbose)
+			fprintf(stderr, "%s: no answer - %s\n", path, strerror(errno));
+	}
+	return NULL;
+}
+
+/* Split a cache line on tabs, in place */
+static int split_tabs(char *line, char **fields, int max)
+{
+	int n = 0;
+
+	line[strcspn(line, "\n")] = '\0';
+	while (n < max) {
+		fields[n++] = line;
+		line = strchr(line, '\t');
+		if (line == NULL)
+			break;
+		*line++ = '\0';
+	}
+	return n;
+}
+
+/*
+ * Cache lines: path, identity, found, SCSI ID, API version, metadata API,
+ * capabilities, target types (hex), vendor, product, revision
+ */
+static int cache_load(bs_probe *cache, int max)
+{
+	char path[1024];
+	char line[1024];
+	char *f[11];
+	FILE *fd;
+	int n = 0;
+	int i;
+
+	if (cache_path(path, sizeof(path), DISCOVER_CACHE) != 0 ||
+	    (fd = fopen(path, "r")) == NULL)
+		return 0;
+
+	while (n < max && fgets(line, sizeof(line), fd) != NULL) {
+		bs_probe *p = &cache[n];
+
+		if (line[0] == '#' || split_tabs(line, f, 11) != 11)
+			continue;
+		memset(p, 0, sizeof(*p));
+		snprintf(p->path, sizeof(p->path), "%s", f[0]);
+		snprintf(p->identity, sizeof(p->identity), "%s", f[1]);
+		p->found = atoi(f[2]);
+		p->scsi_id = atoi(f[3]);
+		p->api_ver = atoi(f[4]);
+		p->meta_api = atoi(f[5]);
+		p->caps = (int)strtol(f[6], NULL, 16);
+		for (i = 0; i < 8 && f[7][i * 2] != '\0'; i++) {
+			unsigned int b;
+
+			sscanf(&f[7][i * 2], "%2x", &b);
+			p->dev_map[i] = (unsigned char)b;
+		}
+		snprintf(p->vendor, sizeof(p->vendor), "%s", f[8]);
+		snprintf(p->product, sizeof(p->product), "%s", f[9]);
+		snprintf(p->rev, sizeof(p->rev), "%s", f[10]);
+		n++;
+	}
+	fclose(fd);
+	return n;
+}
+
+static void cache_save(const bs_probe *cache, int n)
+{
+	char path[1024];
+	char tmp[1100];
+	FILE *fd;
+	int i, j;
+
+	if (cache_path(path, sizeof(path), DISCOVER_CACHE) != 0)
+		return;
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if ((fd = cache_create(tmp)) == NULL)
+		return;
+
+	fprintf(fd, "# bstoolbox discover cache\n");
+	for (i = 0; i < n; i++) {
+		const bs_probe *p = &cache[i];
+
+		/* Nodes without an identity can't be revalidated, so don't keep them */
+		if (p->identity[0] == '\0')
+			continue;
+		fprintf(fd, "%s\t%s\t%d\t%d\t%d\t%d\t%02x\t", p->path, p->identity, p->found,
+			p->scsi_id, p->api_ver, p->meta_api, p->caps);
+		for (j = 0; j < 8; j++)
+			fprintf(fd, "%02x", p->dev_map[j]);
+		fprintf(fd, "\t%s\t%s\t%s\n", p->vendor, p->product, p->rev);
+	}
+	if (fclose(fd) != 0 || rename(tmp, path) != 0)
+		remove(tmp);
+}
+
+/*
+ * Fill probes[] for the given paths (all OS device nodes if none), from
+ * the cache where the identity still matches and by probing otherwise.
+ */
+static int discover_scan(char **paths, int npaths, int rescan, bs_probe *probes, int *ncached)
+{
+	char listed[DISCOVER_MAX][SCSI_PATH_LEN];
+	bs_probe cache[DISCOVER_MAX];
+	pthread_t threads[DISCOVER_THREADS];
+	int todo[DISCOVER_MAX];
+	probe_work work;
+	int ncache;
+	int nthreads;
+	int n, i, j;
+	char identity[128];
+
+	if (npaths > 0) {
+		n = npaths < DISCOVER_MAX ? npaths : DISCOVER_MAX;
+		for (i = 0; i < n; i++)
+			snprintf(listed[i], SCSI_PATH_LEN, "%s", paths[i]);
+	} else {
+		n = scsi_list_paths(listed, DISCOVER_MAX);
+	}
+
+	ncache = rescan ? 0 : cache_load(cache, DISCOVER_MAX);
+	memset(&work, 0, sizeof(work));
+	work.probes = probes;
+	work.todo = todo;
+	*ncached = 0;
+
+	for (i = 0; i < n; i++) {
+		memset(&probes[i], 0, sizeof(bs_probe));
+		snprintf(probes[i].path, SCSI_PATH_LEN, "%.*s", SCSI_PATH_LEN - 1, listed[i]);
+
+		if (scsi_identity(listed[i], identity, sizeof(identity)) == 0) {
+			for (j = 0; j < ncache; j++) {
+				if (strcmp(cache[j].path, listed[i]) == 0 &&
+				    strcmp(cache[j].identity, identity) == 0)
+					break;
+			}
+			if (j < ncache) {
+				probes[i] = cache[j];
+				probes[i].cached = 1;
+				(*ncached)++;
+				continue;
+			}
+		}
+		todo[work.ntodo++] = i;
+	}
+
+	if (work.ntodo > 0) {
+		pthread_mutex_init(&work.lock, NULL);
+		nthreads = work.ntodo < DISCOVER_THREADS ? work.ntodo : DISCOVER_THREADS;
+		for (i = 0; i < nthreads; i++) {
+			if (pthread_create(&threads[i], NULL, probe_thread, &work) != 0)
+				break;
+		}
+		nthreads = i;
+		/* Couldn't start any threads, probe inline */
+		if (nthreads == 0)
+			probe_thread(&work);
+		for (i = 0; i < nthreads; i++)
+			pthread_join(threads[i], NULL);
+		pthread_mutex_destroy(&work.lock);
+
+		/* Merge the fresh results into whatever else the cache knew */
+		if (rescan)
+			ncache = cache_load(cache, DISCOVER_MAX);
+		for (i = 0; i < work.ntodo; i++) {
+			bs_probe *p = &probes[todo[i]];
+
+			for (j = 0; j < ncache; j++) {
+				if (strcmp(cache[j].path, p->path) == 0)
+					break;
+			}
+			if (j == ncache && ncache < DISCOVER_MAX)
+				ncache++;
+			if (j < ncache)
+				cache[j] = *p;
+		}
+		cache_save(cache, ncache);
+	}
+	return n;
+}
+
+static const char *type_name(unsigned char type)
+{
+	switch (type) {
+	case TYPE_HDD:        return "HDD";
+	case TYPE_REMOVABLE:  return "removable";
+	case TYPE_CD:         return "CD";
+	case TYPE_FLOPPY:     return "floppy";
+	case TYPE_MO:         return "MO";
+	case TYPE_SEQUENTIAL: return "tape";
+	}
+	return "?";
+}
+
+/* "bstoolbox discover": list every BlueSCSI found */
+int discover_run(char **paths, int npaths, int rescan)
+{
+	static bs_probe probes[DISCOVER_MAX];
+	unsigned long long start;
+	int n, i, j;
+	int ncached;
+	int nfound = 0;
+
+	start = scsi_now_us();
+	n = discover_scan(paths, npaths, rescan, probes, &ncached);
+
+	for (i = 0; i < n; i++) {
+		bs_probe *p = &probes[i];
+
+		if (!p->found) {
+			if (verbose && p->vendor[0] != '\0')
+				fprintf(stdout, "%s: not a BlueSCSI (%s %s)\n", p->path, p->vendor, p->product);
+			continue;
+		}
+		nfound++;
+		fprintf(stdout, "%s: BlueSCSI ID %d, %s %s %s, toolbox API v%d, capabilities 0x%02x%s\n",
+			p->path, p->scsi_id, p->vendor, p->product, p->rev,
+			p->meta_api ? p->meta_api : p->api_ver, p->caps, p->cached ? " (cached)" : "");
+		fprintf(stdout, "    targets:");
+		for (j = 0; j < 8; j++) {
+			if (p->dev_map[j] != TYPE_NONE)
+				fprintf(stdout, " %d:%s", j, type_name(p->dev_map[j]));
+		}
+		fprintf(stdout, "\n");
+	}
+
+	fprintf(stdout, "%d BlueSCSI on %d device nodes (%d probed, %d cached) in %.1f ms\n",
+		nfound, n, n - ncached, ncached, (scsi_now_us() - start) / 1000.0);
+	return nfound > 0 ? 0 : 1;
+}
+
+/*
+ * The cached probe of path, if its identity still matches and it was a
+ * BlueSCSI.  Lets a run skip the handshake (see bluescsi_handshake()).
+ */
+int discover_cached(const char *path, bs_probe *p)
+{
+	bs_probe *cache;
+	char identity[128];
+	int ret = -1;
+	int n, i;
+
+	if (scsi_identity(path, identity, sizeof(identity)) != 0)
+		return -1;
+	if ((cache = (bs_probe *)malloc(DISCOVER_MAX * sizeof(bs_probe))) == NULL)
+		return -1;
+	pthread_mutex_lock(&cache_lock);
+	n = cache_load(cache, DISCOVER_MAX);
+	pthread_mutex_unlock(&cache_lock);
+	for (i = 0; i < n; i++) {
+		if (strcmp(cache[i].path, path) == 0 && strcmp(cache[i].identity, identity) == 0 &&
+		    cache[i].found) {
+			*p = cache[i];
+			p->cached = 1;
+			ret = 0;
+			break;
+		}
+	}
+	free(cache);
+	return ret;
+}
+
+/* Add or replace the cache entry for p->path */
+void discover_remember(const bs_probe *p)
+{
+	bs_probe *cache;
+	int n, i;
+
+	if ((cache = (bs_probe *)malloc(DISCOVER_MAX * sizeof(bs_probe))) == NULL)
+		return;
+	pthread_mutex_lock(&cache_lock);
+	n = cache_load(cache, DISCOVER_MAX);
+	for (i = 0; i < n; i++) {
+		if (strcmp(cache[i].path, p->path) == 0)
+			break;
+	}
+	if (i < DISCOVER_MAX) {
+		cache[i] = *p;
+		cache[i].cached = 0;
+		cache_save(cache, i == n ? n + 1 : n);
+	}
+	pthread_mutex_unlock(&cache_lock);
+	free(cache);
+}
+
+/* Path of the first BlueSCSI on the system, for the "auto" device */
+int discover_lookup(char *out, size_t out_len)
+{
+	static bs_probe probes[DISCOVER_MAX];
+	int n, i;
+	int ncached;
+
+	n = discover_scan(NULL, 0, 0, probes, &ncached);
+	for (i = 0; i < n; i++) {
+		if (probes[i].found) {
+			snprintf(out, out_len, "%s", probes[i].path);
+			return 0;
+		}
+	}
+	return -1;
+}
@@ -0,0 +1,34 @@
+#ifndef DISCOVER_H
+#define DISCOVER_H
+
+#include "os.h"
+
+#define DISCOVER_MAX      64	/* Device nodes considered per scan */
+#define DISCOVER_THREADS  8
+#define DISCOVER_CACHE    "discover"
+
+/* What a probe found behind one device node */
+typedef struct {
+	char path[SCSI_PATH_LEN];
+	char identity[128];	/* Empty if the transport can't tell */
+	int found;		/* Answered as a BlueSCSI toolbox target */
+	int cached;
+	int scsi_id;
+	int api_ver;		/* Toolbox API version from INQUIRY */
+	int meta_api;		/* ...and from the metadata capabilities */
+	int caps;
+	unsigned char dev_map[8];
+	char vendor[9];
+	char product[17];
+	char rev[5];
+} bs_probe;
+
+int bluescsi_vendor_page_match(const unsigned char *buf, int len);
+void bluescsi_probe_strings(bs_probe *p, const unsigned char *inq);
+int bluescsi_probe(const char *path, bs_probe *p);
+int discover_run(char **paths, int npaths, int rescan);
+int discover_lookup(char *out, size_t out_len);
+int discover_cached(const char *path, bs_probe *p);
+void discover_remember(const bs_probe *p);
+
+#endif
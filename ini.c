@@ -0,0 +1,787 @@
+/*
+ * bstoolbox ini: bluescsi.ini profiles, see ini.h
+ *
+ * The file is edited line by line, so comments, key order and everything
+ * a profile doesn't mention go back to the card exactly as they were.
+ * Applying a profile is remembered per device in the cache directory, and
+ * the next probe is filed under it, which gives a history of settings
+ * against measured throughput.
+ */
+#include <ctype.h>
+#include <dirent.h>
+#include <time.h>
+
+#include "bstoolbox.h"
+#include "checksum.h"
+#include "cache.h"
+#include "transport.h"
+#include "ini.h"
+
+enum {
+	LINE_OTHER,
+	LINE_SECTION,
+	LINE_KEY
+};
+
+typedef struct {
+	int n;
+	int crlf;		/* Written back with the line ends it came with */
+	char line[INI_MAX_LINES][INI_LINE_LEN];
+} ini_file;
+
+/* The card side of a command, see dev_open() */
+typedef struct {
+	bs_ctx *c;
+	char orig_wdir[256];
+	int wdir_moved;
+	char tmpdir[64];
+	char name[BS_NAME_LEN];	/* As the card spells it */
+	int idx;		/* In the root listing, -1 if there is none */
+} ini_dev;
+
+static char *skip_space(char *s)
+{
+	while (isspace((unsigned char)*s))
+		s++;
+	return s;
+}
+
+static char *trim(char *s)
+{
+	int i;
+
+	s = skip_space(s);
+	for (i = strlen(s); i > 0 && isspace((unsigned char)s[i - 1]); i--)
+		s[i - 1] = '\0';
+	return s;
+}
+
+/*
+ * What one line holds.  For a section its name goes to name; for a key,
+ * the key goes to name and the value, without any trailing comment but
+ * still quoted, to raw.
+ */
+static int parse_line(const char *line, char *name, char *raw)
+{
+	char buf[INI_LINE_LEN];
+	char *p, *q;
+	int quoted = 0;
+
+	snprintf(buf, sizeof(buf), "%s", line);
+	p = skip_space(buf);
+	if (*p == '[') {
+		if ((q = strchr(p, ']')) == NULL)
+			return LINE_OTHER;
+		*q = '\0';
+		snprintf(name, INI_LINE_LEN, "%s", trim(p + 1));
+		return LINE_SECTION;
+	}
+	if (*p == ';' || *p == '#' || (q = strchr(p, '=')) == NULL)
+		return LINE_OTHER;
+
+	*q++ = '\0';
+	snprintf(name, INI_LINE_LEN, "%s", trim(p));
+	for (p = q; *p != '\0'; p++) {
+		if (*p == '"')
+			quoted = !quoted;
+		else if (!quoted && (*p == ';' || *p == '#')) {
+			*p = '\0';
+			break;
+		}
+	}
+	snprintf(raw, INI_LINE_LEN, "%s", trim(q));
+	return name[0] != '\0' ? LINE_KEY : LINE_OTHER;
+}
+
+/* A value as the firmware reads it, for comparing */
+static void unquote(const char *raw, char *out, size_t out_len)
+{
+	size_t len = strlen(raw);
+
+	if (len >= 2 && raw[0] == '"' && raw[len - 1] == '"')
+		snprintf(out, out_len, "%.*s", (int)(len - 2), raw + 1);
+	else
+		snprintf(out, out_len, "%s", raw);
+}
+
+static int ini_load(const char *path, ini_file *f)
+{
+	char line[INI_LINE_LEN + 2];
+	FILE *fp;
+	size_t len;
+
+	f->n = 0;
+	f->crlf = 0;
+	if ((fp = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "Error: can't open %s - %s\n", path, strerror(errno));
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		len = strlen(line);
+		if (len > 0 && line[len - 1] != '\n' && !feof(fp)) {
+			fprintf(stderr, "Error: %s:%d: line too long\n", path, f->n + 1);
+			fclose(fp);
+			return -1;
+		}
+		if (f->n == INI_MAX_LINES) {
+			fprintf(stderr, "Error: %s has more than %d lines\n", path, INI_MAX_LINES);
+			fclose(fp);
+			return -1;
+		}
+		if (len > 0 && line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (len > 0 && line[len - 1] == '\r') {
+			line[--len] = '\0';
+			f->crlf = 1;
+		}
+		snprintf(f->line[f->n++], INI_LINE_LEN, "%s", line);
+	}
+	fclose(fp);
+	return 0;
+}
+
+static int ini_save(const ini_file *f, const char *path)
+{
+	FILE *fp;
+	int i;
+
+	if ((fp = fopen(path, "w")) == NULL) {
+		fprintf(stderr, "Error: can't write %s - %s\n", path, strerror(errno));
+		return -1;
+	}
+	for (i = 0; i < f->n; i++)
+		fprintf(fp, "%s%s", f->line[i], f->crlf ? "\r\n" : "\n");
+	if (fclose(fp) != 0) {
+		fprintf(stderr, "Error: can't write %s - %s\n", path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * The line holding sect.key, or -1.  *end is where a new key for the
+ * section would go (after its last key), or -1 if there is no section.
+ */
+static int ini_find(const ini_file *f, const char *sect, const char *key, int *end)
+{
+	char name[INI_LINE_LEN], raw[INI_LINE_LEN];
+	int inside = 0;
+	int i;
+
+	*end = -1;
+	for (i = 0; i < f->n; i++) {
+		switch (parse_line(f->line[i], name, raw)) {
+		case LINE_SECTION:
+			inside = strcasecmp(name, sect) == 0;
+			if (inside)
+				*end = i + 1;
+			break;
+		case LINE_KEY:
+			if (!inside)
+				break;
+			if (strcasecmp(name, key) == 0)
+				return i;
+			*end = i + 1;
+			break;
+		}
+	}
+	return -1;
+}
+
+static int ini_get(const ini_file *f, const char *sect, const char *key, char *raw)
+{
+	char name[INI_LINE_LEN];
+	int end;
+	int i;
+
+	if ((i = ini_find(f, sect, key, &end)) < 0)
+		return -1;
+	parse_line(f->line[i], name, raw);
+	return 0;
+}
+
+/* [sect] if sect is given, else key=raw, failing if it doesn't fit a line */
+static int ini_line(char *out, const char *sect, const char *key, const char *raw)
+{
+	char line[INI_LINE_LEN];
+	int len;
+
+	if (sect != NULL)
+		len = snprintf(line, sizeof(line), "[%s]", sect);
+	else
+		len = snprintf(line, sizeof(line), "%s=%s", key, raw);
+	if (len < 0 || len >= (int)sizeof(line)) {
+		fprintf(stderr, "Error: %s is too long for a line of %s\n", sect != NULL ? sect : key, INI_NAME);
+		return -1;
+	}
+	memcpy(out, line, sizeof(line));
+	return 0;
+}
+
+static int ini_set(ini_file *f, const char *sect, const char *key, const char *raw)
+{
+	char name[INI_LINE_LEN], old[INI_LINE_LEN], line[INI_LINE_LEN], head[INI_LINE_LEN];
+	int end;
+	int i;
+
+	if ((i = ini_find(f, sect, key, &end)) >= 0) {
+		/* Keep the key as the file spells it */
+		parse_line(f->line[i], name, old);
+		return ini_line(f->line[i], NULL, name, raw);
+	}
+
+	if (f->n + 3 > INI_MAX_LINES) {
+		fprintf(stderr, "Error: %s would have more than %d lines\n", INI_NAME, INI_MAX_LINES);
+		return -1;
+	}
+	if (ini_line(line, NULL, key, raw) != 0 || (end < 0 && ini_line(head, sect, NULL, NULL) != 0))
+		return -1;
+	if (end < 0) {
+		if (f->n > 0 && *trim(f->line[f->n - 1]) != '\0')
+			f->line[f->n++][0] = '\0';
+		memcpy(f->line[f->n++], head, INI_LINE_LEN);
+		end = f->n;
+	}
+	for (i = f->n; i > end; i--)
+		memcpy(f->line[i], f->line[i - 1], INI_LINE_LEN);
+	memcpy(f->line[end], line, INI_LINE_LEN);
+	f->n++;
+	return 0;
+}
+
+/*
+ * Set every key of profile p in f, printing what changes.  With dry set f
+ * is left alone.  Returns the number of keys that change.
+ */
+static int ini_apply(ini_file *f, const ini_file *p, int dry)
+{
+	char sect[INI_LINE_LEN], name[INI_LINE_LEN], raw[INI_LINE_LEN];
+	char old[INI_LINE_LEN], a[INI_LINE_LEN], b[INI_LINE_LEN];
+	int changes = 0;
+	int i;
+
+	snprintf(sect, sizeof(sect), "%s", INI_DEFAULT_SECT);
+	for (i = 0; i < p->n; i++) {
+		switch (parse_line(p->line[i], name, raw)) {
+		case LINE_SECTION:
+			snprintf(sect, sizeof(sect), "%s", name);
+			break;
+		case LINE_KEY:
+			if (ini_get(f, sect, name, old) == 0) {
+				unquote(old, a, sizeof(a));
+				unquote(raw, b, sizeof(b));
+				if (strcasecmp(a, b) == 0)
+					break;
+				fprintf(stdout, "%s.%s: %s -> %s\n", sect, name, old, raw);
+			}
+			else
+				fprintf(stdout, "%s.%s: (unset) -> %s\n", sect, name, raw);
+			changes++;
+			if (!dry && ini_set(f, sect, name, raw) != 0)
+				return -1;
+			break;
+		}
+	}
+	return changes;
+}
+
+/* Turn S.KEY=VAL arguments into a profile */
+static int args_profile(int argc, char **argv, ini_file *p)
+{
+	char buf[INI_LINE_LEN];
+	char *eq, *dot, *key;
+	int i;
+
+	p->n = 0;
+	p->crlf = 0;
+	for (i = 0; i < argc; i++) {
+		if (strlen(argv[i]) >= sizeof(buf)) {
+			fprintf(stderr, "Error: %.32s... is too long for a line of %s\n", argv[i], INI_NAME);
+			return -1;
+		}
+		snprintf(buf, sizeof(buf), "%s", argv[i]);
+		if ((eq = strchr(buf, '=')) == NULL || eq == buf || p->n + 2 > INI_MAX_LINES) {
+			fprintf(stderr, "Error: expected SECTION.KEY=VALUE, not %s\n", argv[i]);
+			return -1;
+		}
+		*eq = '\0';
+		key = buf;
+		if ((dot = strchr(buf, '.')) != NULL) {
+			*dot = '\0';
+			key = dot + 1;
+		}
+		if (ini_line(p->line[p->n++], dot != NULL ? buf : INI_DEFAULT_SECT, NULL, NULL) != 0 ||
+		    ini_line(p->line[p->n++], NULL, key, eq + 1) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+static void profile_dir(char *out, size_t out_len)
+{
+	const char *env;
+
+	if ((env = getenv("BSTOOLBOX_INI_DIR")) != NULL && *env != '\0')
+		snprintf(out, out_len, "%s", env);
+	else if ((env = getenv("HOME")) != NULL && *env != '\0')
+		snprintf(out, out_len, "%s/.config/bstoolbox", env);
+	else
+		snprintf(out, out_len, "/etc/bstoolbox");
+}
+
+static void host_name(char *out, size_t out_len)
+{
+	char *dot;
+
+	if (gethostname(out, out_len) != 0)
+		snprintf(out, out_len, "default");
+	out[out_len - 1] = '\0';
+	if ((dot = strchr(out, '.')) != NULL)
+		*dot = '\0';
+}
+
+/* Find the file for a profile name; *label gets what to call it */
+static int profile_path(const char *name, char *out, size_t out_len, char *label, size_t label_len)
+{
+	char host[256];
+	char dir[1024];
+	int len;
+
+	if (name == NULL) {
+		host_name(host, sizeof(host));
+		name = host;
+	}
+	snprintf(label, label_len, "%s", name);
+
+	if (strchr(name, '/') != NULL) {
+		snprintf(out, out_len, "%s", name);
+		name = strrchr(name, '/') + 1;
+		if (strncmp(name, INI_NAME ".", strlen(INI_NAME) + 1) == 0)
+			name += strlen(INI_NAME) + 1;
+		snprintf(label, label_len, "%s", name);
+		for (; *label != '\0'; label++)
+			if (isspace((unsigned char)*label))
+				*label = '_';
+		return 0;
+	}
+	snprintf(out, out_len, "%s.%s", INI_NAME, name);
+	if (access(out, R_OK) == 0)
+		return 0;
+	profile_dir(dir, sizeof(dir));
+	len = snprintf(out, out_len, "%s/%s.%s", dir, INI_NAME, name);
+	if (len >= 0 && (size_t)len < out_len && access(out, R_OK) == 0)
+		return 0;
+	fprintf(stderr, "Error: no profile %s, looked for %s.%s here and in %s\n", name, INI_NAME, name, dir);
+	return -1;
+}
+
+static void list_profiles_in(const char *dir, const char *host)
+{
+	struct dirent *de;
+	DIR *d;
+	size_t plen = strlen(INI_NAME) + 1;
+
+	if ((d = opendir(dir)) == NULL)
+		return;
+	while ((de = readdir(d)) != NULL) {
+		if (strncmp(de->d_name, INI_NAME ".", plen) != 0 || de->d_name[plen] == '\0')
+			continue;
+		fprintf(stdout, "%-20s %s/%s%s\n", de->d_name + plen, dir, de->d_name,
+			strcmp(de->d_name + plen, host) == 0 ? " (this host)" : "");
+	}
+	closedir(d);
+}
+
+static int list_profiles(void)
+{
+	char host[256];
+	char dir[1024];
+
+	host_name(host, sizeof(host));
+	profile_dir(dir, sizeof(dir));
+	list_profiles_in(".", host);
+	list_profiles_in(dir, host);
+	return 0;
+}
+
+/*
+ * Per device record of applied profiles and probe results, one line each:
+ *	apply TIME LABEL
+ *	probe TIME LABEL BYTES_PER_SEC US_PER_COMMAND
+ */
+static int state_path(const char *devpath, char *out, size_t out_len)
+{
+	char id[256];
+	char name[32];
+
+	if (scsi_identity(devpath, id, sizeof(id)) != 0 || id[0] == '\0')
+		snprintf(id, sizeof(id), "%s", devpath);
+	snprintf(name, sizeof(name), "ini-%08x",
+		crc32c_final(crc32c_update(crc32c_init(), id, strlen(id))));
+	return cache_path(out, out_len, name);
+}
+
+static void state_add(const char *devpath, const char *kind, const char *label, double rate, double cmd_us)
+{
+	char path[1024];
+	FILE *fp;
+
+	if (state_path(devpath, path, sizeof(path)) != 0 || (fp = fopen(path, "a")) == NULL) {
+		fprintf(stderr, "Warning: couldn't record the %s in the cache directory\n", kind);
+		return;
+	}
+	if (strcmp(kind, "probe") == 0)
+		fprintf(fp, "probe %lu %s %.0f %.1f\n", (unsigned long)time(NULL), label, rate, cmd_us);
+	else
+		fprintf(fp, "%s %lu %s\n", kind, (unsigned long)time(NULL), label);
+	fclose(fp);
+}
+
+/* The profile applied since the last probe, if any */
+static int state_pending(const char *devpath, char *label, size_t label_len)
+{
+	char path[1024];
+	char line[512], kind[16], name[256];
+	unsigned long t;
+	FILE *fp;
+	int pending = 0;
+
+	if (state_path(devpath, path, sizeof(path)) != 0 || (fp = fopen(path, "r")) == NULL)
+		return 0;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "%15s %lu %255s", kind, &t, name) != 3)
+			continue;
+		pending = strcmp(kind, "apply") == 0;
+		if (pending)
+			snprintf(label, label_len, "%s", name);
+	}
+	fclose(fp);
+	return pending;
+}
+
+static void print_history(const char *devpath)
+{
+	char path[1024];
+	char line[512], name[256], when[32];
+	unsigned long t;
+	double rate, cmd_us;
+	time_t tt;
+	long skip;
+	long n = 0;
+	FILE *fp;
+
+	if (state_path(devpath, path, sizeof(path)) != 0 || (fp = fopen(path, "r")) == NULL)
+		return;
+	while (fgets(line, sizeof(line), fp) != NULL)
+		if (strncmp(line, "probe ", 6) == 0)
+			n++;
+	skip = n > INI_HISTORY ? n - INI_HISTORY : 0;
+
+	rewind(fp);
+	fprintf(stdout, "\n%-16s  %-20s %10s %12s\n", "When", "Profile", "MB/s", "ms/command");
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "probe %lu %255s %lf %lf", &t, name, &rate, &cmd_us) != 4 || skip-- > 0)
+			continue;
+		tt = (time_t)t;
+		strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&tt));
+		fprintf(stdout, "%-16s  %-20s %10.2f %12.2f\n", when, name, rate / 1000000.0, cmd_us / 1000.0);
+	}
+	fclose(fp);
+}
+
+static void dev_file(const ini_dev *d, const char *sub, char *out, size_t out_len)
+{
+	snprintf(out, out_len, "%s%s/%s", d->tmpdir, sub, d->name);
+}
+
+/*
+ * Move to the root directory and fetch the card's bluescsi.ini into a
+ * private temporary directory.
+ */
+static int dev_open(ini_dev *d, bs_ctx *c)
+{
+	bs_file list[BS_MAX_FILES];
+	int n, i;
+
+	memset(d, 0, sizeof(*d));
+	d->c = c;
+	d->idx = -1;
+	snprintf(d->name, sizeof(d->name), "%s", INI_NAME);
+
+	if (bs_get_wdir(c, d->orig_wdir, sizeof(d->orig_wdir)) != 0)
+		return -1;
+	if (bs_set_wdir(c, "/") != 0)
+		return -1;
+	d->wdir_moved = 1;
+
+	snprintf(d->tmpdir, sizeof(d->tmpdir), "/tmp/bstoolbox-ini.XXXXXX");
+	if (mkdtemp(d->tmpdir) == NULL) {
+		fprintf(stderr, "Error: can't make a temporary directory - %s\n", strerror(errno));
+		d->tmpdir[0] = '\0';
+		return -1;
+	}
+
+	if ((n = bs_list(c, list, BS_MAX_FILES)) < 0)
+		return -1;
+	for (i = 0; i < n; i++) {
+		if (strcasecmp(list[i].name, INI_NAME) == 0) {
+			d->idx = list[i].index;
+			snprintf(d->name, sizeof(d->name), "%s", list[i].name);
+			return bs_get(c, d->idx, d->tmpdir);
+		}
+	}
+	return 0;
+}
+
+static void dev_close(ini_dev *d)
+{
+	char path[1024];
+
+	if (d->wdir_moved && bs_set_wdir(d->c, d->orig_wdir) != 0)
+		fprintf(stderr, "Warning: failed to restore working directory to %s\n", d->orig_wdir);
+	if (d->tmpdir[0] == '\0')
+		return;
+
+	dev_file(d, "/new", path, sizeof(path));
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/new/%s", d->tmpdir, MANIFEST_NAME);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/new", d->tmpdir);
+	rmdir(path);
+	dev_file(d, "", path, sizeof(path));
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/%s", d->tmpdir, MANIFEST_NAME);
+	unlink(path);
+	rmdir(d->tmpdir);
+}
+
+/* The card's file, or an empty one if it has none */
+static int dev_load(ini_dev *d, ini_file *f)
+{
+	char path[1024];
+
+	if (d->idx < 0) {
+		f->n = 0;
+		f->crlf = 0;
+		return 0;
+	}
+	dev_file(d, "", path, sizeof(path));
+	return ini_load(path, f);
+}
+
+/*
+ * Replace the card's file with f.  The old one is removed first, as a
+ * put over an existing name may append to it; if the upload then fails
+ * the old one is put back.
+ */
+static int dev_store(ini_dev *d, const ini_file *f)
+{
+	char path[1024], orig[1024];
+
+	snprintf(path, sizeof(path), "%s/new", d->tmpdir);
+	if (mkdir(path, 0700) != 0 && errno != EEXIST) {
+		fprintf(stderr, "Error: can't make %s - %s\n", path, strerror(errno));
+		return -1;
+	}
+	dev_file(d, "/new", path, sizeof(path));
+	if (ini_save(f, path) != 0)
+		return -1;
+
+	if (d->idx >= 0 && bs_remove(d->c, d->idx) != 0)
+		return -1;
+	if (bs_put(d->c, path) == 0)
+		return 0;
+
+	if (d->idx >= 0) {
+		dev_file(d, "", orig, sizeof(orig));
+		if (bs_put(d->c, orig) == 0)
+			fprintf(stderr, "Error: upload failed, the previous %s was put back\n", d->name);
+		else
+			fprintf(stderr, "Error: upload failed and the card has no %s now, a copy is in %s\n",
+				d->name, orig);
+		d->tmpdir[0] = '\0';	/* Keep it */
+	}
+	return -1;
+}
+
+static int copy_out(const char *from, FILE *to)
+{
+	char buf[4096];
+	size_t n;
+	FILE *fp;
+
+	if ((fp = fopen(from, "rb")) == NULL) {
+		fprintf(stderr, "Error: can't open %s - %s\n", from, strerror(errno));
+		return -1;
+	}
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+		if (fwrite(buf, 1, n, to) != n)
+			break;
+	fclose(fp);
+	return ferror(to) ? -1 : 0;
+}
+
+/* show and get */
+static int ini_fetch(bs_ctx *c, const char *dest)
+{
+	char path[1024];
+	ini_dev d;
+	FILE *fp;
+	int ret = -1;
+
+	if (dev_open(&d, c) == 0) {
+		dev_file(&d, "", path, sizeof(path));
+		if (d.idx < 0)
+			fprintf(stderr, "Error: the card has no %s\n", INI_NAME);
+		else if (dest == NULL)
+			ret = copy_out(path, stdout);
+		else if ((fp = fopen(dest, "wb")) == NULL)
+			fprintf(stderr, "Error: can't write %s - %s\n", dest, strerror(errno));
+		else {
+			ret = copy_out(path, fp);
+			if (fclose(fp) != 0)
+				ret = -1;
+			if (ret == 0)
+				fprintf(stdout, "Saved %s as %s\n", d.name, dest);
+		}
+	}
+	dev_close(&d);
+	return ret;
+}
+
+/* diff, apply and set: p holds the keys, label is what to file them under */
+static int ini_change(bs_ctx *c, const char *devpath, const ini_file *p, const char *label, int dry)
+{
+	ini_file *f;
+	ini_dev d;
+	int n;
+	int ret = -1;
+
+	if ((f = malloc(sizeof(*f))) == NULL) {
+		fprintf(stderr, "Error: out of memory\n");
+		return -1;
+	}
+	if (dev_open(&d, c) == 0 && dev_load(&d, f) == 0 &&
+	    (n = ini_apply(f, p, dry)) >= 0) {
+		if (n == 0) {
+			fprintf(stdout, "Nothing to change in %s\n", d.name);
+			ret = 0;
+		}
+		else if (dry)
+			ret = 0;
+		else if (dev_store(&d, f) == 0) {
+			state_add(devpath, "apply", label, 0, 0);
+			fprintf(stdout, "Updated %s, %d setting%s changed.\n", d.name, n, n == 1 ? "" : "s");
+			fprintf(stdout, "Reboot the BlueSCSI for it to take effect, then run: bstoolbox %s ini probe\n",
+				devpath);
+			ret = 0;
+		}
+	}
+	dev_close(&d);
+	free(f);
+	return ret;
+}
+
+/*
+ * Time reads from one file, plus small command round trips, and keep the
+ * result with whatever was applied before the reboot.
+ */
+static int ini_probe(bs_ctx *c, const char *devpath, const char *arg)
+{
+	bs_file list[BS_MAX_FILES];
+	unsigned long long bytes, us, t, cmd_us = 0;
+	char label[256];
+	double rate;
+	int n, i, idx = -1;
+
+	if ((n = bs_list(c, list, BS_MAX_FILES)) < 0)
+		return -1;
+	if (arg != NULL) {
+		idx = atoi(arg);
+		if (idx < 0 || idx >= n) {
+			fprintf(stderr, "Error: no file #%s, the directory has %d files\n", arg, n);
+			return -1;
+		}
+	}
+	else {
+		for (i = 0; i < n; i++)
+			if (idx < 0 || list[i].size > list[idx].size)
+				idx = i;
+	}
+	if (idx < 0 || list[idx].size < GET_BLOCK_SIZE) {
+		fprintf(stderr, "Error: nothing to read, put a file of a few MB in the working directory first\n");
+		return -1;
+	}
+
+	if (bs_read_test(c, list[idx].index, 0, INI_PROBE_BYTES, &bytes, &us) != 0)
+		return -1;
+	for (i = 0; i < INI_PROBE_CMDS; i++) {
+		t = scsi_now_us();
+		if (bs_get_debug(c) < 0)
+			return -1;
+		cmd_us += scsi_now_us() - t;
+	}
+	if (us == 0)
+		us = 1;
+	rate = bytes * 1000000.0 / us;
+
+	if (!state_pending(devpath, label, sizeof(label)))
+		snprintf(label, sizeof(label), "unchanged");
+	fprintf(stdout, "Read %llu KB of %s in %.3f s: %.2f MB/s, %.2f ms per command (%s)\n",
+		bytes / 1024, list[idx].name, us / 1000000.0, rate / 1000000.0,
+		cmd_us / 1000.0 / INI_PROBE_CMDS, label);
+	if (bytes < INI_PROBE_BYTES)
+		fprintf(stdout, "Note: %s is small, a larger file gives steadier numbers\n", list[idx].name);
+
+	state_add(devpath, "probe", label, rate, (double)cmd_us / INI_PROBE_CMDS);
+	print_history(devpath);
+	return 0;
+}
+
+static void ini_usage(void)
+{
+	fprintf(stderr, "Usage: bstoolbox <device> ini show | get [file] | profiles | diff [profile]\n");
+	fprintf(stderr, "                              | apply [profile] | set SECTION.KEY=VALUE... | probe [num]\n");
+}
+
+/* Returns 0 on success, 1 on failure */
+int ini_run(bs_ctx *c, const char *devpath, int argc, char **argv)
+{
+	char path[1024], label[256];
+	const char *cmd = argc > 0 ? argv[0] : "";
+	const char *arg = argc > 1 ? argv[1] : NULL;
+	ini_file *p;
+	int ret = -1;
+
+	if (argc < 1 || (argc > 2 && strcmp(cmd, "set") != 0) || (argc < 2 && strcmp(cmd, "set") == 0) ||
+	    (arg != NULL && (strcmp(cmd, "show") == 0 || strcmp(cmd, "profiles") == 0))) {
+		ini_usage();
+		return 1;
+	}
+
+	if (strcmp(cmd, "show") == 0)
+		ret = ini_fetch(c, NULL);
+	else if (strcmp(cmd, "get") == 0)
+		ret = ini_fetch(c, arg != NULL ? arg : INI_NAME);
+	else if (strcmp(cmd, "profiles") == 0)
+		ret = list_profiles();
+	else if (strcmp(cmd, "probe") == 0)
+		ret = ini_probe(c, devpath, arg);
+	else if (strcmp(cmd, "diff") == 0 || strcmp(cmd, "apply") == 0 || strcmp(cmd, "set") == 0) {
+		if ((p = malloc(sizeof(*p))) == NULL) {
+			fprintf(stderr, "Error: out of memory\n");
+			return 1;
+		}
+		if (strcmp(cmd, "set") == 0) {
+			if (args_profile(argc - 1, argv + 1, p) == 0)
+				ret = ini_change(c, devpath, p, "set", 0);
+		}
+		else if (profile_path(arg, path, sizeof(path), label, sizeof(label)) == 0 &&
+			 ini_load(path, p) == 0)
+			ret = ini_change(c, devpath, p, label, strcmp(cmd, "diff") == 0);
+		free(p);
+	}
+	else
+		ini_usage();
+	return ret != 0;
+}
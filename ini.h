@@ -0,0 +1,36 @@
+#ifndef INI_H
+#define INI_H
+
+#include "libbstoolbox.h"
+
+/*
+ * bstoolbox <device> ini ...: look after the bluescsi.ini in the root of
+ * the SD card over the toolbox, so bus settings on a deployed machine can
+ * be changed and measured without pulling the card.
+ *
+ *	show             print the card's bluescsi.ini
+ *	get [FILE]       save it, as ./bluescsi.ini by default
+ *	profiles         list the profiles found
+ *	diff [PROFILE]   what apply would change
+ *	apply [PROFILE]  set the keys of a profile and upload the result
+ *	set S.KEY=VAL... set single keys ([SCSI] if S. is left out)
+ *	probe [NUM]      after a reboot, time reads of file NUM (the largest
+ *	                 by default) and keep the result with the profile
+ *
+ * A profile is an ini file holding just the keys it sets, named
+ * bluescsi.ini.NAME in the current directory or in $BSTOOLBOX_INI_DIR
+ * (else ~/.config/bstoolbox).  NAME defaults to the short host name, so
+ * each machine picks up its own; a PROFILE with a '/' is a path.
+ */
+
+#define INI_NAME         "bluescsi.ini"
+#define INI_MAX_LINES    512
+#define INI_LINE_LEN     256
+#define INI_DEFAULT_SECT "SCSI"
+#define INI_PROBE_BYTES  (4 * 1024 * 1024)
+#define INI_PROBE_CMDS   16	/* Small commands timed per probe */
+#define INI_HISTORY      20	/* Probe results shown */
+
+int ini_run(bs_ctx *c, const char *devpath, int argc, char **argv);
+
+#endif
@@ -0,0 +1,206 @@
+/*
+ * bstoolboxd socket protocol, client side and request encoding, see ipc.h
+ */
+
+/* struct ucred, for SO_PEERCRED */
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "ipc.h"
+#include "devlock.h"
+
+#define IPC_FIELDS 13
+
+int ipc_socket_path(const char *devpath, int create, char *out, size_t out_len)
+{
+	char path[1024];
+	char dir[1024];
+	struct stat st;
+	char *base;
+	int len;
+
+	if (devlock_path(devpath, "sock", path, sizeof(path)) != 0)
+		return -1;
+	base = strrchr(path, '/');
+	*base++ = '\0';
+	len = snprintf(dir, sizeof(dir), "%s/bstoolboxd-%ld", path, (long)geteuid());
+	if (len < 0 || (size_t)len >= sizeof(dir))
+		return -1;
+	if (create)
+		mkdir(dir, 0700);
+
+	/* Anyone can make directories in the lock directory, so check it is ours */
+	if (lstat(dir, &st) != 0)
+		return -1;
+	if (!S_ISDIR(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & 077) != 0) {
+		fprintf(stderr, "Error: %s must be a directory of yours with mode 0700\n", dir);
+		return -1;
+	}
+	len = snprintf(out, out_len, "%s/%s", dir, base);
+	return (len < 0 || (size_t)len >= out_len) ? -1 : 0;
+}
+
+/* Is the other end of a connection root or the same user as us? */
+int ipc_peer_ok(int fd)
+{
+#if defined(SO_PEERCRED)
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+		return 0;
+	return cred.uid == 0 || cred.uid == geteuid();
+#else
+	/* No peer credentials; the private socket directory has to do */
+	(void)fd;
+	return 1;
+#endif
+}
+
+/* Tabs and newlines would break the framing, so such paths go direct */
+static int ipc_clean(const char *s)
+{
+	return strpbrk(s, "\t\n") == NULL;
+}
+
+int ipc_encode(const ipc_request *r, char *out, size_t out_len)
+{
+	int len;
+
+	if (!ipc_clean(r->cwd) || !ipc_clean(r->arg) || !ipc_clean(r->manifest))
+		return -1;
+	len = snprintf(out, out_len, "%s\t%d\t%d\t%d\t%d\t%.0f\t%d\t%d\t%d\t%d\t%s\t%s\t%s\n",
+		IPC_MAGIC, r->mode, r->cd_img, r->file, r->verbose, r->rate,
+		r->duty_on_ms, r->duty_off_ms, r->nice, r->wait_secs, r->cwd, r->arg, r->manifest);
+	return (len < 0 || (size_t)len >= out_len) ? -1 : len;
+}
+
+int ipc_decode(char *line, ipc_request *r)
+{
+	char *f[IPC_FIELDS];
+	int n = 0;
+
+	line[strcspn(line, "\r\n")] = '\0';
+	while (n < IPC_FIELDS) {
+		f[n++] = line;
+		line = strchr(line, '\t');
+		if (line == NULL)
+			break;
+		*line++ = '\0';
+	}
+	if (n != IPC_FIELDS || strcmp(f[0], IPC_MAGIC) != 0)
+		return -1;
+
+	memset(r, 0, sizeof(*r));
+	r->mode = atoi(f[1]);
+	r->cd_img = atoi(f[2]);
+	r->file = atoi(f[3]);
+	r->verbose = atoi(f[4]);
+	r->rate = atof(f[5]);
+	r->duty_on_ms = atoi(f[6]);
+	r->duty_off_ms = atoi(f[7]);
+	r->nice = atoi(f[8]);
+	r->wait_secs = atoi(f[9]);
+	snprintf(r->cwd, sizeof(r->cwd), "%s", f[10]);
+	snprintf(r->arg, sizeof(r->arg), "%s", f[11]);
+	snprintf(r->manifest, sizeof(r->manifest), "%s", f[12]);
+	return 0;
+}
+
+/* Send data as records of one stream, split up as needed */
+int ipc_send(int fd, int stream, const char *data, int len)
+{
+	char head[8];
+	int n;
+
+	do {
+		n = len > IPC_MAX_RECORD ? IPC_MAX_RECORD : len;
+		snprintf(head, sizeof(head), "%c%04x", stream, n);
+		if (write(fd, head, 5) != 5 || write(fd, data, n) != n)
+			return -1;
+		data += n;
+		len -= n;
+	} while (len > 0);
+	return 0;
+}
+
+/*
+ * Hand the request to the bstoolboxd serving devpath and relay its output.
+ * Returns the request's exit status, or -1 if no daemon is listening.
+ */
+int ipc_client_run(const char *devpath, const ipc_request *r)
+{
+	struct sockaddr_un addr;
+	char line[IPC_MAX_LINE];
+	char head[6];
+	FILE *in, *out;
+	int status = -1;
+	int len;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (ipc_socket_path(devpath, 0, addr.sun_path, sizeof(addr.sun_path)) != 0)
+		return -1;
+	if (access(addr.sun_path, F_OK) != 0)
+		return -1;
+	if ((len = ipc_encode(r, line, sizeof(line))) < 0)
+		return -1;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		close(fd);
+		return -1;
+	}
+	if (!ipc_peer_ok(fd)) {
+		fprintf(stderr, "Error: %s isn't served by a bstoolboxd of yours\n", addr.sun_path);
+		close(fd);
+		return 1;
+	}
+	if (write(fd, line, len) != len) {
+		fprintf(stderr, "Error: couldn't send request to bstoolboxd - %s\n", strerror(errno));
+		close(fd);
+		return 1;
+	}
+
+	in = fdopen(fd, "r");
+	if (in == NULL) {
+		close(fd);
+		return 1;
+	}
+	while (fread(head, 1, 5, in) == 5) {
+		head[5] = '\0';
+		len = (int)strtol(head + 1, NULL, 16);
+		if (len < 0 || len > IPC_MAX_RECORD || fread(line, 1, len, in) != (size_t)len)
+			break;
+		line[len] = '\0';
+		if (head[0] == IPC_STATUS) {
+			status = atoi(line);
+			break;
+		}
+		/* Pass output on as it comes, for -L -f, each on its own stream */
+		out = head[0] == IPC_STDERR ? stderr : stdout;
+		fwrite(line, 1, len, out);
+		fflush(out);
+	}
+	fclose(in);
+
+	if (status < 0) {
+		fprintf(stderr, "Error: bstoolboxd closed the connection\n");
+		return 1;
+	}
+	return status;
+}
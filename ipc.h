@@ -0,0 +1,54 @@
+#ifndef IPC_H
+#define IPC_H
+
+/*
+ * bstoolboxd socket protocol.
+ *
+ * The daemon serving a device listens on a Unix socket in a mode 0700
+ * directory of its user next to the device lock, so a daemon only serves,
+ * and a client only trusts, the same user or root; where the OS can tell,
+ * both ends also check the peer's credentials.  A client sends one request line,
+ * then reads records until the exit status.  A record is a stream byte
+ * (IPC_STDOUT, IPC_STDERR or IPC_STATUS), the data length in four hex
+ * digits and the data: what the daemon printed to that stream while
+ * carrying out the request, or the exit status in decimal.
+ *
+ * Request fields, tab separated: IPC_MAGIC, mode, CD, file, verbose,
+ * bwlimit, duty on, duty off, nice, --wait seconds, client cwd, path
+ * argument, manifest.
+ * Paths are resolved by the daemon from the client's cwd.
+ */
+
+#include <stddef.h>
+
+#define IPC_MAGIC       "BSTB3"
+#define IPC_MAX_LINE    4096
+
+#define IPC_STDOUT      '1'
+#define IPC_STDERR      '2'
+#define IPC_STATUS      'S'
+#define IPC_MAX_RECORD  (IPC_MAX_LINE - 1)
+
+typedef struct {
+	int mode;
+	int cd_img;
+	int file;
+	int verbose;
+	double rate;
+	int duty_on_ms;
+	int duty_off_ms;
+	int nice;
+	int wait_secs;		/* For the device lock, as devlock_acquire() */
+	char cwd[1024];
+	char arg[1024];
+	char manifest[1024];
+} ipc_request;
+
+int ipc_socket_path(const char *devpath, int create, char *out, size_t out_len);
+int ipc_peer_ok(int fd);
+int ipc_encode(const ipc_request *r, char *out, size_t out_len);
+int ipc_decode(char *line, ipc_request *r);
+int ipc_send(int fd, int stream, const char *data, int len);
+int ipc_client_run(const char *devpath, const ipc_request *r);
+
+#endif
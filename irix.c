@@ -7,21 +7,23 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <dirent.h>
 
 #include "os.h"
+#include "transport.h"
 
 #ifndef INV_PERIPH
 #define INV_PERIPH 9
 #endif
 
-#define MAX_READY_RETRIES 10
 #define SENSE_BUF_LEN     64
 #define STATUS_CHECKCOND  0x02
 
 extern int verbose;
 
-int mediad_start(void) {
+int mediad_start(const char *path) {
     int status;
+    (void)path;
     if (verbose)
         fprintf(stdout, "Starting mediad...\n");
     status = system("/etc/init.d/mediad start");
@@ -32,8 +34,9 @@ int mediad_start(void) {
     return 0;
 }
 
-int mediad_stop(void) {
+int mediad_stop(const char *path) {
     int status;
+    (void)path;
     if (verbose)
         fprintf(stdout, "Stopping mediad...\n");
     status = system("/etc/init.d/mediad stop");
@@ -61,7 +64,7 @@ static int test_dsreq_flags(int dev_fd, uint flag)
    }
 }
 
-int scsi_open(char *path, int readonly)
+static int irix_open(const char *path, int readonly)
 {
     int ret;
     if (readonly)
@@ -73,15 +76,61 @@ int scsi_open(char *path, int readonly)
     return ret;
 }
 
-int scsi_close(int dev)
+static int irix_close(int dev)
 {
     return close(dev);
 }
 
-#define MAX_READY_RETRIES 10
 #define SENSE_BUF_LEN 64
 #define STATUS_CHECKCOND 0x02
 
+/*
+ * Fold the dsreq return code into a transport outcome.  Anything not
+ * listed (DSRT_OK, DSRT_SHORT, DSRT_SENSE...) is left to ds_status.
+ */
+static int irix_transport(const dsreq_t *r)
+{
+    switch (r->ds_ret) {
+#ifdef DSRT_TIMEOUT
+    case DSRT_TIMEOUT:
+        return SCSI_XPORT_TIMEOUT;
+#endif
+#ifdef DSRT_PARITY
+    case DSRT_PARITY:
+        return SCSI_XPORT_PARITY;
+#endif
+#ifdef DSRT_NOSEL
+    case DSRT_NOSEL:
+        return SCSI_XPORT_NOSEL;
+#endif
+#ifdef DSRT_EBSY
+    case DSRT_EBSY:
+        return SCSI_XPORT_BUSY;
+#endif
+#ifdef DSRT_AGAIN
+    case DSRT_AGAIN:
+        return SCSI_XPORT_BUSY;
+#endif
+#ifdef DSRT_HOST
+    case DSRT_HOST:
+        return SCSI_XPORT_ERROR;
+#endif
+#ifdef DSRT_PROTO
+    case DSRT_PROTO:
+        return SCSI_XPORT_ERROR;
+#endif
+#ifdef DSRT_CMDO
+    case DSRT_CMDO:
+        return SCSI_XPORT_ERROR;
+#endif
+#ifdef DSRT_STAI
+    case DSRT_STAI:
+        return SCSI_XPORT_ERROR;
+#endif
+    }
+    return SCSI_XPORT_OK;
+}
+
 /*
  * Execute a SCSI command with the specified data direction.
  *
@@ -89,6 +138,9 @@ int scsi_close(int dev)
  *     DSRQ_READ   Device -> host
  *     DSRQ_WRITE  Host -> device
  *
+ * timeout_ms comes from the adaptive estimate in transport.c.
+ * Status, sense and ds_ret are returned in res.
+ *
  * Returns:
  *      0       success
  *     -errno   ioctl failure
@@ -99,7 +151,9 @@ static int scsi_send_command_dir(int dev,
                                  int cmd_len,
                                  unsigned char *buf,
                                  int buf_len,
-                                 int direction)
+                                 int direction,
+                                 int timeout_ms,
+                                 scsi_result *res)
 {
     int i;
     int err;
@@ -130,7 +184,7 @@ static int scsi_send_command_dir(int dev,
     r.ds_sensebuf = (caddr_t)sense_data;
     r.ds_senselen = sizeof(sense_data);
 
-    r.ds_time = 30 * 1000;
+    r.ds_time = timeout_ms;
 
     /*
      * Always request sense information.  Add the requested
@@ -153,6 +207,7 @@ static int scsi_send_command_dir(int dev,
 
     if (ioctl(dev, DS_ENTER, &r) != 0) {
         err = errno;
+        res->os_error = err;
 
         if (verbose)
             fprintf(stderr, "DS_ENTER failed: %s\n", strerror(err));
@@ -160,6 +215,18 @@ static int scsi_send_command_dir(int dev,
         return -err;
     }
 
+    res->status = r.ds_status;
+    res->host_status = r.ds_ret;
+    res->transport = irix_transport(&r);
+    res->sense_len = r.ds_sensesent < SCSI_SENSE_LEN ? r.ds_sensesent : SCSI_SENSE_LEN;
+    memcpy(res->sense, sense_data, res->sense_len);
+
+    if (res->transport != SCSI_XPORT_OK) {
+        fprintf(stderr, "SCSI transport error, ds_ret: 0x%02x\n", r.ds_ret);
+        errno = EIO;
+        return -EIO;
+    }
+
     if (r.ds_status == STATUS_CHECKCOND) {
         fprintf(stderr, "SCSI CHECK CONDITION\n");
 
@@ -176,6 +243,7 @@ static int scsi_send_command_dir(int dev,
                     key, asc, ascq);
         }
 
+        errno = EIO;
         return -EIO;
     }
 
@@ -184,6 +252,7 @@ static int scsi_send_command_dir(int dev,
                 "SCSI command failed, status: 0x%02x\n",
                 r.ds_status);
 
+        errno = EIO;
         return -EIO;
     }
 
@@ -192,113 +261,96 @@ static int scsi_send_command_dir(int dev,
 
 
 /*
- * Wait until the SCSI device reports that it is ready.
+ * Send a SCSI command in either direction.  Readiness is tracked per
+ * session in transport.c, so writes go straight to the device.
  */
-static int scsi_wait_until_ready(int dev)
-{
-    dsreq_t tur;
-    unsigned char tur_cmd[6] = {
-        0x00, 0, 0, 0, 0, 0
-    };
-    unsigned char sense_data[SENSE_BUF_LEN];
-    int i;
-
-    for (i = 0; i < MAX_READY_RETRIES; ++i) {
-        memset(&tur, 0, sizeof(dsreq_t));
-        memset(sense_data, 0, sizeof(sense_data));
-
-        tur.ds_cmdbuf   = (caddr_t)tur_cmd;
-        tur.ds_cmdlen   = sizeof(tur_cmd);
-        tur.ds_databuf  = NULL;
-        tur.ds_datalen  = 0;
-        tur.ds_sensebuf = (caddr_t)sense_data;
-        tur.ds_senselen = sizeof(sense_data);
-        tur.ds_time     = 1000;
-        tur.ds_flags    = DSRQ_SENSE;
-
-        if (ioctl(dev, DS_ENTER, &tur) == 0) {
-            if (tur.ds_status == 0)
-                return 0;
-
-            if (tur.ds_status == STATUS_CHECKCOND) {
-                if (verbose) {
-                    fprintf(stderr,
-                            "SCSI CHECK CONDITION on TUR, "
-                            "sense key: 0x%02x\n",
-                            sense_data[2] & 0x0F);
-                }
-            } else if (verbose) {
-                fprintf(stderr,
-                        "TEST UNIT READY returned status: 0x%02x\n",
-                        tur.ds_status);
-            }
-        } else {
-            if (verbose)
-                perror("TEST UNIT READY ioctl failed");
-        }
-
-        usleep(100000);
-    }
-
-    return -ETIMEDOUT;
-}
-
-/*
- * Send a SCSI command which reads data from the device.
- */
-int scsi_send_command(int dev,
-                      unsigned char *cmd,
-                      int cmd_len,
-                      unsigned char *buf,
-                      int buf_len)
+static int irix_send(int dev,
+                     unsigned char *cmd,
+                     int cmd_len,
+                     unsigned char *buf,
+                     int buf_len,
+                     int dir,
+                     int timeout_ms,
+                     scsi_result *res)
 {
     return scsi_send_command_dir(dev,
                                  cmd,
                                  cmd_len,
                                  buf,
                                  buf_len,
-                                 DSRQ_READ);
+                                 dir == SCSI_DIR_READ ? DSRQ_READ : DSRQ_WRITE,
+                                 timeout_ms,
+                                 res);
 }
 
+static int irix_devnum(const char *path) {
+    int dev_path_num;
+
+    if (sscanf(path, "/dev/scsi/sc%*dd%dl%*d", &dev_path_num) != 1) {
+        fprintf(stderr, "ERROR: Invalid path format: %s\n", path);
+        return -1;
+    }
+
+    return dev_path_num;
+}
 
 /*
- * Send a SCSI command which writes data to the device.
- *
- * This retains the existing TEST UNIT READY check before
- * performing the write.
+ * Identity of /dev/scsi/scXdYlZ from the hardware inventory: whatever
+ * hinv lists on that controller and unit.
  */
-int scsi_send_commandw(int dev,
-                       unsigned char *cmd,
-                       int cmd_len,
-                       unsigned char *buf,
-                       int buf_len)
+static int irix_identity(const char *path, char *out, size_t out_len)
 {
-    int ret;
+    inventory_t *inv;
+    int ctlr, unit, lun;
+    int found = 0;
 
-    ret = scsi_wait_until_ready(dev);
+    if (sscanf(path, "/dev/scsi/sc%dd%dl%d", &ctlr, &unit, &lun) != 3)
+        return -1;
 
-    if (ret != 0) {
-        fprintf(stderr,
-                "Device not ready, aborting transfer\n");
-        return ret;
+    setinvent();
+    while ((inv = getinvent()) != NULL) {
+        if (inv->inv_controller == ctlr && inv->inv_unit == unit &&
+            inv->inv_class != INV_PROCESSOR && inv->inv_class != INV_MEMORY) {
+            snprintf(out, out_len, "sc%dd%dl%d %d/%d/%ld",
+                     ctlr, unit, lun, inv->inv_class, inv->inv_type, (long)inv->inv_state);
+            found = 1;
+            break;
+        }
     }
+    endinvent();
 
-    return scsi_send_command_dir(dev,
-                                 cmd,
-                                 cmd_len,
-                                 buf,
-                                 buf_len,
-                                 DSRQ_WRITE);
+    return found ? 0 : -1;
 }
-int path_to_devnum(const char *path) {
-    int dev_path_num;
 
-    if (sscanf(path, "/dev/scsi/sc%*dd%dl%*d", &dev_path_num) != 1) {
-        fprintf(stderr, "ERROR: Invalid path format: %s\n", path);
-        return -1;
+scsi_transport os_transport = {
+    "irix",
+    NULL,
+    irix_open,
+    irix_close,
+    irix_send,
+    irix_devnum,
+    irix_identity
+};
+
+/* Every LUN 0 node under /dev/scsi */
+int scsi_list_paths(char (*paths)[SCSI_PATH_LEN], int max)
+{
+    DIR *dir;
+    struct dirent *entry;
+    int ctlr, unit;
+    int n = 0;
+
+    dir = opendir("/dev/scsi");
+    if (dir == NULL)
+        return 0;
+    while ((entry = readdir(dir)) != NULL && n < max) {
+        if (sscanf(entry->d_name, "sc%dd%dl0", &ctlr, &unit) != 2 ||
+            strcmp(strrchr(entry->d_name, 'l'), "l0") != 0)
+            continue;
+        snprintf(paths[n++], SCSI_PATH_LEN, "/dev/scsi/%s", entry->d_name);
     }
-
-    return dev_path_num;
+    closedir(dir);
+    return n;
 }
 
 /* Helper to get scsi path from network name, eg 'dp0' -> '/dev/scsi/sc0dd010 */
@@ -0,0 +1,157 @@
+#ifndef LIBBSTOOLBOX_H
+#define LIBBSTOOLBOX_H
+
+/*
+ * libbstoolbox - the BlueSCSI toolbox protocol as a library.
+ *
+ * Everything about one device (handle, handshake and listing caches,
+ * transfer pacing, statistics, callbacks) lives in an opaque bs_ctx, so a
+ * process can drive several devices at once.  Calls on one context are
+ * serialized by a lock in the context and may come from any thread; calls
+ * on different contexts run in parallel.
+ *
+ * A few things are per process rather than per context: command
+ * recording, tracing and statistics (-R, -T, --stats in bstoolbox) and
+ * the transport's debug output.  Threads may share them, but they are
+ * switched on and off by the program around its use of the library, not
+ * by library calls.  Only the bs_ names below are exported from the
+ * shared library.
+ *
+ * Functions returning int give 0 (or a count) on success and -1 on
+ * failure, with a message on stderr as in the rest of the toolbox.
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+
+/* The library is built with hidden visibility; this is its API */
+#if defined(__GNUC__) && __GNUC__ >= 4
+#define BS_API __attribute__((visibility("default")))
+#else
+#define BS_API
+#endif
+
+#define BS_NAME_LEN      33
+#define BS_MAX_FILES     100
+#define BS_PROGRESS_US   100000	/* Minimum time between progress callbacks */
+
+#define BS_OPEN_READONLY 0x01
+
+/* Target types, as in bs_target_type() */
+#define BS_TYPE_NONE     0xFF
+#define BS_TYPE_HDD      0x00
+#define BS_TYPE_CD       0x02
+
+/* Entry types in bs_file, as the toolbox lists them */
+#define BS_FILE_DIR      0x00
+#define BS_FILE_REGULAR  0x01
+
+typedef struct bs_ctx bs_ctx;
+
+typedef struct {
+	int index;
+	int type;
+	char name[BS_NAME_LEN];
+	unsigned long long size;
+} bs_file;
+
+typedef struct {
+	unsigned long files_in;		/* Completed gets */
+	unsigned long files_out;	/* Completed puts */
+	unsigned long long bytes_in;
+	unsigned long long bytes_out;
+	unsigned long long xfer_us;	/* Time spent in get/put */
+	unsigned long listings;		/* Full directory transfers */
+	unsigned long listings_reused;	/* ...avoided by the listing cache */
+	unsigned long cd_switches;
+	unsigned long long cd_switch_us;	/* Last CD change until the image was ready */
+} bs_stats;
+
+/* What the handshake learned about the device, see bs_device_info() */
+typedef struct {
+	int api_ver;		/* Toolbox API version from INQUIRY */
+	int meta_api;		/* ...and from the metadata capabilities, 0 on older firmware */
+	int caps;		/* BS_CAP_* */
+	char vendor[9];
+	char product[17];
+	char rev[5];
+} bs_device;
+
+#define BS_CAP_LARGE_TRANSFERS 0x01
+#define BS_CAP_LARGE_SEND      0x02
+#define BS_CAP_SET_WORKING_DIR 0x04
+
+/*
+ * Progress of a get or put.  Called from the transfer loop with the
+ * context locked, at most every BS_PROGRESS_US and once at the end, so it
+ * must return quickly and must not call back into the same context.
+ */
+typedef void (*bs_progress_fn)(void *arg, const char *name,
+		unsigned long long done, unsigned long long total);
+
+BS_API bs_ctx *bs_open(const char *path, int flags);
+BS_API void bs_close(bs_ctx *c);
+
+BS_API void bs_set_verbose(bs_ctx *c, int on);
+BS_API void bs_set_manifest(bs_ctx *c, const char *path);
+BS_API void bs_set_listing_cache(bs_ctx *c, int on);
+BS_API void bs_set_pacing(bs_ctx *c, double rate, int duty_on_ms, int duty_off_ms, int nice);
+BS_API void bs_set_progress(bs_ctx *c, bs_progress_fn fn, void *arg);
+BS_API void bs_get_stats(bs_ctx *c, bs_stats *out);
+
+/*
+ * Another program may have used the card since the last call: drop the
+ * listing, working directory and CD catalog, which it could have changed.
+ * The handshake is kept, the device itself being the same.
+ */
+BS_API void bs_forget(bs_ctx *c);
+
+BS_API int bs_inquiry(bs_ctx *c, int print);
+BS_API int bs_device_info(bs_ctx *c, bs_device *out);
+BS_API int bs_target_type(bs_ctx *c);
+BS_API int bs_list(bs_ctx *c, bs_file *out, int max);
+BS_API int bs_get(bs_ctx *c, int idx, const char *outdir);
+BS_API int bs_put(bs_ctx *c, const char *path);
+BS_API int bs_remove(bs_ctx *c, int idx);
+BS_API int bs_remove_many(bs_ctx *c, const int *idx, int n);
+BS_API int bs_get_wdir(bs_ctx *c, char *out, size_t out_len);
+BS_API int bs_set_wdir(bs_ctx *c, const char *dir);
+BS_API int bs_get_log(bs_ctx *c, const char *outdir, FILE *out);
+BS_API int bs_log_begin(bs_ctx *c, unsigned long long *size);
+BS_API int bs_log_read(bs_ctx *c, unsigned long long *offset, FILE *out);
+BS_API int bs_log_end(bs_ctx *c);
+BS_API int bs_list_cds(bs_ctx *c, bs_file *out, int max);
+BS_API int bs_set_cd(bs_ctx *c, int num);
+BS_API int bs_set_cd_name(bs_ctx *c, const char *name);
+BS_API int bs_get_debug(bs_ctx *c);
+BS_API int bs_set_debug(bs_ctx *c, int on);
+
+/*
+ * Measuring the bus.  bs_read_test() times reading the first max_bytes of
+ * file idx, blocks 4 KB blocks per command (0 for the default), without
+ * storing the data; *bytes gets what was read.  bs_write_test() times
+ * writing size bytes of filler to a new file, blocks 512 byte blocks per
+ * command, counted in blocks or (legacy) in bytes.  bs_time_command()
+ * times one small command.  *us gets how long each took.
+ */
+#define BS_CMD_COUNT_FILES 0
+#define BS_CMD_GET_WDIR    1
+#define BS_CMD_GET_CAP     2
+
+BS_API int bs_read_test(bs_ctx *c, int idx, int blocks, unsigned long long max_bytes,
+		unsigned long long *bytes, unsigned long long *us);
+BS_API int bs_write_test(bs_ctx *c, const char *name, unsigned long long size, int blocks, int legacy,
+		unsigned long long *us);
+BS_API int bs_time_command(bs_ctx *c, int which, unsigned long long *us);
+
+/*
+ * The same transfers with real data, for checking what comes back:
+ * bs_write_data() writes size bytes from data, and bs_read_data() reads
+ * up to size bytes of file idx into data, *bytes getting how many.
+ */
+BS_API int bs_write_data(bs_ctx *c, const char *name, const void *data, unsigned long long size,
+		int blocks, int legacy, unsigned long long *us);
+BS_API int bs_read_data(bs_ctx *c, int idx, int blocks, void *data, unsigned long long size,
+		unsigned long long *bytes, unsigned long long *us);
+
+#endif
@@ -6,6 +6,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/mount.h>
 #include <scsi/sg.h>
 #include <string.h>
 #include <errno.h>
@@ -13,24 +14,125 @@
 #include <dirent.h>
 
 #include "os.h"
+#include "transport.h"
 
 extern int verbose;
 
-// Run when a CD is changed
-// TODO Is there a systemd way of doing this?
-int mediad_start(void) 
+/*
+ * CD changes.  The CD target we reach through /dev/sgN is /dev/srN to the
+ * kernel: it is unmounted before the switch, and opened again afterwards
+ * so the kernel revalidates the medium and tells udev, and any automounter
+ * listening there, that it changed.
+ */
+#define MEDIA_MAX_MOUNTS 8
+
+static int sg_block_node(const char *path, char *out, size_t out_len)
 {
-	fprintf(stderr, "mediad_start(): Not implemented on Linux\n");
-	return 1;
+	char sys_path[256];
+	struct dirent *de;
+	const char *node;
+	DIR *dir;
+	int len;
+
+	node = strrchr(path, '/');
+	node = node != NULL ? node + 1 : path;
+
+	snprintf(sys_path, sizeof(sys_path), "/sys/class/scsi_generic/%s/device/block", node);
+	if ((dir = opendir(sys_path)) == NULL)
+		return -1;
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+		len = snprintf(out, out_len, "/dev/%s", de->d_name);
+		closedir(dir);
+		return (len < 0 || (size_t)len >= out_len) ? -1 : 0;
+	}
+	closedir(dir);
+	return -1;
 }
 
-int mediad_stop(void) 
+/* /proc/mounts writes blanks in mount points as \040 and so on */
+static void unescape_mount(char *s)
 {
-	fprintf(stderr, "mediad_stop(): Not implemented on Linux\n");
-	return 1;
+	char *out = s;
+
+	while (*s != '\0') {
+		if (s[0] == '\\' && s[1] >= '0' && s[1] <= '3' && s[2] >= '0' && s[2] <= '7' &&
+		    s[3] >= '0' && s[3] <= '7') {
+			*out++ = (char)((s[1] - '0') * 64 + (s[2] - '0') * 8 + (s[3] - '0'));
+			s += 4;
+		}
+		else
+			*out++ = *s++;
+	}
+	*out = '\0';
 }
 
-int scsi_open(char *path, int readonly)
+int mediad_stop(const char *path)
+{
+	char mounts[MEDIA_MAX_MOUNTS][256];
+	char line[1024];
+	char dev[64];
+	char *src, *mnt;
+	FILE *fd;
+	int n = 0;
+	int ret = 0;
+	int i;
+
+	if (sg_block_node(path, dev, sizeof(dev)) != 0) {
+		if (verbose)
+			fprintf(stdout, "%s has no block device, nothing to unmount\n", path);
+		return 0;
+	}
+
+	/* Collect first, /proc/mounts changes under us as we unmount */
+	if ((fd = fopen("/proc/mounts", "r")) == NULL)
+		return 0;
+	while (n < MEDIA_MAX_MOUNTS && fgets(line, sizeof(line), fd) != NULL) {
+		src = strtok(line, " ");
+		mnt = strtok(NULL, " ");
+		if (src == NULL || mnt == NULL || strcmp(src, dev) != 0)
+			continue;
+		unescape_mount(mnt);
+		snprintf(mounts[n++], sizeof(mounts[0]), "%s", mnt);
+	}
+	fclose(fd);
+
+	for (i = n - 1; i >= 0; i--) {
+		if (umount(mounts[i]) == 0) {
+			if (verbose)
+				fprintf(stdout, "Unmounted %s from %s\n", dev, mounts[i]);
+			continue;
+		}
+		if (errno == EBUSY && umount2(mounts[i], MNT_DETACH) == 0) {
+			fprintf(stderr, "Warning: %s is in use, detached it\n", mounts[i]);
+			continue;
+		}
+		fprintf(stderr, "Error: couldn't unmount %s - %s\n", mounts[i], strerror(errno));
+		ret = 1;
+	}
+	return ret;
+}
+
+int mediad_start(const char *path)
+{
+	char dev[64];
+	int fd;
+
+	if (sg_block_node(path, dev, sizeof(dev)) != 0)
+		return 0;
+	fd = open(dev, O_RDONLY | O_NONBLOCK);
+	if (fd < 0) {
+		fprintf(stderr, "Warning: couldn't reopen %s to pick up the new CD - %s\n", dev, strerror(errno));
+		return 1;
+	}
+	close(fd);
+	if (verbose)
+		fprintf(stdout, "%s revalidated\n", dev);
+	return 0;
+}
+
+static int linux_open(const char *path, int readonly)
 {
 	if (readonly)
 		return open(path, O_RDONLY | O_SYNC);
@@ -38,42 +140,64 @@ int scsi_open(char *path, int readonly)
 		return open(path, O_RDWR | O_SYNC);
 }
 
-int scsi_close(int dev)
+static int linux_close(int dev)
 {
 	return close(dev);
 }
 
-int scsi_send_command(int dev, unsigned char *cmd, int cmd_len, unsigned char *buf, int buf_len)
+/* SG_IO host_status values from the kernel's scsi.h */
+#define DID_OK          0x00
+#define DID_NO_CONNECT  0x01
+#define DID_BUS_BUSY    0x02
+#define DID_TIME_OUT    0x03
+#define DID_BAD_TARGET  0x04
+#define DID_PARITY      0x06
+#define DID_RESET       0x08
+#define DID_IMM_RETRY   0x0c
+#define DID_REQUEUE     0x0d
+
+#define DRIVER_BUSY     0x01
+#define DRIVER_TIMEOUT  0x06
+
+/* Fold the SG_IO host and driver status into a transport outcome */
+static int linux_transport(const struct sg_io_hdr *io_hdr)
 {
-	int i;
-	struct sg_io_hdr io_hdr = { 0 };
-
-	io_hdr.interface_id = 'S';
-	io_hdr.cmdp = cmd;
-	io_hdr.cmd_len = cmd_len;
-	io_hdr.mx_sb_len = 0;
-	io_hdr.dxfer_direction = SG_DXFER_FROM_DEV;
-	io_hdr.dxferp = buf;
-	io_hdr.dxfer_len = buf_len;
-	/* 5000ms should be enough */
-	io_hdr.timeout = 5000;
-
-	if (verbose) {
-		fprintf(stdout, "Sending SCSI command: ");
-		for (i = 0; i < cmd_len; ++i) {
-			fprintf(stdout, "%02x ", (unsigned char) io_hdr.cmdp[i]);
-		}
-		fprintf(stdout, "\n");
+	switch (io_hdr->host_status) {
+	case DID_OK:
+		break;
+	case DID_BUS_BUSY:
+	case DID_IMM_RETRY:
+	case DID_REQUEUE:
+		return SCSI_XPORT_BUSY;
+	case DID_TIME_OUT:
+		return SCSI_XPORT_TIMEOUT;
+	case DID_PARITY:
+		return SCSI_XPORT_PARITY;
+	case DID_RESET:
+		return SCSI_XPORT_RESET;
+	case DID_NO_CONNECT:
+	case DID_BAD_TARGET:
+		return SCSI_XPORT_NOSEL;
+	default:
+		return SCSI_XPORT_ERROR;
 	}
 
-	if (ioctl(dev, SG_IO, &io_hdr) < 0)
-		return 1;
-
-	return 0;
+	switch (io_hdr->driver_status & 0x0F) {
+	case DRIVER_BUSY:
+		return SCSI_XPORT_BUSY;
+	case DRIVER_TIMEOUT:
+		return SCSI_XPORT_TIMEOUT;
+	}
+	return SCSI_XPORT_OK;
 }
 
-// TODO Document this or just do it better
-int scsi_send_commandw(int dev, unsigned char *cmd, int cmd_len, unsigned char *buf, int buf_len)
+/*
+ * Issue one SG_IO request.  dir is SCSI_DIR_READ (device -> host) or
+ * SCSI_DIR_WRITE (host -> device).  Status, sense and the host/driver
+ * status are returned in res; 0 means the command completed with GOOD.
+ */
+static int linux_send(int dev, unsigned char *cmd, int cmd_len, unsigned char *buf, int buf_len, int dir,
+		int timeout_ms, scsi_result *res)
 {
 	int i;
 	struct sg_io_hdr io_hdr = { 0 };
@@ -81,12 +205,12 @@ int scsi_send_commandw(int dev, unsigned char *cmd, int cmd_len, unsigned char *
 	io_hdr.interface_id = 'S';
 	io_hdr.cmdp = cmd;
 	io_hdr.cmd_len = cmd_len;
-	io_hdr.mx_sb_len = 0;
-	io_hdr.dxfer_direction = SG_DXFER_TO_DEV;
+	io_hdr.sbp = res->sense;
+	io_hdr.mx_sb_len = sizeof(res->sense);
+	io_hdr.dxfer_direction = (dir == SCSI_DIR_WRITE) ? SG_DXFER_TO_DEV : SG_DXFER_FROM_DEV;
 	io_hdr.dxferp = buf;
 	io_hdr.dxfer_len = buf_len;
-	/* 5000ms should be enough */
-	io_hdr.timeout = 5000;
+	io_hdr.timeout = timeout_ms;
 
 	if (verbose) {
 		fprintf(stdout, "Sending SCSI command: ");
@@ -94,36 +218,23 @@ int scsi_send_commandw(int dev, unsigned char *cmd, int cmd_len, unsigned char *
 			fprintf(stdout, "%02x ", (unsigned char) io_hdr.cmdp[i]);
 		}
 		fprintf(stdout, "\n");
-		fprintf(stdout, "Data to device (%d bytes):\n", buf_len);
-		for (i = 0; i < buf_len; i += 16) {
-			int j;
-			fprintf(stdout, "  %04x: ", i);
-
-			// Hex part
-			for (j = 0; j < 16; ++j) {
-				if (i + j < buf_len) {
-					fprintf(stdout, "%02x ", buf[i + j]);
-				} else {
-					fprintf(stdout, "   "); // padding
-				}
-			}
-
-			fprintf(stdout, " |");
-
-			// ASCII part
-			for (j = 0; j < 16; ++j) {
-				if (i + j < buf_len) {
-					unsigned char c = buf[i + j];
-					fprintf(stdout, "%c", (c >= 32 && c <= 126) ? c : '.');
-				}
-			}
-
-			fprintf(stdout, "|\n");
-		}
 	}
 
-	if (ioctl(dev, SG_IO, &io_hdr) < 0)
+	if (ioctl(dev, SG_IO, &io_hdr) < 0) {
+		res->os_error = errno;
+		return 1;
+	}
+
+	res->status = io_hdr.status;
+	res->host_status = io_hdr.host_status;
+	res->driver_status = io_hdr.driver_status;
+	res->sense_len = io_hdr.sb_len_wr;
+	res->transport = linux_transport(&io_hdr);
+
+	if (res->transport != SCSI_XPORT_OK || res->status != SCSI_STATUS_GOOD) {
+		errno = EIO;
 		return 1;
+	}
 
 	return 0;
 }
@@ -132,7 +243,7 @@ int scsi_send_commandw(int dev, unsigned char *cmd, int cmd_len, unsigned char *
  * Extract the SCSI ID from a /dev/sgX device path.
  * Returns: SCSI ID on success, -1 on failure.
  */
-int path_to_devnum(const char *path) {
+static int linux_devnum(const char *path) {
 	struct sg_scsi_id scsi_id;
 	int fd;
 
@@ -163,6 +274,97 @@ int path_to_devnum(const char *path) {
 	return scsi_id.scsi_id;
 }
 
+/* Read a sysfs attribute, trailing whitespace stripped */
+static void read_sysfs_attr(const char *dir, const char *attr, char *out, size_t out_len)
+{
+	char path[320];
+	FILE *fd;
+	size_t len;
+
+	out[0] = '\0';
+	snprintf(path, sizeof(path), "%s/%s", dir, attr);
+	fd = fopen(path, "r");
+	if (fd == NULL)
+		return;
+	if (fgets(out, out_len, fd) == NULL)
+		out[0] = '\0';
+	fclose(fd);
+
+	len = strlen(out);
+	while (len > 0 && (out[len - 1] == '\n' || out[len - 1] == ' '))
+		out[--len] = '\0';
+}
+
+/*
+ * Identity of /dev/sgN from sysfs: host:channel:target:lun of the device
+ * it is bound to, plus the INQUIRY strings the kernel cached at scan time.
+ */
+static int linux_identity(const char *path, char *out, size_t out_len)
+{
+	char sys_path[256];
+	char link[256];
+	char vendor[32], model[32], rev[16];
+	const char *node;
+	const char *hctl;
+	ssize_t n;
+
+	node = strrchr(path, '/');
+	node = node != NULL ? node + 1 : path;
+
+	snprintf(sys_path, sizeof(sys_path), "/sys/class/scsi_generic/%s/device", node);
+	n = readlink(sys_path, link, sizeof(link) - 1);
+	if (n < 0)
+		return -1;
+	link[n] = '\0';
+	hctl = strrchr(link, '/');
+	hctl = hctl != NULL ? hctl + 1 : link;
+
+	read_sysfs_attr(sys_path, "vendor", vendor, sizeof(vendor));
+	read_sysfs_attr(sys_path, "model", model, sizeof(model));
+	read_sysfs_attr(sys_path, "rev", rev, sizeof(rev));
+	snprintf(out, out_len, "%s %s/%s/%s", hctl, vendor, model, rev);
+	return 0;
+}
+
+scsi_transport os_transport = {
+	"linux",
+	NULL,
+	linux_open,
+	linux_close,
+	linux_send,
+	linux_devnum,
+	linux_identity
+};
+
+static int cmp_sg(const void *a, const void *b)
+{
+	return atoi((const char *)a + 7) - atoi((const char *)b + 7);
+}
+
+/* Every /dev/sgN node, in numeric order */
+int scsi_list_paths(char (*paths)[SCSI_PATH_LEN], int max)
+{
+	DIR *dir;
+	struct dirent *entry;
+	int n = 0;
+
+	dir = opendir("/dev");
+	if (dir == NULL)
+		return 0;
+	while ((entry = readdir(dir)) != NULL && n < max) {
+		if (strncmp(entry->d_name, "sg", 2) != 0 ||
+		    entry->d_name[2] < '0' || entry->d_name[2] > '9')
+			continue;
+		/* A name too long for a path slot can't be a real sg node */
+		if (snprintf(paths[n], SCSI_PATH_LEN, "/dev/%s", entry->d_name) < SCSI_PATH_LEN)
+			n++;
+	}
+	closedir(dir);
+
+	qsort(paths, n, SCSI_PATH_LEN, cmp_sg);
+	return n;
+}
+
 /*
  * Resolves a Linux network interface name to its SCSI generic node (/dev/sgX).
  * Returns 0 on success, -1 if the exact interface or SCSI node does not exist.
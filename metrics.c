@@ -0,0 +1,130 @@
+/*
+ * Prometheus text format metrics files, see metrics.h
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "cmdstats.h"
+#include "metrics.h"
+
+static const double quantiles[] = { 0.5, 0.9, 0.99 };
+
+FILE *metrics_begin(const char *path, char *tmp, size_t tmp_len)
+{
+	FILE *f;
+
+	snprintf(tmp, tmp_len, "%s.tmp", path);
+	if ((f = fopen(tmp, "w")) == NULL)
+		fprintf(stderr, "Error: can't write metrics to %s\n", tmp);
+	return f;
+}
+
+int metrics_end(FILE *f, const char *tmp, const char *path)
+{
+	if (ferror(f) || fclose(f) != 0 || rename(tmp, path) != 0) {
+		fprintf(stderr, "Error: can't write metrics to %s\n", path);
+		remove(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+void metrics_family(FILE *f, const char *name, const char *type, const char *help)
+{
+	fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void metrics_quote(FILE *f, const char *value)
+{
+	fputc('"', f);
+	for (; *value != '\0'; value++) {
+		if (*value == '\\' || *value == '"')
+			fprintf(f, "\\%c", *value);
+		else if (*value == '\n')
+			fputs("\\n", f);
+		else
+			fputc(*value, f);
+	}
+	fputc('"', f);
+}
+
+/* PREFIX_NAME{device="...",opcode="..." ... */
+static void op_sample(FILE *f, const char *prefix, const char *name, const char *device,
+		const char *opcode)
+{
+	fprintf(f, "%s_%s{device=", prefix, name);
+	metrics_quote(f, device);
+	fprintf(f, ",opcode=");
+	metrics_quote(f, opcode);
+}
+
+void metrics_commands(FILE *f, const char *prefix, const char *device)
+{
+	cmdstats_op ops[CMDSTATS_MAX_OPS];
+	cmdstats_total t;
+	char name[64];
+	int n, i, q;
+
+	if (!cmdstats_enabled)
+		return;
+	n = cmdstats_ops(ops, CMDSTATS_MAX_OPS);
+	cmdstats_totals(&t);
+
+	snprintf(name, sizeof(name), "%s_commands_total", prefix);
+	metrics_family(f, name, "counter", "SCSI commands issued, by opcode.");
+	for (i = 0; i < n; i++) {
+		op_sample(f, prefix, "commands_total", device, ops[i].name);
+		fprintf(f, "} %lu\n", ops[i].count);
+	}
+
+	snprintf(name, sizeof(name), "%s_command_errors_total", prefix);
+	metrics_family(f, name, "counter", "SCSI commands that failed, by opcode.");
+	for (i = 0; i < n; i++) {
+		op_sample(f, prefix, "command_errors_total", device, ops[i].name);
+		fprintf(f, "} %lu\n", ops[i].errors);
+	}
+
+	snprintf(name, sizeof(name), "%s_command_bytes_total", prefix);
+	metrics_family(f, name, "counter", "Data moved by commands that worked, by opcode.");
+	for (i = 0; i < n; i++) {
+		op_sample(f, prefix, "command_bytes_total", device, ops[i].name);
+		fprintf(f, "} %llu\n", ops[i].bytes);
+	}
+
+	snprintf(name, sizeof(name), "%s_command_latency_seconds", prefix);
+	metrics_family(f, name, "summary", "SCSI command latency, by opcode.");
+	for (i = 0; i < n; i++) {
+		for (q = 0; q < (int)(sizeof(quantiles) / sizeof(quantiles[0])); q++) {
+			op_sample(f, prefix, "command_latency_seconds", device, ops[i].name);
+			fprintf(f, ",quantile=\"%g\"} %.6f\n", quantiles[q],
+				cmdstats_percentile(&ops[i], quantiles[q]) / 1000000.0);
+		}
+		op_sample(f, prefix, "command_latency_seconds_sum", device, ops[i].name);
+		fprintf(f, "} %.6f\n", ops[i].total_us / 1000000.0);
+		op_sample(f, prefix, "command_latency_seconds_count", device, ops[i].name);
+		fprintf(f, "} %lu\n", ops[i].count);
+	}
+
+	snprintf(name, sizeof(name), "%s_command_latency_max_seconds", prefix);
+	metrics_family(f, name, "gauge", "Slowest SCSI command of the run, by opcode.");
+	for (i = 0; i < n; i++) {
+		op_sample(f, prefix, "command_latency_max_seconds", device, ops[i].name);
+		fprintf(f, "} %.6f\n", ops[i].max_us / 1000000.0);
+	}
+
+	snprintf(name, sizeof(name), "%s_bus_bytes_total", prefix);
+	metrics_family(f, name, "counter", "Data moved over the SCSI bus, by direction.");
+	fprintf(f, "%s_bus_bytes_total{device=", prefix);
+	metrics_quote(f, device);
+	fprintf(f, ",direction=\"in\"} %llu\n", t.bytes_in);
+	fprintf(f, "%s_bus_bytes_total{device=", prefix);
+	metrics_quote(f, device);
+	fprintf(f, ",direction=\"out\"} %llu\n", t.bytes_out);
+
+	snprintf(name, sizeof(name), "%s_bus_seconds_total", prefix);
+	metrics_family(f, name, "counter", "Time spent in SCSI commands.");
+	fprintf(f, "%s_bus_seconds_total{device=", prefix);
+	metrics_quote(f, device);
+	fprintf(f, "} %.6f\n", t.bus_us / 1000000.0);
+}
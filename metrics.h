@@ -0,0 +1,33 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+/*
+ * Metrics files in the Prometheus text format, for node_exporter's
+ * textfile collector and anything else that scrapes OpenMetrics.
+ *
+ * A file is written to FILE.tmp and renamed over FILE, so a collector
+ * never sees half of one.  Counters start from zero with each process;
+ * the scraper sees a reset when a new run replaces the file.
+ */
+
+#include <stdio.h>
+
+#define METRICS_PERIOD_US  15000000	/* Between files in long running modes */
+
+FILE *metrics_begin(const char *path, char *tmp, size_t tmp_len);
+int metrics_end(FILE *f, const char *tmp, const char *path);
+
+/* # HELP and # TYPE lines for a family */
+void metrics_family(FILE *f, const char *name, const char *type, const char *help);
+
+/* A label value in quotes, escaped */
+void metrics_quote(FILE *f, const char *value);
+
+/*
+ * The cmdstats counters (see cmdstats.h) as PREFIX_commands_total,
+ * PREFIX_command_errors_total, PREFIX_command_latency_seconds and so on,
+ * labelled with device.  Nothing unless cmdstats is collecting.
+ */
+void metrics_commands(FILE *f, const char *prefix, const char *device);
+
+#endif
@@ -0,0 +1,477 @@
+/*
+ * The bstoolbox modes on top of libbstoolbox, shared by the CLI and
+ * bstoolboxd: one call per mode, printing results the way bstoolbox
+ * always has.
+ */
+#include <ctype.h>
+#include <fnmatch.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+
+#include "bstoolbox.h"
+#include "transport.h"
+#include "cmdstats.h"
+#include "metrics.h"
+#include "libbstoolbox.h"
+
+static int print_files(bs_ctx *c)
+{
+	bs_file list[BS_MAX_FILES];
+	int n, i;
+
+	if ((n = bs_list(c, list, BS_MAX_FILES)) < 0)
+		return -1;
+	for (i = 0; i < n; i++)
+		fprintf (stdout, "#%i %s %llu bytes\n", list[i].index, list[i].name, list[i].size);
+	return 0;
+}
+
+static int print_cds(bs_ctx *c)
+{
+	bs_file list[BS_MAX_FILES];
+	int n, i;
+
+	if ((n = bs_list_cds(c, list, BS_MAX_FILES)) < 0)
+		return -1;
+	fprintf (stdout, "Found %i CDs\n", n);
+	for (i = 0; i < n; i++)
+		fprintf (stdout, "#%i %s\n", list[i].index, list[i].name);
+	fprintf (stdout, "\n");
+	return 0;
+}
+
+static int print_wdir(bs_ctx *c)
+{
+	char wdir[256];
+
+	if (bs_get_wdir(c, wdir, sizeof(wdir)) != 0)
+		return -1;
+	fprintf (stdout, "BlueSCSI working directory: %s\n", wdir);
+	return 0;
+}
+
+static int all_digits(const char *s, const char *end)
+{
+	if (s == end)
+		return 0;
+	for (; s < end; s++)
+		if (!isdigit((unsigned char)*s))
+			return 0;
+	return 1;
+}
+
+/*
+ * Mark the files one item of a -D spec names: an exact name, an index, a
+ * range lo-hi or a name pattern.  Patterns pass over directories, and an
+ * index or range that takes one in is refused.  Returns -1 if it names
+ * nothing in the listing, or a directory.
+ */
+static int select_item(char *item, bs_file *list, int n, char *sel)
+{
+	char *dash = strchr(item, '-');
+	int lo, hi, i, found = 0;
+
+	for (i = 0; i < n; i++) {
+		if (strcmp(item, list[i].name) == 0) {
+			if (list[i].type == BS_FILE_DIR) {
+				fprintf(stderr, "Error: %s is a directory\n", item);
+				return -1;
+			}
+			sel[i] = 1;
+			return 0;
+		}
+	}
+
+	if (all_digits(item, item + strlen(item)) ||
+	    (dash != NULL && all_digits(item, dash) && all_digits(dash + 1, dash + strlen(dash)))) {
+		lo = atoi(item);
+		hi = dash != NULL && all_digits(item, dash) ? atoi(dash + 1) : lo;
+		if (lo > hi || hi >= n) {
+			fprintf(stderr, "Error: no file #%s, the directory has %d files\n", item, n);
+			return -1;
+		}
+		for (i = lo; i <= hi; i++) {
+			if (list[i].type == BS_FILE_DIR) {
+				fprintf(stderr, "Error: #%d %s is a directory\n", i, list[i].name);
+				return -1;
+			}
+		}
+		for (i = lo; i <= hi; i++)
+			sel[i] = 1;
+		return 0;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (list[i].type != BS_FILE_DIR && fnmatch(item, list[i].name, 0) == 0) {
+			sel[i] = 1;
+			found = 1;
+		}
+	}
+	if (!found) {
+		fprintf(stderr, "Error: no file matches %s\n", item);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * -D: remove the files named by a comma separated list of indices, ranges
+ * and patterns, all resolved against one listing before anything goes.
+ */
+static int remove_files(bs_ctx *c, const char *spec)
+{
+	bs_file list[BS_MAX_FILES];
+	char sel[BS_MAX_FILES];
+	int pick[BS_MAX_FILES];
+	char buf[1024];
+	char *item, *next;
+	int n, k, i, done;
+	int quiet;
+
+	if ((n = bs_list(c, list, BS_MAX_FILES)) < 0)
+		return -1;
+
+	memset(sel, 0, sizeof(sel));
+	snprintf(buf, sizeof(buf), "%s", spec);
+	for (item = buf; item != NULL; item = next) {
+		if ((next = strchr(item, ',')) != NULL)
+			*next++ = '\0';
+		if (*item == '\0')
+			continue;
+		if (select_item(item, list, n, sel) != 0)
+			return -1;
+	}
+
+	/* Highest first, the order bs_remove_many() takes them in */
+	for (k = 0, i = n - 1; i >= 0; i--)
+		if (sel[i])
+			pick[k++] = list[i].index;
+	if (k == 0) {
+		fprintf(stderr, "Error: nothing to remove\n");
+		return -1;
+	}
+
+	done = bs_remove_many(c, pick, k);
+	quiet = all_digits(spec, spec + strlen(spec));
+	for (i = 0; !quiet && i < done; i++)
+		fprintf (stdout, "Removed #%i %s\n", pick[i], list[pick[i]].name);
+	return done == k ? 0 : -1;
+}
+
+static const char *metrics_path = NULL;
+static const char *metrics_dev;
+static int metrics_ret;			/* Of the last request */
+static time_t metrics_time;
+
+/* --metrics FILE: counters from here on, written by bluescsi_metrics_write() */
+void bluescsi_metrics_start(const char *path, const char *devpath)
+{
+	metrics_path = path;
+	metrics_dev = devpath;
+	metrics_ret = 0;
+	metrics_time = time(NULL);
+	if (!cmdstats_enabled)
+		cmdstats_start();
+}
+
+static void metric_dev(FILE *f, const char *name, const char *extra, unsigned long long v)
+{
+	fprintf(f, "%s{device=", name);
+	metrics_quote(f, metrics_dev);
+	fprintf(f, "%s} %llu\n", extra, v);
+}
+
+static void device_metrics(FILE *f, bs_ctx *c)
+{
+	static const struct {
+		int bit;
+		const char *label;
+	} caps[] = {
+		{ BS_CAP_LARGE_TRANSFERS, ",capability=\"large_transfers\"" },
+		{ BS_CAP_LARGE_SEND,      ",capability=\"large_send\"" },
+		{ BS_CAP_SET_WORKING_DIR, ",capability=\"set_working_dir\"" }
+	};
+	bs_device d;
+	bs_stats st;
+	int i;
+
+	if (bs_device_info(c, &d) == 0) {
+		metrics_family(f, "bstoolbox_device_info", "gauge", "INQUIRY strings of the BlueSCSI.");
+		fprintf(f, "bstoolbox_device_info{device=");
+		metrics_quote(f, metrics_dev);
+		fprintf(f, ",vendor=");
+		metrics_quote(f, d.vendor);
+		fprintf(f, ",product=");
+		metrics_quote(f, d.product);
+		fprintf(f, ",revision=");
+		metrics_quote(f, d.rev);
+		fprintf(f, "} 1\n");
+		metrics_family(f, "bstoolbox_device_api_version", "gauge", "Toolbox API version from INQUIRY.");
+		metric_dev(f, "bstoolbox_device_api_version", "", d.api_ver);
+		metrics_family(f, "bstoolbox_device_metadata_api_version", "gauge",
+			"Toolbox metadata API version, 0 on older firmware.");
+		metric_dev(f, "bstoolbox_device_metadata_api_version", "", d.meta_api);
+		metrics_family(f, "bstoolbox_device_capability", "gauge", "Toolbox capabilities the firmware reports.");
+		for (i = 0; i < (int)(sizeof(caps) / sizeof(caps[0])); i++)
+			metric_dev(f, "bstoolbox_device_capability", caps[i].label, (d.caps & caps[i].bit) != 0);
+	}
+
+	bs_get_stats(c, &st);
+	metrics_family(f, "bstoolbox_transfer_bytes_total", "counter", "File data moved by -g and -p, by direction.");
+	metric_dev(f, "bstoolbox_transfer_bytes_total", ",direction=\"in\"", st.bytes_in);
+	metric_dev(f, "bstoolbox_transfer_bytes_total", ",direction=\"out\"", st.bytes_out);
+	metrics_family(f, "bstoolbox_transfer_files_total", "counter", "Completed -g and -p, by direction.");
+	metric_dev(f, "bstoolbox_transfer_files_total", ",direction=\"in\"", st.files_in);
+	metric_dev(f, "bstoolbox_transfer_files_total", ",direction=\"out\"", st.files_out);
+	metrics_family(f, "bstoolbox_transfer_seconds_total", "counter", "Time spent in -g and -p.");
+	fprintf(f, "bstoolbox_transfer_seconds_total{device=");
+	metrics_quote(f, metrics_dev);
+	fprintf(f, "} %.6f\n", st.xfer_us / 1000000.0);
+	metrics_family(f, "bstoolbox_cd_switches_total", "counter", "CD changes.");
+	metric_dev(f, "bstoolbox_cd_switches_total", "", st.cd_switches);
+}
+
+/*
+ * Replace the --metrics file with the counters so far and how the last
+ * request went: ret as from bluescsi_run(), or -1 to refresh the counters
+ * and keep the last result.  c may be NULL if the device couldn't be
+ * opened.
+ */
+void bluescsi_metrics_write(bs_ctx *c, int ret)
+{
+	char tmp[1100];
+	FILE *f;
+
+	if (metrics_path == NULL)
+		return;
+	if (ret >= 0) {
+		metrics_ret = ret;
+		metrics_time = time(NULL);
+	}
+	if ((f = metrics_begin(metrics_path, tmp, sizeof(tmp))) == NULL)
+		return;
+
+	metrics_family(f, "bstoolbox_last_run_success", "gauge", "Whether the last request worked.");
+	metric_dev(f, "bstoolbox_last_run_success", "", metrics_ret == 0);
+	metrics_family(f, "bstoolbox_last_run_timestamp_seconds", "gauge", "When the last request ended.");
+	metric_dev(f, "bstoolbox_last_run_timestamp_seconds", "", (unsigned long long)metrics_time);
+	if (c != NULL)
+		device_metrics(f, c);
+	metrics_commands(f, "bstoolbox", metrics_dev);
+	metrics_end(f, tmp, metrics_path);
+}
+
+#define FOLLOW_POLL_MS   500
+#define FOLLOW_TAIL      4096	/* Show this much of the log first */
+
+static volatile sig_atomic_t follow_stop;
+static void (*chain_int)(int);
+static void (*chain_term)(int);
+
+static void on_follow_signal(int sig)
+{
+	void (*chain)(int) = sig == SIGINT ? chain_int : chain_term;
+
+	follow_stop = 1;
+	if (chain != SIG_DFL && chain != SIG_IGN)
+		chain(sig);
+}
+
+/*
+ * Sleep between polls, returning early with 1 once whoever reads our
+ * output has gone (the end of a pipe).
+ */
+static int follow_wait(void)
+{
+	struct pollfd pfd;
+
+	pfd.fd = fileno(stdout);
+	pfd.events = 0;
+	pfd.revents = 0;
+	if (poll(&pfd, 1, FOLLOW_POLL_MS) > 0 && (pfd.revents & (POLLHUP | POLLERR)))
+		return 1;
+	return 0;
+}
+
+/* -L -f: stream what gets appended to log.txt until interrupted */
+static int follow_log(bs_ctx *c)
+{
+	struct sigaction sa, old_int, old_term;
+	unsigned long long size, offset, metrics_us = 0, now;
+	int ret = 0;
+
+	if (bs_log_begin(c, &size) != 0)
+		return -1;
+	offset = size > FOLLOW_TAIL ? size - FOLLOW_TAIL : 0;
+
+	/* bstoolboxd has its own handlers, which still need to see the signal */
+	follow_stop = 0;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_follow_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, NULL, &old_int);
+	sigaction(SIGTERM, NULL, &old_term);
+	chain_int = old_int.sa_handler;
+	chain_term = old_term.sa_handler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	while (!follow_stop) {
+		if (bs_log_read(c, &offset, stdout) != 0) {
+			ret = -1;
+			break;
+		}
+		if (fflush(stdout) != 0 || follow_wait())
+			break;
+		now = scsi_now_us();
+		if (metrics_path != NULL && now - metrics_us >= METRICS_PERIOD_US) {
+			bluescsi_metrics_write(c, -1);
+			metrics_us = now;
+		}
+	}
+
+	sigaction(SIGINT, &old_int, NULL);
+	sigaction(SIGTERM, &old_term, NULL);
+	if (bs_log_end(c) != 0)
+		ret = -1;
+	return ret;
+}
+
+#define PROGRESS_DELAY_US  1000000	/* Quiet for transfers shorter than this */
+#define PROGRESS_TTY_US    250000
+#define PROGRESS_LOG_US    5000000	/* Between lines when stderr isn't a terminal */
+
+/* -g and -p progress on stderr, see show_progress() */
+typedef struct {
+	int tty;
+	int shown;
+	unsigned long long start_us;
+	unsigned long long last_us;	/* Last line */
+	unsigned long long last_done;
+	double rate;			/* Recent bytes/s, smoothed */
+	int width;			/* Of the line on the terminal */
+} progress_state;
+
+static void format_eta(char *out, size_t out_len, double secs)
+{
+	unsigned long s;
+
+	/* Beyond a few days it is a stall, not an estimate */
+	if (!(secs < 100 * 3600.0)) {
+		snprintf(out, out_len, "--:--");
+		return;
+	}
+	s = (unsigned long)(secs + 0.5);
+	if (s >= 3600)
+		snprintf(out, out_len, "%lu:%02lu:%02lu", s / 3600, s / 60 % 60, s % 60);
+	else
+		snprintf(out, out_len, "%lu:%02lu", s / 60, s % 60);
+}
+
+/*
+ * Progress callback.  On a terminal one line is redrawn a few times a
+ * second; otherwise a key=value line goes out every few seconds for logs
+ * and scripts.  Nothing shows for transfers that finish within a second.
+ */
+static void show_progress(void *arg, const char *name, unsigned long long done,
+		unsigned long long total)
+{
+	progress_state *p = arg;
+	unsigned long long now = scsi_now_us();
+	double avg, secs, eta;
+	char eta_buf[24];		/* Fits any %lu:%02lu:%02lu */
+	char line[256];
+	int len;
+
+	if (now - p->start_us < PROGRESS_DELAY_US && (done < total || !p->shown))
+		return;
+	if (done < total && now - p->last_us < (unsigned long long)(p->tty ? PROGRESS_TTY_US : PROGRESS_LOG_US))
+		return;
+
+	if (now > p->last_us && done >= p->last_done) {
+		secs = (now - p->last_us) / 1000000.0;
+		avg = (done - p->last_done) / secs;
+		p->rate = p->rate > 0 ? p->rate + (avg - p->rate) / 4 : avg;
+	}
+	secs = (now - p->start_us) / 1000000.0;
+	avg = secs > 0 ? done / secs : 0;
+	eta = p->rate > 0 ? (total - done) / p->rate : 0;
+	format_eta(eta_buf, sizeof(eta_buf), eta);
+
+	if (p->tty) {
+		len = snprintf(line, sizeof(line), "%s: %.1f/%.1f MB %3d%%  %.2f MB/s (avg %.2f)  ETA %s",
+			name, done / 1000000.0, total / 1000000.0, total ? (int)(done * 100 / total) : 100,
+			p->rate / 1000000.0, avg / 1000000.0, eta_buf);
+		fprintf(stderr, "\r%s%*s%s", line, p->width > len ? p->width - len : 0, "",
+			done < total ? "" : "\n");
+		p->width = len;
+	}
+	else
+		fprintf(stderr, "progress file=%s bytes=%llu total=%llu rate=%.0f avg=%.0f eta=%.0f\n",
+			name, done, total, p->rate, avg, eta);
+	p->shown = 1;
+	p->last_us = now;
+	p->last_done = done;
+}
+
+static int transfer(bs_ctx *c, int file, const char *path)
+{
+	progress_state p;
+	int ret;
+
+	memset(&p, 0, sizeof(p));
+	p.tty = isatty(fileno(stderr));
+	p.start_us = scsi_now_us();
+	p.last_us = p.start_us;
+	bs_set_progress(c, show_progress, &p);
+	if (file != NOT_ACTIVE)
+		ret = bs_get(c, file, path);
+	else
+		ret = bs_put(c, path);
+	bs_set_progress(c, NULL, NULL);
+	if (p.tty && p.shown && ret != 0)
+		fprintf(stderr, "\n");
+	return ret;
+}
+
+/*
+ * Carry out one bstoolbox mode on an open context.  Returns 0 on
+ * success, 1 on failure.
+ */
+int bluescsi_run(bs_ctx *c, int mode, int cd_img, int file, const char *outdir)
+{
+	int ret = 0;
+
+	if (mode == MODE_CD)
+		ret = print_cds(c);
+	else if (mode == MODE_INQUIRY)
+		ret = bs_inquiry(c, PRINT_ON);
+	else if (mode == MODE_DEBUG)
+		ret = bs_set_debug(c, file);
+	else if (mode == MODE_SHARED)
+		ret = print_files(c);
+	else if (mode == MODE_PUT)
+		ret = transfer(c, NOT_ACTIVE, outdir);
+	else if (mode == MODE_GET_WDIR)
+		ret = print_wdir(c);
+	else if (mode == MODE_SET_WDIR)
+		ret = bs_set_wdir(c, outdir);
+	else if (mode == MODE_REMOVE_FILE && outdir[0] != '\0')
+		ret = remove_files(c, outdir);
+	else if (mode == MODE_REMOVE_FILE)
+		ret = bs_remove(c, file);
+	else if (mode == MODE_GET_LOG)
+		ret = bs_get_log(c, outdir, stdout);
+	else if (mode == MODE_FOLLOW_LOG)
+		ret = follow_log(c);
+	else if (file != NOT_ACTIVE)
+		ret = transfer(c, file, outdir);
+	else if (cd_img == CD_BY_NAME)
+		ret = bs_set_cd_name(c, outdir);
+	else if (cd_img != NOT_ACTIVE)
+		ret = bs_set_cd(c, cd_img);
+
+	bluescsi_metrics_write(c, ret != 0);
+	return ret != 0;
+}
@@ -1,10 +1,43 @@
+#ifndef OS_H
+#define OS_H
+
+#include <stddef.h>
+
 int scsi_open(char *path, int readonly);
 int scsi_send_command(int dev, unsigned char *cmd, int cmd_len, unsigned char *buf, int buf_len);
 int scsi_send_commandw(int dev, unsigned char *cmd, int cmd_len, unsigned char *buf, int buf_len);
 int scsi_close(int dev);
 
+/* Error classes for the last command on a handle, see scsi_classify() */
+enum {
+	SCSI_CLASS_OK,
+	SCSI_CLASS_UNIT_ATTENTION,
+	SCSI_CLASS_BUSY,
+	SCSI_CLASS_TRANSPORT,
+	SCSI_CLASS_TIMEOUT,
+	SCSI_CLASS_FATAL
+};
+
+int scsi_last_class(int dev);
+int scsi_class_retryable(int cls);
+const char *scsi_class_name(int cls);
+unsigned long scsi_reset_count(int dev);
+void scsi_session_trust(int dev);
+
 int path_to_devnum(const char *path);
+
+/*
+ * Discovery helpers.  scsi_list_paths() fills in the OS device nodes that
+ * may have a target behind them.  scsi_identity() describes what is behind
+ * a path without any bus traffic (sysfs, hinv), so cached probe results
+ * can be trusted until it changes; -1 if the transport can't tell.
+ */
+#define SCSI_PATH_LEN 256
+int scsi_list_paths(char (*paths)[SCSI_PATH_LEN], int max);
+int scsi_identity(const char *path, char *out, size_t out_len);
 int get_scsi_path_for_iface(const char *ifname, char *out_path, size_t path_len);
 
-int mediad_start(void); //Helper functions to start and stop the removable device damons
-int mediad_stop(void);
+int mediad_start(const char *path); //Helper functions to start and stop the removable device damons
+int mediad_stop(const char *path);
+
+#endif
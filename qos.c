@@ -0,0 +1,135 @@
+/*
+ * Transfer pacing, see qos.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "qos.h"
+#include "transport.h"
+
+static void qos_sleep(qos_state *q, unsigned long long us)
+{
+	if (us == 0)
+		return;
+	q->slept_us += us;
+	while (us > 0) {
+		/* usleep() may refuse a second or more */
+		unsigned long step = us > 500000 ? 500000 : (unsigned long)us;
+
+		usleep(step);
+		us -= step;
+	}
+}
+
+/* "64K", "2M", "100000" -> bytes/s */
+int qos_parse_rate(const char *s, double *rate)
+{
+	char *end;
+	double v;
+
+	v = strtod(s, &end);
+	if (end == s || v <= 0)
+		return -1;
+	if (*end == 'k' || *end == 'K')
+		v *= 1024;
+	else if (*end == 'm' || *end == 'M')
+		v *= 1024 * 1024;
+	else if (*end != '\0')
+		return -1;
+	*rate = v;
+	return 0;
+}
+
+/* "ON/OFF" in milliseconds */
+int qos_parse_duty(const char *s, int *on_ms, int *off_ms)
+{
+	if (sscanf(s, "%d/%d", on_ms, off_ms) != 2 || *on_ms <= 0 || *off_ms < 0)
+		return -1;
+	return 0;
+}
+
+void qos_init(qos_state *q)
+{
+	q->enabled = q->rate > 0 || q->duty_on_ms > 0 || q->nice > 0;
+	if (q->nice > QOS_NICE_MAX)
+		q->nice = QOS_NICE_MAX;
+
+	q->burst = q->rate * QOS_BURST_SECS;
+	if (q->burst < QOS_MIN_BURST)
+		q->burst = QOS_MIN_BURST;
+	q->tokens = q->burst;
+	q->refill_us = 0;
+	q->duty_start_us = 0;
+	q->base_us_per_kb = 0;
+	q->slept_us = 0;
+}
+
+/* Wait until the next chunk of 'bytes' may go out */
+void qos_begin(qos_state *q, int bytes)
+{
+	unsigned long long now;
+
+	if (!q->enabled)
+		return;
+
+	now = scsi_now_us();
+	if (q->duty_on_ms > 0) {
+		if (q->duty_start_us == 0)
+			q->duty_start_us = now;
+		if (now - q->duty_start_us >= (unsigned long long)q->duty_on_ms * 1000) {
+			qos_sleep(q, (unsigned long long)q->duty_off_ms * 1000);
+			now = scsi_now_us();
+			q->duty_start_us = now;
+		}
+	}
+
+	if (q->rate > 0) {
+		if (q->refill_us != 0) {
+			q->tokens += (now - q->refill_us) * q->rate / 1000000.0;
+			if (q->tokens > q->burst)
+				q->tokens = q->burst;
+		}
+		q->refill_us = now;
+
+		/* Go into debt for the chunk and sleep it off */
+		q->tokens -= bytes;
+		if (q->tokens < 0) {
+			qos_sleep(q, (unsigned long long)(-q->tokens * 1000000.0 / q->rate));
+			now = scsi_now_us();
+			q->tokens = 0;
+			q->refill_us = now;
+		}
+	}
+
+	q->chunk_start_us = now;
+}
+
+/*
+ * Compare the chunk's service time per KB with the best seen lately.  A
+ * slower chunk means someone else is using the adapter, so give them
+ * nice times the extra time before the next chunk.
+ */
+void qos_end(qos_state *q, int bytes)
+{
+	double us_per_kb;
+	double excess_us;
+
+	if (!q->enabled || q->nice <= 0 || bytes <= 0)
+		return;
+
+	us_per_kb = (scsi_now_us() - q->chunk_start_us) * 1024.0 / bytes;
+	if (q->base_us_per_kb <= 0 || us_per_kb < q->base_us_per_kb) {
+		q->base_us_per_kb = us_per_kb;
+		return;
+	}
+	q->base_us_per_kb += (us_per_kb - q->base_us_per_kb) / QOS_BASELINE_DRIFT;
+
+	if (us_per_kb < q->base_us_per_kb * QOS_NICE_THRESHOLD)
+		return;
+	excess_us = (us_per_kb - q->base_us_per_kb) * bytes / 1024.0 * q->nice;
+	if (excess_us > QOS_NICE_MAX_DELAY_US)
+		excess_us = QOS_NICE_MAX_DELAY_US;
+	qos_sleep(q, (unsigned long long)excess_us);
+}
@@ -0,0 +1,47 @@
+#ifndef QOS_H
+#define QOS_H
+
+/*
+ * Pacing for the get and send loops, so a long transfer can share the bus
+ * with a system disk.  Three independent knobs:
+ *
+ *	--bwlimit=RATE  token bucket, RATE bytes/s (K and M suffixes allowed)
+ *	--duty=ON/OFF   transfer for ON ms, then leave the bus idle for OFF ms
+ *	--nice[=N]      back off by N times any rise in per-chunk service time
+ *	                over the best recently seen, i.e. when other traffic on
+ *	                the same adapter is slowing us down (N = 1..10)
+ *
+ * Callers bracket each data command with qos_begin()/qos_end().
+ */
+
+#define QOS_MIN_BURST        65536		/* Bucket holds at least one full chunk */
+#define QOS_BURST_SECS       0.1
+#define QOS_NICE_DEFAULT     5
+#define QOS_NICE_MAX         10
+#define QOS_NICE_THRESHOLD   1.25		/* Slowdown that counts as contention */
+#define QOS_NICE_MAX_DELAY_US 1000000
+#define QOS_BASELINE_DRIFT   64			/* Baseline creeps up by 1/64 of a slower sample */
+
+typedef struct {
+	double rate;		/* Bytes/s, 0 = unlimited */
+	int duty_on_ms;
+	int duty_off_ms;
+	int nice;
+
+	int enabled;
+	double burst;
+	double tokens;
+	unsigned long long refill_us;
+	unsigned long long duty_start_us;
+	unsigned long long chunk_start_us;
+	double base_us_per_kb;	/* Best recent service time */
+	unsigned long long slept_us;
+} qos_state;
+
+int qos_parse_rate(const char *s, double *rate);
+int qos_parse_duty(const char *s, int *on_ms, int *off_ms);
+void qos_init(qos_state *q);
+void qos_begin(qos_state *q, int bytes);
+void qos_end(qos_state *q, int bytes);
+
+#endif
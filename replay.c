@@ -0,0 +1,334 @@
+/*
+ * Record and replay of SCSI sessions
+ *
+ * Recording wraps whatever transport is in use: every command that goes
+ * through scsi_send_command()/scsi_send_commandw() is appended to the trace.
+ * Replay is selected with a device path of the form:
+ *
+ *	replay:FILE[,fast]
+ *
+ * Commands must arrive in the recorded order with the same CDB, direction,
+ * length and (for writes) payload digest.  The recorded status, data and
+ * latency are handed back; "fast" skips the latency sleeps.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "os.h"
+#include "transport.h"
+#include "replay.h"
+#include "checksum.h"
+
+#define REPLAY_HDR_LEN 8
+#define REPLAY_REC_LEN 24
+
+extern int verbose;
+
+int replay_recording = 0;
+static FILE *record_fd = NULL;
+
+typedef struct {
+	int in_use;
+	FILE *fd;
+	int fast;
+	unsigned long seq;
+} replay_dev;
+
+static replay_dev replay_devs[SCSI_MAX_HANDLES];
+
+static void put_be32(unsigned char *p, unsigned long v)
+{
+	p[0] = (unsigned char)(v >> 24);
+	p[1] = (unsigned char)(v >> 16);
+	p[2] = (unsigned char)(v >> 8);
+	p[3] = (unsigned char)v;
+}
+
+static unsigned long get_be32(const unsigned char *p)
+{
+	return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16) |
+		((unsigned long)p[2] << 8) | p[3];
+}
+
+static unsigned int digest(const unsigned char *buf, int len)
+{
+	if (buf == NULL || len <= 0)
+		return 0;
+	return crc32c_final(crc32c_update(crc32c_init(), buf, len));
+}
+
+/*
+ * Header: magic[4], version, SCSI ID of the recorded device, 2 reserved
+ */
+int replay_record_start(const char *trace, const char *devpath)
+{
+	unsigned char hdr[REPLAY_HDR_LEN];
+	int id;
+
+	record_fd = fopen(trace, "wb");
+	if (record_fd == NULL) {
+		fprintf(stderr, "Error: couldn't create trace %s - %s\n", trace, strerror(errno));
+		return -1;
+	}
+
+	id = path_to_devnum(devpath);
+
+	memset(hdr, 0, sizeof(hdr));
+	memcpy(hdr, REPLAY_MAGIC, 4);
+	hdr[4] = REPLAY_VERSION;
+	hdr[5] = (unsigned char)(id < 0 ? 0xFF : id);
+	fwrite(hdr, 1, sizeof(hdr), record_fd);
+
+	replay_recording = 1;
+	return 0;
+}
+
+void replay_record_stop(void)
+{
+	if (record_fd != NULL && fclose(record_fd) != 0)
+		fprintf(stderr, "Warning: error writing trace - %s\n", strerror(errno));
+	record_fd = NULL;
+	replay_recording = 0;
+}
+
+/*
+ * Record: cdb_len, dir, failed, SCSI status, data_len, latency_us, crc32c,
+ * payload_len, sense key, ASC, ASCQ, transport outcome, then the CDB and
+ * any payload from the device.
+ */
+void replay_record(const unsigned char *cmd, int cmd_len, const unsigned char *buf, int buf_len,
+		int dir, int ret, const scsi_result *res, unsigned long long latency_us)
+{
+	unsigned char rec[REPLAY_REC_LEN];
+	int payload_len;
+	int key, asc, ascq;
+
+	if (record_fd == NULL)
+		return;
+	if (cmd_len > REPLAY_MAX_CDB)
+		cmd_len = REPLAY_MAX_CDB;
+	if (buf == NULL)
+		buf_len = 0;
+
+	payload_len = (dir == SCSI_DIR_READ && ret == 0) ? buf_len : 0;
+
+	memset(rec, 0, sizeof(rec));
+	rec[0] = (unsigned char)cmd_len;
+	rec[1] = (unsigned char)dir;
+	rec[2] = ret == 0 ? 0 : 1;
+	rec[3] = (unsigned char)res->status;
+	put_be32(&rec[4], (unsigned long)buf_len);
+	put_be32(&rec[8], (unsigned long)(latency_us > 0xFFFFFFFFULL ? 0xFFFFFFFFULL : latency_us));
+	put_be32(&rec[12], digest(buf, buf_len));
+	put_be32(&rec[16], (unsigned long)payload_len);
+	scsi_sense_fields(res, &key, &asc, &ascq);
+	rec[20] = (unsigned char)key;
+	rec[21] = (unsigned char)asc;
+	rec[22] = (unsigned char)ascq;
+	rec[23] = (unsigned char)res->transport;
+
+	/* Keep the record in one piece if several handles are busy at once */
+	flockfile(record_fd);
+	fwrite(rec, 1, sizeof(rec), record_fd);
+	fwrite(cmd, 1, cmd_len, record_fd);
+	if (payload_len > 0)
+		fwrite(buf, 1, payload_len, record_fd);
+	funlockfile(record_fd);
+}
+
+static int read_header(FILE *fd, int *id)
+{
+	unsigned char hdr[REPLAY_HDR_LEN];
+
+	if (fread(hdr, 1, sizeof(hdr), fd) != sizeof(hdr) ||
+	    memcmp(hdr, REPLAY_MAGIC, 4) != 0 || hdr[4] != REPLAY_VERSION) {
+		fprintf(stderr, "replay: not a version %d trace file\n", REPLAY_VERSION);
+		errno = EINVAL;
+		return -1;
+	}
+	*id = hdr[5] == 0xFF ? -1 : hdr[5];
+	return 0;
+}
+
+/* Split "FILE[,fast]" */
+static void replay_parse(const char *path, char *file, size_t file_len, int *fast)
+{
+	const char *comma;
+
+	*fast = 0;
+	comma = strrchr(path, ',');
+	if (comma != NULL && strcmp(comma + 1, "fast") == 0) {
+		*fast = 1;
+		snprintf(file, file_len, "%.*s", (int)(comma - path), path);
+	} else {
+		snprintf(file, file_len, "%s", path);
+	}
+}
+
+static int replay_open(const char *path, int readonly)
+{
+	char file[1024];
+	int fd;
+	int id;
+
+	(void)readonly;
+
+	for (fd = 0; fd < SCSI_MAX_HANDLES; fd++) {
+		if (!replay_devs[fd].in_use)
+			break;
+	}
+	if (fd == SCSI_MAX_HANDLES) {
+		errno = EMFILE;
+		return -1;
+	}
+
+	replay_parse(path, file, sizeof(file), &replay_devs[fd].fast);
+	replay_devs[fd].fd = fopen(file, "rb");
+	if (replay_devs[fd].fd == NULL)
+		return -1;
+	if (read_header(replay_devs[fd].fd, &id) != 0) {
+		fclose(replay_devs[fd].fd);
+		return -1;
+	}
+
+	replay_devs[fd].seq = 0;
+	replay_devs[fd].in_use = 1;
+	return fd;
+}
+
+static int replay_close(int fd)
+{
+	if (fd < 0 || fd >= SCSI_MAX_HANDLES || !replay_devs[fd].in_use) {
+		errno = EBADF;
+		return -1;
+	}
+	if (verbose)
+		fprintf(stdout, "replay: %lu commands replayed\n", replay_devs[fd].seq);
+	fclose(replay_devs[fd].fd);
+	replay_devs[fd].in_use = 0;
+	return 0;
+}
+
+static int replay_diverged(replay_dev *r, const char *what)
+{
+	fprintf(stderr, "replay: command #%lu diverges from trace: %s\n", r->seq, what);
+	errno = EPROTO;
+	return 1;
+}
+
+static int replay_send(int fd, unsigned char *cmd, int cmd_len, unsigned char *buf, int buf_len, int dir,
+		int timeout_ms, scsi_result *res)
+{
+	replay_dev *r;
+	unsigned char rec[REPLAY_REC_LEN];
+	unsigned char rcmd[REPLAY_MAX_CDB];
+	unsigned long data_len, latency_us, crc, payload_len;
+	struct timespec ts;
+
+	if (fd < 0 || fd >= SCSI_MAX_HANDLES || !replay_devs[fd].in_use) {
+		errno = EBADF;
+		return 1;
+	}
+	r = &replay_devs[fd];
+	r->seq++;
+	(void)timeout_ms;
+
+	if (buf == NULL)
+		buf_len = 0;
+	if (cmd_len > REPLAY_MAX_CDB)
+		cmd_len = REPLAY_MAX_CDB;
+
+	if (fread(rec, 1, sizeof(rec), r->fd) != sizeof(rec))
+		return replay_diverged(r, "trace exhausted");
+	data_len = get_be32(&rec[4]);
+	latency_us = get_be32(&rec[8]);
+	crc = get_be32(&rec[12]);
+	payload_len = get_be32(&rec[16]);
+
+	if (rec[0] > REPLAY_MAX_CDB || fread(rcmd, 1, rec[0], r->fd) != rec[0])
+		return replay_diverged(r, "truncated record");
+	if (rec[0] != cmd_len || memcmp(rcmd, cmd, cmd_len) != 0)
+		return replay_diverged(r, "different CDB");
+	if (rec[1] != dir || data_len != (unsigned long)buf_len)
+		return replay_diverged(r, "different direction or length");
+	if (dir == SCSI_DIR_WRITE && crc != digest(buf, buf_len))
+		return replay_diverged(r, "different payload");
+
+	if (payload_len > 0) {
+		if (payload_len > (unsigned long)buf_len ||
+		    fread(buf, 1, payload_len, r->fd) != payload_len)
+			return replay_diverged(r, "truncated payload");
+	}
+
+	if (r->fast)
+		res->elapsed_us = latency_us + 1;
+	else if (latency_us > 0) {
+		ts.tv_sec = latency_us / 1000000;
+		ts.tv_nsec = (long)(latency_us % 1000000) * 1000;
+		while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+			;
+	}
+
+	if (rec[2] != 0) {
+		res->status = rec[3];
+		res->transport = rec[23];
+		if (rec[20] != 0) {
+			res->sense[0] = 0x70;
+			res->sense[2] = rec[20];
+			res->sense[7] = 10;
+			res->sense[12] = rec[21];
+			res->sense[13] = rec[22];
+			res->sense_len = 18;
+		}
+		errno = EIO;
+		return 1;
+	}
+	return 0;
+}
+
+/* A trace never changes under us unless it is rewritten */
+static int replay_identity(const char *path, char *out, size_t out_len)
+{
+	char file[1024];
+	struct stat st;
+	int fast;
+
+	replay_parse(path, file, sizeof(file), &fast);
+	if (stat(file, &st) != 0)
+		return -1;
+	snprintf(out, out_len, "replay %lu/%ld", (unsigned long)st.st_size, (long)st.st_mtime);
+	return 0;
+}
+
+static int replay_devnum(const char *path)
+{
+	char file[1024];
+	FILE *fd;
+	int fast;
+	int id = -1;
+
+	replay_parse(path, file, sizeof(file), &fast);
+	fd = fopen(file, "rb");
+	if (fd == NULL) {
+		fprintf(stderr, "ERROR: Failed to open %s: %s\n", file, strerror(errno));
+		return -1;
+	}
+	read_header(fd, &id);
+	fclose(fd);
+	return id;
+}
+
+scsi_transport replay_transport = {
+	"replay",
+	"replay:",
+	replay_open,
+	replay_close,
+	replay_send,
+	replay_devnum,
+	replay_identity
+};
@@ -0,0 +1,28 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+/*
+ * Record and replay of SCSI sessions.
+ *
+ * A trace file holds a small header followed by one record per command:
+ * the CDB, direction, data length, CRC32C of the payload, SCSI status,
+ * sense key/ASC/ASCQ, transport outcome and the wall-clock latency.
+ * Data coming from the device is stored as well, so the replay:
+ * transport can hand back exactly what the real card sent.  All
+ * integers are big endian so traces move between IRIX and Linux.
+ */
+
+#include "transport.h"
+
+#define REPLAY_MAGIC   "BSRP"
+#define REPLAY_VERSION 3	/* 3: sessions open with TEST UNIT READY */
+#define REPLAY_MAX_CDB 16
+
+extern int replay_recording;
+
+int replay_record_start(const char *trace, const char *devpath);
+void replay_record(const unsigned char *cmd, int cmd_len, const unsigned char *buf, int buf_len,
+		int dir, int ret, const scsi_result *res, unsigned long long latency_us);
+void replay_record_stop(void);
+
+#endif
@@ -0,0 +1,788 @@
+/*
+ * In-process simulated BlueSCSI target
+ *
+ * Selected with a device path of the form:
+ *
+ *	sim:DIR[,option=value...]
+ *
+ * DIR stands in for the root of the SD card.  The working directory starts
+ * at /shared when DIR/shared exists, and CD images are listed from DIR/CD<id>.
+ * After SET_NEXT_CD the target reports the medium change and then takes a
+ * few TEST UNIT READYs to load the new image, as a real drive would.
+ *
+ * Options:
+ *	id=N      SCSI ID the target answers on (default 3)
+ *	bw=N      bus bandwidth in bytes/s, K and M suffixes allowed (0 = unlimited)
+ *	lat=N     fixed per-command latency in microseconds
+ *	err=N     fail one in N toolbox commands with a parity error
+ *	ua=N      reset the target (UNIT ATTENTION) before one in N toolbox commands
+ *	busy=N    answer BUSY to one in N toolbox commands
+ *	seed=N    seed for error injection
+ *	nosleep   account bus time without actually sleeping
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+
+#include "bstoolbox.h"
+#include "transport.h"
+
+#define SIM_MAX_DEVS     4
+#define SIM_DEFAULT_ID   3
+#define SIM_PATH_LEN     1024
+#define SIM_CD_LOAD_POLLS 3	/* TURs answered "becoming ready" after a CD switch */
+
+#define SENSE_NO_SENSE        0x00
+#define SENSE_NOT_READY       0x02
+#define SENSE_ILLEGAL_REQUEST 0x05
+#define SENSE_UNIT_ATTENTION  0x06
+#define SENSE_ABORTED_COMMAND 0x0B
+
+typedef struct {
+	char name[256];
+	int is_dir;
+	unsigned long long size;
+} sim_entry;
+
+typedef struct {
+	int in_use;
+	char root[SIM_PATH_LEN];
+	char wdir[256];
+	int id;
+	int debug;
+	int next_cd;
+	int cd_changed;		/* UNIT ATTENTION pending for the new medium */
+	int cd_loading;		/* TURs left before it is ready */
+	int prevent;		/* PREVENT ALLOW MEDIUM REMOVAL state */
+	FILE *send_fd;
+	unsigned long bw;
+	unsigned long lat_us;
+	unsigned long err_every;
+	unsigned long ua_every;
+	unsigned long busy_every;
+	unsigned long rng;
+	int nosleep;
+	unsigned long cmds;
+	unsigned long errors;
+	double bus_us;
+	unsigned char sense_key;
+	unsigned char asc;
+	unsigned char ascq;
+} sim_dev;
+
+static sim_dev sim_devs[SIM_MAX_DEVS];
+
+static unsigned long parse_size(const char *s)
+{
+	char *end;
+	unsigned long v;
+
+	v = strtoul(s, &end, 0);
+	if (*end == 'k' || *end == 'K')
+		v *= 1024;
+	else if (*end == 'm' || *end == 'M')
+		v *= 1024 * 1024;
+	return v;
+}
+
+/* Split "DIR,opt=val,..." into the device config */
+static int sim_parse(const char *path, sim_dev *d)
+{
+	char spec[SIM_PATH_LEN];
+	char *opt;
+	char *next;
+	size_t len;
+
+	memset(d, 0, sizeof(*d));
+	d->id = SIM_DEFAULT_ID;
+	d->rng = 1;
+
+	if (strlen(path) >= sizeof(spec)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(spec, path);
+
+	next = strchr(spec, ',');
+	if (next != NULL)
+		*next++ = '\0';
+
+	len = strlen(spec);
+	while (len > 1 && spec[len - 1] == '/')
+		spec[--len] = '\0';
+	if (len == 0) {
+		errno = ENOENT;
+		return -1;
+	}
+	strcpy(d->root, spec);
+
+	while ((opt = next) != NULL) {
+		next = strchr(opt, ',');
+		if (next != NULL)
+			*next++ = '\0';
+
+		if (strncmp(opt, "id=", 3) == 0)
+			d->id = atoi(opt + 3) & 7;
+		else if (strncmp(opt, "bw=", 3) == 0)
+			d->bw = parse_size(opt + 3);
+		else if (strncmp(opt, "lat=", 4) == 0)
+			d->lat_us = strtoul(opt + 4, NULL, 0);
+		else if (strncmp(opt, "err=", 4) == 0)
+			d->err_every = strtoul(opt + 4, NULL, 0);
+		else if (strncmp(opt, "ua=", 3) == 0)
+			d->ua_every = strtoul(opt + 3, NULL, 0);
+		else if (strncmp(opt, "busy=", 5) == 0)
+			d->busy_every = strtoul(opt + 5, NULL, 0);
+		else if (strncmp(opt, "seed=", 5) == 0)
+			d->rng = strtoul(opt + 5, NULL, 0);
+		else if (strcmp(opt, "nosleep") == 0)
+			d->nosleep = 1;
+		else {
+			fprintf(stderr, "sim: unknown option %s\n", opt);
+			errno = EINVAL;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static unsigned long sim_rand(sim_dev *d)
+{
+	d->rng = d->rng * 1103515245UL + 12345UL;
+	return (d->rng >> 16) & 0x7FFF;
+}
+
+static int sim_fail(sim_dev *d, unsigned char key, unsigned char asc, unsigned char ascq)
+{
+	d->sense_key = key;
+	d->asc = asc;
+	d->ascq = ascq;
+	d->errors++;
+	errno = EIO;
+	return -1;
+}
+
+/* Host path of dir (and name in it) on the card, -1 if it won't fit */
+static int sim_join(char *out, size_t out_len, const sim_dev *d, const char *dir, const char *name)
+{
+	int len;
+
+	if (name == NULL)
+		len = snprintf(out, out_len, "%s%s", d->root, dir);
+	else
+		len = snprintf(out, out_len, "%s%s/%s", d->root, strcmp(dir, "/") == 0 ? "" : dir, name);
+	return (len < 0 || (size_t)len >= out_len) ? -1 : 0;
+}
+
+static int is_dir(const char *path)
+{
+	struct stat st;
+
+	return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+static int entry_cmp(const void *a, const void *b)
+{
+	return strcmp(((const sim_entry *)a)->name, ((const sim_entry *)b)->name);
+}
+
+/* List a directory the way the firmware does, sorted so indices are stable */
+static int sim_scan(const sim_dev *d, const char *dir, sim_entry *out, int max)
+{
+	char path[SIM_PATH_LEN];
+	DIR *dp;
+	struct dirent *de;
+	struct stat st;
+	int n = 0;
+
+	if (sim_join(path, sizeof(path), d, dir, NULL) != 0 || (dp = opendir(path)) == NULL)
+		return 0;
+
+	while ((de = readdir(dp)) != NULL && n < max) {
+		if (de->d_name[0] == '.')
+			continue;
+		if (sim_join(path, sizeof(path), d, dir, de->d_name) != 0 || stat(path, &st) != 0)
+			continue;
+		snprintf(out[n].name, sizeof(out[n].name), "%s", de->d_name);
+		out[n].is_dir = S_ISDIR(st.st_mode) ? 1 : 0;
+		out[n].size = out[n].is_dir ? 0 : (unsigned long long)st.st_size;
+		n++;
+	}
+	closedir(dp);
+
+	qsort(out, n, sizeof(sim_entry), entry_cmp);
+	return n;
+}
+
+static void sim_encode(const sim_entry *e, int n, unsigned char *buf, int buf_len)
+{
+	ToolboxFileEntry te;
+	int i;
+	int k;
+
+	for (i = 0; i < n && (i + 1) * (int)sizeof(te) <= buf_len; i++) {
+		memset(&te, 0, sizeof(te));
+		te.index = (unsigned char)i;
+		te.type = e[i].is_dir ? 0x00 : 0x01;
+		strncpy(te.name, e[i].name, NAME_BUF_SIZE - 1);
+		for (k = 0; k < 5; k++)
+			te.size[k] = (unsigned char)((e[i].size >> (8 * (4 - k))) & 0xFF);
+		memcpy(buf + i * sizeof(te), &te, sizeof(te));
+	}
+}
+
+static void sim_cd_dir(const sim_dev *d, char *out, size_t out_len)
+{
+	snprintf(out, out_len, "/CD%d", d->id);
+}
+
+static int sim_set_wdir(sim_dev *d, const unsigned char *buf, int len)
+{
+	char req[256];
+	char full[256];
+	char path[SIM_PATH_LEN];
+
+	if (len <= 0 || len >= (int)sizeof(req))
+		return sim_fail(d, SENSE_ILLEGAL_REQUEST, 0x24, 0x00);
+	memcpy(req, buf, len);
+	req[len] = '\0';
+
+	if (strstr(req, "..") != NULL)
+		return sim_fail(d, SENSE_ILLEGAL_REQUEST, 0x24, 0x00);
+
+	if (req[0] == '/')
+		len = snprintf(full, sizeof(full), "%s", req);
+	else
+		len = snprintf(full, sizeof(full), "%s/%s", strcmp(d->wdir, "/") == 0 ? "" : d->wdir, req);
+	if (len < 0 || len >= (int)sizeof(full))
+		return sim_fail(d, SENSE_ILLEGAL_REQUEST, 0x24, 0x00);
+
+	len = strlen(full);
+	while (len > 1 && full[len - 1] == '/')
+		full[--len] = '\0';
+
+	if (sim_join(path, sizeof(path), d, full, NULL) != 0 || !is_dir(path))
+		return sim_fail(d, SENSE_ILLEGAL_REQUEST, 0x24, 0x00);
+
+	strcpy(d->wdir, full);
+	return 0;
+}
+
+static int sim_inquiry(sim_dev *d, unsigned char *buf, int buf_len)
+{
+	unsigned char inq[37];
+
+	(void)d;
+	memset(inq, ' ', sizeof(inq));
+	inq[0] = 0x00;
+	inq[1] = 0x00;
+	inq[2] = 0x02;
+	inq[3] = 0x02;
+	inq[4] = sizeof(inq) - 5;
+	inq[5] = inq[6] = inq[7] = 0;
+	memcpy(&inq[8], "BLUESCSI", 8);
+	memcpy(&inq[16], "SIMULATOR", 9);
+	memcpy(&inq[32], "SIM1", 4);
+	inq[36] = BLUESCSI_TOOLBOX_API_VER;
+
+	memcpy(buf, inq, buf_len < (int)sizeof(inq) ? buf_len : (int)sizeof(inq));
+	return 0;
+}
+
+static int sim_mode_sense(sim_dev *d, unsigned char *cmd, unsigned char *buf, int buf_len)
+{
+	static const char text[] = "BlueSCSI is the BEST STOLEN FROM BLUESCSI";
+	unsigned char page[4 + 44];
+
+	if ((cmd[2] & 0x3F) != 0x31)
+		return sim_fail(d, SENSE_ILLEGAL_REQUEST, 0x24, 0x00);
+
+	memset(page, 0, sizeof(page));
+	page[0] = sizeof(page) - 1;
+	page[4] = 0x31;
+	page[5] = 42;
+	memcpy(&page[6], text, sizeof(text));
+
+	memcpy(buf, page, buf_len < (int)sizeof(page) ? buf_len : (int)sizeof(page));
+	return 0;
+}
+
+static int sim_get_file(sim_dev *d, unsigned char *cmd, unsigned char *buf, int buf_len)
+{
+	sim_entry *e;
+	char path[SIM_PATH_LEN];
+	unsigned long long offset;
+	size_t got;
+	FILE *fd;
+	int n;
+
+	e = (sim_entry *)malloc(sizeof(sim_entry) * MAX_FILES);
+	if (e == NULL)
+		return sim_fail(d, SENSE_ABORTED_COMMAND, 0x00, 0x00);
+	n = sim_scan(d, d->wdir, e, MAX_FILES);
+	if (cmd[1] >= n || e[cmd[1]].is_dir) {
+		free(e);
+		return sim_fail(d, SENSE_ILLEGAL_REQUEST, 0x24, 0x00);
+	}
+	if (sim_join(path, sizeof(path), d, d->wdir, e[cmd[1]].name) != 0) {
+		free(e);
+		return sim_fail(d, SENSE_ILLEGAL_REQUEST, 0x24, 0x00);
+	}
+	free(e);
+
+	offset = ((unsigned long long)cmd[2] << 24) | ((unsigned long long)cmd[3] << 16) |
+		((unsigned long long)cmd[4] << 8) | cmd[5];
+	offset *= GET_BLOCK_SIZE;
+
+	fd = fopen(path, "rb");
+	if (fd == NULL)
+		return sim_fail(d, SENSE_ABORTED_COMMAND, 0x00, 0x00);
+	memset(buf, 0, buf_len);
+	got = 0;
+	if (fseek(fd, (long)offset, SEEK_SET) == 0)
+		got = fread(buf, 1, buf_len, fd);
+	fclose(fd);
+	if (verbose)
+		fprintf(stdout, "sim: get_file %s offset %llu, %lu bytes\n", path, offset, (unsigned long)got);
+	return 0;
+}
+
+static int sim_send_prep(sim_dev *d, unsigned char *buf, int buf_len)
+{
+	char name[NAME_BUF_SIZE];
+	char path[SIM_PATH_LEN];
+
+	if (buf_len < 1)
+		return sim_fail(d, SENSE_ILLEGAL_REQUEST, 0x24, 0x00);
+	memset(name, 0, sizeof(name));
+	memcpy(name, buf, buf_len < NAME_BUF_SIZE ? buf_len : NAME_BUF_SIZE - 1);
+	if (name[0] == '\0' || strchr(name, '/') != NULL)
+		return sim_fail(d, SENSE_ILLEGAL_REQUEST, 0x24, 0x00);
+
+	if (d->send_fd != NULL)
+		fclose(d->send_fd);
+	d->send_fd = NULL;
+	if (sim_join(path, sizeof(path), d, d->wdir, name) != 0)
+		return sim_fail(d, SENSE_ILLEGAL_REQUEST, 0x24, 0x00);
+	d->send_fd = fopen(path, "wb");
+	if (d->send_fd == NULL)
+		return sim_fail(d, SENSE_ABORTED_COMMAND, 0x00, 0x00);
+	return 0;
+}
+
+static int sim_send_10(sim_dev *d, unsigned char *cmd, unsigned char *buf, int buf_len)
+{
+	long offset;
+	int len;
+
+	if (d->send_fd == NULL)
+		return sim_fail(d, SENSE_ILLEGAL_REQUEST, 0x2C, 0x00);
+
+	if (cmd[6] != 0)
+		len = cmd[6] * SEND_BLOCK_SIZE;
+	else
+		len = (cmd[1] << 8) | cmd[2];
+	if (len > buf_len)
+		return sim_fail(d, SENSE_ILLEGAL_REQUEST, 0x24, 0x00);
+
+	offset = ((long)cmd[3] << 16) | ((long)cmd[4] << 8) | cmd[5];
+	offset *= SEND_BLOCK_SIZE;
+
+	if (fseek(d->send_fd, offset, SEEK_SET) != 0 ||
+	    fwrite(buf, 1, len, d->send_fd) != (size_t)len)
+		return sim_fail(d, SENSE_ABORTED_COMMAND, 0x00, 0x00);
+	return 0;
+}
+
+static int sim_metadata(sim_dev *d, unsigned char *cmd, unsigned char *buf, int buf_len)
+{
+	sim_entry *e;
+	char path[SIM_PATH_LEN];
+	int n;
+	int i;
+
+	switch (cmd[1]) {
+	case BLUESCSI_TOOLBOX_METADATA_LIST_DEVICES:
+		for (i = 0; i < 8 && i < buf_len; i++)
+			buf[i] = TYPE_NONE;
+		if (d->id < buf_len) {
+			char cd_dir[64];
+
+			sim_cd_dir(d, cd_dir, sizeof(cd_dir));
+			buf[d->id] = sim_join(path, sizeof(path), d, cd_dir, NULL) == 0 && is_dir(path) ?
+				TYPE_CD : TYPE_HDD;
+		}
+		return 0;
+
+	case BLUESCSI_TOOLBOX_METADATA_GET_CAP:
+		if (buf_len >= 2) {
+			buf[0] = BLUESCSI_TOOLBOX_API_VER;
+			buf[1] = 0x07;
+		}
+		return 0;
+
+	case BLUESCSI_TOOLBOX_METADATA_SET_WDIR:
+		return sim_set_wdir(d, buf, buf_len);
+
+	case BLUESCSI_TOOLBOX_METADATA_GET_WDIR:
+		memset(buf, 0, buf_len);
+		strncpy((char *)buf, d->wdir, buf_len > 0 ? buf_len - 1 : 0);
+		return 0;
+
+	case BLUESCSI_TOOLBOX_METADATA_REMOVE_FILE:
+		e = (sim_entry *)malloc(sizeof(sim_entry) * MAX_FILES);
+		if (e == NULL)
+			return sim_fail(d, SENSE_ABORTED_COMMAND, 0x00, 0x00);
+		n = sim_scan(d, d->wdir, e, MAX_FILES);
+		if (cmd[8] >= n || e[cmd[8]].is_dir) {
+			free(e);
+			return sim_fail(d, SENSE_ILLEGAL_REQUEST, 0x24, 0x00);
+		}
+		i = sim_join(path, sizeof(path), d, d->wdir, e[cmd[8]].name);
+		free(e);
+		if (i != 0 || remove(path) != 0)
+			return sim_fail(d, SENSE_ABORTED_COMMAND, 0x00, 0x00);
+		return 0;
+	}
+
+	return sim_fail(d, SENSE_ILLEGAL_REQUEST, 0x24, 0x00);
+}
+
+static int sim_list(sim_dev *d, const char *dir, unsigned char *buf, int buf_len, int count_only)
+{
+	sim_entry *e;
+	int n;
+
+	e = (sim_entry *)malloc(sizeof(sim_entry) * MAX_FILES);
+	if (e == NULL)
+		return sim_fail(d, SENSE_ABORTED_COMMAND, 0x00, 0x00);
+	n = sim_scan(d, dir, e, MAX_FILES);
+
+	memset(buf, 0, buf_len);
+	if (count_only) {
+		if (buf_len > 0)
+			buf[0] = (unsigned char)n;
+	} else {
+		sim_encode(e, n, buf, buf_len);
+	}
+	free(e);
+	return 0;
+}
+
+static int sim_tur(sim_dev *d)
+{
+	if (d->cd_changed) {
+		d->cd_changed = 0;
+		return sim_fail(d, SENSE_UNIT_ATTENTION, 0x28, 0x00);
+	}
+	if (d->cd_loading > 0) {
+		d->cd_loading--;
+		return sim_fail(d, SENSE_NOT_READY, 0x04, 0x01);
+	}
+	return 0;
+}
+
+/* Size of the current CD image in 2048 byte blocks */
+static int sim_read_capacity(sim_dev *d, unsigned char *buf, int buf_len)
+{
+	sim_entry *e;
+	char cd_dir[64];
+	unsigned long long blocks = 0;
+	int n;
+
+	if (d->cd_loading > 0)
+		return sim_fail(d, SENSE_NOT_READY, 0x04, 0x01);
+	e = (sim_entry *)malloc(sizeof(sim_entry) * MAX_FILES);
+	if (e == NULL)
+		return sim_fail(d, SENSE_ABORTED_COMMAND, 0x00, 0x00);
+	sim_cd_dir(d, cd_dir, sizeof(cd_dir));
+	n = sim_scan(d, cd_dir, e, MAX_FILES);
+	if (d->next_cd < n)
+		blocks = (e[d->next_cd].size + 2047) / 2048;
+	free(e);
+	if (blocks == 0)
+		return sim_fail(d, SENSE_NOT_READY, 0x3A, 0x00);
+
+	memset(buf, 0, buf_len);
+	if (buf_len >= 8) {
+		blocks--;
+		buf[0] = (unsigned char)(blocks >> 24);
+		buf[1] = (unsigned char)(blocks >> 16);
+		buf[2] = (unsigned char)(blocks >> 8);
+		buf[3] = (unsigned char)blocks;
+		buf[6] = 2048 >> 8;
+	}
+	return 0;
+}
+
+static int sim_exec(sim_dev *d, unsigned char *cmd, unsigned char *buf, int buf_len)
+{
+	char cd_dir[64];
+
+	switch (cmd[0]) {
+	case SCSI_TEST_UNIT_READY:
+		return sim_tur(d);
+	case SCSI_PREVENT_ALLOW:
+		d->prevent = cmd[4] & 0x01;
+		return 0;
+	case SCSI_START_STOP_UNIT:
+		/* LoEj without Start is an eject */
+		if ((cmd[4] & 0x03) == 0x02 && d->prevent)
+			return sim_fail(d, SENSE_ILLEGAL_REQUEST, 0x53, 0x02);
+		return 0;
+	case SCSI_READ_CAPACITY:
+		return sim_read_capacity(d, buf, buf_len);
+	case SCSI_INQUIRY:
+		return sim_inquiry(d, buf, buf_len);
+	case 0x1A: /* MODE SENSE (6) */
+		return sim_mode_sense(d, cmd, buf, buf_len);
+	case BLUESCSI_TOOLBOX_MODE_FILES:
+		return sim_list(d, d->wdir, buf, buf_len, 0);
+	case BLUESCSI_TOOLBOX_COUNT_FILES:
+		return sim_list(d, d->wdir, buf, buf_len, 1);
+	case BLUESCSI_TOOLBOX_GET_FILE:
+		return sim_get_file(d, cmd, buf, buf_len);
+	case BLUESCSI_TOOLBOX_SEND_FILE_PREP:
+		return sim_send_prep(d, buf, buf_len);
+	case BLUESCSI_TOOLBOX_SEND_FILE_10:
+		return sim_send_10(d, cmd, buf, buf_len);
+	case BLUESCSI_TOOLBOX_SEND_FILE_END:
+		if (d->send_fd == NULL)
+			return sim_fail(d, SENSE_ILLEGAL_REQUEST, 0x2C, 0x00);
+		fclose(d->send_fd);
+		d->send_fd = NULL;
+		return 0;
+	case BLUESCSI_TOOLBOX_TOGGLE_DEBUG:
+		if (cmd[1] == DEBUG_SET)
+			d->debug = cmd[2] ? 1 : 0;
+		else if (buf_len > 0)
+			buf[0] = (unsigned char)d->debug;
+		return 0;
+	case BLUESCSI_TOOLBOX_MODE_CDS:
+		sim_cd_dir(d, cd_dir, sizeof(cd_dir));
+		return sim_list(d, cd_dir, buf, buf_len, 0);
+	case BLUESCSI_TOOLBOX_COUNT_CDS:
+		sim_cd_dir(d, cd_dir, sizeof(cd_dir));
+		return sim_list(d, cd_dir, buf, buf_len, 1);
+	case BLUESCSI_TOOLBOX_SET_NEXT_CD:
+		d->next_cd = cmd[1];
+		d->cd_changed = 1;
+		d->cd_loading = SIM_CD_LOAD_POLLS;
+		return 0;
+	case BLUESCSI_TOOLBOX_METADATA:
+		return sim_metadata(d, cmd, buf, buf_len);
+	}
+
+	return sim_fail(d, SENSE_ILLEGAL_REQUEST, 0x20, 0x00);
+}
+
+/*
+ * Charge the command to the bus: fixed latency plus payload over bandwidth.
+ * Returns non-zero when that exceeds the host's timeout, which is then all
+ * the time that gets spent.
+ */
+static int sim_delay(sim_dev *d, int bytes, int timeout_ms, scsi_result *res)
+{
+	double us;
+	int timed_out = 0;
+	struct timespec ts;
+
+	us = (double)d->lat_us;
+	if (d->bw > 0)
+		us += (double)bytes * 1000000.0 / (double)d->bw;
+	if (timeout_ms > 0 && us > timeout_ms * 1000.0) {
+		us = timeout_ms * 1000.0;
+		timed_out = 1;
+	}
+	d->bus_us += us;
+
+	if (d->nosleep) {
+		res->elapsed_us = (unsigned long long)us + 1;
+		return timed_out;
+	}
+	if (us < 1.0)
+		return timed_out;
+	ts.tv_sec = (time_t)(us / 1000000.0);
+	ts.tv_nsec = (long)((us - (double)ts.tv_sec * 1000000.0) * 1000.0);
+	while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+		;
+	return timed_out;
+}
+
+static int sim_open(const char *path, int readonly)
+{
+	sim_dev cfg;
+	char full[SIM_PATH_LEN];
+	int fd;
+
+	(void)readonly;
+
+	if (sim_parse(path, &cfg) != 0)
+		return -1;
+	if (!is_dir(cfg.root)) {
+		fprintf(stderr, "sim: %s is not a directory\n", cfg.root);
+		errno = ENOENT;
+		return -1;
+	}
+
+	for (fd = 0; fd < SIM_MAX_DEVS; fd++) {
+		if (!sim_devs[fd].in_use)
+			break;
+	}
+	if (fd == SIM_MAX_DEVS) {
+		errno = EMFILE;
+		return -1;
+	}
+
+	if (sim_join(full, sizeof(full), &cfg, "/shared", NULL) != 0) {
+		fprintf(stderr, "sim: %s is too long\n", cfg.root);
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(cfg.wdir, is_dir(full) ? "/shared" : "/");
+	cfg.in_use = 1;
+	sim_devs[fd] = cfg;
+
+	if (verbose)
+		fprintf(stdout, "sim: %s as SCSI ID %d, wdir %s\n", cfg.root, cfg.id, cfg.wdir);
+	return fd;
+}
+
+static int sim_close(int fd)
+{
+	sim_dev *d;
+
+	if (fd < 0 || fd >= SIM_MAX_DEVS || !sim_devs[fd].in_use) {
+		errno = EBADF;
+		return -1;
+	}
+	d = &sim_devs[fd];
+
+	if (d->send_fd != NULL)
+		fclose(d->send_fd);
+	if (verbose)
+		fprintf(stdout, "sim: %lu commands, %lu errors, %.3f ms bus time\n",
+			d->cmds, d->errors, d->bus_us / 1000.0);
+	d->in_use = 0;
+	return 0;
+}
+
+/* Report the sense of the last failure as fixed format sense data */
+static void sim_result(const sim_dev *d, scsi_result *res)
+{
+	res->status = SCSI_STATUS_CHECK_COND;
+	res->sense[0] = 0x70;
+	res->sense[2] = d->sense_key;
+	res->sense[7] = 10;
+	res->sense[12] = d->asc;
+	res->sense[13] = d->ascq;
+	res->sense_len = 18;
+}
+
+static int sim_inject(sim_dev *d, unsigned long every)
+{
+	return every > 0 && sim_rand(d) % every == 0;
+}
+
+static int sim_send(int fd, unsigned char *cmd, int cmd_len, unsigned char *buf, int buf_len, int dir,
+		int timeout_ms, scsi_result *res)
+{
+	sim_dev *d;
+	int toolbox;
+	int i;
+
+	(void)dir;
+
+	if (fd < 0 || fd >= SIM_MAX_DEVS || !sim_devs[fd].in_use) {
+		errno = EBADF;
+		return 1;
+	}
+	d = &sim_devs[fd];
+	d->cmds++;
+	d->sense_key = SENSE_NO_SENSE;
+	d->asc = d->ascq = 0;
+
+	if (verbose) {
+		fprintf(stdout, "Sending SCSI command: ");
+		for (i = 0; i < cmd_len; ++i)
+			fprintf(stdout, "%02x ", cmd[i]);
+		fprintf(stdout, "\n");
+	}
+
+	if (buf == NULL)
+		buf_len = 0;
+
+	if (sim_delay(d, buf_len, timeout_ms, res)) {
+		d->errors++;
+		res->transport = SCSI_XPORT_TIMEOUT;
+		errno = ETIMEDOUT;
+		return 1;
+	}
+
+	toolbox = cmd[0] >= BLUESCSI_TOOLBOX_MODE_FILES && cmd[0] <= BLUESCSI_TOOLBOX_COUNT_CDS;
+
+	if (toolbox && sim_inject(d, d->busy_every)) {
+		d->errors++;
+		res->status = SCSI_STATUS_BUSY;
+		errno = EIO;
+		return 1;
+	}
+
+	/* A reset drops any file being received, like the firmware does */
+	if (toolbox && sim_inject(d, d->ua_every)) {
+		if (d->send_fd != NULL)
+			fclose(d->send_fd);
+		d->send_fd = NULL;
+		sim_fail(d, SENSE_UNIT_ATTENTION, 0x29, 0x00);
+		sim_result(d, res);
+		return 1;
+	}
+
+	/* Injected faults look like a parity error on the bus */
+	if (toolbox && sim_inject(d, d->err_every)) {
+		sim_fail(d, SENSE_ABORTED_COMMAND, 0x47, 0x00);
+		sim_result(d, res);
+		return 1;
+	}
+
+	if (sim_exec(d, cmd, buf, buf_len) != 0) {
+		sim_result(d, res);
+		return 1;
+	}
+	return 0;
+}
+
+static int sim_devnum(const char *path)
+{
+	sim_dev cfg;
+
+	if (sim_parse(path, &cfg) != 0)
+		return -1;
+	return cfg.id;
+}
+
+/* The card layout (CD directories) is all that shapes the probe answers */
+static int sim_identity(const char *path, char *out, size_t out_len)
+{
+	sim_dev cfg;
+	struct stat st;
+
+	if (sim_parse(path, &cfg) != 0 || stat(cfg.root, &st) != 0)
+		return -1;
+	snprintf(out, out_len, "sim %d/%ld", cfg.id, (long)st.st_mtime);
+	return 0;
+}
+
+scsi_transport sim_transport = {
+	"sim",
+	"sim:",
+	sim_open,
+	sim_close,
+	sim_send,
+	sim_devnum,
+	sim_identity
+};
@@ -0,0 +1,428 @@
+/*
+ * bstoolbox soak, see soak.h
+ *
+ * The data goes through bs_write_data() and bs_read_data(), so chunk
+ * sizes and the send mode can be picked per iteration and what comes
+ * back is compared in memory.  The random sizes, contents and chunks all
+ * come from one seed, printed at the start, so -S repeats a run exactly.
+ */
+#include <math.h>
+#include <signal.h>
+#include <time.h>
+
+#include "bstoolbox.h"
+#include "checksum.h"
+#include "qos.h"
+#include "cmdstats.h"
+#include "transport.h"
+#include "soak.h"
+
+/* mean and variance (Welford), min and max of a series of samples */
+typedef struct {
+	double mean, m2, min, max;
+	unsigned long n;
+} soak_acc;
+
+typedef struct {
+	unsigned long long size;
+	int send_blocks;
+	int legacy;
+	int get_blocks;
+	double put_rate, get_rate;	/* Bytes/s */
+	double put_cmd_us, get_cmd_us;	/* Per command */
+	unsigned long errors;		/* Commands that failed, retries included */
+	char fail[80];			/* Empty if it worked */
+} soak_iter;
+
+static unsigned long long rng_state;
+static volatile sig_atomic_t soak_stop;
+
+static void on_soak_signal(int sig)
+{
+	(void)sig;
+	soak_stop = 1;
+}
+
+/* xorshift64*, plenty for picking sizes and filling buffers */
+static unsigned long long rng_next(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 2685821657736338717ULL;
+}
+
+static void acc_add(soak_acc *a, double v)
+{
+	double d;
+
+	if (a->n == 0 || v < a->min)
+		a->min = v;
+	if (a->n == 0 || v > a->max)
+		a->max = v;
+	a->n++;
+	d = v - a->mean;
+	a->mean += d / a->n;
+	a->m2 += d * (v - a->mean);
+}
+
+static double acc_sd(const soak_acc *a)
+{
+	return a->n > 1 ? sqrt(a->m2 / (a->n - 1)) : 0.0;
+}
+
+/* Index of the scratch file in the working directory, -1 if absent, -2 on error */
+static int find_scratch(bs_ctx *c, unsigned long long *size)
+{
+	bs_file list[BS_MAX_FILES];
+	int n, i;
+
+	if ((n = bs_list(c, list, BS_MAX_FILES)) < 0)
+		return -2;
+	for (i = 0; i < n; i++)
+		if (strcmp(list[i].name, SOAK_SCRATCH) == 0) {
+			if (size != NULL)
+				*size = list[i].size;
+			return list[i].index;
+		}
+	return -1;
+}
+
+static int remove_scratch(bs_ctx *c)
+{
+	int idx = find_scratch(c, NULL);
+
+	if (idx == -2)
+		return -1;
+	return idx < 0 ? 0 : bs_remove(c, idx);
+}
+
+/* 123, 90s, 45m or 2h */
+static int parse_duration(const char *s, double *secs)
+{
+	char *end;
+
+	*secs = strtod(s, &end);
+	if (end == s || *secs <= 0)
+		return -1;
+	if (*end == 'm')
+		*secs *= 60;
+	else if (*end == 'h')
+		*secs *= 3600;
+	else if (*end != 's' && *end != '\0')
+		return -1;
+	return *end == '\0' || end[1] == '\0' ? 0 : -1;
+}
+
+static unsigned long long chunks(unsigned long long size, unsigned long long chunk)
+{
+	return (size + chunk - 1) / chunk;
+}
+
+/* One write, read back and compare; it->fail says what went wrong */
+static void soak_iteration(bs_ctx *c, soak_iter *it, unsigned char *data, unsigned char *back,
+		unsigned long long max_size, int large)
+{
+	unsigned long long put_us, get_us, got, listed = 0, i, r = 0;
+	int idx;
+
+	memset(it, 0, sizeof(*it));
+	it->size = 1 + rng_next() % max_size;
+	it->legacy = (int)(rng_next() & 1);
+	it->send_blocks = 1 + (int)(rng_next() % (large && !it->legacy ? 255 : SEND_BLOCKS_PER_XFER));
+	it->get_blocks = 1 + (int)(rng_next() % (large ? 64 : GET_BLOCKS_PER_XFER));
+	for (i = 0; i < it->size; i++) {
+		if (i % 8 == 0)
+			r = rng_next();
+		data[i] = (unsigned char)(r >> (i % 8 * 8));
+	}
+
+	if (remove_scratch(c) != 0) {
+		snprintf(it->fail, sizeof(it->fail), "couldn't remove the old scratch file");
+		return;
+	}
+	if (bs_write_data(c, SOAK_SCRATCH, data, it->size, it->send_blocks, it->legacy, &put_us) != 0) {
+		snprintf(it->fail, sizeof(it->fail), "write failed");
+		return;
+	}
+	if ((idx = find_scratch(c, &listed)) < 0) {
+		snprintf(it->fail, sizeof(it->fail), "scratch file missing after the write");
+		return;
+	}
+	if (listed != it->size) {
+		snprintf(it->fail, sizeof(it->fail), "listed as %llu bytes", listed);
+		return;
+	}
+
+	memset(back, 0, (size_t)it->size);
+	if (bs_read_data(c, idx, it->get_blocks, back, it->size, &got, &get_us) != 0) {
+		snprintf(it->fail, sizeof(it->fail), "read failed");
+		return;
+	}
+	if (got != it->size) {
+		snprintf(it->fail, sizeof(it->fail), "read back %llu bytes", got);
+		return;
+	}
+	if (memcmp(data, back, (size_t)it->size) != 0) {
+		for (i = 0; data[i] == back[i]; i++)
+			;
+		snprintf(it->fail, sizeof(it->fail), "data differs from byte %llu (block %llu)",
+			i, i / GET_BLOCK_SIZE);
+		return;
+	}
+
+	it->put_rate = it->size * 1000000.0 / (put_us > 0 ? put_us : 1);
+	it->get_rate = it->size * 1000000.0 / (get_us > 0 ? get_us : 1);
+	it->put_cmd_us = (double)put_us / chunks(it->size, (unsigned long long)it->send_blocks * SEND_BLOCK_SIZE);
+	it->get_cmd_us = (double)get_us / chunks(it->size, (unsigned long long)it->get_blocks * GET_BLOCK_SIZE);
+}
+
+static void print_iter(unsigned long n, const soak_iter *it)
+{
+	char when[16];
+	time_t now = time(NULL);
+
+	if (it->fail[0] != '\0') {
+		strftime(when, sizeof(when), "%H:%M:%S", localtime(&now));
+		fprintf(stdout, "%6lu %10llu %8.1f KB %-6s %6.1f KB  FAILED at %s: %s\n", n, it->size,
+			it->send_blocks * SEND_BLOCK_SIZE / 1024.0, it->legacy ? "legacy" : "block",
+			it->get_blocks * GET_BLOCK_SIZE / 1024.0, when, it->fail);
+	}
+	else {
+		fprintf(stdout, "%6lu %10llu %8.1f KB %-6s %6.1f KB %9.2f %9.2f", n, it->size,
+			it->send_blocks * SEND_BLOCK_SIZE / 1024.0, it->legacy ? "legacy" : "block",
+			it->get_blocks * GET_BLOCK_SIZE / 1024.0, it->put_rate / 1000000.0, it->get_rate / 1000000.0);
+		/* Worked, but only because the retries covered for the bus */
+		if (it->errors > 0)
+			fprintf(stdout, "  %lu command%s retried", it->errors, it->errors == 1 ? "" : "s");
+		fprintf(stdout, "\n");
+	}
+	fflush(stdout);
+}
+
+static void print_acc(const char *what, const soak_acc *a, double scale)
+{
+	if (a->n > 0)
+		fprintf(stdout, "%-12s %9.3f %9.3f %9.3f %9.3f\n", what, a->mean / scale,
+			acc_sd(a) / scale, a->min / scale, a->max / scale);
+}
+
+/* Fetch the BlueSCSI log into file, and show its end if anything failed */
+static int soak_log(bs_ctx *c, const char *file, int show_tail)
+{
+	char tmpdir[64];
+	char path[128];
+	char tail[SOAK_LOG_TAIL][256];
+	FILE *f;
+	int n = 0, i;
+	int ret;
+
+	snprintf(tmpdir, sizeof(tmpdir), "/tmp/bstoolbox-soak.XXXXXX");
+	if (mkdtemp(tmpdir) == NULL) {
+		fprintf(stderr, "Error: can't make a temporary directory - %s\n", strerror(errno));
+		return -1;
+	}
+	if ((f = fopen(file, "w")) == NULL) {
+		fprintf(stderr, "Error: can't write %s - %s\n", file, strerror(errno));
+		rmdir(tmpdir);
+		return -1;
+	}
+	fprintf(stdout, "\n");
+	ret = bs_get_log(c, tmpdir, f);
+	if (fclose(f) != 0)
+		ret = -1;
+	snprintf(path, sizeof(path), "%s/log.txt", tmpdir);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/%s", tmpdir, MANIFEST_NAME);
+	unlink(path);
+	rmdir(tmpdir);
+	if (ret != 0) {
+		fprintf(stderr, "Error: couldn't fetch the BlueSCSI log\n");
+		return -1;
+	}
+	fprintf(stdout, "BlueSCSI log saved in %s\n", file);
+
+	if (!show_tail || (f = fopen(file, "r")) == NULL)
+		return 0;
+	while (fgets(tail[n % SOAK_LOG_TAIL], sizeof(tail[0]), f) != NULL)
+		n++;
+	fclose(f);
+	fprintf(stdout, "Last lines of the log:\n");
+	for (i = n > SOAK_LOG_TAIL ? n - SOAK_LOG_TAIL : 0; i < n; i++)
+		fprintf(stdout, "  %s", tail[i % SOAK_LOG_TAIL]);
+	return 0;
+}
+
+static void soak_usage(void)
+{
+	fprintf(stderr, "Usage: bstoolbox <device> soak [-n iterations] [-t time] [-s size] [-S seed] [-l file] [-x] [-q]\n");
+	fprintf(stderr, "\t-n iterations : stop after this many (default %d without -t)\n", SOAK_ITERATIONS);
+	fprintf(stderr, "\t-t time       : stop after this long, s, m or h suffix (default seconds)\n");
+	fprintf(stderr, "\t-s size       : largest scratch file, K and M suffixes (default 1M)\n");
+	fprintf(stderr, "\t-S seed       : repeat an earlier run\n");
+	fprintf(stderr, "\t-l file       : where to save the BlueSCSI log (default %s)\n", SOAK_LOG);
+	fprintf(stderr, "\t-x            : also try chunks above the toolbox defaults\n");
+	fprintf(stderr, "\t-q            : only show failed iterations\n");
+}
+
+/*
+ * argv[0] is "soak".  Returns 0 if every iteration worked without a
+ * command error, SOAK_RECOVERED if some only worked thanks to retries and
+ * 1 if any failed; the scratch file is removed either way.
+ */
+int soak_run(bs_ctx *c, const char *devpath, int argc, char **argv)
+{
+	struct sigaction sa, old_int, old_term;
+	double max_size = SOAK_SIZE, secs = 0;
+	unsigned long iterations = 0, n, failed = 0, in_a_row = 0;
+	unsigned long recovered = 0, errors_failed = 0, errors_recovered = 0;
+	unsigned long long start, elapsed, seed;
+	const char *log_file = SOAK_LOG;
+	int large = 0, quiet = 0, own_stats = 0;
+	unsigned char *data, *back;
+	soak_acc put, get, put_cmd, get_cmd;
+	cmdstats_total before, after;
+	soak_iter it;
+	int opt;
+
+	seed = (unsigned long long)time(NULL) ^ ((unsigned long long)getpid() << 32);
+	optind = 1;
+	while ((opt = getopt(argc, argv, "n:t:s:S:l:xq")) != -1) switch (opt) {
+		case 'n':
+			if (atol(optarg) < 1) {
+				fprintf(stderr, "Error: bad iteration count %s\n", optarg);
+				return 1;
+			}
+			iterations = (unsigned long)atol(optarg);
+			break;
+		case 't':
+			if (parse_duration(optarg, &secs) != 0) {
+				fprintf(stderr, "Error: bad time %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 's':
+			if (qos_parse_rate(optarg, &max_size) != 0 || max_size < 1) {
+				fprintf(stderr, "Error: bad size %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'S':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'l':
+			log_file = optarg;
+			break;
+		case 'x':
+			large = 1;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		default:
+			soak_usage();
+			return 1;
+	}
+	if (optind != argc) {
+		soak_usage();
+		return 1;
+	}
+	if (iterations == 0 && secs == 0)
+		iterations = SOAK_ITERATIONS;
+	rng_state = seed != 0 ? seed : 1;
+
+	data = (unsigned char *)malloc((size_t)max_size);
+	back = (unsigned char *)malloc((size_t)max_size);
+	if (data == NULL || back == NULL) {
+		fprintf(stderr, "Error: can't allocate %.0f byte buffers\n", max_size);
+		free(data);
+		free(back);
+		return 1;
+	}
+
+	/* Per-opcode latency percentiles for the summary, unless --stats has them */
+	if (!cmdstats_enabled) {
+		cmdstats_start();
+		own_stats = 1;
+	}
+
+	/* Ctrl-C ends the run early but still gives the summary and the log */
+	soak_stop = 0;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_soak_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, &old_int);
+	sigaction(SIGTERM, &sa, &old_term);
+
+	fprintf(stdout, "Soak of %s: files up to %.0f KB, seed %llu\n\n", devpath, max_size / 1024, seed);
+	fprintf(stdout, "%6s %10s %11s %-6s %9s %9s %9s\n", "Iter", "Bytes", "Send", "Mode", "Get",
+		"Put MB/s", "Get MB/s");
+
+	memset(&put, 0, sizeof(put));
+	memset(&get, 0, sizeof(get));
+	memset(&put_cmd, 0, sizeof(put_cmd));
+	memset(&get_cmd, 0, sizeof(get_cmd));
+	start = scsi_now_us();
+	for (n = 0; !soak_stop; n++) {
+		elapsed = scsi_now_us() - start;
+		if ((iterations > 0 && n >= iterations) || (secs > 0 && elapsed >= secs * 1000000.0))
+			break;
+
+		/* The dispatcher and the chunk loops retry quietly; cmdstats still sees it */
+		cmdstats_totals(&before);
+		soak_iteration(c, &it, data, back, (unsigned long long)max_size, large);
+		cmdstats_totals(&after);
+		it.errors = after.errors - before.errors;
+		if (it.fail[0] != '\0') {
+			failed++;
+			in_a_row++;
+			errors_failed += it.errors;
+		} else {
+			in_a_row = 0;
+			if (it.errors > 0) {
+				recovered++;
+				errors_recovered += it.errors;
+			}
+			acc_add(&put, it.put_rate);
+			acc_add(&get, it.get_rate);
+			acc_add(&put_cmd, it.put_cmd_us);
+			acc_add(&get_cmd, it.get_cmd_us);
+		}
+		if (!quiet || it.fail[0] != '\0')
+			print_iter(n + 1, &it);
+		if (in_a_row >= SOAK_GIVE_UP) {
+			fprintf(stderr, "Error: %d failures in a row, giving up\n", SOAK_GIVE_UP);
+			n++;
+			break;
+		}
+	}
+	elapsed = scsi_now_us() - start;
+	sigaction(SIGINT, &old_int, NULL);
+	sigaction(SIGTERM, &old_term, NULL);
+	free(data);
+	free(back);
+
+	if (remove_scratch(c) != 0)
+		fprintf(stderr, "Warning: couldn't remove %s\n", SOAK_SCRATCH);
+
+	fprintf(stdout, "\n%lu iteration%s in %.1f s, %lu failed (%.2f%%), %lu recovered by retries (%.2f%%), seed %llu\n",
+		n, n == 1 ? "" : "s", elapsed / 1000000.0, failed, n > 0 ? failed * 100.0 / n : 0.0,
+		recovered, n > 0 ? recovered * 100.0 / n : 0.0, seed);
+	fprintf(stdout, "%lu command error%s: %lu in failed iterations, %lu retried successfully\n",
+		errors_failed + errors_recovered, errors_failed + errors_recovered == 1 ? "" : "s",
+		errors_failed, errors_recovered);
+	if (put.n > 0) {
+		fprintf(stdout, "\n%-12s %9s %9s %9s %9s\n", "Of the good", "avg", "sd", "min", "max");
+		print_acc("Put MB/s", &put, 1000000.0);
+		print_acc("Get MB/s", &get, 1000000.0);
+		print_acc("Put ms/cmd", &put_cmd, 1000.0);
+		print_acc("Get ms/cmd", &get_cmd, 1000.0);
+	}
+	if (own_stats)
+		cmdstats_report(stdout);
+
+	soak_log(c, log_file, failed > 0 || recovered > 0);
+	if (failed > 0 || n == 0)
+		return 1;
+	return recovered > 0 ? SOAK_RECOVERED : 0;
+}
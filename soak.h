@@ -0,0 +1,29 @@
+#ifndef SOAK_H
+#define SOAK_H
+
+#include "libbstoolbox.h"
+
+/*
+ * bstoolbox <device> soak [-n iterations] [-t time] [-s size] [-S seed]
+ * [-l file] [-x] [-q]: an acceptance test for a SCSI chain.  Each
+ * iteration writes a scratch file of random size and content with a
+ * random SEND_FILE_10 chunk size, in block or legacy mode, reads it back
+ * with a random GET_FILE chunk size and compares.  Failures are counted
+ * rather than fatal, and so are iterations that only worked because a
+ * command was retried; the summary gives both rates, the spread
+ * of throughput and command latency, and per-opcode latency percentiles.
+ * At the end the BlueSCSI log is fetched into the -l file, so failures
+ * can be matched with what the firmware saw.
+ */
+
+#define SOAK_SCRATCH      "bstoolbox-soak.tmp"
+#define SOAK_ITERATIONS   50		/* Without -n or -t */
+#define SOAK_SIZE         (1024 * 1024)	/* Largest file, -s */
+#define SOAK_LOG          "bluescsi-soak.log"
+#define SOAK_GIVE_UP      5		/* Failures in a row before stopping */
+#define SOAK_LOG_TAIL     20		/* Log lines shown after failures */
+#define SOAK_RECOVERED    2		/* Exit status: no failures, but retries */
+
+int soak_run(bs_ctx *c, const char *devpath, int argc, char **argv);
+
+#endif
@@ -0,0 +1,83 @@
+#!/bin/sh
+#
+# Smoke test of bstoolbox against the simulated BlueSCSI (sim:, see sim.c):
+# list, get, put, remove and CD change, checking what ends up on each side.
+#
+# Usage: tests/sim-smoke.sh [path to bstoolbox]
+#
+
+BSTOOLBOX=${1:-./bstoolbox}
+case $BSTOOLBOX in
+	/*) ;;
+	*) BSTOOLBOX=`pwd`/$BSTOOLBOX ;;
+esac
+
+WORK=`mktemp -d /tmp/bstoolbox-smoke.XXXXXX` || exit 1
+trap 'rm -rf "$WORK"' 0
+trap 'exit 1' 1 2 13 15
+ROOT=$WORK/card
+DEV=sim:$ROOT
+
+# Keep locks and caches out of the real ones
+BSTOOLBOX_LOCK_DIR=$WORK/lock
+BSTOOLBOX_CACHE_DIR=$WORK/cache
+export BSTOOLBOX_LOCK_DIR BSTOOLBOX_CACHE_DIR
+mkdir "$BSTOOLBOX_LOCK_DIR" "$BSTOOLBOX_CACHE_DIR" "$WORK/out" || exit 1
+
+mkdir -p "$ROOT/shared" "$ROOT/CD3" || exit 1
+head -c 300000 /dev/urandom > "$ROOT/shared/alpha.bin"
+head -c 70001 /dev/urandom > "$ROOT/shared/beta.bin"
+: > "$ROOT/shared/empty.bin"
+head -c 4096 /dev/urandom > "$ROOT/CD3/disc1.iso"
+head -c 4096 /dev/urandom > "$ROOT/CD3/disc2.iso"
+head -c 123457 /dev/urandom > "$WORK/upload.bin"
+
+failed=0
+
+fail()
+{
+	echo "FAIL: $*"
+	failed=1
+}
+
+run()
+{
+	(cd "$WORK/out" && "$BSTOOLBOX" "$DEV" "$@") > "$WORK/stdout" 2> "$WORK/stderr"
+}
+
+# -s lists the shared directory in order
+run -s || fail "-s exited with $?"
+for f in alpha.bin beta.bin empty.bin; do
+	grep -q " $f " "$WORK/stdout" || fail "-s doesn't list $f"
+done
+
+# -g fetches a file intact, and records it in the manifest
+run -g 0 || fail "-g 0 exited with $?"
+cmp -s "$ROOT/shared/alpha.bin" "$WORK/out/alpha.bin" || fail "-g 0 didn't fetch alpha.bin intact"
+grep -q " get alpha.bin" "$WORK/out/bstoolbox.manifest" 2>/dev/null || fail "-g 0 didn't write the manifest"
+
+# Errors go to stderr and the exit status
+run -g 42 && fail "-g 42 succeeded"
+grep -q "invalid file index" "$WORK/stderr" || fail "-g 42 didn't explain itself on stderr"
+
+# -p sends a file intact
+run -p "$WORK/upload.bin" || fail "-p exited with $?"
+cmp -s "$WORK/upload.bin" "$ROOT/shared/upload.bin" || fail "-p didn't send upload.bin intact"
+
+# -D removes by name pattern, and only what matches
+run -D 'up*.bin' || fail "-D exited with $?"
+[ -f "$ROOT/shared/upload.bin" ] && fail "-D didn't remove upload.bin"
+[ -f "$ROOT/shared/alpha.bin" ] || fail "-D removed alpha.bin"
+
+# -l and -c see the CD images for the target's SCSI ID
+run -l || fail "-l exited with $?"
+grep -q "disc2.iso" "$WORK/stdout" || fail "-l doesn't list disc2.iso"
+run -c 1 || fail "-c 1 exited with $?"
+
+if [ $failed -ne 0 ]; then
+	echo "Last stdout:"; cat "$WORK/stdout"
+	echo "Last stderr:"; cat "$WORK/stderr"
+	exit 1
+fi
+echo "sim smoke test passed"
+exit 0
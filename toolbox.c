@@ -0,0 +1,2316 @@
+/*
+ * BlueSCSI toolbox protocol: libbstoolbox, see libbstoolbox.h
+ *
+ * All state for a device lives in its bs_ctx.  The public bs_*() calls
+ * take the context lock and pick up any bus reset since the last call;
+ * the bluescsi_*() helpers below them assume the lock is held.
+ */
+#include <pthread.h>
+#include <ctype.h>
+
+#include "bstoolbox.h"
+#include "libbstoolbox.h"
+#include "transport.h"
+#include "checksum.h"
+#include "discover.h"
+#include "cache.h"
+#include "qos.h"
+#include "replay.h"
+
+int verbose = 0;
+
+struct bs_ctx {
+	pthread_mutex_t lock;
+	int dev;
+	char path[SCSI_PATH_LEN];
+	int scsi_id;
+	int verbose;
+	unsigned long resets;		/* scsi_reset_count() at the last call */
+
+	int device_list[8];
+	ToolboxFileEntry files[MAX_FILES];
+	int files_count;
+
+	char manifest[1024];		/* Empty for the one next to each file */
+	qos_state qos;			/* Applied to the get and send loops */
+
+	/*
+	 * files[] is reused while a COUNT_FILES still agrees with it, and
+	 * dropped by our own put, remove and SET_WDIR.  With listing_cache
+	 * set it is also kept on disk per device identity and working
+	 * directory, for later runs.
+	 */
+	int listing_cache;
+	struct {
+		int valid;
+		int wdir_known;
+		char wdir[256];
+	} listing;
+
+	/* Handshake state, see bluescsi_handshake() */
+	struct {
+		int have;		/* HS_* already established */
+		int cached;		/* ...from the discover cache */
+		int distrust;		/* Don't use the cache until we've refreshed it */
+		bs_probe fp;		/* Fingerprint to persist once complete */
+	} hs;
+
+	/* CD images of the target, see bluescsi_catalog() */
+	struct {
+		int valid;
+		int count;
+		bs_file cds[MAX_FILES];
+	} catalog;
+
+	/* -L -f: the working directory to go back to, see bs_log_begin() */
+	struct {
+		int active;
+		char orig_wdir[256];
+	} log;
+
+	bs_progress_fn progress;
+	void *progress_arg;
+	unsigned long long progress_us;	/* Clock at the last callback */
+	unsigned long long progress_done;	/* ...and bytes done then */
+	unsigned long long progress_next;	/* Don't look at the clock before this */
+
+	bs_stats stats;
+	char *buf;			/* Transfer buffer, GET_BUF_SIZE or SEND_BUF_SIZE */
+};
+
+static int bluescsi_listfiles(bs_ctx *c);
+static int bluescsi_getfile(bs_ctx *c, int idx, const char *outdir);
+
+/* Where the on-disk listing for the device with this identity lives */
+static int listing_file(char *out, size_t out_len, const char *identity)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), "listing-%08x",
+		crc32c_final(crc32c_update(crc32c_init(), identity, strlen(identity))));
+	return cache_path(out, out_len, name);
+}
+
+/*
+ * The directory contents changed under files[].  The on-disk copy goes
+ * too, even if this run isn't using it, so a later run can't pick it up.
+ */
+static void listing_forget_disk(bs_ctx *c)
+{
+	char path[1024];
+
+	if (c->hs.fp.identity[0] != '\0' &&
+	    listing_file(path, sizeof(path), c->hs.fp.identity) == 0)
+		unlink(path);
+}
+
+static void bluescsi_invalidate_listing(bs_ctx *c)
+{
+	c->listing.valid = 0;
+	listing_forget_disk(c);
+}
+
+/* Lock the context; a reset since the last call may mean a different image set */
+static void bs_enter(bs_ctx *c)
+{
+	unsigned long resets;
+
+	pthread_mutex_lock(&c->lock);
+	resets = scsi_reset_count(c->dev);
+	if (resets != c->resets) {
+		if (c->verbose)
+			fprintf(stdout, "%s: reset seen, repeating handshake\n", c->path);
+		c->listing.valid = 0;
+		c->listing.wdir_known = 0;
+		c->catalog.valid = 0;
+		c->hs.have = 0;
+		c->hs.cached = 0;
+		c->hs.distrust = 1;
+		c->resets = resets;
+	}
+}
+
+static void bs_leave(bs_ctx *c)
+{
+	pthread_mutex_unlock(&c->lock);
+}
+
+static void progress_begin(bs_ctx *c)
+{
+	c->progress_us = scsi_now_us();
+	c->progress_done = 0;
+	c->progress_next = 0;
+}
+
+/*
+ * Called after every chunk, but the clock is only read once enough bytes
+ * have gone by to be about half way to the next callback at the rate
+ * seen so far.  The gap between reads can at most double, so a transfer
+ * that slows down is caught within a few chunks.
+ */
+static void report_progress(bs_ctx *c, const char *name, unsigned long long done,
+		unsigned long long total)
+{
+	unsigned long long now, step;
+
+	if (c->progress == NULL || (done < total && done < c->progress_next))
+		return;
+	if (done >= total && total > 0 && c->progress_done >= total)
+		return;		/* The end was already reported */
+	now = scsi_now_us();
+	if (done < total && now - c->progress_us < BS_PROGRESS_US) {
+		step = (done - c->progress_done) * (BS_PROGRESS_US / 2) / (now - c->progress_us + 1);
+		if (step > done - c->progress_done)
+			step = done - c->progress_done;
+		c->progress_next = done + step;
+		return;
+	}
+	c->progress_next = done + (done - c->progress_done) / 2;
+	c->progress_us = now;
+	c->progress_done = done;
+	c->progress(c->progress_arg, name, done, total);
+}
+
+/* Record a finished transfer in the -M manifest or the one next to the local file */
+static void record_manifest(bs_ctx *c, const char *local_path, const char *name, unsigned long long size,
+		unsigned int crc, const char *direction)
+{
+	char path[1024];
+
+	if (c->manifest[0] != '\0')
+		snprintf(path, sizeof(path), "%s", c->manifest);
+	else
+		manifest_path_for(path, sizeof(path), local_path);
+
+	if (c->verbose)
+		fprintf(stdout, "%s: crc32c %08x (%s) -> %s\n", name, crc, crc32c_impl(), path);
+	manifest_append(path, name, size, crc, direction);
+}
+
+/*
+ * Send one idempotent command (GET_FILE, SEND_FILE_10, listings and other
+ * reads), retrying it on transient bus errors with a bounded exponential
+ * backoff.
+ * Fatal errors and exhausted retries are returned to the caller.
+ */
+static int bluescsi_xfer(bs_ctx *c, unsigned char *cmd, int cmd_len, unsigned char *buf, int len, int write)
+{
+	unsigned long backoff = XFER_BACKOFF_US;
+	int attempt;
+	int ret;
+	int cls;
+
+	for (attempt = 0; ; attempt++)
+	{
+		if (write)
+			ret = scsi_send_commandw(c->dev, cmd, cmd_len, buf, len);
+		else
+			ret = scsi_send_command(c->dev, cmd, cmd_len, buf, len);
+		if (ret == 0)
+			return 0;
+
+		cls = scsi_last_class(c->dev);
+		if (!scsi_class_retryable(cls) || attempt >= XFER_RETRIES)
+			return ret;
+
+		fprintf(stderr, "Warning: command 0x%02x hit %s, retrying (%d/%d)\n",
+			cmd[0], scsi_class_name(cls), attempt + 1, XFER_RETRIES);
+		usleep(backoff);
+		if (backoff < XFER_BACKOFF_MAX_US)
+			backoff *= 2;
+	}
+}
+
+static unsigned long long size_to_long(const unsigned char size[5])
+{
+        int i;
+        unsigned long long result = 0;
+        for (i = 0; i < 5; i++)
+        {
+                result = (result << 8) | size[i];
+        }
+        return result;
+}
+
+/* One shared transfer buffer per context, big enough for either direction */
+static char *xfer_buf(bs_ctx *c)
+{
+	if (c->buf == NULL)
+		c->buf = (char *)malloc(GET_BUF_SIZE > SEND_BUF_SIZE ? GET_BUF_SIZE : SEND_BUF_SIZE);
+	return c->buf;
+}
+
+/*
+ * BLUESCSI_TOOLBOX_METADATA (0xD9) Subcommands
+ */
+
+/* Subcommand 0x00 - List Devices */
+static int bluescsi_metadata_list_devices(bs_ctx *c, unsigned char dev_map[8])
+{
+	unsigned char cmd[10];
+	unsigned char buf[8];
+	int i;
+
+	memset(cmd, 0, sizeof(cmd));
+	cmd[0] = BLUESCSI_TOOLBOX_METADATA;
+	cmd[1] = BLUESCSI_TOOLBOX_METADATA_LIST_DEVICES;
+	cmd[8] = 0x08; /* Allocation length = 8 bytes */
+
+	memset(buf, 0xFF, sizeof(buf));
+
+	if (bluescsi_xfer(c, cmd, sizeof(cmd), buf, sizeof(buf), 0) != 0)
+	{
+		if (c->verbose)
+			fprintf(stderr, "Error: metadata list_devices command failed - %s\n", strerror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < 8; i++)
+	{
+		dev_map[i] = buf[i];
+	}
+
+	return 0;
+}
+
+/* Subcommand 0x01 - Get Capabilities */
+static int bluescsi_metadata_get_capabilities(bs_ctx *c, unsigned char *api_ver, unsigned char *caps)
+{
+	unsigned char cmd[10];
+	unsigned char buf[8];
+
+	memset(cmd, 0, sizeof(cmd));
+	cmd[0] = BLUESCSI_TOOLBOX_METADATA;
+	cmd[1] = BLUESCSI_TOOLBOX_METADATA_GET_CAP;
+	cmd[8] = 0x08; /* Allocation length = 8 bytes */
+
+	memset(buf, 0, sizeof(buf));
+
+	if (bluescsi_xfer(c, cmd, sizeof(cmd), buf, sizeof(buf), 0) != 0)
+	{
+		/* Legacy devices return CHECK_CONDITION: default to API v0 and no capabilities */
+		if (c->verbose)
+			fprintf(stdout, "Metadata get_capabilities unsupported, assuming legacy device (API v0, no caps)\n");
+		*api_ver = 0;
+		*caps = 0;
+		return 0;
+	}
+
+	*api_ver = buf[0];
+	*caps = buf[1];
+
+	if (c->verbose)
+	{
+		fprintf(stdout, "Toolbox Metadata API Version: %u\n", *api_ver);
+		fprintf(stdout, "Capability Flags: 0x%02X\n", *caps);
+		fprintf(stdout, " - CAP_LARGE_TRANSFERS: %s\n", (*caps & 0x01) ? "Yes" : "No");
+		fprintf(stdout, " - CAP_LARGE_SEND     : %s\n", (*caps & 0x02) ? "Yes" : "No");
+		fprintf(stdout, " - CAP_SET_WORKING_DIR: %s\n", (*caps & 0x04) ? "Yes" : "No");
+	}
+
+	return 0;
+}
+
+static int bluescsi_metadata_set_working_dir(bs_ctx *c, const char *path)
+{
+	unsigned char cmd[10];
+	size_t path_len;
+	int ret;
+
+	if (c->verbose)
+		fprintf(stdout, "Setting working directory to: %s\n", path);
+
+	path_len = (path != NULL) ? strlen(path) : 0;
+	if (path_len > 64)
+	{
+		fprintf(stderr, "Error: working directory path exceeds maximum length of 64 bytes\n");
+		return -1;
+	}
+	else if (path_len == 0)
+	{
+		fprintf(stdout, "Error: set working dir path_len was zero\n");
+		return -1;
+	}
+
+	memset(cmd, 0, sizeof(cmd));
+	cmd[0] = BLUESCSI_TOOLBOX_METADATA;
+	cmd[1] = BLUESCSI_TOOLBOX_METADATA_SET_WDIR;
+	cmd[8] = (unsigned char)path_len; /* Path length in bytes (DATA_OUT) */
+
+	/* Same contents on disk, but we're looking somewhere else now */
+	c->listing.valid = 0;
+	c->listing.wdir_known = 0;
+	ret = scsi_send_commandw(c->dev, cmd, sizeof(cmd), (unsigned char *)path, (int)path_len);
+	if (ret != 0)
+	{
+		fprintf(stderr, "Error: set_working_dir failed - %s\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int bluescsi_metadata_get_working_dir(bs_ctx *c, char *out, size_t out_len)
+{
+        unsigned char cmd[10];
+        unsigned char buf[256];
+        size_t req_len;
+        int ret;
+
+        req_len = 255; /* Cap at 255 bytes so cmd[8] fits and leaves room for '\0' */
+
+        memset(cmd, 0, sizeof(cmd));
+        cmd[0] = BLUESCSI_TOOLBOX_METADATA;
+        cmd[1] = BLUESCSI_TOOLBOX_METADATA_GET_WDIR;
+        cmd[7] = (unsigned char)((req_len >> 8) & 0xFF);
+        cmd[8] = (unsigned char)(req_len & 0xFF);
+
+        memset(buf, 0, sizeof(buf));
+
+        ret = bluescsi_xfer(c, cmd, sizeof(cmd), buf, (int)req_len, 0);
+        if (ret != 0)
+        {
+                fprintf(stderr, "Error: get_working_dir failed - %s\n", strerror(errno));
+                return -1;
+        }
+
+        buf[255] = '\0';
+        snprintf(out, out_len, "%s", (char *)buf);
+
+        if (c->verbose)
+                fprintf(stdout, "Current working directory: %s\n", out);
+
+        return 0;
+}
+
+static void listing_save(bs_ctx *c);
+
+/*
+ * File file_num is gone: the firmware lists the directory in a stable
+ * order, so the entries after it just move up one, and files[] stays
+ * good without a new COUNT_FILES/MODE_FILES.
+ */
+static void listing_drop(bs_ctx *c, int file_num)
+{
+	int i;
+
+	if (!c->listing.valid) {
+		bluescsi_invalidate_listing(c);
+		return;
+	}
+	for (i = 0; i < c->files_count && c->files[i].index != file_num; i++)
+		;
+	if (i == c->files_count) {
+		bluescsi_invalidate_listing(c);
+		return;
+	}
+	memmove(&c->files[i], &c->files[i + 1], (c->files_count - i - 1) * sizeof(c->files[0]));
+	c->files_count--;
+	for (; i < c->files_count; i++)
+		c->files[i].index--;
+
+	if (c->listing_cache)
+		listing_save(c);
+	else
+		listing_forget_disk(c);
+}
+
+/*
+ * Subcommand 0x04 - Remove File
+ */
+static int bluescsi_remove_file(bs_ctx *c, int file_num)
+{
+	unsigned char cmd[10];
+
+	if (c->verbose)
+		fprintf(stdout, "Removing file number: %d\n", file_num);
+
+	if (file_num < 0 || file_num > 255)
+	{
+		fprintf(stderr, "Error: file number %d out of range (0-255)\n", file_num);
+		return -1;
+	}
+
+	memset(cmd, 0, sizeof(cmd));
+	cmd[0] = BLUESCSI_TOOLBOX_METADATA;
+	cmd[1] = BLUESCSI_TOOLBOX_METADATA_REMOVE_FILE;
+	cmd[8] = (unsigned char)file_num;
+
+	if (scsi_send_command(c->dev, cmd, sizeof(cmd), NULL, 0) != 0)
+	{
+		fprintf(stderr, "Error: metadata remove_file failed - %s\n", strerror(errno));
+		bluescsi_invalidate_listing(c);
+		return -1;
+	}
+	listing_drop(c, file_num);
+
+	if (c->verbose)
+		fprintf(stdout, "File #%d successfully removed.\n", file_num);
+
+	return 0;
+}
+
+/*
+ * Find log.txt in the root directory, which must be the working
+ * directory.  The log grows without the file count changing, so this
+ * always fetches a new listing rather than trusting a cached one.
+ */
+static int log_locate(bs_ctx *c, unsigned long long *size)
+{
+	int keep = c->listing_cache;
+	int ret;
+	int i;
+
+	c->listing.valid = 0;
+	c->listing_cache = 0;
+	ret = bluescsi_listfiles(c);
+	c->listing_cache = keep;
+	if (ret != 0)
+	{
+		fprintf(stderr, "Error: get_log failed to list root directory files\n");
+		return -1;
+	}
+
+	for (i = 0; i < c->files_count; i++)
+	{
+		if (strcasecmp(c->files[i].name, "log.txt") == 0)
+		{
+			if (size != NULL)
+				*size = size_to_long(c->files[i].size);
+			return c->files[i].index;
+		}
+	}
+	fprintf(stderr, "Error: log.txt not found in root directory\n");
+	return -1;
+}
+
+/*
+ * Write log.txt from *offset up to size to out, fetching only the 4 KB
+ * blocks that hold those bytes.  A log that got shorter was restarted, so
+ * it is shown again from the top.
+ */
+static int bluescsi_read_log(bs_ctx *c, int idx, unsigned long long size,
+		unsigned long long *offset, FILE *out)
+{
+	unsigned char cmd[10];
+	unsigned long long blk, blk_bytes;
+	size_t skip, len;
+	char *buf;
+	int blocks;
+
+	if (*offset > size)
+	{
+		fprintf(stderr, "Note: log.txt was truncated, following from the start\n");
+		*offset = 0;
+	}
+	if ((buf = xfer_buf(c)) == NULL)
+	{
+		fprintf(stderr, "Error: malloc failed for receive buffer\n");
+		return -1;
+	}
+
+	blk = *offset / GET_BLOCK_SIZE;
+	skip = (size_t)(*offset % GET_BLOCK_SIZE);
+	while (*offset < size)
+	{
+		blk_bytes = size - blk * GET_BLOCK_SIZE;
+		blocks = (int)((blk_bytes + GET_BLOCK_SIZE - 1) / GET_BLOCK_SIZE);
+		if (blocks > GET_BLOCKS_PER_XFER)
+			blocks = GET_BLOCKS_PER_XFER;
+
+		memset(cmd, 0, sizeof(cmd));
+		cmd[0] = BLUESCSI_TOOLBOX_GET_FILE;
+		cmd[1] = (unsigned char)(idx & 0xFF);
+		cmd[2] = (unsigned char)((blk >> 24) & 0xFF);
+		cmd[3] = (unsigned char)((blk >> 16) & 0xFF);
+		cmd[4] = (unsigned char)((blk >>  8) & 0xFF);
+		cmd[5] = (unsigned char)((blk      ) & 0xFF);
+		cmd[6] = (unsigned char)blocks;
+
+		if (bluescsi_xfer(c, cmd, sizeof(cmd), (unsigned char *)buf, blocks * GET_BLOCK_SIZE, 0) != 0)
+		{
+			fprintf(stderr, "Error: get_log failed at block %llu - %s\n", blk, strerror(errno));
+			return -1;
+		}
+		c->stats.bytes_in += (unsigned long long)blocks * GET_BLOCK_SIZE;
+
+		len = (size_t)(blk_bytes < (unsigned long long)blocks * GET_BLOCK_SIZE ?
+			blk_bytes : (unsigned long long)blocks * GET_BLOCK_SIZE) - skip;
+		if (fwrite(buf + skip, 1, len, out) != len)
+			return -1;
+		*offset += len;
+		blk += blocks;
+		skip = 0;
+	}
+	return 0;
+}
+
+/* Helper function that stores the current working dir,
+ * switches to / and grabs the log */
+static int bluescsi_get_log(bs_ctx *c, const char *outdir, FILE *out)
+{
+	char orig_wdir[256];
+	char log_filepath[1024];
+	int log_idx = -1;
+	int ret = 0;
+	FILE *fd;
+	int ch;
+
+	/* 1. Get and store original working directory */
+	if (bluescsi_metadata_get_working_dir(c, orig_wdir, sizeof(orig_wdir)) != 0)
+	{
+		fprintf(stderr, "Error: get_log couldn't determine original working directory\n");
+		return -1;
+	}
+
+	/* 2. Change working directory to root ("/") */
+	if (bluescsi_metadata_set_working_dir(c, "/") != 0)
+	{
+		fprintf(stderr, "Error: get_log couldn't change working directory to root\n");
+		return -1;
+	}
+
+	/* 3. List files in root directory to locate "log.txt" */
+	if ((log_idx = log_locate(c, NULL)) < 0)
+	{
+		ret = -1;
+		goto restore_wdir;
+	}
+
+	/* 4. Download log.txt directly into specified output directory */
+	if (bluescsi_getfile(c, log_idx, outdir) != 0)
+	{
+		fprintf(stderr, "Error: get_log failed to fetch log file\n");
+		ret = -1;
+		goto restore_wdir;
+	}
+
+	/* Construct local path to read log.txt from outdir */
+	if (outdir != NULL && strlen(outdir) > 0 && outdir[strlen(outdir) - 1] == '/')
+		snprintf(log_filepath, sizeof(log_filepath), "%slog.txt", outdir);
+	else
+		snprintf(log_filepath, sizeof(log_filepath), "%s/log.txt", (outdir && strlen(outdir) > 0) ? outdir : ".");
+
+	/* 5. Copy log.txt contents to out */
+	fd = fopen(log_filepath, "r");
+	if (fd == NULL)
+	{
+		fprintf(stderr, "Error: get_log couldn't open fetched log file %s\n", log_filepath);
+		ret = -1;
+		goto restore_wdir;
+	}
+
+	while ((ch = fgetc(fd)) != EOF)
+	{
+		fputc(ch, out);
+	}
+	fclose(fd);
+
+	/* Clean up downloaded log file */
+	//unlink(log_filepath);
+
+restore_wdir:
+	/* 6. Restore original working directory */
+	if (bluescsi_metadata_set_working_dir(c, orig_wdir) != 0)
+	{
+		fprintf(stderr, "Warning: failed to restore working directory to %s\n", orig_wdir);
+		ret = -1;
+	}
+
+	return ret;
+}
+/*
+ * Sending Files (Host -> BlueSCSI / shared)
+ */
+static int bluescsi_sendfile(bs_ctx *c, const char *path)
+{
+	char cmd[10];
+	char filename[NAME_BUF_SIZE];
+	const char *base_name;
+	char *send_buf;
+	long int bytes_read = 0;
+	long int actual_read = 0;
+	long int blk_offset = 0; /* Offset in 512-byte blocks */
+	int num_blocks;
+	int ret;
+	FILE *fd;
+	long int filesize;
+	struct stat st;
+	unsigned int crc = crc32c_init();
+	unsigned long resets;
+	unsigned long long start;
+	int restarts = 0;
+
+	if (c->verbose)
+		fprintf(stdout, "sendfile: %s\n", path);
+
+	/* Extract base filename */
+	base_name = strrchr(path, '/');
+	if (base_name == NULL) {
+		base_name = path;
+	} else {
+		base_name++;
+	}
+
+	if (strlen(base_name) >= NAME_BUF_SIZE) {
+		fprintf(stderr, "Error: sendfile Filename too long: %s\n", base_name);
+		return -1;
+	}
+
+	memset(filename, 0, NAME_BUF_SIZE);
+	strncpy(filename, base_name, NAME_BUF_SIZE - 1);
+
+	/* Open file */
+	fd = fopen(path, "rb");
+	if (fd == NULL) {
+		fprintf(stderr, "Error: sendfile couldn't open %s\n", path);
+		return -1;
+	}
+
+	if (stat(path, &st) == 0) {
+		if (c->verbose)
+			printf("File size of %s is %lld bytes\n", filename, (long long)st.st_size);
+	} else {
+		fprintf(stderr, "Error: sendfile couldn't stat %s\n", path);
+		fclose(fd);
+		return -1;
+	}
+	filesize = st.st_size;
+
+	send_buf = xfer_buf(c);
+	if (send_buf == NULL) {
+		fprintf(stderr, "Error: sendfile couldn't allocate send buffer\n");
+		fclose(fd);
+		return -1;
+	}
+
+	resets = scsi_reset_count(c->dev);
+	bluescsi_invalidate_listing(c);
+	start = scsi_now_us();
+
+restart:
+	progress_begin(c);
+	/* 1. Send BLUESCSI_TOOLBOX_SEND_FILE_PREP (0xD3) */
+	memset(cmd, 0, sizeof(cmd));
+	cmd[0] = BLUESCSI_TOOLBOX_SEND_FILE_PREP;
+	if (bluescsi_xfer(c, (unsigned char *)cmd, sizeof(cmd), (unsigned char *)filename, 33, 1) != 0) {
+		fprintf(stderr, "Error: sendfileprep failed - %s\n", strerror(errno));
+		goto fail;
+	}
+
+	/* 2. Send Data Blocks via BLUESCSI_TOOLBOX_SEND_FILE_10 (0xD4) */
+	while (bytes_read < filesize) {
+		long int chunk = (filesize - bytes_read) < SEND_BUF_SIZE ? (filesize - bytes_read) : SEND_BUF_SIZE;
+		memset(send_buf, 0, SEND_BUF_SIZE);
+
+		actual_read = fread(send_buf, 1, chunk, fd);
+		if (actual_read <= 0) {
+			fprintf(stderr, "Error: fread failed or returned 0 at offset %ld\n", bytes_read);
+			goto fail;
+		}
+
+		memset(cmd, 0, sizeof(cmd));
+		cmd[0] = BLUESCSI_TOOLBOX_SEND_FILE_10;
+
+		/* CDB[3..5]: 24-bit big endian block offset (512-byte blocks) */
+		cmd[3] = (unsigned char)((blk_offset >> 16) & 0xFF);
+		cmd[4] = (unsigned char)((blk_offset >>  8) & 0xFF);
+		cmd[5] = (unsigned char)((blk_offset      ) & 0xFF);
+
+		if (actual_read % SEND_BLOCK_SIZE == 0) {
+			/* Block Mode: Transfer size = CDB[6] * 512 bytes */
+			num_blocks = actual_read / SEND_BLOCK_SIZE;
+			cmd[1] = 0;
+			cmd[2] = 0;
+			cmd[6] = (unsigned char)(num_blocks & 0xFF);
+		} else {
+			/* Legacy Mode: CDB[6] = 0, CDB[1..2] = raw byte count */
+			num_blocks = (actual_read + SEND_BLOCK_SIZE - 1) / SEND_BLOCK_SIZE;
+			cmd[1] = (unsigned char)((actual_read >> 8) & 0xFF);
+			cmd[2] = (unsigned char)(actual_read & 0xFF);
+			cmd[6] = 0;
+		}
+
+		qos_begin(&c->qos, actual_read);
+		ret = bluescsi_xfer(c, (unsigned char *)cmd, sizeof(cmd), (unsigned char *)send_buf, actual_read, 1);
+		qos_end(&c->qos, actual_read);
+		if (scsi_reset_count(c->dev) != resets)
+			goto reset;
+		if (ret != 0) {
+			fprintf(stderr, "Error: sendfile10 failed at block %ld - %s\n", blk_offset, strerror(errno));
+			goto fail;
+		}
+
+		crc = crc32c_update(crc, send_buf, actual_read);
+		bytes_read += actual_read;
+		blk_offset += num_blocks;
+		report_progress(c, filename, bytes_read, filesize);
+	}
+
+	/* 3. Send BLUESCSI_TOOLBOX_SEND_FILE_END (0xD5) */
+	memset(cmd, 0, sizeof(cmd));
+	cmd[0] = BLUESCSI_TOOLBOX_SEND_FILE_END;
+
+	ret = scsi_send_command(c->dev, (unsigned char *)cmd, sizeof(cmd), NULL, 0);
+	if (scsi_reset_count(c->dev) != resets)
+		goto reset;
+	if (ret != 0) {
+		fprintf(stderr, "Error: sendfileend failed - %s\n", strerror(errno));
+		goto fail;
+	}
+
+	fclose(fd);
+	report_progress(c, filename, filesize, filesize);
+	c->stats.files_out++;
+	c->stats.bytes_out += filesize;
+	c->stats.xfer_us += scsi_now_us() - start;
+	record_manifest(c, path, filename, (unsigned long long)filesize, crc32c_final(crc), "put");
+	return 0;
+
+reset:
+	/* The target lost the open file, start the whole sequence again */
+	if (restarts++ < SEND_RESTARTS && fseek(fd, 0, SEEK_SET) == 0) {
+		fprintf(stderr, "Bus reset during transfer, restarting %s (attempt %d)\n", filename, restarts);
+		resets = scsi_reset_count(c->dev);
+		bytes_read = 0;
+		blk_offset = 0;
+		crc = crc32c_init();
+		goto restart;
+	}
+	fprintf(stderr, "Error: sendfile giving up on %s after %d restarts\n", filename, SEND_RESTARTS);
+
+fail:
+	fclose(fd);
+	return -1;
+}
+
+/*
+ * Debug control
+ */
+static int bluescsi_getdebug (bs_ctx *c)
+{
+	int ret;
+	char cmd[10] = {BLUESCSI_TOOLBOX_TOGGLE_DEBUG, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+	char buf[1];
+	cmd[1] = DEBUG_GET;
+	memset(buf, 0, sizeof(buf));
+	if (bluescsi_xfer(c, (unsigned char *)cmd, sizeof(cmd), (unsigned char *)buf, sizeof(buf), 0) != 0)
+	{
+		fprintf (stderr, "Error: getdebug failed - %s\n", strerror(errno));
+		return -1;
+	}
+	ret = buf[0];
+	return ret;
+}
+
+static int bluescsi_setdebug (bs_ctx *c, int value)
+{
+	char cmd[10] = {BLUESCSI_TOOLBOX_TOGGLE_DEBUG, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+	if (value > 1)
+		value = 1;
+	else if (value < 0)
+		value = 0;
+	cmd[1] = DEBUG_SET;
+	cmd[2] = value;
+	if (scsi_send_command(c->dev, (unsigned char *)cmd, sizeof(cmd), (unsigned char *)NULL, 0) != 0)
+	{
+		fprintf (stderr, "Error: BlueSCSI setdebug failed - %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (c->verbose)
+		fprintf (stdout, "Debug mode set to: %i\n", bluescsi_getdebug (c));
+	return 0;
+}
+
+static int bluescsi_countfiles(bs_ctx *c)
+{
+	char cmd[10] = {BLUESCSI_TOOLBOX_COUNT_FILES, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+	char buf[1];
+	int ret;
+	memset(buf, 0, sizeof(buf));
+	if (bluescsi_xfer(c, (unsigned char *)cmd, sizeof(cmd), (unsigned char *)buf, sizeof(buf), 0) != 0)
+	{
+		fprintf (stderr, "Error: countfiles failed - %s\n", strerror(errno));
+		return -1;
+	}
+	ret = buf[0];
+	return ret;
+}
+
+/*
+ * The CD catalog in one round trip: MODE_CDS with room for MAX_FILES
+ * entries instead of a COUNT_CDS first.  The target sends only the
+ * entries it has and the rest of the buffer stays zero.  The image set
+ * only changes with the SD card, which takes a reboot of the BlueSCSI, so
+ * the catalog is kept until a reset unless fresh is set.
+ */
+static int bluescsi_catalog(bs_ctx *c, int fresh)
+{
+	char cmd[10] = {BLUESCSI_TOOLBOX_MODE_CDS, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+	ToolboxFileEntry *buf;
+	int buf_size;
+	int n;
+
+	if (c->catalog.valid && !fresh)
+		return 0;
+
+	buf_size = sizeof(ToolboxFileEntry) * MAX_FILES;
+	buf = (ToolboxFileEntry *)malloc(buf_size);
+	if (buf == NULL)
+	{
+		fprintf (stderr, "Error: failed to malloc %i bytes: - %s\n", buf_size, strerror(errno));
+		return -1;
+	}
+
+	memset(buf, 0, buf_size);
+	if (bluescsi_xfer(c, (unsigned char *)cmd, sizeof(cmd), (unsigned char *)buf, buf_size, 0) != 0)
+	{
+		fprintf (stderr, "Error: listcds failed - %s\n", strerror(errno));
+		free(buf);
+		return -1;
+	}
+	for (n = 0; n < MAX_FILES && buf[n].name[0] != '\0'; n++)
+	{
+		c->catalog.cds[n].index = buf[n].index;
+		c->catalog.cds[n].type = buf[n].type;
+		snprintf(c->catalog.cds[n].name, sizeof(c->catalog.cds[n].name), "%.*s", NAME_BUF_SIZE - 1, buf[n].name);
+		c->catalog.cds[n].size = size_to_long(buf[n].size);
+	}
+	free(buf);
+	c->catalog.count = n;
+	c->catalog.valid = 1;
+	if (c->verbose)
+		fprintf (stdout, "Found %i CDs\n", n);
+	return 0;
+}
+
+static int bluescsi_setnextcd(bs_ctx *c, int num)
+{
+	char cmd[10];
+	memset(cmd, 0, sizeof(cmd));
+	cmd[0] = BLUESCSI_TOOLBOX_SET_NEXT_CD;
+
+	if (bluescsi_catalog(c, 0) != 0)
+		return -1;
+	if (num < 0 || num >= c->catalog.count)
+	{
+		fprintf (stderr, "setnextcd: %i is out of range, there are %i CDs\n", num, c->catalog.count);
+		return -1;
+	}
+
+	cmd[1] = num;
+	if (c->verbose)
+		fprintf (stdout, "%i set as next CD\n", cmd[1]);
+	if (scsi_send_command(c->dev, (unsigned char *)cmd, 10, (unsigned char *)NULL, 0) != 0)
+	{
+		fprintf (stderr, "Error: setnextcd failed - %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Get the emulated drive to present the image SET_NEXT_CD chose: allow
+ * removal (so no host lock pins the old medium), load, then poll TEST
+ * UNIT READY and READ CAPACITY until the new medium answers.  No eject:
+ * the firmware moves on to the following image when the tray opens.
+ */
+static int bluescsi_media_change(bs_ctx *c, int num)
+{
+	unsigned char allow[6] = { SCSI_PREVENT_ALLOW, 0, 0, 0, 0x00, 0 };
+	unsigned char load[6] = { SCSI_START_STOP_UNIT, 0, 0, 0, 0x03, 0 };
+	unsigned char tur[6] = { SCSI_TEST_UNIT_READY, 0, 0, 0, 0, 0 };
+	unsigned char cap_cmd[10] = { SCSI_READ_CAPACITY, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+	unsigned char cap[8];
+	unsigned long long start, blocks;
+	unsigned long block_len;
+	int polls = 0;
+
+	start = scsi_now_us();
+	if (scsi_send_command(c->dev, allow, sizeof(allow), NULL, 0) != 0 && c->verbose)
+		fprintf(stdout, "ALLOW MEDIUM REMOVAL failed - %s\n", strerror(errno));
+	if (scsi_send_command(c->dev, load, sizeof(load), NULL, 0) != 0 && c->verbose)
+		fprintf(stdout, "START STOP UNIT (load) failed - %s\n", strerror(errno));
+
+	for (;;) {
+		polls++;
+		memset(cap, 0, sizeof(cap));
+		if (scsi_send_command(c->dev, tur, sizeof(tur), NULL, 0) == 0 &&
+		    scsi_send_command(c->dev, cap_cmd, sizeof(cap_cmd), cap, sizeof(cap)) == 0)
+			break;
+		if (scsi_now_us() - start > MEDIA_READY_TIMEOUT_US) {
+			fprintf(stderr, "Error: CD %i not ready after %i s\n", num, MEDIA_READY_TIMEOUT_US / 1000000);
+			return -1;
+		}
+		usleep(MEDIA_POLL_US);
+	}
+
+	blocks = (((unsigned long long)cap[0] << 24) | (cap[1] << 16) | (cap[2] << 8) | cap[3]) + 1;
+	block_len = ((unsigned long)cap[4] << 24) | (cap[5] << 16) | (cap[6] << 8) | cap[7];
+	c->stats.cd_switches++;
+	c->stats.cd_switch_us = scsi_now_us() - start;
+	fprintf (stdout, "CD %i ready, %.1f MB, in %.1f ms\n", num,
+		(double)(blocks * block_len) / (1024 * 1024), c->stats.cd_switch_us / 1000.0);
+	if (c->verbose)
+		fprintf (stdout, "%llu blocks of %lu bytes, %i polls\n", blocks, block_len, polls);
+	return 0;
+}
+
+static int bluescsi_listcds(bs_ctx *c, bs_file *out, int max)
+{
+	int i;
+
+	if (bluescsi_catalog(c, 1) != 0)
+		return -1;
+	for (i = 0; i < c->catalog.count && i < max; i++)
+		out[i] = c->catalog.cds[i];
+	return c->catalog.count;
+}
+
+/* Lower case letters and digits only, and no extension, for fuzzy matches */
+static void cd_key(const char *name, char *out, size_t out_len)
+{
+	const char *dot = strrchr(name, '.');
+	size_t n = 0;
+
+	for (; *name != '\0' && name != dot && n + 1 < out_len; name++)
+		if (isalnum((unsigned char)*name))
+			out[n++] = (char)tolower((unsigned char)*name);
+	out[n] = '\0';
+}
+
+static int edit_distance(const char *a, const char *b)
+{
+	int row[NAME_BUF_SIZE + 1];
+	int lb = strlen(b);
+	int i, j, diag, up;
+
+	for (j = 0; j <= lb; j++)
+		row[j] = j;
+	for (i = 1; a[i - 1] != '\0'; i++) {
+		diag = row[0];
+		row[0] = i;
+		for (j = 1; j <= lb; j++) {
+			up = row[j];
+			row[j] = diag + (a[i - 1] != b[j - 1]);
+			if (up + 1 < row[j])
+				row[j] = up + 1;
+			if (row[j - 1] + 1 < row[j])
+				row[j] = row[j - 1] + 1;
+			diag = up;
+		}
+	}
+	return row[lb];
+}
+
+/* Typos between want and key, or the start of key when want is shorter */
+static int fuzzy_distance(const char *want, const char *key)
+{
+	char head[NAME_BUF_SIZE];
+	int len = strlen(want);
+	int best, d, l;
+
+	best = edit_distance(want, key);
+	for (l = len - 1; l <= len + 1; l++) {
+		if (l < 1 || l >= (int)strlen(key))
+			continue;
+		snprintf(head, sizeof(head), "%.*s", l, key);
+		if ((d = edit_distance(want, head)) < best)
+			best = d;
+	}
+	return best;
+}
+
+/*
+ * Pick the CD a name refers to.  In order: the exact file name, then
+ * ignoring case, punctuation and extension the same name, a unique
+ * prefix, a unique substring, and last the closest name (or start of a
+ * name) within a few typos, at most one per three letters.  Ambiguous names list the candidates and match nothing.
+ */
+static int cd_key_matches(const char *key, const char *want, int pass)
+{
+	if (pass == 0)
+		return strcmp(key, want) == 0;
+	if (pass == 1)
+		return strncmp(key, want, strlen(want)) == 0;
+	return strstr(key, want) != NULL;
+}
+
+static int bluescsi_find_cd(bs_ctx *c, const char *name)
+{
+	char want[NAME_BUF_SIZE], key[NAME_BUF_SIZE];
+	int best = -1, best_dist = 0, tie = 0;
+	int found, pass, dist, i;
+
+	if (bluescsi_catalog(c, 0) != 0)
+		return -1;
+	for (i = 0; i < c->catalog.count; i++)
+		if (strcasecmp(c->catalog.cds[i].name, name) == 0)
+			return c->catalog.cds[i].index;
+
+	cd_key(name, want, sizeof(want));
+	if (want[0] == '\0') {
+		fprintf (stderr, "Error: no CD matches \"%s\"\n", name);
+		return -1;
+	}
+
+	for (pass = 0; pass < 3; pass++) {
+		found = -1;
+		for (i = 0; i < c->catalog.count; i++) {
+			cd_key(c->catalog.cds[i].name, key, sizeof(key));
+			if (!cd_key_matches(key, want, pass))
+				continue;
+			if (found >= 0) {
+				fprintf (stderr, "Error: \"%s\" matches more than one CD:\n", name);
+				for (i = 0; i < c->catalog.count; i++) {
+					cd_key(c->catalog.cds[i].name, key, sizeof(key));
+					if (cd_key_matches(key, want, pass))
+						fprintf (stderr, "  #%i %s\n", c->catalog.cds[i].index, c->catalog.cds[i].name);
+				}
+				return -1;
+			}
+			found = i;
+		}
+		if (found >= 0)
+			goto matched;
+	}
+
+	for (i = 0; i < c->catalog.count; i++) {
+		cd_key(c->catalog.cds[i].name, key, sizeof(key));
+		dist = fuzzy_distance(want, key);
+		if (best < 0 || dist < best_dist) {
+			best = i;
+			best_dist = dist;
+			tie = 0;
+		}
+		else if (dist == best_dist)
+			tie = 1;
+	}
+	if (best < 0 || tie || best_dist > CD_MATCH_TYPOS || best_dist > (int)strlen(want) / 3) {
+		fprintf (stderr, "Error: no CD matches \"%s\", try -l\n", name);
+		return -1;
+	}
+	found = best;
+
+matched:
+	fprintf (stdout, "\"%s\" is CD %i, %s\n", name, c->catalog.cds[found].index, c->catalog.cds[found].name);
+	return c->catalog.cds[found].index;
+}
+
+/*
+ * The working directory the listing belongs to, for the on-disk key.
+ * Firmware without SET_WDIR support always lists the same directory.
+ */
+static const char *listing_wdir(bs_ctx *c)
+{
+	if (c->listing.wdir_known)
+		return c->listing.wdir;
+	if (!(c->hs.have & HS_CAPS))
+		return NULL;
+	if (c->hs.fp.caps & 0x04) {
+		if (bluescsi_metadata_get_working_dir(c, c->listing.wdir, sizeof(c->listing.wdir)) != 0)
+			return NULL;
+	}
+	else
+		c->listing.wdir[0] = '\0';
+	c->listing.wdir_known = 1;
+	return c->listing.wdir;
+}
+
+/*
+ * On-disk listing: identity, working directory and count, then one
+ * index, type, size (hex bytes) and name per line.
+ */
+static int listing_load(bs_ctx *c, int num_files)
+{
+	char path[1024];
+	char line[NAME_BUF_SIZE + 64];
+	char want[512];
+	const char *wdir;
+	unsigned int b[5];
+	int idx, type, n, i, j;
+	FILE *fd;
+
+	if (c->hs.fp.identity[0] == '\0' || (wdir = listing_wdir(c)) == NULL ||
+	    listing_file(path, sizeof(path), c->hs.fp.identity) != 0 ||
+	    (fd = fopen(path, "r")) == NULL)
+		return -1;
+
+	snprintf(want, sizeof(want), "%s\t%s\t%d\n", c->hs.fp.identity, wdir, num_files);
+	if (fgets(line, sizeof(line), fd) == NULL || strcmp(line, want) != 0) {
+		fclose(fd);
+		return -1;
+	}
+	for (i = 0; i < num_files && fgets(line, sizeof(line), fd) != NULL; i++) {
+		if (sscanf(line, "%d\t%d\t%2x%2x%2x%2x%2x\t%n", &idx, &type,
+			&b[0], &b[1], &b[2], &b[3], &b[4], &n) != 7)
+			break;
+		line[strcspn(line, "\n")] = '\0';
+		c->files[i].index = (unsigned char)idx;
+		c->files[i].type = (unsigned char)type;
+		for (j = 0; j < 5; j++)
+			c->files[i].size[j] = (unsigned char)b[j];
+		snprintf(c->files[i].name, sizeof(c->files[i].name), "%s", line + n);
+	}
+	fclose(fd);
+	if (i != num_files)
+		return -1;
+	c->files_count = num_files;
+	return 0;
+}
+
+static void listing_save(bs_ctx *c)
+{
+	char path[1024];
+	char tmp[1100];
+	const char *wdir;
+	ToolboxFileEntry *f;
+	FILE *fd;
+	int i;
+
+	if (c->hs.fp.identity[0] == '\0' || (wdir = listing_wdir(c)) == NULL ||
+	    listing_file(path, sizeof(path), c->hs.fp.identity) != 0)
+		return;
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if ((fd = cache_create(tmp)) == NULL)
+		return;
+	fprintf(fd, "%s\t%s\t%d\n", c->hs.fp.identity, wdir, c->files_count);
+	for (i = 0; i < c->files_count; i++) {
+		f = &c->files[i];
+		fprintf(fd, "%d\t%d\t%02x%02x%02x%02x%02x\t%s\n", f->index, f->type,
+			f->size[0], f->size[1], f->size[2], f->size[3], f->size[4], f->name);
+	}
+	if (fclose(fd) != 0 || rename(tmp, path) != 0)
+		remove(tmp);
+}
+
+/* Bring files[] up to date with the working directory */
+static int bluescsi_listfiles(bs_ctx *c)
+{
+	char cmd[10] = {BLUESCSI_TOOLBOX_MODE_FILES, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+	char *buf;
+	int i;
+	int buf_size;
+	int num_files;
+
+	if (c->verbose)
+		fprintf (stdout, "Listing files on dev %d\n", c->dev);
+
+	num_files = bluescsi_countfiles (c);
+	if (num_files < 0 || num_files > MAX_FILES)
+	{
+		fprintf (stderr, "Error: listfiles num_files invalid: %i\n", num_files);
+		return -1;
+	}
+	if (c->verbose)
+		fprintf (stdout, "Found %i files\n", num_files);
+
+	/* Nothing of ours changed it and the count still agrees */
+	if (c->listing.valid && c->files_count == num_files)
+		goto reused;
+	if (c->listing_cache && listing_load(c, num_files) == 0)
+	{
+		if (c->verbose)
+			fprintf (stdout, "Using cached listing\n");
+		c->listing.valid = 1;
+		goto reused;
+	}
+
+	c->files_count = num_files;
+	buf_size = sizeof(ToolboxFileEntry) * num_files;
+
+	buf = (char *)malloc(buf_size);
+	if (buf == NULL)
+	{
+		fprintf (stderr, "Error: failed to malloc %i bytes: - %s\n", buf_size, strerror(errno));
+		return -1;
+	}
+
+	memset(buf, 0, buf_size);
+	if (bluescsi_xfer(c, (unsigned char *)cmd, sizeof(cmd), (unsigned char *)buf, buf_size, 0) != 0)
+	{
+		fprintf (stderr, "Error: listfiles failed - %s\n", strerror(errno));
+		free(buf);
+		c->files_count = 0;
+		return -1;
+	}
+
+	for (i = 0; i < num_files; i++) {
+		memcpy(&c->files[i], buf + i * sizeof(ToolboxFileEntry), sizeof(ToolboxFileEntry));
+		c->files[i].name[sizeof(c->files[i].name) - 1] = '\0';
+	}
+	free(buf);
+	c->listing.valid = 1;
+	c->stats.listings++;
+	if (c->listing_cache)
+		listing_save(c);
+	return 0;
+
+reused:
+	c->stats.listings_reused++;
+	return 0;
+}
+
+static int bluescsi_getfile(bs_ctx *c, int idx, const char *outdir)
+{
+	char cmd[10];
+	char *buf;
+	FILE *fd;
+	char filename[1024];
+	const char *name;
+	unsigned long long total_bytes;
+	unsigned long long total_blocks;
+	unsigned long long blk_offset = 0;
+	unsigned long long bytes_written = 0;
+	unsigned long long blocks_remaining;
+	unsigned long long start;
+	size_t bytes_to_read;
+	size_t bytes_to_write;
+	int blocks_to_req;
+	int ret;
+	unsigned int crc = crc32c_init();
+
+	if (outdir == NULL || strlen(outdir) < 1)
+		outdir = "./";
+
+	if (bluescsi_listfiles(c) != 0)
+	{
+		fprintf(stderr, "Error: getfile couldn't listfiles\n");
+		return -1;
+	}
+
+	if (idx < 0 || idx >= c->files_count)
+	{
+		fprintf(stderr, "Error: invalid file index %d\n", idx);
+		return -1;
+	}
+
+	name = c->files[idx].name;
+	total_bytes = size_to_long(c->files[idx].size);
+	if (c->verbose)
+		fprintf(stdout, "getfile :#%i %s %llu bytes\n", c->files[idx].index, name, total_bytes);
+
+	if (outdir[strlen(outdir) - 1] == '/')
+		snprintf(filename, sizeof(filename), "%s%s", outdir, name);
+	else
+		snprintf(filename, sizeof(filename), "%s/%s", outdir, name);
+
+	fprintf(stdout, "Fetching %s (%llu bytes)\n", name, total_bytes);
+	fd = fopen(filename, "wb");
+	if (fd == NULL)
+	{
+		fprintf(stderr, "Error: getfile couldn't open %s\n", filename);
+		return -1;
+	}
+
+	buf = xfer_buf(c);
+	if (buf == NULL)
+	{
+		fprintf(stderr, "Error: malloc failed for receive buffer\n");
+		fclose(fd);
+		return -1;
+	}
+
+	/* Total 4096-byte blocks required */
+	total_blocks = (total_bytes + GET_BLOCK_SIZE - 1) / GET_BLOCK_SIZE;
+	start = scsi_now_us();
+	progress_begin(c);
+
+	while (blk_offset < total_blocks)
+	{
+		blocks_remaining = total_blocks - blk_offset;
+		blocks_to_req = (blocks_remaining < GET_BLOCKS_PER_XFER) ? (int)blocks_remaining : GET_BLOCKS_PER_XFER;
+
+		/* ALWAYS request full block aligned size over SCSI DMA to prevent bus hangs */
+		bytes_to_read = (size_t)blocks_to_req * GET_BLOCK_SIZE;
+
+		/* Determine actual file payload bytes to extract from this chunk */
+		if (bytes_written + bytes_to_read > total_bytes)
+			bytes_to_write = (size_t)(total_bytes - bytes_written);
+		else
+			bytes_to_write = bytes_to_read;
+
+		memset(cmd, 0, sizeof(cmd));
+		cmd[0] = BLUESCSI_TOOLBOX_GET_FILE;
+		cmd[1] = (unsigned char)(idx & 0xFF);
+		cmd[2] = (unsigned char)((blk_offset >> 24) & 0xFF);
+		cmd[3] = (unsigned char)((blk_offset >> 16) & 0xFF);
+		cmd[4] = (unsigned char)((blk_offset >>  8) & 0xFF);
+		cmd[5] = (unsigned char)((blk_offset      ) & 0xFF);
+		cmd[6] = (unsigned char)(blocks_to_req & 0xFF);
+
+		memset(buf, 0, GET_BUF_SIZE);
+		qos_begin(&c->qos, (int)bytes_to_read);
+		ret = bluescsi_xfer(c, (unsigned char *)cmd, sizeof(cmd), (unsigned char *)buf, (int)bytes_to_read, 0);
+		qos_end(&c->qos, (int)bytes_to_read);
+		if (ret != 0)
+		{
+			fprintf(stderr, "Error: getfile failed during transfer at block %llu - %s\n", blk_offset, strerror(errno));
+			fclose(fd);
+			return -1;
+		}
+
+		if (fwrite(buf, 1, bytes_to_write, fd) != bytes_to_write)
+		{
+			fprintf(stderr, "Error: fwrite failed writing to %s\n", filename);
+			fclose(fd);
+			return -1;
+		}
+
+		crc = crc32c_update(crc, buf, bytes_to_write);
+		bytes_written += bytes_to_write;
+		blk_offset += blocks_to_req;
+		report_progress(c, name, bytes_written, total_bytes);
+	}
+
+	fclose(fd);
+	report_progress(c, name, total_bytes, total_bytes);
+	c->stats.files_in++;
+	c->stats.bytes_in += total_bytes;
+	c->stats.xfer_us += scsi_now_us() - start;
+	record_manifest(c, filename, name, total_bytes, crc32c_final(crc), "get");
+	return 0;
+}
+
+/*
+ * Read up to max_bytes from the start of file idx, blocks 4 KB blocks per
+ * GET_FILE, and throw the data away: the bus and card side of a get
+ * without the local disk.
+ */
+static int bluescsi_read_test(bs_ctx *c, int idx, int blocks, unsigned char *out,
+		unsigned long long max_bytes, unsigned long long *bytes, unsigned long long *us)
+{
+	unsigned char cmd[10];
+	unsigned long long total_blocks, blk, start, file_size, want;
+	char *buf;
+	int n;
+	int ret = 0;
+
+	if (bluescsi_listfiles(c) != 0)
+		return -1;
+	if (idx < 0 || idx >= c->files_count)
+	{
+		fprintf(stderr, "Error: invalid file index %d\n", idx);
+		return -1;
+	}
+	if (blocks <= 0)
+		blocks = GET_BLOCKS_PER_XFER;
+	if (blocks > 255)
+		blocks = 255;
+	if (blocks <= GET_BLOCKS_PER_XFER)
+		buf = xfer_buf(c);
+	else
+		buf = (char *)malloc((size_t)blocks * GET_BLOCK_SIZE);
+	if (buf == NULL)
+	{
+		fprintf(stderr, "Error: malloc failed for receive buffer\n");
+		return -1;
+	}
+
+	/* Whole blocks only when the data is thrown away, the file's exact length when kept */
+	file_size = size_to_long(c->files[idx].size);
+	total_blocks = (file_size + GET_BLOCK_SIZE - 1) / GET_BLOCK_SIZE;
+	if (out != NULL)
+		want = file_size < max_bytes ? file_size : max_bytes;
+	else
+		want = max_bytes / GET_BLOCK_SIZE * GET_BLOCK_SIZE;
+	if (total_blocks > (want + GET_BLOCK_SIZE - 1) / GET_BLOCK_SIZE)
+		total_blocks = (want + GET_BLOCK_SIZE - 1) / GET_BLOCK_SIZE;
+
+	start = scsi_now_us();
+	for (blk = 0; blk < total_blocks; blk += n)
+	{
+		n = total_blocks - blk < (unsigned long long)blocks ? (int)(total_blocks - blk) : blocks;
+
+		memset(cmd, 0, sizeof(cmd));
+		cmd[0] = BLUESCSI_TOOLBOX_GET_FILE;
+		cmd[1] = (unsigned char)(idx & 0xFF);
+		cmd[2] = (unsigned char)((blk >> 24) & 0xFF);
+		cmd[3] = (unsigned char)((blk >> 16) & 0xFF);
+		cmd[4] = (unsigned char)((blk >>  8) & 0xFF);
+		cmd[5] = (unsigned char)((blk      ) & 0xFF);
+		cmd[6] = (unsigned char)n;
+
+		if (bluescsi_xfer(c, cmd, sizeof(cmd), (unsigned char *)buf, n * GET_BLOCK_SIZE, 0) != 0)
+		{
+			fprintf(stderr, "Error: read test failed at block %llu - %s\n", blk, strerror(errno));
+			ret = -1;
+			break;
+		}
+		if (out != NULL)
+			memcpy(out + blk * GET_BLOCK_SIZE, buf,
+				want - blk * GET_BLOCK_SIZE < (unsigned long long)n * GET_BLOCK_SIZE ?
+				(size_t)(want - blk * GET_BLOCK_SIZE) : (size_t)n * GET_BLOCK_SIZE);
+	}
+	if (buf != c->buf)
+		free(buf);
+	if (ret != 0)
+		return -1;
+
+	*us = scsi_now_us() - start;
+	*bytes = out != NULL ? want : total_blocks * GET_BLOCK_SIZE;
+	c->stats.bytes_in += *bytes;
+	return 0;
+}
+
+/*
+ * Write size bytes of data, or of filler if data is NULL, to a new file
+ * name in blocks of 512 byte blocks per SEND_FILE_10, counted in CDB[6]
+ * or, with legacy set, as a byte count in CDB[1..2] the way older
+ * firmware wants it.
+ */
+static int bluescsi_write_test(bs_ctx *c, const char *name, const unsigned char *data,
+		unsigned long long size, int blocks, int legacy, unsigned long long *us)
+{
+	unsigned char cmd[10];
+	char filename[NAME_BUF_SIZE];
+	unsigned long long done = 0, start;
+	unsigned long seed = 1;
+	unsigned char *buf;
+	int i, len;
+	int ret = 0;
+
+	if (blocks <= 0)
+		blocks = SEND_BLOCKS_PER_XFER;
+	if (blocks > (legacy ? 0xFFFF / SEND_BLOCK_SIZE : 255))
+	{
+		fprintf(stderr, "Error: %d blocks is too many for one %s send\n", blocks, legacy ? "legacy" : "block mode");
+		return -1;
+	}
+	if (strlen(name) >= NAME_BUF_SIZE)
+	{
+		fprintf(stderr, "Error: sendfile Filename too long: %s\n", name);
+		return -1;
+	}
+	memset(filename, 0, sizeof(filename));
+	strncpy(filename, name, NAME_BUF_SIZE - 1);
+
+	if ((buf = (unsigned char *)malloc((size_t)blocks * SEND_BLOCK_SIZE)) == NULL)
+	{
+		fprintf(stderr, "Error: sendfile couldn't allocate send buffer\n");
+		return -1;
+	}
+	for (i = 0; i < blocks * SEND_BLOCK_SIZE; i++)
+	{
+		seed = seed * 1103515245UL + 12345UL;
+		buf[i] = (unsigned char)(seed >> 16);
+	}
+
+	bluescsi_invalidate_listing(c);
+	start = scsi_now_us();
+
+	memset(cmd, 0, sizeof(cmd));
+	cmd[0] = BLUESCSI_TOOLBOX_SEND_FILE_PREP;
+	if (bluescsi_xfer(c, cmd, sizeof(cmd), (unsigned char *)filename, 33, 1) != 0)
+	{
+		fprintf(stderr, "Error: sendfileprep failed - %s\n", strerror(errno));
+		free(buf);
+		return -1;
+	}
+
+	while (done < size)
+	{
+		len = size - done < (unsigned long long)blocks * SEND_BLOCK_SIZE ?
+			(int)(size - done) : blocks * SEND_BLOCK_SIZE;
+		/* A tail too long for a byte count goes as whole blocks first */
+		if (len % SEND_BLOCK_SIZE != 0 && len > 0xFFFF)
+			len -= len % SEND_BLOCK_SIZE;
+
+		memset(cmd, 0, sizeof(cmd));
+		cmd[0] = BLUESCSI_TOOLBOX_SEND_FILE_10;
+		cmd[3] = (unsigned char)(((done / SEND_BLOCK_SIZE) >> 16) & 0xFF);
+		cmd[4] = (unsigned char)(((done / SEND_BLOCK_SIZE) >>  8) & 0xFF);
+		cmd[5] = (unsigned char)(((done / SEND_BLOCK_SIZE)      ) & 0xFF);
+		if (!legacy && len % SEND_BLOCK_SIZE == 0)
+			cmd[6] = (unsigned char)(len / SEND_BLOCK_SIZE);
+		else
+		{
+			cmd[1] = (unsigned char)((len >> 8) & 0xFF);
+			cmd[2] = (unsigned char)(len & 0xFF);
+		}
+
+		if (bluescsi_xfer(c, cmd, sizeof(cmd), data != NULL ? (unsigned char *)data + done : buf, len, 1) != 0)
+		{
+			fprintf(stderr, "Error: write test failed at byte %llu - %s\n", done, strerror(errno));
+			ret = -1;
+			break;
+		}
+		done += len;
+	}
+	free(buf);
+
+	memset(cmd, 0, sizeof(cmd));
+	cmd[0] = BLUESCSI_TOOLBOX_SEND_FILE_END;
+	if (scsi_send_command(c->dev, cmd, sizeof(cmd), NULL, 0) != 0 && ret == 0)
+	{
+		fprintf(stderr, "Error: sendfileend failed - %s\n", strerror(errno));
+		ret = -1;
+	}
+	if (ret != 0)
+		return -1;
+
+	*us = scsi_now_us() - start;
+	c->stats.bytes_out += size;
+	return 0;
+}
+
+/* One small command for bs_time_command(), answer thrown away */
+static int bluescsi_time_command(bs_ctx *c, int which, unsigned long long *us)
+{
+	unsigned long long start = scsi_now_us();
+	unsigned char api_ver, caps;
+	char wdir[256];
+	int ret;
+
+	if (which == BS_CMD_COUNT_FILES)
+		ret = bluescsi_countfiles(c) < 0 ? -1 : 0;
+	else if (which == BS_CMD_GET_WDIR)
+		ret = bluescsi_metadata_get_working_dir(c, wdir, sizeof(wdir));
+	else if (which == BS_CMD_GET_CAP)
+		ret = bluescsi_metadata_get_capabilities(c, &api_ver, &caps);
+	else
+	{
+		fprintf(stderr, "Error: no timed command %d\n", which);
+		return -1;
+	}
+	*us = scsi_now_us() - start;
+	return ret;
+}
+
+static int bluescsi_listdevices(bs_ctx *c, char **outbuf)
+{
+	char cmd[10] = {BLUESCSI_TOOLBOX_MODE_DEVICES, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+	char buf[8];
+	*outbuf = NULL;
+
+	memset(buf, 0, sizeof(buf));
+	if (bluescsi_xfer(c, (unsigned char *)cmd, sizeof(cmd), (unsigned char *)buf, sizeof(buf), 0) != 0)
+	{
+		fprintf (stderr, "Error: BlueSCSI listdevices failed - %s\n", strerror(errno));
+		return -1;
+	}
+	*outbuf = (char *)calloc(sizeof(buf), sizeof(char));
+	if (*outbuf) {
+		memcpy(*outbuf, buf, sizeof(buf));
+		return 0;
+	}
+	else
+		return -1;
+}
+
+static int bluescsi_check_vendor_page(bs_ctx *c)
+{
+	unsigned char cmd[6];
+	unsigned char buf[64];
+
+	/* MODE SENSE (6) CDB: Opcode 0x1A, requesting Page 0x31 */
+	cmd[0] = 0x1A; /* MODE SENSE (6) */
+	cmd[1] = 0x08; /* DBD = 1 (Disable Block Descriptors) */
+	cmd[2] = 0x31; /* Page code 0x31 */
+	cmd[3] = 0x00; /* Subpage code */
+	cmd[4] = 64;   /* Allocation length */
+	cmd[5] = 0x00; /* Control */
+
+	memset(buf, 0, sizeof(buf));
+
+	if (c->verbose)
+		fprintf(stdout, "Fetching BlueSCSI vendor page\n");
+	if (bluescsi_xfer(c, cmd, sizeof(cmd), buf, sizeof(buf), 0) != 0)
+	{
+		if (c->verbose)
+			fprintf(stderr, "Error: MODE SENSE (6) command failed - %s\n", strerror(errno));
+		return 1;
+	}
+
+	if (bluescsi_vendor_page_match(buf, sizeof(buf)) != 0)
+	{
+		if (c->verbose)
+			fprintf(stderr, "Error: Vendor page 0x31 missing or mismatched\n");
+		return 1;
+	}
+
+	if (c->verbose)
+		fprintf(stdout, "Vendor page: %.*s\n", 41, (char *)&buf[4 + buf[3] + 2]);
+	return 0;
+}
+
+/* INQUIRY, vendor checks and API version: is this a BlueSCSI we can talk to */
+static int bluescsi_identify(bs_ctx *c, int print)
+{
+	char cmd[] ={SCSI_INQUIRY, 0, 0, 0, sizeof(scsi_inquiry), 0};
+	char buf[sizeof(scsi_inquiry)];
+	const char *BlueSCSI_vendor_id = "BLUESCSI";
+	scsi_inquiry inq;
+	int additional_len;
+	int total_len;
+	int toolbox_api_version;
+
+	memset(buf, 0, sizeof(buf));
+	if (c->verbose)
+		fprintf(stdout, "Sending SCSI Inquiry command\n");
+	if (bluescsi_xfer(c, (unsigned char *)cmd, sizeof(cmd), (unsigned char *)buf, sizeof(buf), 0) != 0)
+	{
+		fprintf (stderr, "Error: inquiry command failed - %s\n", strerror(errno));
+		return 1;
+	}
+
+	memset (&inq, 0, sizeof(scsi_inquiry));
+	memcpy (&inq.version, &buf[2], 1);
+	memcpy (&inq.vendor_id, &buf[8], sizeof(inq.vendor_id) - 1);
+	inq.vendor_id[8] = '\0';
+	memcpy (&inq.product_id, &buf[16], sizeof(inq.product_id) - 1);
+	inq.product_id[16] = '\0';
+	memcpy (&inq.product_rev, &buf[32], sizeof(inq.product_rev) - 1);
+	inq.product_rev[4] = '\0';
+
+	if (c->verbose || print)
+	{
+		fprintf (stdout, "SCSI version: %i\n", inq.version);
+		fprintf (stdout, "vendor_id: %s \nproduct_id: %s\n", inq.vendor_id, inq.product_id);
+		fprintf (stdout, "product_rev: %s\n", inq.product_rev);
+	}
+
+	/* Do not proceed if it's not a BlueSCSI device */
+	if (strstr (inq.vendor_id, BlueSCSI_vendor_id) == NULL)
+	{
+		fprintf (stderr, "Error: didn't find \"%s\" in vendor_id: %s\n", BlueSCSI_vendor_id, inq.vendor_id);
+		return 1;
+	}
+	else if (c->verbose || print)
+		fprintf (stdout, "debug mode: %i\n", bluescsi_getdebug(c)); /* Don't try to get debug mode if it isn't a BlueSCSI */
+
+	/* Check the BlueSCSIVendorPage */
+	if (bluescsi_check_vendor_page(c) != 0)
+	{
+		fprintf (stderr, "Error: didn't find BlueSCSI vendor page\n");
+		return 1;
+	}
+
+	additional_len = buf[4];
+	total_len = additional_len + 5;
+
+	if (total_len <= (int)sizeof(buf)) {
+		toolbox_api_version = buf[total_len - 1];
+		if (c->verbose)
+			fprintf(stdout, "Toolbox API version: %u\n", toolbox_api_version);
+
+		if (toolbox_api_version < BLUESCSI_TOOLBOX_API_VER) {
+			fprintf(stdout, "WARNING! Toolbox API version %u too old, expecting: %u\n", toolbox_api_version, BLUESCSI_TOOLBOX_API_VER);
+		}
+	} else {
+		fprintf(stdout, "Toolbox API version: not available (length mismatch)\n");
+		return 1;
+	}
+
+	/* Kept for the fingerprint */
+	c->hs.fp.api_ver = toolbox_api_version;
+	bluescsi_probe_strings(&c->hs.fp, (unsigned char *)buf);
+	return 0;
+}
+
+/* Fill device_list[] with the emulated target types */
+static int bluescsi_fetch_devices(bs_ctx *c)
+{
+	char* dev_flags;
+	unsigned char dev_map[8];
+	int i;
+
+	/* Use Metadata subcommand 0x00 to list devices */
+	if (bluescsi_metadata_list_devices(c, dev_map) == 0) {
+		if (c->verbose)
+			fprintf (stdout, "Device flags (Metadata 0xD9:00): ");
+		for (i = 0; i < 8; i++)
+		{
+			c->device_list[i] = dev_map[i];
+			if (c->verbose)
+				fprintf (stdout,"%02x ", dev_map[i]);
+		}
+		if (c->verbose)
+			fprintf(stdout, "\n");
+	}
+	else if (bluescsi_listdevices(c, &dev_flags) == 0) {
+		/* Fallback to legacy device list command if metadata 0xD9:00 fails */
+		if (c->verbose)
+			fprintf (stdout, "Device flags (Legacy): ");
+		for (i = 0; i < 8; i++)
+		{
+			c->device_list[i] = (unsigned char) dev_flags[i];
+			if (c->verbose)
+				fprintf (stdout,"%02x ", (unsigned char) dev_flags[i]);
+		}
+		if (c->verbose)
+			fprintf(stdout, "\n");
+		free(dev_flags);
+	}
+	else {
+		fprintf (stderr, "Failed to fetch device flags: %s\n", strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Make sure the facts in need (HS_*) are known, running only the
+ * commands that are missing.  Results last until the context sees a
+ * reset; a discover cache entry whose identity still matches the path
+ * stands in for all of them unless HS_FRESH is given.  A session being
+ * recorded or replayed never uses the cache, so it issues the same
+ * commands whatever the cache holds.
+ * Returns 0, or 1 if the device isn't a usable BlueSCSI.
+ */
+static int bluescsi_handshake(bs_ctx *c, int need)
+{
+	unsigned char api_ver, caps;
+	bs_probe p;
+	int use_cache = !(need & HS_FRESH) && !c->hs.distrust;
+	int traced = replay_recording || strcmp(scsi_transport_name(c->dev), "replay") == 0;
+	int fresh = 0;
+	int i;
+
+	need &= HS_ALL;
+	if (!use_cache)
+		c->hs.have &= ~need;
+	if ((c->hs.have & need) == need)
+		return 0;
+
+	if (use_cache && !traced && discover_cached(c->path, &p) == 0) {
+		if (c->verbose)
+			fprintf(stdout, "Using cached handshake for %s\n", c->path);
+		for (i = 0; i < 8; i++)
+			c->device_list[i] = p.dev_map[i];
+		c->hs.fp = p;
+		c->hs.have = HS_ALL;
+		c->hs.cached = 1;
+		/* The identity still matches, so the TUR would only cost a command */
+		scsi_session_trust(c->dev);
+		return 0;
+	}
+
+	/* No fingerprint to trust: take the full handshake once and keep it */
+	if (traced || scsi_identity(c->path, c->hs.fp.identity, sizeof(c->hs.fp.identity)) == 0)
+		need = HS_ALL;
+
+	if ((need & ~c->hs.have & HS_BLUESCSI) != 0) {
+		if (bluescsi_identify(c, PRINT_OFF) != 0)
+			return 1;
+		c->hs.have |= HS_BLUESCSI;
+		fresh |= HS_BLUESCSI;
+	}
+	if ((need & ~c->hs.have & HS_DEVMAP) != 0) {
+		if (bluescsi_fetch_devices(c) != 0)
+			return 1;
+		c->hs.have |= HS_DEVMAP;
+		fresh |= HS_DEVMAP;
+		c->hs.cached = 0;
+	}
+	if ((need & ~c->hs.have & HS_CAPS) != 0) {
+		bluescsi_metadata_get_capabilities(c, &api_ver, &caps);
+		c->hs.fp.meta_api = api_ver;
+		c->hs.fp.caps = caps;
+		c->hs.have |= HS_CAPS;
+		fresh |= HS_CAPS;
+	}
+
+	if (fresh != 0 && !traced && c->hs.have == HS_ALL && c->hs.fp.identity[0] != '\0') {
+		snprintf(c->hs.fp.path, sizeof(c->hs.fp.path), "%s", c->path);
+		for (i = 0; i < 8; i++)
+			c->hs.fp.dev_map[i] = (unsigned char)c->device_list[i];
+		c->hs.fp.scsi_id = c->scsi_id;
+		c->hs.fp.found = 1;
+		discover_remember(&c->hs.fp);
+		c->hs.distrust = 0;
+	}
+	return 0;
+}
+
+/* Handshake for a public call, saying so if the device isn't usable */
+static int bluescsi_ready(bs_ctx *c, int need)
+{
+	if (bluescsi_handshake(c, need) != 0) {
+		fprintf(stderr, "Didn't find a BlueSCSI device at %s\n", c->path);
+		return -1;
+	}
+	return 0;
+}
+
+/* The target's type, refreshing a cached device map that says it isn't a CD */
+static int bluescsi_target_type(bs_ctx *c)
+{
+	if (bluescsi_ready(c, HS_DEVMAP) != 0)
+		return -1;
+	if (c->device_list[c->scsi_id] != TYPE_CD && c->hs.cached)
+		bluescsi_handshake(c, HS_DEVMAP | HS_FRESH);
+	return c->device_list[c->scsi_id];
+}
+
+/*
+ * Public interface
+ */
+
+bs_ctx *bs_open(const char *path, int flags)
+{
+	bs_ctx *c;
+	int err;
+
+	c = (bs_ctx *)calloc(1, sizeof(*c));
+	if (c == NULL)
+		return NULL;
+	snprintf(c->path, sizeof(c->path), "%s", path);
+
+	c->dev = scsi_open(c->path, (flags & BS_OPEN_READONLY) != 0);
+	if (c->dev < 0) {
+		err = errno;
+		free(c);
+		errno = err;
+		return NULL;
+	}
+	if ((c->scsi_id = path_to_devnum(path)) < 0 || c->scsi_id > 7) {
+		fprintf(stderr, "Failed to get dev_scsi_id from path_to_devnum\n");
+		scsi_close(c->dev);
+		free(c);
+		errno = ENODEV;
+		return NULL;
+	}
+
+	pthread_mutex_init(&c->lock, NULL);
+	c->resets = scsi_reset_count(c->dev);
+	c->verbose = verbose;
+	qos_init(&c->qos);
+	return c;
+}
+
+void bs_close(bs_ctx *c)
+{
+	if (c == NULL)
+		return;
+	bs_log_end(c);
+	scsi_close(c->dev);
+	pthread_mutex_destroy(&c->lock);
+	free(c->buf);
+	free(c);
+}
+
+void bs_set_verbose(bs_ctx *c, int on)
+{
+	bs_enter(c);
+	c->verbose = on;
+	bs_leave(c);
+}
+
+/* Manifest for transfer checksums, NULL for the one next to each file */
+void bs_set_manifest(bs_ctx *c, const char *path)
+{
+	bs_enter(c);
+	snprintf(c->manifest, sizeof(c->manifest), "%s", path != NULL ? path : "");
+	bs_leave(c);
+}
+
+void bs_forget(bs_ctx *c)
+{
+	bs_enter(c);
+	bluescsi_invalidate_listing(c);
+	c->listing.wdir_known = 0;
+	c->catalog.valid = 0;
+	bs_leave(c);
+}
+
+void bs_set_listing_cache(bs_ctx *c, int on)
+{
+	bs_enter(c);
+	c->listing_cache = on;
+	bs_leave(c);
+}
+
+/* Transfer pacing, see qos.h; zeros turn it off */
+void bs_set_pacing(bs_ctx *c, double rate, int duty_on_ms, int duty_off_ms, int nice)
+{
+	bs_enter(c);
+	memset(&c->qos, 0, sizeof(c->qos));
+	c->qos.rate = rate;
+	c->qos.duty_on_ms = duty_on_ms;
+	c->qos.duty_off_ms = duty_off_ms;
+	c->qos.nice = nice;
+	qos_init(&c->qos);
+	bs_leave(c);
+}
+
+void bs_set_progress(bs_ctx *c, bs_progress_fn fn, void *arg)
+{
+	bs_enter(c);
+	c->progress = fn;
+	c->progress_arg = arg;
+	bs_leave(c);
+}
+
+void bs_get_stats(bs_ctx *c, bs_stats *out)
+{
+	bs_enter(c);
+	*out = c->stats;
+	bs_leave(c);
+}
+
+/* Versions, capabilities and INQUIRY strings; quiet if the device doesn't answer */
+int bs_device_info(bs_ctx *c, bs_device *out)
+{
+	int ret = -1;
+
+	memset(out, 0, sizeof(*out));
+	bs_enter(c);
+	if (bluescsi_handshake(c, HS_BLUESCSI | HS_CAPS) == 0) {
+		out->api_ver = c->hs.fp.api_ver;
+		out->meta_api = c->hs.fp.meta_api;
+		out->caps = c->hs.fp.caps;
+		snprintf(out->vendor, sizeof(out->vendor), "%s", c->hs.fp.vendor);
+		snprintf(out->product, sizeof(out->product), "%s", c->hs.fp.product);
+		snprintf(out->rev, sizeof(out->rev), "%s", c->hs.fp.rev);
+		ret = 0;
+	}
+	bs_leave(c);
+	return ret;
+}
+
+/* The full handshake, printing what it finds if asked */
+int bs_inquiry(bs_ctx *c, int print)
+{
+	int ret = -1;
+
+	bs_enter(c);
+	if (bluescsi_identify(c, print) == 0) {
+		c->hs.have |= HS_BLUESCSI;
+		if (bluescsi_fetch_devices(c) == 0) {
+			c->hs.have |= HS_DEVMAP;
+			c->hs.cached = 0;
+			ret = bluescsi_handshake(c, HS_CAPS) == 0 ? 0 : -1;
+		}
+	}
+	bs_leave(c);
+	return ret;
+}
+
+int bs_target_type(bs_ctx *c)
+{
+	int ret;
+
+	bs_enter(c);
+	ret = bluescsi_target_type(c);
+	bs_leave(c);
+	return ret;
+}
+
+/* Fill out[] with up to max entries of the working directory; returns the count */
+int bs_list(bs_ctx *c, bs_file *out, int max)
+{
+	int ret = -1;
+	int i;
+
+	bs_enter(c);
+	if (bluescsi_ready(c, HS_BLUESCSI) == 0 && bluescsi_listfiles(c) == 0) {
+		for (i = 0; i < c->files_count && i < max; i++) {
+			out[i].index = c->files[i].index;
+			out[i].type = c->files[i].type;
+			snprintf(out[i].name, sizeof(out[i].name), "%s", c->files[i].name);
+			out[i].size = size_to_long(c->files[i].size);
+		}
+		ret = c->files_count;
+	}
+	bs_leave(c);
+	return ret;
+}
+
+int bs_get(bs_ctx *c, int idx, const char *outdir)
+{
+	int ret = -1;
+
+	bs_enter(c);
+	if (bluescsi_ready(c, HS_BLUESCSI) == 0)
+		ret = bluescsi_getfile(c, idx, outdir);
+	bs_leave(c);
+	return ret;
+}
+
+int bs_read_test(bs_ctx *c, int idx, int blocks, unsigned long long max_bytes,
+		unsigned long long *bytes, unsigned long long *us)
+{
+	int ret = -1;
+
+	bs_enter(c);
+	if (bluescsi_ready(c, HS_BLUESCSI) == 0)
+		ret = bluescsi_read_test(c, idx, blocks, NULL, max_bytes, bytes, us);
+	bs_leave(c);
+	return ret;
+}
+
+int bs_read_data(bs_ctx *c, int idx, int blocks, void *data, unsigned long long size,
+		unsigned long long *bytes, unsigned long long *us)
+{
+	int ret = -1;
+
+	bs_enter(c);
+	if (bluescsi_ready(c, HS_BLUESCSI) == 0)
+		ret = bluescsi_read_test(c, idx, blocks, (unsigned char *)data, size, bytes, us);
+	bs_leave(c);
+	return ret;
+}
+
+int bs_write_test(bs_ctx *c, const char *name, unsigned long long size, int blocks, int legacy,
+		unsigned long long *us)
+{
+	int ret = -1;
+
+	bs_enter(c);
+	if (bluescsi_ready(c, HS_BLUESCSI) == 0)
+		ret = bluescsi_write_test(c, name, NULL, size, blocks, legacy, us);
+	bs_leave(c);
+	return ret;
+}
+
+int bs_write_data(bs_ctx *c, const char *name, const void *data, unsigned long long size,
+		int blocks, int legacy, unsigned long long *us)
+{
+	int ret = -1;
+
+	bs_enter(c);
+	if (bluescsi_ready(c, HS_BLUESCSI) == 0)
+		ret = bluescsi_write_test(c, name, (const unsigned char *)data, size, blocks, legacy, us);
+	bs_leave(c);
+	return ret;
+}
+
+int bs_time_command(bs_ctx *c, int which, unsigned long long *us)
+{
+	int ret = -1;
+
+	bs_enter(c);
+	if (bluescsi_ready(c, HS_BLUESCSI) == 0)
+		ret = bluescsi_time_command(c, which, us);
+	bs_leave(c);
+	return ret;
+}
+
+int bs_put(bs_ctx *c, const char *path)
+{
+	int ret = -1;
+
+	bs_enter(c);
+	if (bluescsi_ready(c, HS_BLUESCSI) == 0)
+		ret = bluescsi_sendfile(c, path);
+	bs_leave(c);
+	return ret;
+}
+
+int bs_remove(bs_ctx *c, int idx)
+{
+	int ret = -1;
+
+	bs_enter(c);
+	if (bluescsi_ready(c, HS_BLUESCSI) == 0)
+		ret = bluescsi_remove_file(c, idx);
+	bs_leave(c);
+	return ret;
+}
+
+static int cmp_desc(const void *a, const void *b)
+{
+	return *(const int *)b - *(const int *)a;
+}
+
+/*
+ * Remove several files, given by their indices in one listing.  They go
+ * highest first, so the lower indices still point at the same files.
+ * Returns the number removed, stopping at the first failure, or -1 if
+ * the device isn't ready.
+ */
+int bs_remove_many(bs_ctx *c, const int *idx, int n)
+{
+	int *order;
+	int done = -1;
+	int i;
+
+	if (n <= 0)
+		return 0;
+	if ((order = malloc(n * sizeof(*order))) == NULL) {
+		fprintf(stderr, "Error: out of memory\n");
+		return -1;
+	}
+	memcpy(order, idx, n * sizeof(*order));
+	qsort(order, n, sizeof(*order), cmp_desc);
+
+	bs_enter(c);
+	if (bluescsi_ready(c, HS_BLUESCSI) == 0) {
+		done = 0;
+		for (i = 0; i < n; i++) {
+			if (i > 0 && order[i] == order[i - 1])
+				continue;
+			if (bluescsi_remove_file(c, order[i]) != 0)
+				break;
+			done++;
+		}
+	}
+	bs_leave(c);
+	free(order);
+	return done;
+}
+
+int bs_get_wdir(bs_ctx *c, char *out, size_t out_len)
+{
+	int ret = -1;
+
+	bs_enter(c);
+	if (bluescsi_ready(c, HS_BLUESCSI) == 0)
+		ret = bluescsi_metadata_get_working_dir(c, out, out_len);
+	bs_leave(c);
+	return ret;
+}
+
+int bs_set_wdir(bs_ctx *c, const char *dir)
+{
+	int ret = -1;
+
+	bs_enter(c);
+	if (bluescsi_ready(c, HS_BLUESCSI) == 0)
+		ret = bluescsi_metadata_set_working_dir(c, dir);
+	bs_leave(c);
+	return ret;
+}
+
+/* Fetch log.txt from the card root into outdir and copy it to out */
+int bs_get_log(bs_ctx *c, const char *outdir, FILE *out)
+{
+	int ret = -1;
+
+	bs_enter(c);
+	if (bluescsi_ready(c, HS_BLUESCSI) == 0)
+		ret = bluescsi_get_log(c, outdir, out);
+	bs_leave(c);
+	return ret;
+}
+
+/*
+ * Following the log: bs_log_begin() moves to the root directory for the
+ * whole session and gives the current size of log.txt, bs_log_read()
+ * writes whatever was appended since *offset, and bs_log_end() puts the
+ * working directory back.
+ */
+int bs_log_begin(bs_ctx *c, unsigned long long *size)
+{
+	int ret = -1;
+
+	bs_enter(c);
+	if (c->log.active)
+		fprintf(stderr, "Error: already following the log\n");
+	else if (bluescsi_ready(c, HS_BLUESCSI) == 0 &&
+	    bluescsi_metadata_get_working_dir(c, c->log.orig_wdir, sizeof(c->log.orig_wdir)) == 0) {
+		if (bluescsi_metadata_set_working_dir(c, "/") == 0) {
+			c->log.active = 1;
+			if (log_locate(c, size) >= 0)
+				ret = 0;
+		}
+	}
+	bs_leave(c);
+	if (ret != 0 && c->log.active)
+		bs_log_end(c);
+	return ret;
+}
+
+int bs_log_read(bs_ctx *c, unsigned long long *offset, FILE *out)
+{
+	unsigned long long size;
+	int ret = -1;
+	int idx;
+
+	bs_enter(c);
+	if (!c->log.active)
+		fprintf(stderr, "Error: bs_log_read() without bs_log_begin()\n");
+	else if ((idx = log_locate(c, &size)) >= 0)
+		ret = bluescsi_read_log(c, idx, size, offset, out);
+	bs_leave(c);
+	return ret;
+}
+
+int bs_log_end(bs_ctx *c)
+{
+	int ret = 0;
+
+	bs_enter(c);
+	if (c->log.active) {
+		c->log.active = 0;
+		if (bluescsi_metadata_set_working_dir(c, c->log.orig_wdir) != 0) {
+			fprintf(stderr, "Warning: failed to restore working directory to %s\n", c->log.orig_wdir);
+			ret = -1;
+		}
+	}
+	bs_leave(c);
+	return ret;
+}
+
+int bs_list_cds(bs_ctx *c, bs_file *out, int max)
+{
+	int ret = -1;
+
+	bs_enter(c);
+	if (bluescsi_target_type(c) == TYPE_CD)
+		ret = bluescsi_listcds(c, out, max);
+	else
+		fprintf (stderr, "Tried to list CDs, but an emulated CD drive wasn't detected\n");
+	bs_leave(c);
+	return ret;
+}
+
+int bs_set_cd(bs_ctx *c, int num)
+{
+	int type;
+	int ret = -1;
+
+	bs_enter(c);
+	if ((type = bluescsi_target_type(c)) == TYPE_CD) {
+		if ((ret = bluescsi_setnextcd(c, num)) == 0)
+			ret = bluescsi_media_change(c, num);
+	}
+	else if (type >= 0)
+		fprintf (stderr, "Device doesn't seem to be a CD drive? Detected type %i on SCSI ID %i\n", type, c->scsi_id);
+	bs_leave(c);
+	return ret;
+}
+
+/* Switch to the CD a name refers to, see bluescsi_find_cd() */
+int bs_set_cd_name(bs_ctx *c, const char *name)
+{
+	int type;
+	int num;
+	int ret = -1;
+
+	bs_enter(c);
+	if ((type = bluescsi_target_type(c)) == TYPE_CD) {
+		if ((num = bluescsi_find_cd(c, name)) >= 0 &&
+		    (ret = bluescsi_setnextcd(c, num)) == 0)
+			ret = bluescsi_media_change(c, num);
+	}
+	else if (type >= 0)
+		fprintf (stderr, "Device doesn't seem to be a CD drive? Detected type %i on SCSI ID %i\n", type, c->scsi_id);
+	bs_leave(c);
+	return ret;
+}
+
+int bs_get_debug(bs_ctx *c)
+{
+	int ret = -1;
+
+	bs_enter(c);
+	if (bluescsi_ready(c, HS_BLUESCSI) == 0)
+		ret = bluescsi_getdebug(c);
+	bs_leave(c);
+	return ret;
+}
+
+int bs_set_debug(bs_ctx *c, int on)
+{
+	int ret = -1;
+
+	bs_enter(c);
+	if (bluescsi_ready(c, HS_BLUESCSI) == 0)
+		ret = bluescsi_setdebug(c, on);
+	bs_leave(c);
+	return ret;
+}
@@ -0,0 +1,537 @@
+/*
+ * Runtime transport selection and handle table
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <pthread.h>
+
+#include "bstoolbox.h"
+#include "transport.h"
+#include "replay.h"
+#include "cmdtrace.h"
+#include "cmdstats.h"
+
+/* Commands rejected with UNIT ATTENTION or BUSY never ran, so resend them */
+#define UA_RETRIES       3
+#define BUSY_RETRIES     5
+#define BUSY_BACKOFF_US  10000
+
+#define SENSE_KEY_NOT_READY       0x02
+#define SENSE_KEY_UNIT_ATTENTION  0x06
+#define SENSE_KEY_ABORTED_COMMAND 0x0B
+#define ASC_RESET_OCCURRED        0x29
+
+/* Which transfers feed the overhead and throughput estimates */
+#define TIMEOUT_SMALL_XFER  512
+#define TIMEOUT_LARGE_XFER  4096
+#define TIMEOUT_MAX_BPS     (100.0 * 1024 * 1024)
+#define TIMEOUT_MAX_SCALE   16
+
+/*
+ * Session readiness.  A handle starts out UNKNOWN and is moved to READY by
+ * a TEST UNIT READY; anything that may have disturbed the target (UNIT
+ * ATTENTION, a reset, a transport error or timeout) drops it back to
+ * UNKNOWN, so the next command is preceded by another TUR.  In between,
+ * commands go straight to the device.
+ */
+enum {
+	SESSION_UNKNOWN,
+	SESSION_READY
+};
+
+#define READY_RETRIES   10
+#define READY_DELAY_US  100000
+
+typedef struct {
+	int in_use;
+	scsi_transport *tp;
+	int fd;
+	scsi_result last;
+	int last_class;
+	unsigned long resets;
+	double bps;		/* Running estimate of bus throughput */
+	double ovh_us;		/* ...and of fixed per-command overhead */
+	int bps_samples;
+	int ovh_samples;
+	int timeout_scale;	/* Doubled after each timeout, reset on success */
+	int session;
+	unsigned long ready_checks;
+} scsi_handle;
+
+static scsi_transport *transports[] = {
+	&sim_transport,
+	&replay_transport,
+	NULL
+};
+
+static scsi_handle handles[SCSI_MAX_HANDLES];
+
+/*
+ * Guards handle allocation, and the transports' own tables with it, so
+ * discovery can open devices from several threads.  A handle is only ever
+ * used by the thread that opened it.
+ */
+static pthread_mutex_t handles_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Pick a transport by path prefix and strip the prefix off */
+static scsi_transport *transport_for_path(const char *path, const char **rest)
+{
+	int i;
+	size_t len;
+
+	for (i = 0; transports[i] != NULL; i++) {
+		len = strlen(transports[i]->prefix);
+		if (strncmp(path, transports[i]->prefix, len) == 0) {
+			*rest = path + len;
+			return transports[i];
+		}
+	}
+
+	*rest = path;
+	return &os_transport;
+}
+
+static scsi_handle *handle_get(int dev)
+{
+	if (dev < 0 || dev >= SCSI_MAX_HANDLES || !handles[dev].in_use) {
+		errno = EBADF;
+		return NULL;
+	}
+	return &handles[dev];
+}
+
+int scsi_open(char *path, int readonly)
+{
+	scsi_transport *tp;
+	const char *rest;
+	int dev;
+	int fd;
+
+	tp = transport_for_path(path, &rest);
+
+	pthread_mutex_lock(&handles_lock);
+	for (dev = 0; dev < SCSI_MAX_HANDLES; dev++) {
+		if (!handles[dev].in_use)
+			break;
+	}
+	if (dev == SCSI_MAX_HANDLES) {
+		pthread_mutex_unlock(&handles_lock);
+		errno = EMFILE;
+		return -1;
+	}
+
+	fd = tp->open(rest, readonly);
+	if (fd < 0) {
+		pthread_mutex_unlock(&handles_lock);
+		return -1;
+	}
+
+	memset(&handles[dev], 0, sizeof(scsi_handle));
+	handles[dev].in_use = 1;
+	handles[dev].tp = tp;
+	handles[dev].fd = fd;
+	handles[dev].bps = TIMEOUT_INIT_BPS;
+	handles[dev].ovh_us = TIMEOUT_INIT_OVH_US;
+	handles[dev].timeout_scale = 1;
+	handles[dev].session = SESSION_UNKNOWN;
+	pthread_mutex_unlock(&handles_lock);
+	return dev;
+}
+
+int scsi_close(int dev)
+{
+	scsi_handle *h;
+	int ret;
+
+	if ((h = handle_get(dev)) == NULL)
+		return -1;
+
+	if (verbose)
+		fprintf(stdout, "%lu readiness checks, %lu resets\n", h->ready_checks, h->resets);
+	pthread_mutex_lock(&handles_lock);
+	ret = h->tp->close(h->fd);
+	h->in_use = 0;
+	pthread_mutex_unlock(&handles_lock);
+	return ret;
+}
+
+/*
+ * Opcodes that make the firmware touch the SD card filesystem.  Listing,
+ * counting and GET_FILE walk the directory on every call, so their time
+ * depends on how many files there are, not on the bytes moved.
+ */
+static int is_slow_op(const unsigned char *cmd)
+{
+	switch (cmd[0]) {
+	case BLUESCSI_TOOLBOX_MODE_FILES:
+	case BLUESCSI_TOOLBOX_COUNT_FILES:
+	case BLUESCSI_TOOLBOX_MODE_CDS:
+	case BLUESCSI_TOOLBOX_COUNT_CDS:
+	case BLUESCSI_TOOLBOX_GET_FILE:
+	case BLUESCSI_TOOLBOX_SEND_FILE_PREP:
+	case BLUESCSI_TOOLBOX_SEND_FILE_END:
+	case BLUESCSI_TOOLBOX_SET_NEXT_CD:
+		return 1;
+	case BLUESCSI_TOOLBOX_METADATA:
+		return cmd[1] == BLUESCSI_TOOLBOX_METADATA_SET_WDIR ||
+			cmd[1] == BLUESCSI_TOOLBOX_METADATA_REMOVE_FILE;
+	}
+	return 0;
+}
+
+static int scsi_timeout_ms(const scsi_handle *h, const unsigned char *cmd, int len)
+{
+	double ms;
+	double floor_ms;
+
+	ms = (h->ovh_us + (double)len * 1000000.0 / h->bps) / 1000.0;
+	ms *= TIMEOUT_MARGIN;
+
+	floor_ms = is_slow_op(cmd) ? TIMEOUT_SLOW_MIN_MS : TIMEOUT_MIN_MS;
+	if (ms < floor_ms)
+		ms = floor_ms;
+	ms *= h->timeout_scale;
+	if (ms > TIMEOUT_MAX_MS)
+		ms = TIMEOUT_MAX_MS;
+	return (int)ms;
+}
+
+/*
+ * Feed a successful command into the estimates.  Short commands measure
+ * the fixed overhead, long ones the throughput once that is subtracted.
+ * The first sample replaces the initial guess, later ones are averaged
+ * with a weight of 1/8.
+ */
+static void scsi_timeout_update(scsi_handle *h, int len, unsigned long long elapsed_us)
+{
+	double us = (double)elapsed_us;
+	double rate;
+
+	if (len <= TIMEOUT_SMALL_XFER) {
+		h->ovh_us = h->ovh_samples++ ? h->ovh_us + (us - h->ovh_us) / 8.0 : us;
+	} else if (len >= TIMEOUT_LARGE_XFER) {
+		us -= h->ovh_us;
+		if (us < 1.0)
+			us = 1.0;
+		rate = (double)len * 1000000.0 / us;
+		if (rate > TIMEOUT_MAX_BPS)
+			rate = TIMEOUT_MAX_BPS;
+		h->bps = h->bps_samples++ ? h->bps + (rate - h->bps) / 8.0 : rate;
+	}
+}
+
+/* Send one command, time it and record the outcome on the handle */
+static int scsi_exec(scsi_handle *h, unsigned char *cmd, int cmd_len, unsigned char *buf, int buf_len, int dir)
+{
+	unsigned long long start;
+	unsigned long long elapsed;
+	int key, asc, ascq;
+	int ret;
+
+	memset(&h->last, 0, sizeof(h->last));
+
+	start = scsi_now_us();
+	ret = h->tp->send(h->fd, cmd, cmd_len, buf, buf_len, dir,
+			scsi_timeout_ms(h, cmd, buf_len), &h->last);
+	elapsed = h->last.elapsed_us ? h->last.elapsed_us : scsi_now_us() - start;
+	if (replay_recording)
+		replay_record(cmd, cmd_len, buf, buf_len, dir, ret, &h->last, elapsed);
+
+	h->last_class = ret == 0 ? SCSI_CLASS_OK : scsi_classify(&h->last);
+	if (cmdtrace_enabled)
+		cmdtrace_add(cmd, cmd_len, buf, buf_len, dir, &h->last, h->last_class, start, elapsed);
+	if (cmdstats_enabled)
+		cmdstats_add(cmd, buf_len, dir, ret != 0, elapsed);
+
+	if (ret == 0) {
+		h->timeout_scale = 1;
+		scsi_timeout_update(h, buf_len, elapsed);
+		return 0;
+	}
+
+	if (h->last_class == SCSI_CLASS_TIMEOUT && h->timeout_scale < TIMEOUT_MAX_SCALE)
+		h->timeout_scale *= 2;
+	if (h->last_class != SCSI_CLASS_BUSY && h->last_class != SCSI_CLASS_FATAL)
+		h->session = SESSION_UNKNOWN;
+	scsi_sense_fields(&h->last, &key, &asc, &ascq);
+	if ((h->last_class == SCSI_CLASS_UNIT_ATTENTION && asc == ASC_RESET_OCCURRED) ||
+	    h->last.transport == SCSI_XPORT_RESET)
+		h->resets++;
+
+	if (verbose)
+		fprintf(stderr, "SCSI command 0x%02x: %s (status 0x%02x, host 0x%02x, driver 0x%02x, "
+			"sense %x/%02x/%02x)\n", cmd[0], scsi_class_name(h->last_class),
+			h->last.status, h->last.host_status, h->last.driver_status, key, asc, ascq);
+	return ret;
+}
+
+/*
+ * Bring an UNKNOWN session to READY.  UNIT ATTENTION is consumed by the
+ * TUR itself, busy or transport trouble is waited out.  A definite answer
+ * such as NOT READY / medium not present still means the target is
+ * talking to us, so the session is READY and the real command decides.
+ */
+static int scsi_session_ready(scsi_handle *h)
+{
+	unsigned char tur[6] = { SCSI_TEST_UNIT_READY, 0, 0, 0, 0, 0 };
+	int i;
+
+	for (i = 0; i < READY_RETRIES; i++) {
+		h->ready_checks++;
+		if (scsi_exec(h, tur, sizeof(tur), NULL, 0, SCSI_DIR_READ) == 0 ||
+		    h->last_class == SCSI_CLASS_FATAL) {
+			h->session = SESSION_READY;
+			return 0;
+		}
+		if (h->last_class != SCSI_CLASS_UNIT_ATTENTION)
+			usleep(READY_DELAY_US);
+	}
+
+	fprintf(stderr, "Error: device not ready after %d attempts (%s)\n",
+		READY_RETRIES, scsi_class_name(h->last_class));
+	return 1;
+}
+
+static int scsi_dispatch(int dev, unsigned char *cmd, int cmd_len, unsigned char *buf, int buf_len, int dir)
+{
+	scsi_handle *h;
+	int attempt;
+	int ret;
+
+	if ((h = handle_get(dev)) == NULL)
+		return 1;
+	if (buf == NULL)
+		buf_len = 0;
+
+	for (attempt = 0; ; attempt++) {
+		if (h->session != SESSION_READY && scsi_session_ready(h) != 0)
+			return 1;
+
+		ret = scsi_exec(h, cmd, cmd_len, buf, buf_len, dir);
+		if (ret == 0)
+			return 0;
+
+		if (h->last_class == SCSI_CLASS_UNIT_ATTENTION && attempt < UA_RETRIES)
+			continue;
+		if (h->last_class == SCSI_CLASS_BUSY && attempt < BUSY_RETRIES) {
+			usleep(BUSY_BACKOFF_US << attempt);
+			continue;
+		}
+		return ret;
+	}
+}
+
+int scsi_send_command(int dev, unsigned char *cmd, int cmd_len, unsigned char *buf, int buf_len)
+{
+	return scsi_dispatch(dev, cmd, cmd_len, buf, buf_len, SCSI_DIR_READ);
+}
+
+int scsi_send_commandw(int dev, unsigned char *cmd, int cmd_len, unsigned char *buf, int buf_len)
+{
+	return scsi_dispatch(dev, cmd, cmd_len, buf, buf_len, SCSI_DIR_WRITE);
+}
+
+int path_to_devnum(const char *path)
+{
+	scsi_transport *tp;
+	const char *rest;
+
+	tp = transport_for_path(path, &rest);
+	return tp->devnum(rest);
+}
+
+int scsi_identity(const char *path, char *out, size_t out_len)
+{
+	scsi_transport *tp;
+	const char *rest;
+
+	tp = transport_for_path(path, &rest);
+	if (tp->identity == NULL)
+		return -1;
+	return tp->identity(rest, out, out_len);
+}
+
+const char *scsi_transport_name(int dev)
+{
+	scsi_handle *h;
+
+	if ((h = handle_get(dev)) == NULL)
+		return "none";
+	return h->tp->name;
+}
+
+/* What the trace and statistics call a command */
+const char *scsi_opcode_name(const unsigned char *cdb)
+{
+	switch (cdb[0]) {
+	case SCSI_TEST_UNIT_READY:            return "TEST_UNIT_READY";
+	case SCSI_INQUIRY:                    return "INQUIRY";
+	case SCSI_MODE_SENSE_6:               return "MODE_SENSE";
+	case SCSI_MODE_SENSE_10:              return "MODE_SENSE_10";
+	case SCSI_START_STOP_UNIT:            return "START_STOP_UNIT";
+	case SCSI_PREVENT_ALLOW:              return "PREVENT_ALLOW";
+	case SCSI_READ_CAPACITY:              return "READ_CAPACITY";
+	case BLUESCSI_TOOLBOX_MODE_FILES:     return "LIST_FILES";
+	case BLUESCSI_TOOLBOX_GET_FILE:       return "GET_FILE";
+	case BLUESCSI_TOOLBOX_COUNT_FILES:    return "COUNT_FILES";
+	case BLUESCSI_TOOLBOX_SEND_FILE_PREP: return "SEND_FILE_PREP";
+	case BLUESCSI_TOOLBOX_SEND_FILE_10:   return "SEND_FILE_10";
+	case BLUESCSI_TOOLBOX_SEND_FILE_END:  return "SEND_FILE_END";
+	case BLUESCSI_TOOLBOX_TOGGLE_DEBUG:   return "TOGGLE_DEBUG";
+	case BLUESCSI_TOOLBOX_MODE_CDS:       return "LIST_CDS";
+	case BLUESCSI_TOOLBOX_SET_NEXT_CD:    return "SET_NEXT_CD";
+	case BLUESCSI_TOOLBOX_COUNT_CDS:      return "COUNT_CDS";
+	case BLUESCSI_TOOLBOX_METADATA:
+		switch (cdb[1]) {
+		case BLUESCSI_TOOLBOX_METADATA_LIST_DEVICES: return "LIST_DEVICES";
+		case BLUESCSI_TOOLBOX_METADATA_GET_CAP:      return "GET_CAPABILITIES";
+		case BLUESCSI_TOOLBOX_METADATA_SET_WDIR:     return "SET_WDIR";
+		case BLUESCSI_TOOLBOX_METADATA_GET_WDIR:     return "GET_WDIR";
+		case BLUESCSI_TOOLBOX_METADATA_REMOVE_FILE:  return "REMOVE_FILE";
+		}
+		return "METADATA";
+	}
+	return "?";
+}
+
+/* Sense key/ASC/ASCQ from fixed (0x70/0x71) or descriptor (0x72/0x73) sense */
+void scsi_sense_fields(const scsi_result *res, int *key, int *asc, int *ascq)
+{
+	const unsigned char *s = res->sense;
+
+	*key = *asc = *ascq = 0;
+	if (res->sense_len < 3)
+		return;
+
+	if ((s[0] & 0x7F) >= 0x72) {
+		*key = s[1] & 0x0F;
+		*asc = s[2];
+		*ascq = res->sense_len > 3 ? s[3] : 0;
+	} else {
+		*key = s[2] & 0x0F;
+		if (res->sense_len >= 14) {
+			*asc = s[12];
+			*ascq = s[13];
+		}
+	}
+}
+
+/* Decide whether a failed command is worth resending, and how */
+int scsi_classify(const scsi_result *res)
+{
+	int key, asc, ascq;
+
+	switch (res->transport) {
+	case SCSI_XPORT_BUSY:
+		return SCSI_CLASS_BUSY;
+	case SCSI_XPORT_TIMEOUT:
+		return SCSI_CLASS_TIMEOUT;
+	case SCSI_XPORT_PARITY:
+	case SCSI_XPORT_RESET:
+	case SCSI_XPORT_ERROR:
+		return SCSI_CLASS_TRANSPORT;
+	case SCSI_XPORT_NOSEL:
+		return SCSI_CLASS_FATAL;
+	}
+
+	if (res->status == SCSI_STATUS_BUSY || res->status == SCSI_STATUS_TASK_FULL)
+		return SCSI_CLASS_BUSY;
+
+	if (res->status == SCSI_STATUS_CHECK_COND) {
+		scsi_sense_fields(res, &key, &asc, &ascq);
+		if (key == SENSE_KEY_UNIT_ATTENTION)
+			return SCSI_CLASS_UNIT_ATTENTION;
+		if (key == SENSE_KEY_NOT_READY && asc == 0x04 && ascq == 0x01)
+			return SCSI_CLASS_BUSY;	/* Becoming ready */
+		if (key == SENSE_KEY_ABORTED_COMMAND)
+			return SCSI_CLASS_TRANSPORT;
+		return SCSI_CLASS_FATAL;
+	}
+
+	if (res->status != SCSI_STATUS_GOOD)
+		return SCSI_CLASS_FATAL;
+
+	switch (res->os_error) {
+	case EBUSY:
+	case EAGAIN:
+	case EINTR:
+		return SCSI_CLASS_BUSY;
+	case ETIMEDOUT:
+		return SCSI_CLASS_TIMEOUT;
+	case EIO:
+		return SCSI_CLASS_TRANSPORT;
+	}
+	return SCSI_CLASS_FATAL;
+}
+
+int scsi_class_retryable(int cls)
+{
+	return cls == SCSI_CLASS_UNIT_ATTENTION || cls == SCSI_CLASS_BUSY ||
+		cls == SCSI_CLASS_TRANSPORT || cls == SCSI_CLASS_TIMEOUT;
+}
+
+const char *scsi_class_name(int cls)
+{
+	switch (cls) {
+	case SCSI_CLASS_OK:             return "ok";
+	case SCSI_CLASS_UNIT_ATTENTION: return "unit attention";
+	case SCSI_CLASS_BUSY:           return "busy";
+	case SCSI_CLASS_TRANSPORT:      return "transport error";
+	case SCSI_CLASS_TIMEOUT:        return "timeout";
+	}
+	return "fatal error";
+}
+
+int scsi_last_class(int dev)
+{
+	scsi_handle *h;
+
+	if ((h = handle_get(dev)) == NULL)
+		return SCSI_CLASS_FATAL;
+	return h->last_class;
+}
+
+/* Bumped on every bus reset or power-on UNIT ATTENTION seen on the handle */
+unsigned long scsi_reset_count(int dev)
+{
+	scsi_handle *h;
+
+	if ((h = handle_get(dev)) == NULL)
+		return 0;
+	return h->resets;
+}
+
+/*
+ * Take the target as ready without a TEST UNIT READY, when the caller
+ * already knows it is there.  If it isn't, the first command fails, the
+ * session goes back to UNKNOWN and the dispatcher retries it as usual.
+ */
+void scsi_session_trust(int dev)
+{
+	scsi_handle *h;
+
+	if ((h = handle_get(dev)) != NULL && h->session == SESSION_UNKNOWN)
+		h->session = SESSION_READY;
+}
+
+/* Monotonic where the OS has it, wall clock otherwise (older IRIX) */
+unsigned long long scsi_now_us(void)
+{
+#if defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+		return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+#endif
+	{
+		struct timeval tv;
+
+		gettimeofday(&tv, NULL);
+		return (unsigned long long)tv.tv_sec * 1000000ULL + tv.tv_usec;
+	}
+}
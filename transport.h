@@ -0,0 +1,93 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+/*
+ * SCSI transports.
+ *
+ * Everything in the toolbox talks to devices through scsi_open() and
+ * friends in os.h.  Those dispatch through a transport chosen at runtime
+ * from the device path: a "sim:" prefix selects the in-process simulated
+ * BlueSCSI, "replay:" plays back a recorded trace, and anything else goes
+ * to the OS backend (linux.c or irix.c).
+ */
+
+#include <stddef.h>
+
+#define SCSI_MAX_HANDLES 16
+
+/*
+ * Per-command timeouts are derived from the transfer length and a running
+ * estimate of the bus rate and fixed per-command overhead, then scaled by
+ * TIMEOUT_MARGIN and clamped.  Commands that touch the SD card filesystem
+ * (create, close, remove, CD switch) get the larger TIMEOUT_SLOW_MIN_MS.
+ */
+#define TIMEOUT_MARGIN        4
+#define TIMEOUT_MIN_MS        500
+#define TIMEOUT_SLOW_MIN_MS   5000
+#define TIMEOUT_MAX_MS        60000
+#define TIMEOUT_INIT_BPS      65536.0
+#define TIMEOUT_INIT_OVH_US   20000.0
+
+enum {
+	SCSI_DIR_READ,	/* Device -> host */
+	SCSI_DIR_WRITE	/* Host -> device */
+};
+
+#define SCSI_SENSE_LEN 32
+
+/* SCSI status byte values */
+#define SCSI_STATUS_GOOD       0x00
+#define SCSI_STATUS_CHECK_COND 0x02
+#define SCSI_STATUS_BUSY       0x08
+#define SCSI_STATUS_TASK_FULL  0x28
+
+/* Transport outcome, normalised from SG_IO host/driver status or dsreq ds_ret */
+enum {
+	SCSI_XPORT_OK,
+	SCSI_XPORT_BUSY,
+	SCSI_XPORT_TIMEOUT,
+	SCSI_XPORT_PARITY,
+	SCSI_XPORT_RESET,
+	SCSI_XPORT_NOSEL,
+	SCSI_XPORT_ERROR
+};
+
+/*
+ * Filled in by the transport for every command.  host_status and
+ * driver_status are the raw backend values, kept for diagnostics only.
+ * Transports that model time rather than spend it (sim nosleep, replay
+ * fast) set elapsed_us, which is then used instead of the wall clock.
+ */
+typedef struct {
+	unsigned long long elapsed_us;
+	int status;
+	int transport;
+	int host_status;
+	int driver_status;
+	int os_error;
+	int sense_len;
+	unsigned char sense[SCSI_SENSE_LEN];
+} scsi_result;
+
+typedef struct scsi_transport {
+	const char *name;
+	const char *prefix;	/* Device path prefix, NULL for the OS backend */
+	int (*open)(const char *path, int readonly);
+	int (*close)(int fd);
+	int (*send)(int fd, unsigned char *cmd, int cmd_len, unsigned char *buf, int buf_len, int dir,
+			int timeout_ms, scsi_result *res);
+	int (*devnum)(const char *path);
+	int (*identity)(const char *path, char *out, size_t out_len);
+} scsi_transport;
+
+extern scsi_transport os_transport;
+extern scsi_transport sim_transport;
+extern scsi_transport replay_transport;
+
+const char *scsi_transport_name(int dev);
+const char *scsi_opcode_name(const unsigned char *cdb);
+int scsi_classify(const scsi_result *res);
+void scsi_sense_fields(const scsi_result *res, int *key, int *asc, int *ascq);
+unsigned long long scsi_now_us(void);
+
+#endif